@@ -0,0 +1,406 @@
+#pragma once
+
+/*
+
+Level measurement helpers for block aligned capture data (WAVE_FORMAT_PCM 8-32 bit and WAVE_FORMAT_IEEE_FLOAT).
+Levels are normalized to [0, 1] of full scale.
+
+The threshold scans (FindFirstFrameAbove, FindLastFrameAbove) use SSE2 for 8, 16 and 32 bit PCM and float where available.
+They stop at the first hit, so scanning active audio usually only touches a few samples.
+GetLevels computes peak and RMS in one pass, with SSE2 for 16 bit PCM and float (the usual capture formats).
+
+*/
+
+#include <windows.h>
+
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define LOOPBACK_AUDIO_LEVEL_SSE2
+#include <emmintrin.h>
+#endif
+
+// ------------------------------------------------------------
+
+namespace LoopbackAudioLevel
+{
+    // Absolute peak of all samples in the buffer.
+    inline float GetPeak(const unsigned char *pData, size_t iSize, const WAVEFORMATEX& Format)
+    {
+        if (Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+        {
+            const float *pSamples = reinterpret_cast<const float*>(pData);
+            size_t iCount = iSize / sizeof(float);
+            float fPeak = 0.0f;
+
+            for (size_t i = 0; i < iCount; ++i)
+            {
+                float fAbs = std::fabs(pSamples[i]);
+
+                if (fAbs > fPeak)
+                    fPeak = fAbs;
+            }
+
+            return fPeak > 1.0f ? 1.0f : fPeak;
+        }
+
+        INT64 iPeak = 0;
+
+        switch (Format.wBitsPerSample)
+        {
+        case 8:
+            for (size_t i = 0; i < iSize; ++i)
+            {
+                INT64 iAbs = pData[i] >= 128 ? pData[i] - 128 : 128 - pData[i];
+
+                if (iAbs > iPeak)
+                    iPeak = iAbs;
+            }
+
+            return (float)iPeak / 128.0f;
+
+        case 16:
+            for (size_t i = 0; i + 1 < iSize; i += 2)
+            {
+                INT64 iSample = (INT16)(pData[i] | (pData[i + 1] << 8));
+                INT64 iAbs = iSample < 0 ? -iSample : iSample;
+
+                if (iAbs > iPeak)
+                    iPeak = iAbs;
+            }
+
+            return (float)iPeak / 32768.0f;
+
+        case 24:
+            for (size_t i = 0; i + 2 < iSize; i += 3)
+            {
+                INT64 iSample = (INT32)((UINT32)pData[i] << 8 | (UINT32)pData[i + 1] << 16 | (UINT32)pData[i + 2] << 24) >> 8;
+                INT64 iAbs = iSample < 0 ? -iSample : iSample;
+
+                if (iAbs > iPeak)
+                    iPeak = iAbs;
+            }
+
+            return (float)iPeak / 8388608.0f;
+
+        case 32:
+            for (size_t i = 0; i + 3 < iSize; i += 4)
+            {
+                INT64 iSample = (INT32)((UINT32)pData[i] | (UINT32)pData[i + 1] << 8 | (UINT32)pData[i + 2] << 16 | (UINT32)pData[i + 3] << 24);
+                INT64 iAbs = iSample < 0 ? -iSample : iSample;
+
+                if (iAbs > iPeak)
+                    iPeak = iAbs;
+            }
+
+            return (float)((double)iPeak / 2147483648.0);
+        }
+
+        return 0.0f;
+    }
+
+    namespace Detail
+    {
+        struct sThreshold
+        {
+            float                       fLevel;
+            INT64                       iLevel;     // For PCM: |sample| > iLevel is above the threshold
+        };
+
+        inline sThreshold MakeThreshold(const WAVEFORMATEX& Format, float fThreshold)
+        {
+            sThreshold Threshold{ fThreshold, 0 };
+
+            if (Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT && Format.wBitsPerSample >= 8 && Format.wBitsPerSample <= 32)
+                Threshold.iLevel = (INT64)std::floor((double)fThreshold * (double)(1LL << (Format.wBitsPerSample - 1)));
+
+            return Threshold;
+        }
+
+        inline bool IsSampleAbove(const unsigned char *pData, size_t iSample, const WAVEFORMATEX& Format, const sThreshold& Threshold)
+        {
+            if (Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+                return std::fabs(reinterpret_cast<const float*>(pData)[iSample]) > Threshold.fLevel;
+
+            INT64 iSample64 = 0;
+
+            switch (Format.wBitsPerSample)
+            {
+            case 8:
+                iSample64 = (INT64)pData[iSample] - 128;
+                break;
+            case 16:
+                pData += iSample * 2;
+                iSample64 = (INT16)(pData[0] | (pData[1] << 8));
+                break;
+            case 24:
+                pData += iSample * 3;
+                iSample64 = (INT32)((UINT32)pData[0] << 8 | (UINT32)pData[1] << 16 | (UINT32)pData[2] << 24) >> 8;
+                break;
+            case 32:
+                pData += iSample * 4;
+                iSample64 = (INT32)((UINT32)pData[0] | (UINT32)pData[1] << 8 | (UINT32)pData[2] << 16 | (UINT32)pData[3] << 24);
+                break;
+            default:
+                return false;
+            }
+
+            return (iSample64 < 0 ? -iSample64 : iSample64) > Threshold.iLevel;
+        }
+
+#ifdef LOOPBACK_AUDIO_LEVEL_SSE2
+        // Mask of the lanes above the threshold for the 16 bytes at pData. Returns false if the format has no vector path.
+        inline bool GetVectorMask(const unsigned char *pData, const WAVEFORMATEX& Format, const sThreshold& Threshold, int& iMask)
+        {
+            __m128i Data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData));
+
+            if (Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+            {
+                __m128 Abs = _mm_and_ps(_mm_castsi128_ps(Data), _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF)));
+                iMask = _mm_movemask_ps(_mm_cmpgt_ps(Abs, _mm_set1_ps(Threshold.fLevel)));
+                return true;
+            }
+
+            __m128i Above;
+
+            switch (Format.wBitsPerSample)
+            {
+            case 8:
+                Data = _mm_xor_si128(Data, _mm_set1_epi8((char)0x80));
+                Above = _mm_or_si128(_mm_cmpgt_epi8(Data, _mm_set1_epi8((char)Threshold.iLevel)), _mm_cmplt_epi8(Data, _mm_set1_epi8((char)-Threshold.iLevel)));
+                break;
+            case 16:
+                Above = _mm_or_si128(_mm_cmpgt_epi16(Data, _mm_set1_epi16((short)Threshold.iLevel)), _mm_cmplt_epi16(Data, _mm_set1_epi16((short)-Threshold.iLevel)));
+                break;
+            case 32:
+                Above = _mm_or_si128(_mm_cmpgt_epi32(Data, _mm_set1_epi32((int)Threshold.iLevel)), _mm_cmplt_epi32(Data, _mm_set1_epi32((int)-Threshold.iLevel)));
+                break;
+            default:
+                return false;
+            }
+
+            iMask = _mm_movemask_epi8(Above);
+            return true;
+        }
+#endif
+
+        // True if no sample of the format can exceed the threshold (the vector compares would overflow).
+        inline bool IsThresholdUnreachable(const WAVEFORMATEX& Format, const sThreshold& Threshold)
+        {
+            return Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT && Threshold.iLevel >= (1LL << (Format.wBitsPerSample - 1));
+        }
+    }
+
+    // Absolute peak (clamped to 1 like GetPeak) and RMS of all samples in the buffer, in one pass.
+    inline void GetLevels(const unsigned char *pData, size_t iSize, const WAVEFORMATEX& Format, float& fPeak, float& fRms)
+    {
+        fPeak = 0.0f;
+        fRms = 0.0f;
+
+        if (Format.wBitsPerSample < 8 || Format.wBitsPerSample > 32)
+            return;
+
+        size_t iBytesPerSample = Format.wBitsPerSample / 8;
+        size_t iSamples = iSize / iBytesPerSample;
+
+        if (iSamples == 0)
+            return;
+
+        size_t i = 0;
+        double fSumOfSquares = 0.0;
+
+        if (Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+        {
+            const float *pSamples = reinterpret_cast<const float*>(pData);
+            float fMax = 0.0f;
+
+#ifdef LOOPBACK_AUDIO_LEVEL_SSE2
+            // Partial sums stay short (one buffer), float accumulation is accurate enough for a level
+            __m128 Max = _mm_setzero_ps();
+            __m128 Sum = _mm_setzero_ps();
+            __m128 AbsMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+            for (; i + 4 <= iSamples; i += 4)
+            {
+                __m128 Data = _mm_loadu_ps(pSamples + i);
+                Max = _mm_max_ps(Max, _mm_and_ps(Data, AbsMask));
+                Sum = _mm_add_ps(Sum, _mm_mul_ps(Data, Data));
+            }
+
+            float Lanes[4];
+
+            _mm_storeu_ps(Lanes, Max);
+            fMax = Lanes[0] > Lanes[1] ? Lanes[0] : Lanes[1];
+            fMax = fMax > Lanes[2] ? fMax : Lanes[2];
+            fMax = fMax > Lanes[3] ? fMax : Lanes[3];
+
+            _mm_storeu_ps(Lanes, Sum);
+            fSumOfSquares = (double)Lanes[0] + Lanes[1] + Lanes[2] + Lanes[3];
+#endif
+
+            for (; i < iSamples; ++i)
+            {
+                float fAbs = std::fabs(pSamples[i]);
+
+                if (fAbs > fMax)
+                    fMax = fAbs;
+
+                fSumOfSquares += (double)pSamples[i] * pSamples[i];
+            }
+
+            fPeak = fMax > 1.0f ? 1.0f : fMax;
+            fRms = (float)std::sqrt(fSumOfSquares / iSamples);
+            return;
+        }
+
+        INT64 iMax = 0;
+        INT64 iMin = 0;
+        UINT64 iSumOfSquares = 0;
+
+#ifdef LOOPBACK_AUDIO_LEVEL_SSE2
+        if (Format.wBitsPerSample == 16)
+        {
+            __m128i Max = _mm_setzero_si128();
+            __m128i Min = _mm_setzero_si128();
+            __m128i Sum = _mm_setzero_si128();
+            __m128i Zero = _mm_setzero_si128();
+
+            for (; i + 8 <= iSamples; i += 8)
+            {
+                __m128i Data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + i * 2));
+                Max = _mm_max_epi16(Max, Data);
+                Min = _mm_min_epi16(Min, Data);
+
+                // Pairs of squares fit into 32 bit unsigned (at most 2 * 32768^2), widened to 64 bit before summing
+                __m128i Squares = _mm_madd_epi16(Data, Data);
+                Sum = _mm_add_epi64(Sum, _mm_unpacklo_epi32(Squares, Zero));
+                Sum = _mm_add_epi64(Sum, _mm_unpackhi_epi32(Squares, Zero));
+            }
+
+            INT16 MaxLanes[8];
+            INT16 MinLanes[8];
+            UINT64 SumLanes[2];
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(MaxLanes), Max);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(MinLanes), Min);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(SumLanes), Sum);
+
+            for (int l = 0; l < 8; ++l)
+            {
+                iMax = MaxLanes[l] > iMax ? MaxLanes[l] : iMax;
+                iMin = MinLanes[l] < iMin ? MinLanes[l] : iMin;
+            }
+
+            iSumOfSquares = SumLanes[0] + SumLanes[1];
+        }
+#endif
+
+        for (; i < iSamples; ++i)
+        {
+            const unsigned char *pSample = pData + i * iBytesPerSample;
+            INT64 iSample = 0;
+
+            switch (Format.wBitsPerSample)
+            {
+            case 8:
+                iSample = (INT64)pSample[0] - 128;
+                break;
+            case 16:
+                iSample = (INT16)(pSample[0] | (pSample[1] << 8));
+                break;
+            case 24:
+                iSample = (INT32)((UINT32)pSample[0] << 8 | (UINT32)pSample[1] << 16 | (UINT32)pSample[2] << 24) >> 8;
+                break;
+            case 32:
+                iSample = (INT32)((UINT32)pSample[0] | (UINT32)pSample[1] << 8 | (UINT32)pSample[2] << 16 | (UINT32)pSample[3] << 24);
+                break;
+            }
+
+            iMax = iSample > iMax ? iSample : iMax;
+            iMin = iSample < iMin ? iSample : iMin;
+
+            // 32 bit squares are summed as double, the 64 bit sum could overflow
+            if (Format.wBitsPerSample == 32)
+                fSumOfSquares += (double)iSample * (double)iSample;
+            else
+                iSumOfSquares += (UINT64)(iSample * iSample);
+        }
+
+        double fFullScale = (double)(1LL << (Format.wBitsPerSample - 1));
+        INT64 iPeak = -iMin > iMax ? -iMin : iMax;
+
+        fPeak = (float)(iPeak / fFullScale);
+        fRms = (float)(std::sqrt(((double)iSumOfSquares + fSumOfSquares) / iSamples) / fFullScale);
+    }
+
+    // Index of the first frame with any sample above the threshold (0-1), or the number of frames if there is none.
+    inline size_t FindFirstFrameAbove(const unsigned char *pData, size_t iSize, const WAVEFORMATEX& Format, float fThreshold)
+    {
+        if (Format.nBlockAlign == 0 || Format.wBitsPerSample < 8)
+            return 0;
+
+        size_t iFrames = iSize / Format.nBlockAlign;
+        size_t iSamples = iFrames * Format.nChannels;
+        size_t iBytesPerSample = Format.wBitsPerSample / 8;
+        Detail::sThreshold Threshold = Detail::MakeThreshold(Format, fThreshold);
+
+        if (Detail::IsThresholdUnreachable(Format, Threshold))
+            return iFrames;
+
+        size_t i = 0;
+
+#ifdef LOOPBACK_AUDIO_LEVEL_SSE2
+        // Skip silent vectors, the scalar loop below locates the sample inside the first vector with a hit
+        size_t iVectorSamples = 16 / iBytesPerSample;
+        int iMask = 0;
+
+        while (i + iVectorSamples <= iSamples && Detail::GetVectorMask(pData + i * iBytesPerSample, Format, Threshold, iMask) && iMask == 0)
+            i += iVectorSamples;
+#endif
+
+        for (; i < iSamples; ++i)
+        {
+            if (Detail::IsSampleAbove(pData, i, Format, Threshold))
+                return i / Format.nChannels;
+        }
+
+        return iFrames;
+    }
+
+    // Index of the last frame with any sample above the threshold (0-1), or the number of frames if there is none.
+    inline size_t FindLastFrameAbove(const unsigned char *pData, size_t iSize, const WAVEFORMATEX& Format, float fThreshold)
+    {
+        if (Format.nBlockAlign == 0 || Format.wBitsPerSample < 8)
+            return 0;
+
+        size_t iFrames = iSize / Format.nBlockAlign;
+        size_t iSamples = iFrames * Format.nChannels;
+        size_t iBytesPerSample = Format.wBitsPerSample / 8;
+        Detail::sThreshold Threshold = Detail::MakeThreshold(Format, fThreshold);
+
+        if (Detail::IsThresholdUnreachable(Format, Threshold))
+            return iFrames;
+
+        size_t i = iSamples;
+
+#ifdef LOOPBACK_AUDIO_LEVEL_SSE2
+        size_t iVectorSamples = 16 / iBytesPerSample;
+        int iMask = 0;
+
+        while (i >= iVectorSamples && Detail::GetVectorMask(pData + (i - iVectorSamples) * iBytesPerSample, Format, Threshold, iMask) && iMask == 0)
+            i -= iVectorSamples;
+#endif
+
+        while (i > 0)
+        {
+            --i;
+
+            if (Detail::IsSampleAbove(pData, i, Format, Threshold))
+                return i / Format.nChannels;
+        }
+
+        return iFrames;
+    }
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,398 @@
+#include <LoopbackCaptureC.h>
+#include <ProcessLoopbackCapture.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+// The C constants are documented as equal to the C++ ones, callers may compare them directly
+
+static_assert(PLC_ERROR_NONE == (int)eCaptureError::NONE && PLC_ERROR_PROCESSID == (int)eCaptureError::PROCESSID, "PLC_Error out of sync");
+static_assert(PLC_ERROR_DEVICE == (int)eCaptureError::DEVICE && PLC_ERROR_INTERFACE == (int)eCaptureError::INTERFACE, "PLC_Error out of sync");
+static_assert(PLC_ERROR_FILE == (int)eCaptureError::FILE, "PLC_Error out of sync");
+static_assert(PLC_STATE_READY == (int)eCaptureState::READY && PLC_STATE_CAPTURING == (int)eCaptureState::CAPTURING && PLC_STATE_PAUSED == (int)eCaptureState::PAUSED, "PLC_STATE out of sync");
+static_assert(PLC_FORMAT_PCM == WAVE_FORMAT_PCM && PLC_FORMAT_FLOAT == WAVE_FORMAT_IEEE_FLOAT, "PLC_FORMAT out of sync");
+
+// ------------------------------------------------------------ PLC_Capture
+
+struct PLC_Capture
+{
+    ProcessLoopbackCapture          Capture;
+
+    // Written only while READY
+    PLC_ChunkCallback               pChunkFunc = nullptr;
+    void                            *pChunkFuncUserData = nullptr;
+    WAVEFORMATEX                    Format{};
+
+    // Written by the thread that calls the chunk callback
+    std::atomic<bool>               bFirstChunk{ false };
+    std::atomic<UINT64>             iChunkCount{ 0 };
+    std::atomic<UINT64>             iFrameCount{ 0 };
+
+    // Set by any PLC_* call that caught an exception
+    std::atomic<HRESULT>            hrLastException{ S_OK };
+
+    static void Callback(const std::vector<unsigned char>::iterator& i1, const std::vector<unsigned char>::iterator& i2, void* pUserData);
+};
+
+// The data is passed in place, the vector is not touched by the audio thread until the callback returned
+
+void PLC_Capture::Callback(const std::vector<unsigned char>::iterator& i1, const std::vector<unsigned char>::iterator& i2, void* pUserData)
+{
+    PLC_Capture *pCapture = static_cast<PLC_Capture*>(pUserData);
+
+    if (i1 == i2 || pCapture->Format.nBlockAlign == 0)
+        return;
+
+    size_t iSize = (size_t)(i2 - i1);
+    UINT64 iChunk = pCapture->iChunkCount.load(memory_order_relaxed);
+    UINT64 iFrame = pCapture->iFrameCount.load(memory_order_relaxed);
+
+    PLC_ChunkInfo Info{};
+
+    Info.struct_size = sizeof(PLC_ChunkInfo);
+    Info.flags = pCapture->bFirstChunk.exchange(false, memory_order_relaxed) ? PLC_CHUNK_FIRST : 0;
+    Info.sequence = iChunk;
+    Info.first_frame = iFrame;
+    Info.frame_count = (uint32_t)(iSize / pCapture->Format.nBlockAlign);
+    Info.sample_rate = pCapture->Format.nSamplesPerSec;
+    Info.channels = pCapture->Format.nChannels;
+    Info.bits_per_sample = pCapture->Format.wBitsPerSample;
+    Info.format_tag = pCapture->Format.wFormatTag;
+    Info.block_align = pCapture->Format.nBlockAlign;
+
+    UINT64 iDevicePosition = 0;
+    UINT64 iQPCPosition = 0;
+
+    pCapture->Capture.GetCallbackTimestamp(iDevicePosition, iQPCPosition);
+
+    Info.device_position = iDevicePosition;
+    Info.qpc_position = iQPCPosition;
+
+    if (pCapture->pChunkFunc != nullptr)
+        pCapture->pChunkFunc(&*i1, iSize, &Info, pCapture->pChunkFuncUserData);
+
+    pCapture->iChunkCount.store(iChunk + 1, memory_order_relaxed);
+    pCapture->iFrameCount.store(iFrame + Info.frame_count, memory_order_relaxed);
+}
+
+// ------------------------------------------------------------ C interface
+
+// No exception may cross the C boundary. Called from a catch block, keeps the cause for PLC_GetStats.
+
+static PLC_Error OnException(PLC_Capture* capture)
+{
+    HRESULT hr = E_UNEXPECTED;
+
+    try
+    {
+        throw;
+    }
+    catch (const bad_alloc&)
+    {
+        hr = E_OUTOFMEMORY;
+    }
+    catch (...)
+    {
+
+    }
+
+    if (capture != nullptr)
+        capture->hrLastException = hr;
+
+    return PLC_ERROR_EXCEPTION;
+}
+
+extern "C"
+{
+
+int32_t PLC_CALL PLC_GetApiVersion(void)
+{
+    return PLC_API_VERSION;
+}
+
+const char* PLC_CALL PLC_GetErrorText(PLC_Error error)
+{
+    if (error == PLC_ERROR_EXCEPTION)
+        return "Unexpected exception (out of memory or failed to create a thread)";
+
+    return LoopbackCaptureConst::GetErrorText((eCaptureError)error);
+}
+
+PLC_Capture* PLC_CALL PLC_Create(void)
+{
+    try
+    {
+        PLC_Capture *pCapture = new PLC_Capture();
+
+        pCapture->Capture.SetCallback(&PLC_Capture::Callback, pCapture);
+
+        return pCapture;
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void PLC_CALL PLC_Destroy(PLC_Capture* capture)
+{
+    if (capture == nullptr)
+        return;
+
+    // Stopped here, an exception thrown by the destructor could not be caught
+    try
+    {
+        if (capture->Capture.GetState() != eCaptureState::READY)
+            capture->Capture.StopCapture();
+    }
+    catch (...)
+    {
+
+    }
+
+    delete capture;
+}
+
+PLC_Error PLC_CALL PLC_SetCaptureFormat(PLC_Capture* capture, uint32_t sample_rate, uint32_t bits_per_sample, uint32_t channels, uint32_t format_tag)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.SetCaptureFormat(sample_rate, bits_per_sample, channels, format_tag);
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_SetTargetProcess(PLC_Capture* capture, uint32_t process_id, int32_t inclusive)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.SetTargetProcess(process_id, inclusive != 0);
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_SetChunkCallback(PLC_Capture* capture, PLC_ChunkCallback callback, void* user_data)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        if (capture->Capture.GetState() != eCaptureState::READY)
+            return PLC_ERROR_STATE;
+
+        capture->pChunkFunc = callback;
+        capture->pChunkFuncUserData = user_data;
+
+        return PLC_ERROR_NONE;
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_SetIntermediateThreadEnabled(PLC_Capture* capture, int32_t enable)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.SetIntermediateThreadEnabled(enable != 0);
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_SetCallbackInterval(PLC_Capture* capture, uint32_t interval)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.SetCallbackInterval(interval);
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_SetBatchInterval(PLC_Capture* capture, uint32_t interval)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.SetBatchInterval(interval);
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_Start(PLC_Capture* capture)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        if (capture->Capture.GetState() != eCaptureState::READY)
+            return PLC_ERROR_STATE;
+
+        // The format is fixed until the capture is stopped, the callback reads it without synchronization
+        capture->Format = {};
+        capture->Capture.CopyCaptureFormat(capture->Format);
+        capture->bFirstChunk = true;
+
+        return (PLC_Error)capture->Capture.StartCapture();
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_Stop(PLC_Capture* capture)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.StopCapture();
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_Pause(PLC_Capture* capture)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        return (PLC_Error)capture->Capture.PauseCapture();
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+PLC_Error PLC_CALL PLC_Resume(PLC_Capture* capture, double initial_duration_to_skip)
+{
+    if (capture == nullptr)
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        if (capture->Capture.GetState() != eCaptureState::PAUSED)
+            return PLC_ERROR_STATE;
+
+        // The audio threads are stopped while paused
+        capture->bFirstChunk = true;
+
+        return (PLC_Error)capture->Capture.ResumeCapture(initial_duration_to_skip);
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+int32_t PLC_CALL PLC_GetState(PLC_Capture* capture)
+{
+    if (capture == nullptr)
+        return PLC_STATE_READY;
+
+    try
+    {
+        return (int32_t)capture->Capture.GetState();
+    }
+    catch (...)
+    {
+        OnException(capture);
+        return PLC_STATE_READY;
+    }
+}
+
+PLC_Error PLC_CALL PLC_GetStats(PLC_Capture* capture, PLC_Stats* stats)
+{
+    if (capture == nullptr || stats == nullptr || stats->struct_size < sizeof(uint32_t))
+        return PLC_ERROR_PARAM;
+
+    try
+    {
+        PLC_Stats Stats{};
+        size_t iQueueSize = 0;
+
+        capture->Capture.GetQueueSize(iQueueSize);
+
+        Stats.struct_size = stats->struct_size;
+        Stats.state = (int32_t)capture->Capture.GetState();
+        Stats.last_error_result = (int32_t)capture->Capture.GetLastErrorResult();
+        Stats.chunk_count = capture->iChunkCount.load(memory_order_relaxed);
+        Stats.frame_count = capture->iFrameCount.load(memory_order_relaxed);
+        Stats.max_execution_time = capture->Capture.GetMaxExecutionTime();
+        Stats.wakeups_per_second = capture->Capture.GetWakeupsPerSecond();
+        Stats.queue_size = iQueueSize;
+        Stats.last_exception_result = (int32_t)capture->hrLastException.load();
+
+        // Callers built against an older header pass a smaller struct
+        memcpy(stats, &Stats, min((size_t)stats->struct_size, sizeof(PLC_Stats)));
+
+        return PLC_ERROR_NONE;
+    }
+    catch (...)
+    {
+        return OnException(capture);
+    }
+}
+
+void PLC_CALL PLC_ResetMaxExecutionTime(PLC_Capture* capture)
+{
+    if (capture == nullptr)
+        return;
+
+    try
+    {
+        capture->Capture.ResetMaxExecutionTime();
+    }
+    catch (...)
+    {
+        OnException(capture);
+    }
+}
+
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,178 @@
+#pragma once
+
+/*
+
+Flat C interface for ProcessLoopbackCapture, for consumers in other languages (Python ctypes/cffi, Rust, C# P/Invoke).
+
+The header only depends on stdint.h and stddef.h. All functions use the C calling convention (__cdecl), all structs are plain
+C structs with fixed-size members and a leading struct_size, so fields can be appended later without breaking existing callers.
+Build LoopbackCaptureC.cpp into a DLL with PROCESS_LOOPBACK_CAPTURE_C_EXPORTS defined, callers of the DLL define
+PROCESS_LOOPBACK_CAPTURE_C_DLL. Without either, the functions are plain (static library) symbols.
+
+Audio is delivered without copying: the chunk callback receives a pointer into the capture's internal buffer.
+
+Buffer lifetime rules:
+- data is valid only until the chunk callback returns. It must not be written to, freed or used after the return.
+  Consumers that keep audio (e.g. a numpy array that outlives the call) must copy it before returning.
+- info is valid only until the chunk callback returns as well.
+- Chunks always contain whole frames in the capture format (see PLC_SetCaptureFormat).
+
+Threading rules:
+- The chunk callback is called on the main audio thread, or on the intermediate thread if it is enabled. It must not call
+  PLC_Stop, PLC_Pause, PLC_Resume or PLC_Destroy on its own capture.
+- PLC_Start, PLC_Stop, PLC_Pause and PLC_Resume must be called on the same thread. PLC_Start requires COM to be initialized on it
+  (CoInitializeEx).
+- PLC_GetState and PLC_GetStats can be called from any thread, also while the capture is running.
+
+No C++ exception leaves a PLC_* function. If the capture throws (out of memory, a thread that can not be created), the call
+returns PLC_ERROR_EXCEPTION and keeps the cause for PLC_Stats.last_exception_result.
+
+PLC_Capture* pCapture = PLC_Create();
+PLC_SetCaptureFormat(pCapture, 48000, 16, 2, PLC_FORMAT_PCM);
+PLC_SetTargetProcess(pCapture, dwProcessId, 1);
+PLC_SetChunkCallback(pCapture, &OnChunk, pContext);
+PLC_Start(pCapture);
+...
+PLC_Stop(pCapture);
+PLC_Destroy(pCapture);
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined PROCESS_LOOPBACK_CAPTURE_C_EXPORTS
+#define PLC_API __declspec(dllexport)
+#elif defined PROCESS_LOOPBACK_CAPTURE_C_DLL
+#define PLC_API __declspec(dllimport)
+#else
+#define PLC_API
+#endif
+
+#define PLC_CALL __cdecl
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ------------------------------------------------------------
+
+// Incremented when functions are added or structs are extended
+#define PLC_API_VERSION 3
+
+// Same values as eCaptureError, except PLC_ERROR_EXCEPTION
+typedef int32_t PLC_Error;
+
+#define PLC_ERROR_NONE          0
+#define PLC_ERROR_PARAM         1
+#define PLC_ERROR_STATE         2
+#define PLC_ERROR_NOT_AVAILABLE 3
+#define PLC_ERROR_FORMAT        4
+#define PLC_ERROR_PROCESSID     5
+#define PLC_ERROR_DEVICE        6
+#define PLC_ERROR_ACTIVATION    7
+#define PLC_ERROR_INITIALIZE    8
+#define PLC_ERROR_SERVICE       9
+#define PLC_ERROR_START         10
+#define PLC_ERROR_STOP          11
+#define PLC_ERROR_EVENT         12
+#define PLC_ERROR_INTERFACE     13
+#define PLC_ERROR_FILE          14
+
+// Only returned by the C interface, outside the range of eCaptureError
+#define PLC_ERROR_EXCEPTION     100
+
+// Same values as eCaptureState
+#define PLC_STATE_READY         0
+#define PLC_STATE_CAPTURING     1
+#define PLC_STATE_PAUSED        2
+
+// Same values as WAVE_FORMAT_PCM and WAVE_FORMAT_IEEE_FLOAT
+#define PLC_FORMAT_PCM          1
+#define PLC_FORMAT_FLOAT        3
+
+// PLC_ChunkInfo flags
+#define PLC_CHUNK_FIRST         0x1 // First chunk after PLC_Start or PLC_Resume, the audio before it is not contiguous
+
+typedef struct PLC_Capture PLC_Capture;
+
+typedef struct PLC_ChunkInfo
+{
+    uint32_t struct_size;
+
+    uint32_t flags;             // PLC_CHUNK_*
+    uint64_t sequence;          // Chunks delivered before this one since PLC_Create
+    uint64_t first_frame;       // Frames delivered before this one since PLC_Create
+    uint32_t frame_count;
+
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits_per_sample;
+    uint16_t format_tag;        // PLC_FORMAT_*
+    uint16_t block_align;       // Bytes per frame
+
+    // Version 2
+    uint64_t device_position;   // Position of the first frame in the audio engine's stream, in frames
+    uint64_t qpc_position;      // QueryPerformanceCounter time of the first frame in 100ns units, 0 on a timestamp error
+} PLC_ChunkInfo;
+
+typedef struct PLC_Stats
+{
+    uint32_t struct_size;       // Set by the caller to sizeof(PLC_Stats), only this many bytes are written
+
+    int32_t state;              // PLC_STATE_*
+    int32_t last_error_result;  // HRESULT of the last failed Windows call (see PLC_Error)
+
+    uint64_t chunk_count;
+    uint64_t frame_count;
+
+    double max_execution_time;  // Milliseconds, main audio thread, since PLC_Start or PLC_ResetMaxExecutionTime
+    double wakeups_per_second;  // Main audio thread, since PLC_Start or PLC_Resume
+    uint64_t queue_size;        // Bytes waiting for the intermediate thread, 0 if it is not in use
+
+    // Version 3
+    int32_t last_exception_result; // E_OUTOFMEMORY or E_UNEXPECTED of the last call that returned PLC_ERROR_EXCEPTION, 0 if none
+} PLC_Stats;
+
+typedef void (PLC_CALL *PLC_ChunkCallback)(const uint8_t* data, size_t size, const PLC_ChunkInfo* info, void* user_data);
+
+// ------------------------------------------------------------
+
+PLC_API int32_t PLC_CALL PLC_GetApiVersion(void);
+
+// Static, English text. Never NULL.
+PLC_API const char* PLC_CALL PLC_GetErrorText(PLC_Error error);
+
+// Returns NULL if out of memory.
+PLC_API PLC_Capture* PLC_CALL PLC_Create(void);
+
+// Stops the capture if necessary. NULL is ignored.
+PLC_API void PLC_CALL PLC_Destroy(PLC_Capture* capture);
+
+// Configuration, only in PLC_STATE_READY. See the ProcessLoopbackCapture member of the same name.
+PLC_API PLC_Error PLC_CALL PLC_SetCaptureFormat(PLC_Capture* capture, uint32_t sample_rate, uint32_t bits_per_sample, uint32_t channels, uint32_t format_tag);
+PLC_API PLC_Error PLC_CALL PLC_SetTargetProcess(PLC_Capture* capture, uint32_t process_id, int32_t inclusive);
+PLC_API PLC_Error PLC_CALL PLC_SetChunkCallback(PLC_Capture* capture, PLC_ChunkCallback callback, void* user_data);
+PLC_API PLC_Error PLC_CALL PLC_SetIntermediateThreadEnabled(PLC_Capture* capture, int32_t enable);
+PLC_API PLC_Error PLC_CALL PLC_SetCallbackInterval(PLC_Capture* capture, uint32_t interval);
+PLC_API PLC_Error PLC_CALL PLC_SetBatchInterval(PLC_Capture* capture, uint32_t interval);
+
+PLC_API PLC_Error PLC_CALL PLC_Start(PLC_Capture* capture);
+PLC_API PLC_Error PLC_CALL PLC_Stop(PLC_Capture* capture);
+PLC_API PLC_Error PLC_CALL PLC_Pause(PLC_Capture* capture);
+PLC_API PLC_Error PLC_CALL PLC_Resume(PLC_Capture* capture, double initial_duration_to_skip);
+
+// PLC_STATE_*, PLC_STATE_READY for NULL.
+PLC_API int32_t PLC_CALL PLC_GetState(PLC_Capture* capture);
+
+// stats->struct_size must be set. Older callers with a smaller struct only get the fields they know.
+PLC_API PLC_Error PLC_CALL PLC_GetStats(PLC_Capture* capture, PLC_Stats* stats);
+PLC_API void PLC_CALL PLC_ResetMaxExecutionTime(PLC_Capture* capture);
+
+// ------------------------------------------------------------
+
+#ifdef __cplusplus
+}
+#endif
+
+// ------------------------------------------------------------ EOF
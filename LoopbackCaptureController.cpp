@@ -0,0 +1,175 @@
+#include <LoopbackCaptureController.h>
+
+#include <combaseapi.h> // CoInitializeEx
+
+using namespace std;
+
+// ------------------------------------------------------------ LoopbackCaptureController
+
+// public
+
+LoopbackCaptureController::LoopbackCaptureController(size_t iQueueCapacity) :
+    m_pOwnerThread(nullptr),
+    m_hWakeEvent(NULL),
+    m_bStop(true),
+
+    m_Commands(iQueueCapacity)
+{
+
+}
+
+LoopbackCaptureController::~LoopbackCaptureController()
+{
+    Stop();
+}
+
+eCaptureError LoopbackCaptureController::Start()
+{
+    if (IsRunning())
+        return eCaptureError::STATE;
+
+    // Auto-reset, every push signals and the owning thread runs all queued commands per wake
+
+    m_hWakeEvent = CreateEventW(NULL, false, false, NULL);
+
+    if (m_hWakeEvent == NULL)
+        return eCaptureError::EVENT;
+
+    m_bStop = false;
+    m_pOwnerThread = new thread(&LoopbackCaptureController::OwnerThread, this);
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackCaptureController::Stop()
+{
+    if (!IsRunning())
+        return;
+
+    m_bStop = true;
+    SetEvent(m_hWakeEvent);
+
+    m_pOwnerThread->join();
+    delete m_pOwnerThread;
+    m_pOwnerThread = nullptr;
+
+    CloseHandle(m_hWakeEvent);
+    m_hWakeEvent = NULL;
+
+    // Posted while stopping
+    sCommand *pCommand = nullptr;
+
+    while (m_Commands.Pop(pCommand))
+    {
+        pCommand->Result.set_value(eCaptureError::STATE);
+        delete pCommand;
+    }
+}
+
+bool LoopbackCaptureController::IsRunning()
+{
+    return m_pOwnerThread != nullptr;
+}
+
+std::future<eCaptureError> LoopbackCaptureController::Execute(std::function<eCaptureError(ProcessLoopbackCapture&)> Command)
+{
+    sCommand *pCommand = new sCommand;
+    pCommand->Func = std::move(Command);
+
+    future<eCaptureError> Result = pCommand->Result.get_future();
+
+    if (m_bStop.load(memory_order_acquire))
+    {
+        pCommand->Result.set_value(eCaptureError::STATE);
+        delete pCommand;
+    }
+    else if (!m_Commands.Push(pCommand))
+    {
+        pCommand->Result.set_value(eCaptureError::NOT_AVAILABLE);
+        delete pCommand;
+    }
+    else
+    {
+        SetEvent(m_hWakeEvent);
+    }
+
+    return Result;
+}
+
+std::future<eCaptureError> LoopbackCaptureController::StartCapture()
+{
+    return Execute([](ProcessLoopbackCapture& Capture) { return Capture.StartCapture(); });
+}
+
+std::future<eCaptureError> LoopbackCaptureController::StopCapture()
+{
+    return Execute([](ProcessLoopbackCapture& Capture) { return Capture.StopCapture(); });
+}
+
+std::future<eCaptureError> LoopbackCaptureController::PauseCapture()
+{
+    return Execute([](ProcessLoopbackCapture& Capture) { return Capture.PauseCapture(); });
+}
+
+std::future<eCaptureError> LoopbackCaptureController::ResumeCapture(double fInitialDurationToSkip)
+{
+    return Execute([fInitialDurationToSkip](ProcessLoopbackCapture& Capture) { return Capture.ResumeCapture(fInitialDurationToSkip); });
+}
+
+std::future<eCaptureError> LoopbackCaptureController::Retarget(DWORD dwProcessId, bool bInclusive)
+{
+    return Execute([dwProcessId, bInclusive](ProcessLoopbackCapture& Capture) { return Capture.Retarget(dwProcessId, bInclusive); });
+}
+
+ProcessLoopbackCapture& LoopbackCaptureController::GetCapture()
+{
+    return m_Capture;
+}
+
+eCaptureState LoopbackCaptureController::GetState()
+{
+    return m_Capture.GetState();
+}
+
+// private
+
+void LoopbackCaptureController::OwnerThread()
+{
+    // StartCapture needs COM on the calling thread
+    bool bComInitialized = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+
+    while (!m_bStop.load(memory_order_acquire))
+    {
+        WaitForSingleObject(m_hWakeEvent, INFINITE);
+        RunCommands();
+    }
+
+    // Commands posted before Stop still run, then the capture is stopped on the thread that started it
+
+    RunCommands();
+    m_Capture.StopCapture();
+
+    if (bComInitialized)
+        CoUninitialize();
+}
+
+void LoopbackCaptureController::RunCommands()
+{
+    sCommand *pCommand = nullptr;
+
+    while (m_Commands.Pop(pCommand))
+    {
+        try
+        {
+            pCommand->Result.set_value(pCommand->Func(m_Capture));
+        }
+        catch (...)
+        {
+            pCommand->Result.set_exception(current_exception());
+        }
+
+        delete pCommand;
+    }
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,99 @@
+#pragma once
+
+/*
+
+Thread-agnostic control of a ProcessLoopbackCapture.
+
+StartCapture, StopCapture, PauseCapture, ResumeCapture, Retarget and the setters must be called on one thread (StartCapture also
+needs COM). LoopbackCaptureController owns that thread and the capture: commands can be posted from any thread and are executed
+in order on the owning thread, which initializes COM itself. Every command returns a future for its result, so callers never block
+on the audio engine, and controllers of different captures run their commands in parallel.
+
+Commands are passed through a bounded lock-free ring (any number of writers, the owning thread reads), posting never blocks.
+If the ring is full, the future is ready immediately with NOT_AVAILABLE.
+
+LoopbackCaptureController Controller;
+Controller.Start();
+
+Controller.Execute([](ProcessLoopbackCapture& Capture)
+{
+    Capture.SetCaptureFormat(48000, 16, 2);
+    return Capture.SetTargetProcess(dwProcessId);
+});
+
+std::future<eCaptureError> Result = Controller.StartCapture();
+...
+Controller.StopCapture().wait();
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+
+// ------------------------------------------------------------
+
+class LoopbackCaptureController
+{
+public:
+
+    // iQueueCapacity is rounded up to a power of two.
+    LoopbackCaptureController(size_t iQueueCapacity = 64);
+
+    // Stops the owning thread (see Stop).
+    ~LoopbackCaptureController();
+
+    LoopbackCaptureController(const LoopbackCaptureController&) = delete;
+    LoopbackCaptureController& operator=(const LoopbackCaptureController&) = delete;
+
+    // Starts the owning thread. Start and Stop must be called on one thread, commands can be posted from any thread while running.
+    eCaptureError Start();
+
+    // Executes the commands that are already queued, stops the capture on the owning thread and joins it.
+    // Commands must not be posted concurrently with Stop or the destructor.
+    void Stop();
+
+    bool IsRunning();
+
+    // Runs Command with the capture on the owning thread. Commands run in the order they were posted.
+    // The future is ready with STATE if the controller is not running, and with NOT_AVAILABLE if the queue is full.
+    // An exception thrown by the command is stored in the future.
+    std::future<eCaptureError> Execute(std::function<eCaptureError(ProcessLoopbackCapture&)> Command);
+
+    std::future<eCaptureError> StartCapture();
+    std::future<eCaptureError> StopCapture();
+    std::future<eCaptureError> PauseCapture();
+    std::future<eCaptureError> ResumeCapture(double fInitialDurationToSkip = 0.1);
+    std::future<eCaptureError> Retarget(DWORD dwProcessId, bool bInclusive = true);
+
+    // The capture, for the functions that are safe to call from any thread (GetState, GetMaxExecutionTime, GetQueueSize, ...).
+    // Everything else must go through Execute.
+    ProcessLoopbackCapture& GetCapture();
+
+    eCaptureState GetState();
+
+private:
+
+    struct sCommand
+    {
+        std::function<eCaptureError(ProcessLoopbackCapture&)> Func;
+        std::promise<eCaptureError> Result;
+    };
+
+    void OwnerThread();
+    void RunCommands();
+
+    ProcessLoopbackCapture          m_Capture;
+
+    std::thread                     *m_pOwnerThread;
+    HANDLE                          m_hWakeEvent;
+    std::atomic<bool>               m_bStop;
+
+    LoopbackRing<sCommand*>         m_Commands;
+};
+
+// ------------------------------------------------------------ EOF
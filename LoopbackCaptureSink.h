@@ -0,0 +1,49 @@
+#pragma once
+
+/*
+
+Common base class for consumers of ProcessLoopbackCapture's audio data (file writers, encoders, analysis stages).
+
+A sink is attached by passing ILoopbackCaptureSink::Callback and the sink as user data:
+
+    LoopbackCapture.SetCallback(&ILoopbackCaptureSink::Callback, &MySink);
+
+OnData is called from whichever thread calls the user callback (main audio thread or intermediate thread),
+always with whole frames in the capture format. Sinks that do heavy work (file io, encoding) should be used
+with the intermediate thread enabled.
+
+OnGap is called instead of OnData when a stage in front of the sink dropped audio (e.g. LoopbackQosSink shedding it), so sinks
+with filter state or a timeline do not splice the audio before and after the gap together as if it was continuous.
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <vector>
+
+// ------------------------------------------------------------ 
+
+class ILoopbackCaptureSink
+{
+public:
+
+    virtual ~ILoopbackCaptureSink() = default;
+
+    // Receives block aligned audio data in the capture format. The data is only valid for the duration of the call.
+    virtual void OnData(const unsigned char *pData, size_t iSize) = 0;
+
+    // iFrames frames of the stream were not passed to OnData. Called on the same thread as OnData.
+    // Default: ignored, the next OnData continues as if nothing was missing
+    virtual void OnGap(UINT64 iFrames) {}
+
+    // Adapter for ProcessLoopbackCapture::SetCallback. pUserData must point to the sink.
+    static void Callback(const std::vector<unsigned char>::iterator& i1, const std::vector<unsigned char>::iterator& i2, void* pUserData)
+    {
+        if (pUserData == nullptr || i1 == i2)
+            return;
+
+        static_cast<ILoopbackCaptureSink*>(pUserData)->OnData(&*i1, (size_t)(i2 - i1));
+    }
+};
+
+// ------------------------------------------------------------ EOF
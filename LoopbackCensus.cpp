@@ -0,0 +1,362 @@
+#include <LoopbackCensus.h>
+#include <LoopbackAudioLevel.h>
+
+#include <combaseapi.h> // CoInitializeEx
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// ------------------------------------------------------------ LoopbackCensus
+
+// public
+
+LoopbackCensus::LoopbackCensus() :
+    m_iSampleRate(48000),
+    m_iChannelCount(2),
+    m_iMaxCaptures(4),
+    m_fWindowDuration(2.0),
+    m_fCycleInterval(60.0),
+    m_fActivityThreshold(0.001f),
+
+    m_bRunning(false),
+
+    m_bStop(false),
+    m_iCycleCount(0)
+{
+
+}
+
+LoopbackCensus::~LoopbackCensus()
+{
+    Stop();
+}
+
+eCaptureError LoopbackCensus::SetCaptureFormat(unsigned int iSampleRate, unsigned int iChannelCount)
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    if (iSampleRate < 1000 || iChannelCount == 0 || iChannelCount > 1024)
+        return eCaptureError::PARAM;
+
+    m_iSampleRate = iSampleRate;
+    m_iChannelCount = iChannelCount;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackCensus::SetMaxConcurrentCaptures(unsigned int iMaxCaptures)
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    if (iMaxCaptures == 0)
+        return eCaptureError::PARAM;
+
+    m_iMaxCaptures = iMaxCaptures;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackCensus::SetWindowDuration(double fSeconds)
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    if (!(fSeconds >= 0.01))
+        return eCaptureError::PARAM;
+
+    m_fWindowDuration = fSeconds;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackCensus::SetCycleInterval(double fSeconds)
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    if (!(fSeconds >= 0.0))
+        return eCaptureError::PARAM;
+
+    m_fCycleInterval = fSeconds;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackCensus::SetActivityThreshold(float fThreshold)
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    if (!(fThreshold >= 0.0f && fThreshold <= 1.0f))
+        return eCaptureError::PARAM;
+
+    m_fActivityThreshold = fThreshold;
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackCensus::SetTargets(const std::vector<sLoopbackCensusTarget>& Targets)
+{
+    lock_guard<mutex> Lock(m_Lock);
+
+    m_Targets = Targets;
+}
+
+eCaptureError LoopbackCensus::Start()
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    m_bStop = false;
+    m_Pending.clear();
+    m_iCycleCount = 0;
+    m_StartTime = chrono::steady_clock::now();
+    m_NextCycle = m_StartTime;
+
+    // Slots are kept between Start/Stop, only missing ones are created
+
+    while (m_Slots.size() < m_iMaxCaptures)
+        m_Slots.push_back(make_unique<sSlot>());
+
+    for (unsigned int i = 0; i < m_iMaxCaptures; ++i)
+    {
+        sSlot& Slot = *m_Slots[i];
+
+        eCaptureError eError = Slot.Capture.SetCaptureFormat(m_iSampleRate, 32, m_iChannelCount, WAVE_FORMAT_IEEE_FLOAT);
+
+        if (eError == eCaptureError::NONE)
+            eError = Slot.Capture.SetCallback(&LoopbackCensus::OnCaptureData, &Slot);
+
+        if (eError != eCaptureError::NONE || !Slot.Capture.CopyCaptureFormat(Slot.Format))
+            return eError != eCaptureError::NONE ? eError : eCaptureError::FORMAT;
+
+        Slot.fActivityThreshold = m_fActivityThreshold;
+        Slot.iBlockBytes = (size_t)max(Slot.Format.nSamplesPerSec / 100, (DWORD)1) * Slot.Format.nBlockAlign;
+        Slot.Block.reserve(Slot.iBlockBytes);
+    }
+
+    for (unsigned int i = 0; i < m_iMaxCaptures; ++i)
+        m_Threads.emplace_back(&LoopbackCensus::WorkerThread, this, ref(*m_Slots[i]));
+
+    m_bRunning = true;
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackCensus::Stop()
+{
+    if (!m_bRunning)
+        return;
+
+    {
+        lock_guard<mutex> Lock(m_Lock);
+        m_bStop = true;
+    }
+
+    m_Wake.notify_all();
+
+    for (thread& Thread : m_Threads)
+        Thread.join();
+
+    m_Threads.clear();
+    m_bRunning = false;
+}
+
+bool LoopbackCensus::IsRunning()
+{
+    return m_bRunning;
+}
+
+void LoopbackCensus::GetTable(std::vector<sLoopbackCensusEntry>& Table)
+{
+    Table.clear();
+
+    {
+        lock_guard<mutex> Lock(m_Lock);
+
+        Table.reserve(m_Table.size());
+
+        for (const auto& Entry : m_Table)
+            Table.push_back(Entry.second);
+    }
+
+    stable_sort(Table.begin(), Table.end(), [](const sLoopbackCensusEntry& a, const sLoopbackCensusEntry& b) { return a.fRms > b.fRms; });
+}
+
+UINT64 LoopbackCensus::GetCycleCount()
+{
+    lock_guard<mutex> Lock(m_Lock);
+
+    return m_iCycleCount;
+}
+
+// private
+
+void LoopbackCensus::OnCaptureData(const std::vector<unsigned char>::iterator& i1, const std::vector<unsigned char>::iterator& i2, void *pUserData)
+{
+    sSlot& Slot = *(sSlot*)pUserData;
+
+    const unsigned char *pData = &*i1;
+    size_t iSize = i2 - i1;
+
+    // Activity is judged on whole 10ms blocks, the remainder of a callback is kept for the next one
+
+    if (!Slot.Block.empty())
+    {
+        size_t iCopy = min(Slot.iBlockBytes - Slot.Block.size(), iSize);
+
+        Slot.Block.insert(Slot.Block.end(), pData, pData + iCopy);
+        pData += iCopy;
+        iSize -= iCopy;
+
+        if (Slot.Block.size() < Slot.iBlockBytes)
+            return;
+
+        MeasureBlock(Slot, Slot.Block.data(), Slot.Block.size());
+        Slot.Block.clear();
+    }
+
+    while (iSize >= Slot.iBlockBytes)
+    {
+        MeasureBlock(Slot, pData, Slot.iBlockBytes);
+        pData += Slot.iBlockBytes;
+        iSize -= Slot.iBlockBytes;
+    }
+
+    Slot.Block.insert(Slot.Block.end(), pData, pData + iSize);
+}
+
+void LoopbackCensus::MeasureBlock(sSlot& Slot, const unsigned char *pData, size_t iSize)
+{
+    float fPeak = LoopbackAudioLevel::GetPeak(pData, iSize, Slot.Format);
+
+    size_t iSamples = iSize / sizeof(float);
+    double fSum = 0.0;
+
+    for (size_t i = 0; i < iSamples; ++i)
+    {
+        float fSample;
+        memcpy(&fSample, pData + i * sizeof(float), sizeof(float));
+        fSum += (double)fSample * fSample;
+    }
+
+    Slot.fSumOfSquares += fSum;
+    Slot.iSampleCount += iSamples;
+    Slot.fPeak = max(Slot.fPeak, fPeak);
+    ++Slot.iBlockCount;
+
+    if (fPeak > Slot.fActivityThreshold)
+        ++Slot.iActiveBlockCount;
+}
+
+void LoopbackCensus::WorkerThread(sSlot& Slot)
+{
+    // StartCapture needs COM on the calling thread
+    bool bComInitialized = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+
+    sLoopbackCensusTarget Target;
+
+    while (TakeTarget(Target))
+    {
+        Slot.Block.clear();
+        Slot.fSumOfSquares = 0.0;
+        Slot.iSampleCount = 0;
+        Slot.fPeak = 0.0f;
+        Slot.iBlockCount = 0;
+        Slot.iActiveBlockCount = 0;
+
+        eCaptureError eError = Slot.Capture.SetTargetProcess(Target.dwProcessId, true);
+
+        if (eError == eCaptureError::NONE)
+            eError = Slot.Capture.StartCapture();
+
+        if (eError == eCaptureError::NONE)
+        {
+            {
+                unique_lock<mutex> Lock(m_Lock);
+                m_Wake.wait_for(Lock, chrono::duration<double>(m_fWindowDuration), [this]() { return m_bStop; });
+            }
+
+            Slot.Capture.StopCapture();
+        }
+
+        // The audio thread is joined by StopCapture, the measurement can be read without further synchronization
+
+        lock_guard<mutex> Lock(m_Lock);
+
+        // Dropped from the targets while this window was running
+        if (none_of(m_Targets.begin(), m_Targets.end(), [&](const sLoopbackCensusTarget& t) { return t.dwProcessId == Target.dwProcessId; }))
+            continue;
+
+        sLoopbackCensusEntry& Entry = m_Table[Target.dwProcessId];
+
+        if (Entry.Name != Target.Name)
+            Entry = {};
+
+        Entry.dwProcessId = Target.dwProcessId;
+        Entry.Name = Target.Name;
+        Entry.fLastWindowTime = chrono::duration<double>(chrono::steady_clock::now() - m_StartTime).count();
+        Entry.LastError = eError;
+
+        if (eError != eCaptureError::NONE)
+            continue;
+
+        ++Entry.iWindowCount;
+        Entry.fPeak = Slot.fPeak;
+        Entry.fRms = Slot.iSampleCount > 0 ? (float)sqrt(Slot.fSumOfSquares / Slot.iSampleCount) : 0.0f;
+        Entry.fActivity = Slot.iBlockCount > 0 ? (float)Slot.iActiveBlockCount / Slot.iBlockCount : 0.0f;
+    }
+
+    if (bComInitialized)
+        CoUninitialize();
+}
+
+bool LoopbackCensus::TakeTarget(sLoopbackCensusTarget& Target)
+{
+    unique_lock<mutex> Lock(m_Lock);
+
+    while (!m_bStop)
+    {
+        if (!m_Pending.empty())
+        {
+            Target = move(m_Pending.front());
+            m_Pending.pop_front();
+            return true;
+        }
+
+        auto now = chrono::steady_clock::now();
+
+        if (now < m_NextCycle)
+        {
+            m_Wake.wait_until(Lock, m_NextCycle);
+            continue;
+        }
+
+        // New cycle, drop entries of processes that are no longer targets
+
+        for (auto i = m_Table.begin(); i != m_Table.end();)
+        {
+            if (none_of(m_Targets.begin(), m_Targets.end(), [&](const sLoopbackCensusTarget& t) { return t.dwProcessId == i->first; }))
+                i = m_Table.erase(i);
+            else
+                ++i;
+        }
+
+        m_Pending.assign(m_Targets.begin(), m_Targets.end());
+        m_NextCycle = now + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(m_fCycleInterval));
+        ++m_iCycleCount;
+
+        // Nothing to sample, wait for the next cycle instead of spinning
+        if (m_Pending.empty() && m_fCycleInterval == 0.0)
+            m_Wake.wait_for(Lock, chrono::seconds(1));
+    }
+
+    return false;
+}
+
+// ------------------------------------------------------------ EOF
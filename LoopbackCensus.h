@@ -0,0 +1,158 @@
+#pragma once
+
+/*
+
+Periodic audio census over many processes.
+
+Capturing every process on a host continuously is too expensive, so LoopbackCensus samples them instead: every cycle, each
+target process is captured for a short window, at most SetMaxConcurrentCaptures at a time. The result is a table with the
+level and activity of every target as of its last window.
+
+Each concurrency slot owns a worker thread and a ProcessLoopbackCapture that are reused for all windows of that slot
+(StartCapture/StopCapture are always called from the slot's thread), the measurement state is reused as well.
+Worker threads initialize COM themselves.
+
+Note that a capture always includes the child processes of its target. If both a parent and its child are targets,
+the child's audio is counted for both. Use the top-most process of each application as target (see FindParentProcessIDs).
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ------------------------------------------------------------
+
+struct sLoopbackCensusTarget
+{
+    DWORD                           dwProcessId;
+    std::wstring                    Name;
+};
+
+struct sLoopbackCensusEntry
+{
+    DWORD                           dwProcessId;
+    std::wstring                    Name;
+
+    UINT64                          iWindowCount;       // Windows captured so far
+    double                          fLastWindowTime;    // Seconds since Start at the end of the last window
+
+    // Measured over the last window
+    float                           fPeak;              // 0-1
+    float                           fRms;               // 0-1
+    float                           fActivity;          // Share of 10ms blocks with a peak above the activity threshold
+
+    eCaptureError                   LastError;          // Result of the last StartCapture
+};
+
+// ------------------------------------------------------------
+
+class LoopbackCensus
+{
+public:
+
+    LoopbackCensus();
+    ~LoopbackCensus();
+
+    // Windows are captured as 32 bit float.
+    // Default: 48000 Hz, 2 channels
+    eCaptureError SetCaptureFormat(unsigned int iSampleRate, unsigned int iChannelCount);
+
+    // Default: 4
+    eCaptureError SetMaxConcurrentCaptures(unsigned int iMaxCaptures);
+
+    // Duration of a capture window in seconds.
+    // Default: 2
+    eCaptureError SetWindowDuration(double fSeconds);
+
+    // Minimum time between the starts of two cycles in seconds. 0 starts the next cycle as soon as the last window is taken.
+    // Default: 60
+    eCaptureError SetCycleInterval(double fSeconds);
+
+    // Peak level (0-1) a 10ms block must exceed to count as active.
+    // Default: 0.001 (-60 dBFS)
+    eCaptureError SetActivityThreshold(float fThreshold);
+
+    // Processes to sample. Can be called at any time, the list is picked up at the start of the next cycle.
+    // Table entries of processes that are no longer targets are removed.
+    void SetTargets(const std::vector<sLoopbackCensusTarget>& Targets);
+
+    eCaptureError Start();
+
+    // Stops all running windows and joins the worker threads. The table is kept.
+    void Stop();
+
+    bool IsRunning();
+
+    // Copies the table, loudest (RMS of the last window) first.
+    void GetTable(std::vector<sLoopbackCensusEntry>& Table);
+
+    // Number of cycles started since Start.
+    UINT64 GetCycleCount();
+
+private:
+
+    struct sSlot
+    {
+        ProcessLoopbackCapture          Capture;
+
+        // Written by the capture's audio thread during a window, read by the slot's thread after StopCapture
+        WAVEFORMATEX                    Format{};
+        float                           fActivityThreshold;
+        size_t                          iBlockBytes;
+        std::vector<unsigned char>      Block;              // Partial 10ms block
+
+        double                          fSumOfSquares;
+        UINT64                          iSampleCount;
+        float                           fPeak;
+        UINT64                          iBlockCount;
+        UINT64                          iActiveBlockCount;
+    };
+
+    static void OnCaptureData(const std::vector<unsigned char>::iterator& i1, const std::vector<unsigned char>::iterator& i2, void *pUserData);
+    static void MeasureBlock(sSlot& Slot, const unsigned char *pData, size_t iSize);
+
+    void WorkerThread(sSlot& Slot);
+
+    // Blocks until a target is due. Returns false when stopping.
+    bool TakeTarget(sLoopbackCensusTarget& Target);
+
+    unsigned int                    m_iSampleRate;
+    unsigned int                    m_iChannelCount;
+    unsigned int                    m_iMaxCaptures;
+    double                          m_fWindowDuration;
+    double                          m_fCycleInterval;
+    float                           m_fActivityThreshold;
+
+    bool                            m_bRunning;
+    std::vector<std::unique_ptr<sSlot>>
+                                    m_Slots;
+    std::vector<std::thread>        m_Threads;
+    std::chrono::steady_clock::time_point
+                                    m_StartTime;
+
+    // Shared state (m_Lock)
+
+    std::mutex                      m_Lock;
+    std::condition_variable         m_Wake;
+    bool                            m_bStop;
+    std::vector<sLoopbackCensusTarget>
+                                    m_Targets;
+    std::deque<sLoopbackCensusTarget>
+                                    m_Pending;          // Targets of the current cycle not sampled yet
+    std::chrono::steady_clock::time_point
+                                    m_NextCycle;
+    UINT64                          m_iCycleCount;
+    std::map<DWORD, sLoopbackCensusEntry>
+                                    m_Table;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,520 @@
+#include <LoopbackDecimationBank.h>
+#include <LoopbackSampleMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+namespace
+{
+    using LoopbackSampleMath::PI;
+    using LoopbackSampleMath::Dot;
+    using LoopbackSampleMath::ReadSample;
+
+    double BesselI0(double x)
+    {
+        double fSum = 1.0;
+        double fTerm = 1.0;
+
+        for (int k = 1; k < 50; ++k)
+        {
+            fTerm *= (x / (2.0 * k)) * (x / (2.0 * k));
+            fSum += fTerm;
+
+            if (fTerm < fSum * 1e-12)
+                break;
+        }
+
+        return fSum;
+    }
+
+    // Kaiser-windowed sinc lowpass, fCutoff in cycles per input sample. Normalized to unity gain at DC.
+    vector<double> DesignLowpass(size_t iTaps, double fCutoff)
+    {
+        vector<double> Taps(iTaps);
+        double fCenter = (iTaps - 1) / 2.0;
+        double fWindowScale = 1.0 / BesselI0(LoopbackDecimationConst::KAISER_BETA);
+
+        for (size_t j = 0; j < iTaps; ++j)
+        {
+            double t = j - fCenter;
+            double fSinc = t == 0.0 ? 2.0 * fCutoff : sin(2.0 * PI * fCutoff * t) / (PI * t);
+            double r = t / fCenter;
+
+            Taps[j] = fSinc * BesselI0(LoopbackDecimationConst::KAISER_BETA * sqrt(max(0.0, 1.0 - r * r))) * fWindowScale;
+        }
+
+        double fSum = accumulate(Taps.begin(), Taps.end(), 0.0);
+
+        for (double& fTap : Taps)
+            fTap /= fSum;
+
+        return Taps;
+    }
+}
+
+// ------------------------------------------------------------ LoopbackDecimationBank
+
+// public
+
+LoopbackDecimationBank::LoopbackDecimationBank() :
+    m_pTarget(nullptr),
+    m_bMixToMono(false),
+
+    m_bOpen(false),
+    m_nOutputChannels(0)
+{
+
+}
+
+LoopbackDecimationBank::~LoopbackDecimationBank()
+{
+    Close();
+}
+
+eCaptureError LoopbackDecimationBank::SetTarget(ILoopbackCaptureSink *pTarget)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pTarget = pTarget;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDecimationBank::SetMixToMono(bool bMixToMono)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_bMixToMono = bMixToMono;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDecimationBank::AddOutput(UINT32 iFactor, ILoopbackCaptureSink *pSink)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (iFactor < 2 || iFactor > LoopbackDecimationConst::MAX_FACTOR || pSink == nullptr)
+        return eCaptureError::PARAM;
+
+    m_Outputs.push_back({ iFactor, pSink, SIZE_MAX });
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDecimationBank::ClearOutputs()
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_Outputs.clear();
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDecimationBank::Open(const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || Format.nChannels == 0 || Format.nSamplesPerSec == 0 ||
+        (Format.wFormatTag != WAVE_FORMAT_PCM && Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT) ||
+        Format.nBlockAlign != Format.nChannels * (Format.wBitsPerSample / 8))
+        return eCaptureError::FORMAT;
+
+    for (auto& Output : m_Outputs)
+    {
+        if (Format.nSamplesPerSec % Output.iFactor != 0)
+            return eCaptureError::FORMAT;
+    }
+
+    m_Format = Format;
+    m_Format.cbSize = 0;
+    m_nOutputChannels = m_bMixToMono ? 1 : m_Format.nChannels;
+
+    m_Input.assign(m_nOutputChannels, vector<float>(LoopbackDecimationConst::BLOCK_FRAMES));
+
+    // Smaller factors first, so larger ones can continue from their stages
+
+    vector<size_t> Order(m_Outputs.size());
+    iota(Order.begin(), Order.end(), 0);
+    stable_sort(Order.begin(), Order.end(), [this](size_t a, size_t b) { return m_Outputs[a].iFactor < m_Outputs[b].iFactor; });
+
+    m_Stages.clear();
+
+    for (size_t iOutput : Order)
+    {
+        sOutput& Output = m_Outputs[iOutput];
+
+        // Deepest existing stage whose decimation divides the factor
+
+        size_t iStage = SIZE_MAX;
+        UINT32 iTotalFactor = 1;
+
+        for (size_t i = 0; i < m_Stages.size(); ++i)
+        {
+            if (Output.iFactor % m_Stages[i].iTotalFactor == 0 && m_Stages[i].iTotalFactor > iTotalFactor)
+            {
+                iStage = i;
+                iTotalFactor = m_Stages[i].iTotalFactor;
+            }
+        }
+
+        // The rest is split into prime factors, half-bands first
+
+        UINT32 iRemainder = Output.iFactor / iTotalFactor;
+
+        for (UINT32 iPrime = 2; iRemainder > 1; )
+        {
+            if (iRemainder % iPrime != 0)
+            {
+                ++iPrime;
+                continue;
+            }
+
+            iStage = AddStage(iStage, iPrime);
+            iRemainder /= iPrime;
+        }
+
+        Output.iStage = iStage;
+    }
+
+    m_Interleaved.resize(LoopbackDecimationConst::BLOCK_FRAMES / 2 * m_nOutputChannels + m_nOutputChannels);
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDecimationBank::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    m_Stages.clear();
+    m_Input.clear();
+    m_Interleaved.clear();
+
+    for (auto& Output : m_Outputs)
+        Output.iStage = SIZE_MAX;
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackDecimationBank::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackDecimationBank::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    if (m_pTarget != nullptr)
+        m_pTarget->OnData(pData, iSize);
+
+    size_t iFrames = iSize / m_Format.nBlockAlign;
+
+    while (iFrames > 0)
+    {
+        size_t iBlockFrames = min(iFrames, LoopbackDecimationConst::BLOCK_FRAMES);
+
+        ConvertInput(pData, iBlockFrames);
+
+        // Stages are stored after their parents
+
+        for (auto& Stage : m_Stages)
+        {
+            if (Stage.iParent == SIZE_MAX)
+                RunStage(Stage, m_Input, iBlockFrames);
+            else
+                RunStage(Stage, m_Stages[Stage.iParent].Output, m_Stages[Stage.iParent].iOutputFrames);
+        }
+
+        for (auto& Output : m_Outputs)
+            Deliver(Output);
+
+        pData += iBlockFrames * m_Format.nBlockAlign;
+        iFrames -= iBlockFrames;
+    }
+}
+
+void LoopbackDecimationBank::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    if (m_pTarget != nullptr)
+        m_pTarget->OnGap(iFrames);
+
+    for (auto& Stage : m_Stages)
+        SkipStage(Stage, Stage.iParent == SIZE_MAX ? iFrames : m_Stages[Stage.iParent].iGapFrames);
+
+    for (auto& Output : m_Outputs)
+    {
+        UINT64 iGapFrames = m_Stages[Output.iStage].iGapFrames;
+
+        if (iGapFrames > 0)
+            Output.pSink->OnGap(iGapFrames);
+    }
+}
+
+eCaptureError LoopbackDecimationBank::GetOutputFormat(size_t iOutput, WAVEFORMATEX& Format)
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    if (iOutput >= m_Outputs.size())
+        return eCaptureError::PARAM;
+
+    Format = {};
+    Format.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+    Format.nChannels = m_nOutputChannels;
+    Format.nSamplesPerSec = m_Format.nSamplesPerSec / m_Outputs[iOutput].iFactor;
+    Format.wBitsPerSample = 32;
+    Format.nBlockAlign = Format.nChannels * sizeof(float);
+    Format.nAvgBytesPerSec = Format.nSamplesPerSec * Format.nBlockAlign;
+
+    return eCaptureError::NONE;
+}
+
+size_t LoopbackDecimationBank::GetStageCount()
+{
+    return m_Stages.size();
+}
+
+// private
+
+size_t LoopbackDecimationBank::AddStage(size_t iParent, UINT32 iFactor)
+{
+    sStage Stage{};
+
+    Stage.iParent = iParent;
+    Stage.iFactor = iFactor;
+    Stage.iTotalFactor = (iParent == SIZE_MAX ? 1 : m_Stages[iParent].iTotalFactor) * iFactor;
+    Stage.bHalfBand = iFactor == 2;
+
+    DesignStage(Stage);
+
+    // No stage receives more than a block per pass
+
+    size_t iBlockFrames = LoopbackDecimationConst::BLOCK_FRAMES;
+
+    if (Stage.bHalfBand)
+    {
+        Stage.History.assign(m_nOutputChannels, vector<float>(Stage.iHistory + iBlockFrames / 2 + 1));
+        Stage.Other.assign(m_nOutputChannels, vector<float>(Stage.iOtherHistory + iBlockFrames / 2 + 1));
+    }
+    else
+    {
+        Stage.History.assign(m_nOutputChannels, vector<float>(Stage.iHistory + iBlockFrames));
+    }
+
+    Stage.Output.assign(m_nOutputChannels, vector<float>(iBlockFrames / iFactor + 1));
+
+    m_Stages.push_back(move(Stage));
+
+    return m_Stages.size() - 1;
+}
+
+void LoopbackDecimationBank::DesignStage(sStage& Stage)
+{
+    if (Stage.bHalfBand)
+    {
+        // Every second tap of a half-band filter is zero except the center. With an odd center index the nonzero
+        // taps apart from it are the even ones, which only see the samples at output positions.
+
+        size_t iTaps = LoopbackDecimationConst::HALF_BAND_TAPS;
+        size_t iCenter = (iTaps - 1) / 2;
+
+        vector<double> Taps = DesignLowpass(iTaps, 0.25);
+
+        Stage.Taps.resize(iCenter + 1);
+
+        for (size_t m = 0; m <= iCenter; ++m)
+            Stage.Taps[m] = (float)Taps[iTaps - 1 - 2 * m];
+
+        Stage.fCenterTap = (float)Taps[iCenter];
+        Stage.iHistory = iCenter;
+        Stage.iOtherHistory = (iCenter + 1) / 2;
+
+        return;
+    }
+
+    // The stopband starts at half the output rate, so nothing aliases into the passband
+
+    size_t iTaps = Stage.iFactor * LoopbackDecimationConst::TAPS_PER_PHASE;
+    double fTransition = (80.0 - 8.0) / (2.285 * 2.0 * 3.14159265358979323846 * (iTaps - 1));
+    double fCutoff = 0.5 / Stage.iFactor - fTransition / 2.0;
+
+    vector<double> Taps = DesignLowpass(iTaps, fCutoff);
+
+    Stage.Taps.resize(iTaps);
+
+    for (size_t j = 0; j < iTaps; ++j)
+        Stage.Taps[j] = (float)Taps[iTaps - 1 - j];
+
+    Stage.fCenterTap = 0.0f;
+    Stage.iHistory = iTaps - 1;
+    Stage.iOtherHistory = 0;
+}
+
+void LoopbackDecimationBank::ConvertInput(const unsigned char *pData, size_t iFrames)
+{
+    WORD nChannels = m_Format.nChannels;
+    WORD nBytes = m_Format.wBitsPerSample / 8;
+
+    for (size_t i = 0; i < iFrames; ++i)
+    {
+        const unsigned char *pFrame = pData + i * m_Format.nBlockAlign;
+
+        if (m_bMixToMono)
+        {
+            float fSum = 0.0f;
+
+            for (WORD c = 0; c < nChannels; ++c)
+                fSum += ReadSample(pFrame + c * nBytes, m_Format.wBitsPerSample, m_Format.wFormatTag);
+
+            m_Input[0][i] = fSum / nChannels;
+        }
+        else
+        {
+            for (WORD c = 0; c < nChannels; ++c)
+                m_Input[c][i] = ReadSample(pFrame + c * nBytes, m_Format.wBitsPerSample, m_Format.wFormatTag);
+        }
+    }
+}
+
+void LoopbackDecimationBank::RunStage(sStage& Stage, const std::vector<std::vector<float>>& Input, size_t iFrames)
+{
+    size_t iTaps = Stage.Taps.size();
+    size_t iOutputFrames = 0;
+    UINT32 iPhase = Stage.iPhase;
+
+    // All channels advance in lockstep, the phase is stored once after the last channel
+
+    for (size_t c = 0; c < Stage.History.size(); ++c)
+    {
+        const float *pInput = Input[c].data();
+        float *pHistory = Stage.History[c].data();
+        float *pOutput = Stage.Output[c].data();
+
+        iPhase = Stage.iPhase;
+        iOutputFrames = 0;
+
+        if (Stage.bHalfBand)
+        {
+            // Odd samples go to Other, each even sample completes an output
+
+            float *pOther = Stage.Other[c].data();
+            size_t iCount = Stage.iHistory;
+            size_t iOtherCount = Stage.iOtherHistory;
+            size_t iCenterOffset = (Stage.iHistory - 1) / 2 + 1;
+
+            for (size_t i = 0; i < iFrames; ++i)
+            {
+                if (iPhase == 0)
+                {
+                    pOther[iOtherCount++] = pInput[i];
+                    iPhase = 1;
+                    continue;
+                }
+
+                pHistory[iCount++] = pInput[i];
+                iPhase = 0;
+
+                pOutput[iOutputFrames++] = Dot(pHistory + iCount - iTaps, Stage.Taps.data(), iTaps) + Stage.fCenterTap * pOther[iOtherCount - iCenterOffset];
+            }
+
+            memmove(pHistory, pHistory + iCount - Stage.iHistory, Stage.iHistory * sizeof(float));
+            memmove(pOther, pOther + iOtherCount - Stage.iOtherHistory, Stage.iOtherHistory * sizeof(float));
+        }
+        else
+        {
+            memcpy(pHistory + Stage.iHistory, pInput, iFrames * sizeof(float));
+
+            // Output after input i uses the window ending at it, which starts at pHistory + i
+
+            for (size_t i = 0; i < iFrames; ++i)
+            {
+                if (++iPhase < Stage.iFactor)
+                    continue;
+
+                iPhase = 0;
+                pOutput[iOutputFrames++] = Dot(pHistory + i, Stage.Taps.data(), iTaps);
+            }
+
+            memmove(pHistory, pHistory + iFrames, Stage.iHistory * sizeof(float));
+        }
+    }
+
+    Stage.iPhase = iPhase;
+    Stage.iOutputFrames = iOutputFrames;
+}
+
+void LoopbackDecimationBank::SkipStage(sStage& Stage, UINT64 iFrames)
+{
+    // Same phase logic as RunStage: a half-band stage takes the samples at phase 0 into Other and completes an output at phase 1
+
+    UINT64 iOutputFrames = (Stage.iPhase + iFrames) / Stage.iFactor;
+
+    Stage.iPhase = (UINT32)((Stage.iPhase + iFrames) % Stage.iFactor);
+    Stage.iGapFrames = iOutputFrames;
+
+    // The zeros shift into the history, what is left of it still reaches the outputs after the gap
+
+    UINT64 iHistoryFrames = Stage.bHalfBand ? iOutputFrames : iFrames;
+    UINT64 iOtherFrames = Stage.bHalfBand ? iFrames - iOutputFrames : 0;
+
+    for (size_t c = 0; c < Stage.History.size(); ++c)
+    {
+        size_t iShift = (size_t)min(iHistoryFrames, (UINT64)Stage.iHistory);
+        float *pHistory = Stage.History[c].data();
+
+        memmove(pHistory, pHistory + iShift, (Stage.iHistory - iShift) * sizeof(float));
+        fill(pHistory + Stage.iHistory - iShift, pHistory + Stage.iHistory, 0.0f);
+
+        if (!Stage.bHalfBand)
+            continue;
+
+        iShift = (size_t)min(iOtherFrames, (UINT64)Stage.iOtherHistory);
+        float *pOther = Stage.Other[c].data();
+
+        memmove(pOther, pOther + iShift, (Stage.iOtherHistory - iShift) * sizeof(float));
+        fill(pOther + Stage.iOtherHistory - iShift, pOther + Stage.iOtherHistory, 0.0f);
+    }
+}
+
+void LoopbackDecimationBank::Deliver(const sOutput& Output)
+{
+    const sStage& Stage = m_Stages[Output.iStage];
+
+    if (Stage.iOutputFrames == 0)
+        return;
+
+    size_t iSamples = Stage.iOutputFrames * m_nOutputChannels;
+
+    if (m_Interleaved.size() < iSamples)
+        m_Interleaved.resize(iSamples);
+
+    for (size_t i = 0; i < Stage.iOutputFrames; ++i)
+    {
+        for (size_t c = 0; c < m_nOutputChannels; ++c)
+            m_Interleaved[i * m_nOutputChannels + c] = Stage.Output[c][i];
+    }
+
+    Output.pSink->OnData(reinterpret_cast<const unsigned char*>(m_Interleaved.data()), iSamples * sizeof(float));
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,146 @@
+#pragma once
+
+/*
+
+Multi-rate decimation for ProcessLoopbackCapture: derives several lower-rate float streams (e.g. 16 kHz for speech recognition and
+8 kHz for telephony from a 48 kHz capture) in one pass over the input, next to the full-rate stream.
+
+LoopbackDecimationBank is a sink. The full-rate data is forwarded unchanged to an optional target sink (e.g. the archive), each
+output receives 32-bit float frames at the input rate divided by its integer factor (see GetOutputFormat).
+
+Outputs share their intermediate stages. The factors are split into a chain of stages: half-band filters for factors of 2 and
+polyphase FIR decimators for the other prime factors. An output that is a multiple of another output (or of one of its stages)
+continues from that stage instead of starting over, e.g. factors 3 and 6 are computed as 48 -> 16 -> 8 kHz with one 3:1 stage.
+Only the output samples are computed, and the FIR dot products use SSE where available.
+
+The filters are Kaiser-windowed sinc designs with about 80 dB stopband attenuation. The passband ends at about 40% of each output
+rate (e.g. 6.4 kHz at 16 kHz), the filter delay is not compensated.
+
+LoopbackDecimationBank Bank;
+Bank.SetTarget(&WavSink);
+Bank.SetMixToMono(true);
+Bank.AddOutput(3, &SpeechSink);
+Bank.AddOutput(6, &PhoneSink);
+Bank.Open(Format);
+
+LoopbackCapture.SetCallback(&ILoopbackCaptureSink::Callback, &Bank);
+
+*/
+
+#include <LoopbackCaptureSink.h>
+
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackDecimationConst
+{
+    // Input frames converted and filtered per pass
+    constexpr size_t BLOCK_FRAMES = 1024;
+
+    // Half-band filter length, must be 4n + 3 (odd center tap, about half of the taps are zero)
+    constexpr size_t HALF_BAND_TAPS = 95;
+
+    // Length of the other decimators is the factor times this
+    constexpr size_t TAPS_PER_PHASE = 48;
+
+    constexpr double KAISER_BETA = 8.0;
+
+    constexpr UINT32 MAX_FACTOR = 64;
+}
+
+// ------------------------------------------------------------
+
+class LoopbackDecimationBank : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackDecimationBank();
+    ~LoopbackDecimationBank();
+
+    // Sink that receives the unchanged full-rate data. Must stay valid while open.
+    // Default: nullptr
+    eCaptureError SetTarget(ILoopbackCaptureSink *pTarget);
+
+    // Downmixes the input before decimation, so all outputs are mono.
+    // Default: false
+    eCaptureError SetMixToMono(bool bMixToMono);
+
+    // Adds an output at the input rate divided by iFactor (2-64). pSink receives interleaved 32-bit float frames and must stay valid while open.
+    eCaptureError AddOutput(UINT32 iFactor, ILoopbackCaptureSink *pSink);
+
+    eCaptureError ClearOutputs();
+
+    // Builds the stages and designs the filters. Fails with FORMAT if the sample rate is not divisible by every factor.
+    eCaptureError Open(const WAVEFORMATEX& Format);
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // Advances the filters over iFrames frames of silence without computing them, so the output positions after the gap are those
+    // of a continuous stream. Nothing rings into the gap: a later stage sees zeros where its parent's tail would have been. The
+    // target receives the gap unchanged and each output the gap at its rate.
+    void OnGap(UINT64 iFrames) override;
+
+    // Format of the data passed to the sink of output iOutput (in the order of AddOutput). Only while open.
+    eCaptureError GetOutputFormat(size_t iOutput, WAVEFORMATEX& Format);
+
+    // Number of filter stages after sharing, for diagnostics.
+    size_t GetStageCount();
+
+private:
+
+    struct sOutput
+    {
+        UINT32                      iFactor;
+        ILoopbackCaptureSink        *pSink;
+        size_t                      iStage;
+    };
+
+    struct sStage
+    {
+        size_t                      iParent;        // Index of the input stage, SIZE_MAX for the converted input
+        UINT32                      iFactor;        // Decimation of this stage
+        UINT32                      iTotalFactor;   // Decimation relative to the input
+        bool                        bHalfBand;
+
+        // Reversed taps. Half-band: the even taps only, the center tap is kept separately.
+        std::vector<float>          Taps;
+        float                       fCenterTap;
+
+        // Per channel: history followed by the current block. Half-band stages use Other for the odd samples.
+        std::vector<std::vector<float>> History;
+        std::vector<std::vector<float>> Other;
+        size_t                      iHistory;
+        size_t                      iOtherHistory;
+        UINT32                      iPhase;         // Input samples since the last output sample
+
+        // Per channel output of the current block
+        std::vector<std::vector<float>> Output;
+        size_t                      iOutputFrames;
+        UINT64                      iGapFrames;     // Output frames of the last gap
+    };
+
+    size_t AddStage(size_t iParent, UINT32 iFactor);
+    void DesignStage(sStage& Stage);
+    void ConvertInput(const unsigned char *pData, size_t iFrames);
+    void RunStage(sStage& Stage, const std::vector<std::vector<float>>& Input, size_t iFrames);
+    void SkipStage(sStage& Stage, UINT64 iFrames);
+    void Deliver(const sOutput& Output);
+
+    ILoopbackCaptureSink            *m_pTarget;
+    bool                            m_bMixToMono;
+    std::vector<sOutput>            m_Outputs;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format{};
+    WORD                            m_nOutputChannels;
+
+    std::vector<sStage>             m_Stages;
+    std::vector<std::vector<float>> m_Input;        // Per channel, converted block
+    std::vector<float>              m_Interleaved;  // Output to the sinks
+};
+
+// ------------------------------------------------------------ EOF
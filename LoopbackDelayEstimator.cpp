@@ -0,0 +1,530 @@
+#include <LoopbackDelayEstimator.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+// ------------------------------------------------------------ Helpers
+
+namespace
+{
+    size_t NextPowerOfTwo(size_t iValue)
+    {
+        size_t iResult = 1;
+
+        while (iResult < iValue)
+            iResult <<= 1;
+
+        return iResult;
+    }
+}
+
+// ------------------------------------------------------------ LoopbackDelayEstimator
+
+// public
+
+LoopbackDelayEstimator::LoopbackDelayEstimator() :
+    m_iDecimation(0),
+    m_fWindow(1.0),
+    m_fMaxLag(0.5),
+    m_dwInterval(500),
+    m_fMinConfidence(0.5f),
+    m_pEstimateFunc(nullptr),
+    m_pEstimateFuncUserData(nullptr),
+    m_pEventRing(nullptr),
+    m_iEventSource(0),
+
+    m_bOpen(false),
+    m_iActiveDecimation(0),
+    m_dwSampleRate(0),
+    m_dwAnalysisRate(0),
+
+    m_iWindowSamples(0),
+    m_iLagSamples(0),
+    m_iFFTSize(0),
+    m_iLastAnalyzed(0),
+    m_iLastReportedLag(0),
+    m_bReported(false),
+
+    m_pAnalysisThread(nullptr),
+    m_bStop(false),
+
+    m_bEstimateValid(false),
+    m_iEstimateCount(0)
+{
+
+}
+
+LoopbackDelayEstimator::~LoopbackDelayEstimator()
+{
+    Close();
+}
+
+ILoopbackCaptureSink* LoopbackDelayEstimator::GetInput(size_t iStream)
+{
+    if (iStream >= 2)
+        return nullptr;
+
+    return &m_Streams[iStream].Bank;
+}
+
+eCaptureError LoopbackDelayEstimator::SetDecimation(UINT32 iFactor)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (iFactor == 1 || iFactor > LoopbackDecimationConst::MAX_FACTOR)
+        return eCaptureError::PARAM;
+
+    m_iDecimation = iFactor;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::SetWindow(double fWindow, double fMaxLag)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fWindow < 0.05 || fWindow > 10.0 || fMaxLag <= 0.0 || fMaxLag > 10.0)
+        return eCaptureError::PARAM;
+
+    m_fWindow = fWindow;
+    m_fMaxLag = fMaxLag;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::SetInterval(DWORD dwInterval)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (dwInterval == 0)
+        return eCaptureError::PARAM;
+
+    m_dwInterval = dwInterval;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::SetMinConfidence(float fMinConfidence)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fMinConfidence < 0.0f || fMinConfidence > 1.0f)
+        return eCaptureError::PARAM;
+
+    m_fMinConfidence = fMinConfidence;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::SetEstimateCallback(void (*pEstimateFunc)(const sLoopbackDelayEstimate& Estimate, void*), void *pUserData)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pEstimateFunc = pEstimateFunc;
+    m_pEstimateFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::SetEventLog(LoopbackEventRing *pRing, UINT16 iSource)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pEventRing = pRing;
+    m_iEventSource = iSource;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::Open(const WAVEFORMATEX& Format0, const WAVEFORMATEX& Format1)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format0.nBlockAlign == 0 || Format1.nBlockAlign == 0 || Format0.nSamplesPerSec == 0 || Format0.nSamplesPerSec != Format1.nSamplesPerSec)
+        return eCaptureError::FORMAT;
+
+    m_dwSampleRate = Format0.nSamplesPerSec;
+
+    // Largest factor that divides the rate and keeps at least the analysis rate
+
+    m_iActiveDecimation = m_iDecimation;
+
+    if (m_iActiveDecimation == 0)
+    {
+        for (UINT32 iFactor = min(m_dwSampleRate / LoopbackDelayConst::ANALYSIS_RATE, LoopbackDecimationConst::MAX_FACTOR); iFactor >= 2; --iFactor)
+        {
+            if (m_dwSampleRate % iFactor == 0)
+            {
+                m_iActiveDecimation = iFactor;
+                break;
+            }
+        }
+
+        if (m_iActiveDecimation == 0)
+            return eCaptureError::FORMAT;
+    }
+
+    if (m_dwSampleRate % m_iActiveDecimation != 0)
+        return eCaptureError::FORMAT;
+
+    m_dwAnalysisRate = m_dwSampleRate / m_iActiveDecimation;
+
+    m_iWindowSamples = max((size_t)(m_fWindow * m_dwAnalysisRate + 0.5), (size_t)16);
+    m_iLagSamples = max((size_t)(m_fMaxLag * m_dwAnalysisRate + 0.5), (size_t)1);
+
+    // The second window is longer by twice the lag, and no wrap around may reach the searched lags
+
+    m_iFFTSize = NextPowerOfTwo(m_iWindowSamples + m_iLagSamples * 2);
+
+    m_Window0.assign(m_iWindowSamples, 0.0f);
+    m_Window1.assign(m_iWindowSamples + m_iLagSamples * 2, 0.0f);
+    m_FFT.assign(m_iFFTSize * 2, 0.0f);
+    m_Transform.SetSize(m_iFFTSize);
+
+    // Room for one more second, so a window is not overwritten while the analysis thread copies the other one
+
+    size_t iRingSize = NextPowerOfTwo(m_iFFTSize + m_dwAnalysisRate);
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        sStream& Stream = m_Streams[i];
+
+        Stream.pRing = make_unique<atomic<float>[]>(iRingSize);
+        Stream.iRingSize = iRingSize;
+
+        for (size_t s = 0; s < iRingSize; ++s)
+            Stream.pRing[s].store(0.0f, memory_order_relaxed);
+
+        Stream.iWriteCount.store(0, memory_order_relaxed);
+        Stream.iCount.store(0, memory_order_relaxed);
+
+        Stream.Bank.ClearOutputs();
+        Stream.Bank.SetMixToMono(true);
+        Stream.Bank.AddOutput(m_iActiveDecimation, &Stream);
+
+        eCaptureError eError = Stream.Bank.Open(i == 0 ? Format0 : Format1);
+
+        if (eError != eCaptureError::NONE)
+        {
+            m_Streams[0].Bank.Close();
+            return eError;
+        }
+    }
+
+    m_iLastAnalyzed = 0;
+    m_iLastReportedLag = 0;
+    m_bReported = false;
+
+    {
+        lock_guard<mutex> Lock(m_EstimateLock);
+
+        m_Estimate = {};
+        m_bEstimateValid = false;
+    }
+
+    m_iEstimateCount = 0;
+
+    m_bStop = false;
+    m_pAnalysisThread = new thread(&LoopbackDelayEstimator::AnalysisThread, this);
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDelayEstimator::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    {
+        lock_guard<mutex> Lock(m_Lock);
+        m_bStop = true;
+    }
+
+    m_Wake.notify_all();
+
+    m_pAnalysisThread->join();
+    delete m_pAnalysisThread;
+    m_pAnalysisThread = nullptr;
+
+    m_Streams[0].Bank.Close();
+    m_Streams[1].Bank.Close();
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackDelayEstimator::IsOpen()
+{
+    return m_bOpen;
+}
+
+bool LoopbackDelayEstimator::GetEstimate(sLoopbackDelayEstimate& Estimate)
+{
+    lock_guard<mutex> Lock(m_EstimateLock);
+
+    if (!m_bEstimateValid)
+        return false;
+
+    Estimate = m_Estimate;
+
+    return true;
+}
+
+UINT64 LoopbackDelayEstimator::GetEstimateCount()
+{
+    return m_iEstimateCount.load(memory_order_relaxed);
+}
+
+// private
+
+void LoopbackDelayEstimator::sStream::OnData(const unsigned char *pData, size_t iSize)
+{
+    const float *pSamples = (const float*)pData;
+    size_t iSamples = iSize / sizeof(float);
+    size_t iMask = iRingSize - 1;
+    UINT64 iStart = iCount.load(memory_order_relaxed);
+
+    // Announced before the old samples are overwritten, the fence keeps the announcement ahead of the stores
+    iWriteCount.store(iStart + iSamples, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (size_t i = 0; i < iSamples; ++i)
+        pRing[(size_t)(iStart + i) & iMask].store(pSamples[i], memory_order_relaxed);
+
+    iCount.store(iStart + iSamples, memory_order_release);
+}
+
+void LoopbackDelayEstimator::sStream::OnGap(UINT64 iFrames)
+{
+    size_t iMask = iRingSize - 1;
+    UINT64 iStart = iCount.load(memory_order_relaxed);
+    UINT64 iEnd = iStart + iFrames;
+
+    iWriteCount.store(iEnd, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // Only the part that is still in the ring afterwards
+    for (UINT64 i = iFrames > iRingSize ? iEnd - iRingSize : iStart; i < iEnd; ++i)
+        pRing[(size_t)i & iMask].store(0.0f, memory_order_relaxed);
+
+    iCount.store(iEnd, memory_order_release);
+}
+
+void LoopbackDelayEstimator::AnalysisThread()
+{
+    unique_lock<mutex> Lock(m_Lock);
+
+    while (!m_bStop)
+    {
+        m_Wake.wait_for(Lock, chrono::milliseconds(m_dwInterval), [this]() { return m_bStop; });
+
+        if (m_bStop)
+            break;
+
+        Lock.unlock();
+
+        sLoopbackDelayEstimate Estimate;
+
+        if (Analyze(Estimate))
+        {
+            {
+                lock_guard<mutex> EstimateLock(m_EstimateLock);
+
+                m_Estimate = Estimate;
+                m_bEstimateValid = true;
+            }
+
+            m_iEstimateCount.fetch_add(1, memory_order_relaxed);
+
+            if (m_pEstimateFunc != nullptr)
+                m_pEstimateFunc(Estimate, m_pEstimateFuncUserData);
+
+            // Only confident estimates that moved by more than one analysis sample
+
+            if (m_pEventRing != nullptr && Estimate.fConfidence >= m_fMinConfidence &&
+                (!m_bReported || llabs(Estimate.iLagFrames - m_iLastReportedLag) > (INT64)m_iActiveDecimation))
+            {
+                sLoopbackEvent Event{};
+
+                Event.iTime = (UINT64)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+                Event.iValue = (UINT64)Estimate.iLagFrames;
+                Event.iValue2 = (UINT32)(Estimate.fConfidence * 1000.0f + 0.5f);
+                Event.iSource = m_iEventSource;
+                Event.Type = eLoopbackEvent::DELAY_CHANGED;
+
+                m_pEventRing->Push(Event);
+
+                m_iLastReportedLag = Estimate.iLagFrames;
+                m_bReported = true;
+            }
+        }
+
+        Lock.lock();
+    }
+}
+
+bool LoopbackDelayEstimator::Analyze(sLoopbackDelayEstimate& Estimate)
+{
+    UINT64 iCount0 = m_Streams[0].iCount.load(memory_order_acquire);
+    UINT64 iCount1 = m_Streams[1].iCount.load(memory_order_acquire);
+
+    // The first window ends at iEnd, the second one reaches the lag beyond it on both sides
+
+    size_t W = m_iWindowSamples;
+    size_t L = m_iLagSamples;
+
+    if (iCount1 < L)
+        return false;
+
+    UINT64 iEnd = min(iCount0, iCount1 - L);
+
+    if (iEnd < W + L || iEnd == m_iLastAnalyzed)
+        return false;
+
+    if (!CopyFromRing(m_Streams[0], iEnd - W, W, m_Window0.data()) ||
+        !CopyFromRing(m_Streams[1], iEnd - W - L, W + L * 2, m_Window1.data()))
+        return false;
+
+    m_iLastAnalyzed = iEnd;
+
+    // Both real signals in one complex FFT: z = x + iy
+
+    size_t N = m_iFFTSize;
+    float *pZ = m_FFT.data();
+
+    fill(m_FFT.begin(), m_FFT.end(), 0.0f);
+
+    for (size_t i = 0; i < W; ++i)
+        pZ[i * 2] = m_Window0[i];
+
+    for (size_t i = 0; i < W + L * 2; ++i)
+        pZ[i * 2 + 1] = m_Window1[i];
+
+    m_Transform.Forward(pZ);
+
+    // X = (Z[k] + conj(Z[N - k])) / 2, Y = (Z[k] - conj(Z[N - k])) / 2i. The cross-spectrum conj(X) Y is weighted to unit magnitude
+    // (PHAT) and conjugated, so the forward FFT below computes the inverse.
+
+    for (size_t k = 0; k <= N / 2; ++k)
+    {
+        size_t m = (N - k) & (N - 1);
+
+        float fZr = pZ[k * 2];
+        float fZi = pZ[k * 2 + 1];
+        float fCr = pZ[m * 2];
+        float fCi = -pZ[m * 2 + 1];
+
+        float fXr = (fZr + fCr) * 0.5f;
+        float fXi = (fZi + fCi) * 0.5f;
+        float fYr = (fZi - fCi) * 0.5f;
+        float fYi = (fCr - fZr) * 0.5f;
+
+        float fSr = fXr * fYr + fXi * fYi;
+        float fSi = fXr * fYi - fXi * fYr;
+        float fMagnitude = sqrt(fSr * fSr + fSi * fSi) + 1e-20f;
+
+        fSr /= fMagnitude;
+        fSi /= fMagnitude;
+
+        pZ[k * 2] = fSr;
+        pZ[k * 2 + 1] = -fSi;
+        pZ[m * 2] = fSr;
+        pZ[m * 2 + 1] = fSi;
+    }
+
+    m_Transform.Forward(pZ);
+
+    // Lag k - L is at k, for k in 0 to 2L
+
+    size_t iPeak = 0;
+
+    for (size_t k = 1; k <= L * 2; ++k)
+    {
+        if (pZ[k * 2] > pZ[iPeak * 2])
+            iPeak = k;
+    }
+
+    float fPeak = pZ[iPeak * 2];
+    float fSecond = 0.0f;
+
+    for (size_t k = 0; k <= L * 2; ++k)
+    {
+        if ((k + 2 < iPeak || k > iPeak + 2) && pZ[k * 2] > fSecond)
+            fSecond = pZ[k * 2];
+    }
+
+    if (fPeak <= 0.0f)
+        return false;
+
+    double fOffset = 0.0;
+
+    if (iPeak > 0 && iPeak < L * 2)
+    {
+        double fLeft = pZ[(iPeak - 1) * 2];
+        double fRight = pZ[(iPeak + 1) * 2];
+        double fDenominator = fLeft - 2.0 * fPeak + fRight;
+
+        if (fDenominator < 0.0)
+            fOffset = min(max(0.5 * (fLeft - fRight) / fDenominator, -0.5), 0.5);
+    }
+
+    // Normalized correlation of the aligned windows
+
+    double fDot = 0.0;
+    double fEnergy0 = 0.0;
+    double fEnergy1 = 0.0;
+
+    for (size_t i = 0; i < W; ++i)
+    {
+        double f0 = m_Window0[i];
+        double f1 = m_Window1[i + iPeak];
+
+        fDot += f0 * f1;
+        fEnergy0 += f0 * f0;
+        fEnergy1 += f1 * f1;
+    }
+
+    // Silence (about -100 dBFS) has no delay
+
+    if (fEnergy0 < 1e-10 * W || fEnergy1 < 1e-10 * W)
+        return false;
+
+    double fLagSamples = (double)iPeak - (double)L + fOffset;
+
+    Estimate.iLagFrames = llround(fLagSamples * m_iActiveDecimation);
+    Estimate.fLag = fLagSamples / m_dwAnalysisRate;
+    Estimate.fConfidence = (float)min(max(fDot / sqrt(fEnergy0 * fEnergy1), 0.0), 1.0);
+    Estimate.fPeakRatio = fPeak / max(fSecond, fPeak * 0.001f);
+    Estimate.iFrame = iEnd * m_iActiveDecimation;
+
+    return true;
+}
+
+bool LoopbackDelayEstimator::CopyFromRing(sStream& Stream, UINT64 iStart, size_t iCount, float *pOutput)
+{
+    size_t iMask = Stream.iRingSize - 1;
+
+    for (size_t i = 0; i < iCount; ++i)
+        pOutput[i] = Stream.pRing[(size_t)(iStart + i) & iMask].load(memory_order_relaxed);
+
+    // Overwritten since the counts were read, or while copying. A store seen by the copy makes its announcement visible here.
+
+    atomic_thread_fence(memory_order_acquire);
+
+    return Stream.iWriteCount.load(memory_order_relaxed) - iStart <= Stream.iRingSize;
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,167 @@
+#pragma once
+
+/*
+
+Continuous delay estimation between two capture streams that carry the same audio (e.g. a browser tab and a conferencing app, or
+the same process on two devices), to align or deduplicate them.
+
+Both streams are attached as sinks (GetInput). Each input is downmixed and decimated to about 8 kHz with a LoopbackDecimationBank
+and kept in a short ring. An analysis thread correlates the newest window of the first stream against the second one, over
++-max lag, every interval:
+
+- The cross-spectrum of both windows is computed with one complex FFT (both real signals packed into one), weighted with PHAT
+  (phase transform) for a sharp peak, and transformed back. The peak is refined with a parabolic fit.
+- fConfidence is the normalized correlation of both windows at the peak (1 = identical up to gain), fPeakRatio the height of
+  the peak over the highest other peak.
+
+The lag is measured on the timelines of the inputs (frames passed to each input since Open). A positive lag means the second
+stream is behind: frame n of the first stream matches frame n + lag of the second one.
+
+Results are available as a metric (GetEstimate), on the analysis thread through the estimate callback, and as DELAY_CHANGED
+events in an event ring (see LoopbackEventLog.h) whenever a confident estimate moves.
+
+*/
+
+#include <LoopbackCaptureSink.h>
+#include <LoopbackDecimationBank.h>
+#include <LoopbackFFT.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackDelayConst
+{
+    // Approximate rate the inputs are decimated to (see SetDecimation)
+    constexpr DWORD ANALYSIS_RATE = 8000;
+}
+
+struct sLoopbackDelayEstimate
+{
+    INT64                           iLagFrames;     // Input frames, positive if the second stream is behind
+    double                          fLag;           // Seconds, with sub-sample precision
+    float                           fConfidence;    // Normalized correlation at the peak, 0-1
+    float                           fPeakRatio;     // Peak over the highest other peak
+    UINT64                          iFrame;         // End of the analyzed window on the first stream's timeline
+};
+
+// ------------------------------------------------------------
+
+class LoopbackDelayEstimator
+{
+public:
+
+    LoopbackDelayEstimator();
+    ~LoopbackDelayEstimator();
+
+    // Sink for stream 0 or 1, nullptr for other indices. The pointer stays valid for the lifetime of the estimator, data is only
+    // used while open.
+    ILoopbackCaptureSink* GetInput(size_t iStream);
+
+    // Decimation factor of the inputs (2-64). 0 picks the largest factor that divides the sample rate and keeps at least 8 kHz.
+    // Default: 0
+    eCaptureError SetDecimation(UINT32 iFactor);
+
+    // Seconds of audio correlated per estimate, and the largest lag searched in either direction.
+    // Default: 1, 0.5
+    eCaptureError SetWindow(double fWindow, double fMaxLag);
+
+    // Milliseconds between estimates.
+    // Default: 500
+    eCaptureError SetInterval(DWORD dwInterval);
+
+    // Estimates with a lower confidence are not reported as events.
+    // Default: 0.5
+    eCaptureError SetMinConfidence(float fMinConfidence);
+
+    // Called on the analysis thread for every estimate.
+    eCaptureError SetEstimateCallback(void (*pEstimateFunc)(const sLoopbackDelayEstimate& Estimate, void*), void *pUserData = nullptr);
+
+    // Pushes DELAY_CHANGED events into pRing with iSource. The ring must outlive the estimator.
+    // Default: nullptr
+    eCaptureError SetEventLog(LoopbackEventRing *pRing, UINT16 iSource = 0);
+
+    // Both streams must have the same sample rate, the channels and sample formats may differ. Fails with FORMAT if the rate is not
+    // divisible by the decimation factor (or below 16 kHz with the automatic factor). Starts the analysis thread.
+    eCaptureError Open(const WAVEFORMATEX& Format0, const WAVEFORMATEX& Format1);
+
+    // The inputs must not receive data during Close (stop the captures first).
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    // Latest estimate. Returns false if there is none yet (not enough audio, or silence). Safe to call from any thread.
+    bool GetEstimate(sLoopbackDelayEstimate& Estimate);
+
+    // Number of estimates made since Open.
+    UINT64 GetEstimateCount();
+
+private:
+
+    // Receives the decimated mono stream of one input. Lock-free, one writer (the capture thread of the input) and one reader (the
+    // analysis thread): the writer announces the samples it is about to overwrite in iWriteCount, writes them and publishes them
+    // in iCount. The reader copies without waiting and checks iWriteCount afterwards to detect samples overwritten meanwhile.
+    struct sStream : public ILoopbackCaptureSink
+    {
+        void OnData(const unsigned char *pData, size_t iSize) override;
+
+        // The gap is stored as silence, so both streams stay on the same timeline and the lag stays valid
+        void OnGap(UINT64 iFrames) override;
+
+        LoopbackDecimationBank      Bank;
+        std::unique_ptr<std::atomic<float>[]>
+                                    pRing;
+        size_t                      iRingSize = 0;  // Power of two
+        std::atomic<UINT64>         iWriteCount{ 0 };
+        std::atomic<UINT64>         iCount{ 0 };
+    };
+
+    void AnalysisThread();
+    bool Analyze(sLoopbackDelayEstimate& Estimate);
+    bool CopyFromRing(sStream& Stream, UINT64 iStart, size_t iCount, float *pOutput);
+
+    UINT32                          m_iDecimation;
+    double                          m_fWindow;
+    double                          m_fMaxLag;
+    DWORD                           m_dwInterval;
+    float                           m_fMinConfidence;
+    void                            (*m_pEstimateFunc)(const sLoopbackDelayEstimate&, void*);
+    void                            *m_pEstimateFuncUserData;
+    LoopbackEventRing               *m_pEventRing;
+    UINT16                          m_iEventSource;
+
+    bool                            m_bOpen;
+    UINT32                          m_iActiveDecimation;
+    DWORD                           m_dwSampleRate;
+    DWORD                           m_dwAnalysisRate;
+    sStream                         m_Streams[2];
+
+    // Analysis thread only
+    size_t                          m_iWindowSamples;
+    size_t                          m_iLagSamples;
+    size_t                          m_iFFTSize;
+    std::vector<float>              m_Window0;
+    std::vector<float>              m_Window1;
+    std::vector<float>              m_FFT;          // Interleaved complex
+    LoopbackFFT                     m_Transform;
+    UINT64                          m_iLastAnalyzed;
+    INT64                           m_iLastReportedLag;
+    bool                            m_bReported;
+
+    std::thread                     *m_pAnalysisThread;
+    std::mutex                      m_Lock;
+    std::condition_variable         m_Wake;
+    bool                            m_bStop;
+
+    std::mutex                      m_EstimateLock;
+    sLoopbackDelayEstimate          m_Estimate{};
+    bool                            m_bEstimateValid;
+    std::atomic<UINT64>             m_iEstimateCount;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,605 @@
+#include <LoopbackDenoiseSink.h>
+#include <LoopbackSampleMath.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define LOOPBACK_DENOISE_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+namespace
+{
+    using LoopbackSampleMath::PI;
+    using LoopbackSampleMath::ReadSample;
+
+    // pOutput[i] = pA[i] * pB[i]
+    void Multiply(const float *pA, const float *pB, float *pOutput, size_t iCount)
+    {
+        size_t i = 0;
+
+#if defined LOOPBACK_DENOISE_SSE
+        for (; i + 4 <= iCount; i += 4)
+            _mm_storeu_ps(pOutput + i, _mm_mul_ps(_mm_loadu_ps(pA + i), _mm_loadu_ps(pB + i)));
+#endif
+
+        for (; i < iCount; ++i)
+            pOutput[i] = pA[i] * pB[i];
+    }
+
+    // pOutput[i] += pA[i] * pB[i]
+    void MultiplyAdd(const float *pA, const float *pB, float *pOutput, size_t iCount)
+    {
+        size_t i = 0;
+
+#if defined LOOPBACK_DENOISE_SSE
+        for (; i + 4 <= iCount; i += 4)
+            _mm_storeu_ps(pOutput + i, _mm_add_ps(_mm_loadu_ps(pOutput + i), _mm_mul_ps(_mm_loadu_ps(pA + i), _mm_loadu_ps(pB + i))));
+#endif
+
+        for (; i < iCount; ++i)
+            pOutput[i] += pA[i] * pB[i];
+    }
+}
+
+// ------------------------------------------------------------ LoopbackDenoiseSink
+
+// public
+
+LoopbackDenoiseSink::LoopbackDenoiseSink() :
+    m_pTarget(nullptr),
+    m_iFrameSize(0),
+    m_fReduction(18.0f),
+    m_fNoiseWindow(1.5),
+    m_bTransientSuppression(true),
+    m_bBypass(false),
+
+    m_bOpen(false),
+
+    m_iFFTSize(0),
+    m_iHop(0),
+    m_iFill(0),
+    m_fSmoothing(0.0f),
+    m_fFloorGain(1.0f),
+    m_iSubwindowLength(1),
+    m_iTransientBin(0),
+    m_iMaxTransientFrames(0),
+
+    m_iBusyTime(0),
+    m_iProcessedFrames(0)
+{
+
+}
+
+LoopbackDenoiseSink::~LoopbackDenoiseSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackDenoiseSink::SetTarget(ILoopbackCaptureSink *pTarget)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pTarget = pTarget;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDenoiseSink::SetFrameSize(UINT32 iFFTSize)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (iFFTSize != 0 && (iFFTSize < 64 || iFFTSize > 8192 || (iFFTSize & (iFFTSize - 1)) != 0))
+        return eCaptureError::PARAM;
+
+    m_iFrameSize = iFFTSize;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDenoiseSink::SetReduction(float fReduction)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fReduction < 0.0f || fReduction > 100.0f)
+        return eCaptureError::PARAM;
+
+    m_fReduction = fReduction;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDenoiseSink::SetNoiseWindow(double fSeconds)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fSeconds < 0.2 || fSeconds > 10.0)
+        return eCaptureError::PARAM;
+
+    m_fNoiseWindow = fSeconds;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDenoiseSink::SetTransientSuppression(bool bEnable)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_bTransientSuppression = bEnable;
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackDenoiseSink::SetBypass(bool bBypass)
+{
+    m_bBypass.store(bBypass, memory_order_relaxed);
+}
+
+eCaptureError LoopbackDenoiseSink::Open(const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || Format.nChannels == 0 || Format.nSamplesPerSec == 0 ||
+        (Format.wFormatTag != WAVE_FORMAT_PCM && Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT) ||
+        Format.nBlockAlign != Format.nChannels * (Format.wBitsPerSample / 8))
+        return eCaptureError::FORMAT;
+
+    m_Format = Format;
+    m_Format.cbSize = 0;
+
+    m_iFFTSize = m_iFrameSize;
+
+    if (m_iFFTSize == 0)
+    {
+        double fTarget = Format.nSamplesPerSec * LoopbackDenoiseConst::DEFAULT_FRAME_SECONDS;
+
+        m_iFFTSize = 64;
+
+        while (m_iFFTSize < 8192 && fabs(m_iFFTSize * 2 - fTarget) < fabs(m_iFFTSize - fTarget))
+            m_iFFTSize <<= 1;
+    }
+
+    m_iHop = m_iFFTSize / 2;
+    m_iFill = 0;
+
+    // Per hop factors
+
+    double fHopSeconds = (double)m_iHop / Format.nSamplesPerSec;
+
+    m_fSmoothing = (float)exp(-fHopSeconds / LoopbackDenoiseConst::SMOOTHING_SECONDS);
+    m_fFloorGain = (float)pow(10.0, -m_fReduction / 20.0);
+    m_iSubwindowLength = max((size_t)(m_fNoiseWindow / fHopSeconds / LoopbackDenoiseConst::NOISE_SUBWINDOWS + 0.5), (size_t)1);
+    m_iTransientBin = min((size_t)(LoopbackDenoiseConst::TRANSIENT_FREQUENCY * m_iFFTSize / Format.nSamplesPerSec), m_iFFTSize / 4);
+    m_iMaxTransientFrames = max((size_t)(LoopbackDenoiseConst::TRANSIENT_MAX_SECONDS / fHopSeconds + 0.5), (size_t)1);
+
+    m_FFT.SetSize(m_iFFTSize);
+
+    // Periodic square root Hann, the squares of overlapping halves add up to one
+
+    m_Window.resize(m_iFFTSize);
+
+    for (size_t i = 0; i < m_iFFTSize; ++i)
+        m_Window[i] = (float)sqrt(0.5 - 0.5 * cos(2.0 * PI * (double)i / (double)m_iFFTSize));
+
+    size_t iBins = m_iFFTSize / 2 + 1;
+
+    m_Channels.resize(Format.nChannels);
+
+    for (sChannel& Channel : m_Channels)
+    {
+        Channel.Input.assign(m_iFFTSize, 0.0f);
+        Channel.Output.assign(m_iFFTSize, 0.0f);
+        Channel.Smoothed.assign(iBins, 0.0f);
+        Channel.Noise.assign(iBins, 0.0f);
+        Channel.Clean.assign(iBins, 0.0f);
+        Channel.Minimum.assign(iBins, 0.0f);
+        Channel.WindowMinimum.assign(iBins, 0.0f);
+        Channel.Minima.assign(iBins * LoopbackDenoiseConst::NOISE_SUBWINDOWS, 0.0f);
+        Channel.iSubwindowFrames = 0;
+        Channel.iSubwindow = 0;
+        Channel.iTransientFrames = 0;
+        Channel.bStarted = false;
+    }
+
+    m_Frame.assign(m_iFFTSize, 0.0f);
+    m_Spectrum.assign(m_iFFTSize + 2, 0.0f);
+    m_Power.assign(iBins, 0.0f);
+    m_Limit.assign(iBins, 0.0f);
+    m_Mask.assign(iBins, 1.0f);
+    m_OutputBlock.assign(m_iHop * Format.nChannels, 0.0f);
+
+    m_iBusyTime = 0;
+    m_iProcessedFrames = 0;
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackDenoiseSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackDenoiseSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackDenoiseSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    size_t iFrames = iSize / m_Format.nBlockAlign;
+    WORD wBytesPerSample = m_Format.wBitsPerSample / 8;
+    size_t nChannels = m_Format.nChannels;
+    size_t iOffset = m_iFFTSize - m_iHop;
+
+    for (size_t i = 0; i < iFrames; ++i)
+    {
+        for (size_t c = 0; c < nChannels; ++c)
+            m_Channels[c].Input[iOffset + m_iFill] = ReadSample(pData + c * wBytesPerSample, m_Format.wBitsPerSample, m_Format.wFormatTag);
+
+        pData += m_Format.nBlockAlign;
+
+        if (++m_iFill < m_iHop)
+            continue;
+
+        m_iFill = 0;
+
+        auto Start = chrono::steady_clock::now();
+
+        for (size_t c = 0; c < nChannels; ++c)
+        {
+            sChannel& Channel = m_Channels[c];
+
+            ProcessChannel(Channel, m_OutputBlock.data() + c, nChannels);
+            memmove(Channel.Input.data(), Channel.Input.data() + m_iHop, iOffset * sizeof(float));
+        }
+
+        m_iBusyTime.fetch_add((UINT64)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - Start).count(), memory_order_relaxed);
+
+        if (m_pTarget != nullptr)
+            m_pTarget->OnData((const unsigned char*)m_OutputBlock.data(), m_OutputBlock.size() * sizeof(float));
+    }
+
+    m_iProcessedFrames.fetch_add(iFrames, memory_order_relaxed);
+}
+
+void LoopbackDenoiseSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    size_t nChannels = m_Format.nChannels;
+    size_t iOffset = m_iFFTSize - m_iHop;
+
+    if (m_iFill + iFrames < m_iHop)
+    {
+        for (auto& Channel : m_Channels)
+            fill(Channel.Input.begin() + iOffset + m_iFill, Channel.Input.begin() + iOffset + m_iFill + (size_t)iFrames, 0.0f);
+
+        m_iFill += (size_t)iFrames;
+        return;
+    }
+
+    // The tail of the last frame fades out with the synthesis window. The output of the next frame starts one hop before its
+    // input, the target skips what lies between.
+
+    for (size_t c = 0; c < nChannels; ++c)
+    {
+        sChannel& Channel = m_Channels[c];
+
+        for (size_t i = 0; i < m_iHop; ++i)
+            m_OutputBlock[i * nChannels + c] = Channel.Output[i];
+
+        fill(Channel.Input.begin(), Channel.Input.end(), 0.0f);
+        fill(Channel.Output.begin(), Channel.Output.end(), 0.0f);
+    }
+
+    if (m_pTarget != nullptr)
+    {
+        m_pTarget->OnData((const unsigned char*)m_OutputBlock.data(), m_OutputBlock.size() * sizeof(float));
+
+        if (m_iFill + iFrames > m_iHop)
+            m_pTarget->OnGap(m_iFill + iFrames - m_iHop);
+    }
+
+    m_iFill = 0;
+}
+
+eCaptureError LoopbackDenoiseSink::GetOutputFormat(WAVEFORMATEX& Format)
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    Format = {};
+    Format.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+    Format.nChannels = m_Format.nChannels;
+    Format.nSamplesPerSec = m_Format.nSamplesPerSec;
+    Format.wBitsPerSample = 32;
+    Format.nBlockAlign = Format.nChannels * sizeof(float);
+    Format.nAvgBytesPerSec = Format.nSamplesPerSec * Format.nBlockAlign;
+
+    return eCaptureError::NONE;
+}
+
+size_t LoopbackDenoiseSink::GetLatency()
+{
+    return m_iFFTSize - m_iHop;
+}
+
+double LoopbackDenoiseSink::GetLoad()
+{
+    UINT64 iFrames = m_iProcessedFrames.load(memory_order_relaxed);
+
+    if (iFrames == 0 || m_Format.nSamplesPerSec == 0)
+        return 0.0;
+
+    double fBusy = m_iBusyTime.load(memory_order_relaxed) / 1e9;
+
+    return fBusy / ((double)iFrames / m_Format.nSamplesPerSec);
+}
+
+double LoopbackDenoiseSink::GetChannelLoad()
+{
+    return m_Format.nChannels > 0 ? GetLoad() / m_Format.nChannels : 0.0;
+}
+
+// private
+
+void LoopbackDenoiseSink::ProcessChannel(sChannel& Channel, float *pOutput, size_t iStride)
+{
+    size_t N = m_iFFTSize;
+    size_t iBins = N / 2 + 1;
+
+    float *pFrame = m_Frame.data();
+    float *pSpectrum = m_Spectrum.data();
+    float *pPower = m_Power.data();
+    float *pSmoothed = Channel.Smoothed.data();
+    float *pNoise = Channel.Noise.data();
+    float *pClean = Channel.Clean.data();
+    float *pMinimum = Channel.Minimum.data();
+    float *pWindowMinimum = Channel.WindowMinimum.data();
+    float *pMask = m_Mask.data();
+
+    Multiply(Channel.Input.data(), m_Window.data(), pFrame, N);
+    m_FFT.ForwardReal(pFrame, pSpectrum);
+
+    size_t k = 0;
+
+#if defined LOOPBACK_DENOISE_SSE
+    for (; k + 4 <= iBins; k += 4)
+    {
+        __m128 A = _mm_loadu_ps(pSpectrum + k * 2);
+        __m128 B = _mm_loadu_ps(pSpectrum + k * 2 + 4);
+
+        A = _mm_mul_ps(A, A);
+        B = _mm_mul_ps(B, B);
+
+        _mm_storeu_ps(pPower + k, _mm_add_ps(_mm_shuffle_ps(A, B, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(A, B, _MM_SHUFFLE(3, 1, 3, 1))));
+    }
+#endif
+
+    for (; k < iBins; ++k)
+        pPower[k] = pSpectrum[k * 2] * pSpectrum[k * 2] + pSpectrum[k * 2 + 1] * pSpectrum[k * 2 + 1];
+
+    // The tracker starts on the first frame instead of rising from zero
+
+    if (!Channel.bStarted)
+    {
+        for (k = 0; k < iBins; ++k)
+        {
+            float fPower = max(pPower[k], LoopbackDenoiseConst::MIN_NOISE_FLOOR);
+
+            pSmoothed[k] = fPower;
+            pNoise[k] = fPower;
+            pMinimum[k] = fPower / LoopbackDenoiseConst::NOISE_BIAS;
+            pWindowMinimum[k] = pMinimum[k];
+        }
+
+        for (size_t u = 0; u < LoopbackDenoiseConst::NOISE_SUBWINDOWS; ++u)
+            copy(pMinimum, pMinimum + iBins, Channel.Minima.begin() + u * iBins);
+
+        Channel.bStarted = true;
+    }
+
+    // The tracker and the gain see the limited power in transient frames
+
+    bool bTransient = m_bTransientSuppression && LimitTransient(Channel);
+    const float *pInput = bTransient ? m_Limit.data() : pPower;
+
+    // S = P + a (S - P), the noise floor is the bias times the minimum of S over the window. The a priori SNR is
+    // xi = b C / N + (1 - b) max(P / N - 1, 0) with the clean power C = G^2 P of the previous frame, the gain G = xi / (1 + xi).
+
+    float fSmoothing = m_fSmoothing;
+    float fFloor = m_fFloorGain;
+
+    k = 0;
+
+#if defined LOOPBACK_DENOISE_SSE
+    {
+        __m128 Smoothing = _mm_set1_ps(fSmoothing);
+        __m128 Bias = _mm_set1_ps(LoopbackDenoiseConst::NOISE_BIAS);
+        __m128 MinNoise = _mm_set1_ps(LoopbackDenoiseConst::MIN_NOISE_FLOOR);
+        __m128 Previous = _mm_set1_ps(LoopbackDenoiseConst::DECISION_DIRECTED);
+        __m128 Current = _mm_set1_ps(1.0f - LoopbackDenoiseConst::DECISION_DIRECTED);
+        __m128 Floor = _mm_set1_ps(fFloor);
+        __m128 One = _mm_set1_ps(1.0f);
+        __m128 Zero = _mm_setzero_ps();
+
+        for (; k + 4 <= iBins; k += 4)
+        {
+            __m128 P = _mm_loadu_ps(pInput + k);
+            __m128 S = _mm_loadu_ps(pSmoothed + k);
+
+            S = _mm_add_ps(P, _mm_mul_ps(Smoothing, _mm_sub_ps(S, P)));
+
+            __m128 Minimum = _mm_min_ps(_mm_loadu_ps(pMinimum + k), S);
+            __m128 Noise = _mm_max_ps(_mm_mul_ps(Bias, _mm_min_ps(Minimum, _mm_loadu_ps(pWindowMinimum + k))), MinNoise);
+
+            __m128 Posterior = _mm_div_ps(P, Noise);
+            __m128 Prior = _mm_add_ps(_mm_mul_ps(Previous, _mm_div_ps(_mm_loadu_ps(pClean + k), Noise)),
+                _mm_mul_ps(Current, _mm_max_ps(_mm_sub_ps(Posterior, One), Zero)));
+            __m128 Gain = _mm_max_ps(_mm_div_ps(Prior, _mm_add_ps(One, Prior)), Floor);
+
+            _mm_storeu_ps(pSmoothed + k, S);
+            _mm_storeu_ps(pMinimum + k, Minimum);
+            _mm_storeu_ps(pNoise + k, Noise);
+            _mm_storeu_ps(pClean + k, _mm_mul_ps(_mm_mul_ps(Gain, Gain), P));
+            _mm_storeu_ps(pMask + k, Gain);
+        }
+    }
+#endif
+
+    for (; k < iBins; ++k)
+    {
+        float fPower = pInput[k];
+        float fS = fPower + fSmoothing * (pSmoothed[k] - fPower);
+        float fMinimum = min(pMinimum[k], fS);
+        float fNoise = max(LoopbackDenoiseConst::NOISE_BIAS * min(fMinimum, pWindowMinimum[k]), LoopbackDenoiseConst::MIN_NOISE_FLOOR);
+
+        float fPrior = LoopbackDenoiseConst::DECISION_DIRECTED * pClean[k] / fNoise +
+            (1.0f - LoopbackDenoiseConst::DECISION_DIRECTED) * max(fPower / fNoise - 1.0f, 0.0f);
+        float fGain = max(fPrior / (1.0f + fPrior), fFloor);
+
+        pSmoothed[k] = fS;
+        pMinimum[k] = fMinimum;
+        pNoise[k] = fNoise;
+        pClean[k] = fGain * fGain * fPower;
+        pMask[k] = fGain;
+    }
+
+    // A completed part of the window replaces the oldest one, the next part starts from the current smoothed power
+
+    if (++Channel.iSubwindowFrames >= m_iSubwindowLength)
+    {
+        float *pMinima = Channel.Minima.data();
+
+        copy(pMinimum, pMinimum + iBins, pMinima + Channel.iSubwindow * iBins);
+        copy(pMinima, pMinima + iBins, pWindowMinimum);
+
+        for (size_t u = 1; u < LoopbackDenoiseConst::NOISE_SUBWINDOWS; ++u)
+        {
+            const float *pPart = pMinima + u * iBins;
+
+            for (k = 0; k < iBins; ++k)
+                pWindowMinimum[k] = min(pWindowMinimum[k], pPart[k]);
+        }
+
+        copy(pSmoothed, pSmoothed + iBins, pMinimum);
+
+        Channel.iSubwindow = (Channel.iSubwindow + 1) % LoopbackDenoiseConst::NOISE_SUBWINDOWS;
+        Channel.iSubwindowFrames = 0;
+    }
+
+    // The limit scales the output of transient frames on top of the gain, the tracker keeps running while bypassed
+
+    if (m_bBypass.load(memory_order_relaxed))
+    {
+        fill(m_Mask.begin(), m_Mask.end(), 1.0f);
+    }
+    else if (bTransient)
+    {
+        for (k = 0; k < iBins; ++k)
+            pMask[k] *= pPower[k] > 0.0f ? sqrtf(m_Limit[k] / pPower[k]) : 1.0f;
+    }
+
+    // Mask applied to both parts of every bin
+
+    k = 0;
+
+#if defined LOOPBACK_DENOISE_SSE
+    for (; k + 4 <= iBins; k += 4)
+    {
+        __m128 Mask = _mm_loadu_ps(pMask + k);
+
+        _mm_storeu_ps(pSpectrum + k * 2, _mm_mul_ps(_mm_loadu_ps(pSpectrum + k * 2), _mm_unpacklo_ps(Mask, Mask)));
+        _mm_storeu_ps(pSpectrum + k * 2 + 4, _mm_mul_ps(_mm_loadu_ps(pSpectrum + k * 2 + 4), _mm_unpackhi_ps(Mask, Mask)));
+    }
+#endif
+
+    for (; k < iBins; ++k)
+    {
+        pSpectrum[k * 2] *= pMask[k];
+        pSpectrum[k * 2 + 1] *= pMask[k];
+    }
+
+    // Synthesis window and overlap-add, the first hop is complete
+
+    m_FFT.InverseReal(pSpectrum, pFrame);
+
+    float *pAccumulator = Channel.Output.data();
+
+    MultiplyAdd(pFrame, m_Window.data(), pAccumulator, N);
+
+    for (size_t i = 0; i < m_iHop; ++i)
+        pOutput[i * iStride] = pAccumulator[i];
+
+    memmove(pAccumulator, pAccumulator + m_iHop, (N - m_iHop) * sizeof(float));
+    fill(pAccumulator + N - m_iHop, pAccumulator + N, 0.0f);
+}
+
+bool LoopbackDenoiseSink::LimitTransient(sChannel& Channel)
+{
+    size_t iBins = m_iFFTSize / 2 + 1;
+
+    const float *pPower = m_Power.data();
+    const float *pSmoothed = Channel.Smoothed.data();
+    const float *pNoise = Channel.Noise.data();
+
+    // Clicks raise most of the upper bins at once to about the level of the strongest bin (their spectrum is flat). Voice onsets
+    // only raise their harmonics, the bins between them stay far below the fundamental.
+
+    float fPeak = 0.0f;
+
+    for (size_t k = 0; k < iBins; ++k)
+        fPeak = max(fPeak, pPower[k]);
+
+    float fMinLevel = fPeak * LoopbackDenoiseConst::TRANSIENT_PEAK_RATIO;
+    size_t iJumps = 0;
+
+    for (size_t k = m_iTransientBin; k < iBins; ++k)
+    {
+        if (pPower[k] > fMinLevel && pPower[k] > LoopbackDenoiseConst::TRANSIENT_JUMP * max(pSmoothed[k], pNoise[k]))
+            ++iJumps;
+    }
+
+    if (iJumps * 2 <= iBins - m_iTransientBin)
+    {
+        Channel.iTransientFrames = 0;
+        return false;
+    }
+
+    // Too long for a click, the tracker takes it from here
+    if (Channel.iTransientFrames >= m_iMaxTransientFrames)
+        return false;
+
+    ++Channel.iTransientFrames;
+
+    for (size_t k = 0; k < iBins; ++k)
+        m_Limit[k] = min(pPower[k], max(pSmoothed[k], pNoise[k]));
+
+    return true;
+}
+
+// ------------------------------------------------------------ EOF
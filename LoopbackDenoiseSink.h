@@ -0,0 +1,192 @@
+#pragma once
+
+/*
+
+Real-time noise suppression for voice captures (fan, hum and keyboard noise in front of speech recognition), as a sink in front of
+another sink.
+
+Every channel is processed with a short-time Fourier transform: frames of the FFT size with 50% overlap, square root Hann windows
+for analysis and synthesis (so unprocessed frames add up to the input again) and a real FFT (LoopbackFFT). Per bin:
+
+- The noise floor is tracked with minimum statistics: the minimum of the smoothed power over the noise window (1.5 s), scaled by
+  the bias of that minimum against the mean. Speech does not keep a bin busy for that long, so the floor follows steady noise
+  (fans, hum, hiss) through speech without learning it, and a changed noise level within one window.
+- The gain is a Wiener gain G = xi / (1 + xi) of the a priori SNR xi, estimated decision-directed from the clean power of the
+  previous frame and the current excess over the floor. That keeps the gain smooth over time (no "musical noise" of hard gates)
+  and does not attenuate bins well above the floor. The reduction limits how far a bin is attenuated.
+- Transients (keyboard clicks) are short broadband jumps that neither the floor nor the gain can follow. A frame in which most
+  bins above 2 kHz jump well above their smoothed power is limited to that smoothed power in every bin, which removes the click
+  and keeps the voice that was already there. The smoothed power and the floor do not learn the click. Jumps that last longer
+  than a click (a new noise or a loud onset) are passed after 50 ms.
+
+The power spectrum, the tracker, the gain and the overlap-add run four bins or samples per SSE operation where available.
+
+The target receives interleaved 32-bit float frames with the channels and rate of the input (GetOutputFormat), one hop (half the
+FFT size) at a time. The output is delayed by GetLatency() frames (the FFT size minus one hop, about 10 ms with the default size),
+and no sample leaves later than one FFT size after it arrived. Bypass keeps the delay, so the timeline of the target does not jump.
+
+The stage does all its work in OnData. Attach it where the capture callback may take time: with the intermediate thread enabled,
+or as a stage of a LoopbackQosSink. GetChannelLoad reports the processing time per channel against the audio duration.
+
+LoopbackDenoiseSink Denoiser;
+Denoiser.SetTarget(&WavSink);
+Denoiser.Open(Format);
+
+WAVEFORMATEX OutputFormat;
+Denoiser.GetOutputFormat(OutputFormat);
+WavSink.Open(L"denoised.wav", OutputFormat);
+
+LoopbackCapture.SetCallback(&ILoopbackCaptureSink::Callback, &Denoiser);
+
+*/
+
+#include <LoopbackCaptureSink.h>
+#include <LoopbackFFT.h>
+
+#include <atomic>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackDenoiseConst
+{
+    // Time constant of the power smoothing in front of the noise tracker
+    constexpr double SMOOTHING_SECONDS = 0.015;
+
+    // The noise window is split into this many parts, the minimum of the oldest part is dropped when a new one is complete
+    constexpr size_t NOISE_SUBWINDOWS = 8;
+
+    // Mean noise power over the minimum of its smoothed power (minimum statistics bias)
+    constexpr float NOISE_BIAS = 2.0f;
+
+    // Lower bound of the noise floor (power of full scale), so digital silence does not stick the floor at zero
+    constexpr float MIN_NOISE_FLOOR = 1e-12f;
+
+    // Weight of the previous frame in the decision-directed a priori SNR
+    constexpr float DECISION_DIRECTED = 0.98f;
+
+    // Transients: more than half of the bins from this frequency up jump by this factor (power) over their smoothed power
+    constexpr double TRANSIENT_FREQUENCY = 2000.0;
+    constexpr float TRANSIENT_JUMP = 10.0f;
+    constexpr float TRANSIENT_PEAK_RATIO = 0.001f;  // The jumping bins are also within 30 dB of the strongest bin
+    constexpr double TRANSIENT_MAX_SECONDS = 0.05;
+
+    // Default FFT size is the power of two closest to this duration
+    constexpr double DEFAULT_FRAME_SECONDS = 0.02;
+}
+
+// ------------------------------------------------------------
+
+class LoopbackDenoiseSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackDenoiseSink();
+    ~LoopbackDenoiseSink();
+
+    // Sink that receives the denoised float frames. Must stay valid while open.
+    // Default: nullptr
+    eCaptureError SetTarget(ILoopbackCaptureSink *pTarget);
+
+    // FFT size (power of two, 64-8192), the hop is half of it. Larger sizes separate tones from noise better and add latency.
+    // 0 picks the power of two closest to 20 ms.
+    // Default: 0
+    eCaptureError SetFrameSize(UINT32 iFFTSize);
+
+    // Maximum attenuation in dB. Higher values remove more of the steady noise but leave a less natural residual.
+    // Default: 18
+    eCaptureError SetReduction(float fReduction);
+
+    // Seconds over which the minimum of the smoothed power is taken as the noise floor. It must be longer than a bin stays busy
+    // with speech (syllables, held vowels), longer windows follow a raised noise level later.
+    // Default: 1.5
+    eCaptureError SetNoiseWindow(double fSeconds);
+
+    // Limits keyboard clicks and similar transients to the level before them.
+    // Default: true
+    eCaptureError SetTransientSuppression(bool bEnable);
+
+    // Passes the audio through unchanged (apart from the delay). Safe to call from any thread.
+    void SetBypass(bool bBypass);
+
+    // Fails with FORMAT for formats other than 8-32 bit PCM and 32 bit float.
+    eCaptureError Open(const WAVEFORMATEX& Format);
+
+    // The delayed tail is not flushed to the target.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // A gap shorter than the rest of the current hop is filled with silence. Longer gaps flush the overlap-add tail to the target,
+    // pass the rest of the gap on and restart the frames after it, so the target's timeline stays in line with the input. The
+    // noise floor is kept.
+    void OnGap(UINT64 iFrames) override;
+
+    // Format of the data passed to the target. Only while open.
+    eCaptureError GetOutputFormat(WAVEFORMATEX& Format);
+
+    // Frames the output lags behind the input. Only while open.
+    size_t GetLatency();
+
+    // Processing time over the duration of the processed audio since Open, for all channels and per channel. Safe to call from
+    // any thread.
+    double GetLoad();
+    double GetChannelLoad();
+
+private:
+
+    struct sChannel
+    {
+        std::vector<float>          Input;          // Last FFT size samples
+        std::vector<float>          Output;         // Overlap-add accumulator
+        std::vector<float>          Smoothed;       // Per bin
+        std::vector<float>          Noise;
+        std::vector<float>          Clean;          // Estimated clean power of the previous frame
+        std::vector<float>          Minimum;        // Of the current part of the noise window
+        std::vector<float>          WindowMinimum;  // Of the completed parts
+        std::vector<float>          Minima;         // NOISE_SUBWINDOWS x bins, per completed part
+        size_t                      iSubwindowFrames;
+        size_t                      iSubwindow;
+        size_t                      iTransientFrames;
+        bool                        bStarted;
+    };
+
+    void ProcessChannel(sChannel& Channel, float *pOutput, size_t iStride);
+    bool LimitTransient(sChannel& Channel);
+
+    ILoopbackCaptureSink            *m_pTarget;
+    UINT32                          m_iFrameSize;
+    float                           m_fReduction;
+    double                          m_fNoiseWindow;
+    bool                            m_bTransientSuppression;
+    std::atomic<bool>               m_bBypass;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format{};
+
+    // Processing, OnData only
+    size_t                          m_iFFTSize;
+    size_t                          m_iHop;
+    size_t                          m_iFill;        // Samples of the current hop
+    float                           m_fSmoothing;   // Per hop
+    float                           m_fFloorGain;
+    size_t                          m_iSubwindowLength;     // Frames
+    size_t                          m_iTransientBin;
+    size_t                          m_iMaxTransientFrames;
+    LoopbackFFT                     m_FFT;
+    std::vector<float>              m_Window;       // Square root Hann, analysis and synthesis
+    std::vector<sChannel>           m_Channels;
+    std::vector<float>              m_Frame;
+    std::vector<float>              m_Spectrum;     // Interleaved complex
+    std::vector<float>              m_Power;
+    std::vector<float>              m_Limit;        // Power kept per bin, below the power in transient frames
+    std::vector<float>              m_Mask;         // Gains
+    std::vector<float>              m_OutputBlock;  // One hop, interleaved
+
+    std::atomic<UINT64>             m_iBusyTime;    // Nanoseconds
+    std::atomic<UINT64>             m_iProcessedFrames;
+};
+
+// ------------------------------------------------------------ EOF
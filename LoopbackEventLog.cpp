@@ -0,0 +1,258 @@
+#include <LoopbackEventLog.h>
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+// ------------------------------------------------------------ LoopbackEventLog
+
+// public
+
+LoopbackEventLog::LoopbackEventLog(size_t iCapacity) :
+    LoopbackEventRing(iCapacity),
+
+    m_pSinkFunc(nullptr),
+    m_pSinkFuncUserData(nullptr),
+    m_dwDrainInterval(100),
+
+    m_iTimeOrigin(0),
+    m_iReportedDropCount(0),
+
+    m_pDrainThread(nullptr),
+    m_bStop(false)
+{
+
+}
+
+LoopbackEventLog::~LoopbackEventLog()
+{
+    Stop();
+}
+
+eCaptureError LoopbackEventLog::SetSink(void (*pSinkFunc)(const std::string& Line, const sLoopbackEvent& Event, void*), void *pUserData)
+{
+    if (IsRunning())
+        return eCaptureError::STATE;
+
+    m_pSinkFunc = pSinkFunc;
+    m_pSinkFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackEventLog::SetDrainInterval(DWORD dwInterval)
+{
+    if (IsRunning())
+        return eCaptureError::STATE;
+
+    if (dwInterval == 0)
+        return eCaptureError::PARAM;
+
+    m_dwDrainInterval = dwInterval;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackEventLog::Start()
+{
+    if (IsRunning())
+        return eCaptureError::STATE;
+
+    m_iTimeOrigin = (UINT64)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    m_iReportedDropCount = GetDroppedCount();
+    m_bStop = false;
+    m_pDrainThread = new thread(&LoopbackEventLog::DrainThread, this);
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackEventLog::Stop()
+{
+    if (!IsRunning())
+        return;
+
+    {
+        lock_guard<mutex> Lock(m_Lock);
+        m_bStop = true;
+    }
+
+    m_Wake.notify_all();
+
+    m_pDrainThread->join();
+    delete m_pDrainThread;
+    m_pDrainThread = nullptr;
+}
+
+bool LoopbackEventLog::IsRunning()
+{
+    return m_pDrainThread != nullptr;
+}
+
+std::string LoopbackEventLog::Format(const sLoopbackEvent& Event, UINT64 iTimeOrigin)
+{
+    char Text[256];
+
+    unsigned long long iTime = Event.iTime > iTimeOrigin ? Event.iTime - iTimeOrigin : 0;
+    int iLength = snprintf(Text, sizeof(Text), "%llu.%06llus [%u] ", iTime / 1000000, iTime % 1000000, (unsigned int)Event.iSource);
+
+    string Line(Text, (size_t)max(iLength, 0));
+
+    auto GetResultName = [](HRESULT hr) -> const char*
+    {
+        switch (hr)
+        {
+        case AUDCLNT_E_DEVICE_INVALIDATED: return " (AUDCLNT_E_DEVICE_INVALIDATED)";
+        case AUDCLNT_E_BUFFER_ERROR: return " (AUDCLNT_E_BUFFER_ERROR)";
+        case AUDCLNT_E_OUT_OF_ORDER: return " (AUDCLNT_E_OUT_OF_ORDER)";
+        case AUDCLNT_E_BUFFER_OPERATION_PENDING: return " (AUDCLNT_E_BUFFER_OPERATION_PENDING)";
+        case AUDCLNT_E_SERVICE_NOT_RUNNING: return " (AUDCLNT_E_SERVICE_NOT_RUNNING)";
+        }
+
+        return "";
+    };
+
+    auto GetFlagNames = [](UINT64 iFlags)
+    {
+        string Names;
+
+        if (iFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+            Names += " DATA_DISCONTINUITY";
+
+        if (iFlags & AUDCLNT_BUFFERFLAGS_SILENT)
+            Names += " SILENT";
+
+        if (iFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR)
+            Names += " TIMESTAMP_ERROR";
+
+        return Names.empty() ? string(" none") : Names;
+    };
+
+    switch (Event.Type)
+    {
+    case eLoopbackEvent::THREAD_START:
+        Line += Event.iValue2 ? "Audio thread started (MMCSS)" : "Audio thread started";
+        break;
+
+    case eLoopbackEvent::THREAD_STOP:
+        Line += "Audio thread stopped";
+        break;
+
+    case eLoopbackEvent::GETBUFFER_FAILED:
+    case eLoopbackEvent::RELEASEBUFFER_FAILED:
+        snprintf(Text, sizeof(Text), "%s failed: 0x%08X%s", Event.Type == eLoopbackEvent::GETBUFFER_FAILED ? "GetBuffer" : "ReleaseBuffer",
+            (unsigned int)Event.iValue, GetResultName((HRESULT)(UINT32)Event.iValue));
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::FLAGS_CHANGED:
+        Line += "Buffer flags changed:" + GetFlagNames(Event.iValue) + " (was" + GetFlagNames(Event.iValue2) + ")";
+        break;
+
+    case eLoopbackEvent::QUEUE_OVERFLOW:
+        snprintf(Text, sizeof(Text), "Intermediate queue full, allocated for %llu bytes", (unsigned long long)Event.iValue);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::SKIP_COMPLETE:
+        snprintf(Text, sizeof(Text), "Skipped %llu initial bytes", (unsigned long long)Event.iValue);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::CALLBACK_LATE:
+        snprintf(Text, sizeof(Text), "Callback took %.3fms, longer than the callback interval", Event.iValue / 1000.0);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::EVENTS_DROPPED:
+        snprintf(Text, sizeof(Text), "%llu events dropped, the event ring was full", (unsigned long long)Event.iValue);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::QOS_SHED:
+    case eLoopbackEvent::QOS_RESTORE:
+        snprintf(Text, sizeof(Text), "QoS %s, shed level %u (load %.1f%%, queue %llu bytes)", Event.Type == eLoopbackEvent::QOS_SHED ? "shedding" : "restoring",
+            (unsigned int)(Event.iValue2 >> 16), (Event.iValue2 & 0xFFFF) / 10.0, (unsigned long long)Event.iValue);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::RETARGET_COMPLETE:
+        snprintf(Text, sizeof(Text), "Switched to the new target, gap %lld frames", (long long)(INT64)Event.iValue);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::DELAY_CHANGED:
+        snprintf(Text, sizeof(Text), "Stream delay %lld frames (confidence %.1f%%)", (long long)(INT64)Event.iValue, Event.iValue2 / 10.0);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::DRAIN_OVERFLOW:
+        snprintf(Text, sizeof(Text), "Drain ring full, dropping data (%llu bytes)", (unsigned long long)Event.iValue);
+        Line += Text;
+        break;
+
+    case eLoopbackEvent::FINGERPRINT_MATCH:
+        snprintf(Text, sizeof(Text), "Content identified: reference %llu (%u landmarks)", (unsigned long long)Event.iValue, (unsigned int)Event.iValue2);
+        Line += Text;
+        break;
+
+    default:
+        snprintf(Text, sizeof(Text), "Unknown event %u: %llu, %u", (unsigned int)Event.Type, (unsigned long long)Event.iValue, (unsigned int)Event.iValue2);
+        Line += Text;
+        break;
+    }
+
+    return Line;
+}
+
+// private
+
+void LoopbackEventLog::DrainThread()
+{
+    unique_lock<mutex> Lock(m_Lock);
+
+    while (!m_bStop)
+    {
+        m_Wake.wait_for(Lock, chrono::milliseconds(m_dwDrainInterval), [this]() { return m_bStop; });
+
+        Lock.unlock();
+        Drain();
+        Lock.lock();
+    }
+}
+
+void LoopbackEventLog::Drain()
+{
+    sLoopbackEvent Event;
+
+    while (Pop(Event))
+    {
+        if (m_pSinkFunc != nullptr)
+        {
+            string Line = Format(Event, m_iTimeOrigin);
+            m_pSinkFunc(Line, Event, m_pSinkFuncUserData);
+        }
+    }
+
+    // Reported after the events that made it into the ring, the lost ones were pushed last
+
+    UINT64 iDropCount = GetDroppedCount();
+
+    if (iDropCount != m_iReportedDropCount)
+    {
+        Event = {};
+        Event.iTime = (UINT64)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        Event.iValue = iDropCount - m_iReportedDropCount;
+        Event.Type = eLoopbackEvent::EVENTS_DROPPED;
+
+        m_iReportedDropCount = iDropCount;
+
+        if (m_pSinkFunc != nullptr)
+        {
+            string Line = Format(Event, m_iTimeOrigin);
+            m_pSinkFunc(Line, Event, m_pSinkFuncUserData);
+        }
+    }
+}
+
+// ------------------------------------------------------------ EOF
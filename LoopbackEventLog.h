@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+
+Background drainer for the diagnostic events of ProcessLoopbackCapture (see ProcessLoopbackCapture::SetEventLog).
+
+The audio threads only push fixed-size sLoopbackEvent records into the ring, they never format, allocate or block.
+LoopbackEventLog empties the ring on its own thread every drain interval, formats each event into a line of text and passes
+it to a user-provided sink. Events lost because the ring was full are reported as EVENTS_DROPPED.
+
+LoopbackEventLog EventLog;
+EventLog.SetSink(&MyLogFunc);
+EventLog.Start();
+
+LoopbackCapture.SetEventLog(&EventLog, 1);
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// ------------------------------------------------------------
+
+class LoopbackEventLog :
+    public LoopbackEventRing
+{
+public:
+
+    LoopbackEventLog(size_t iCapacity = 4096);
+    ~LoopbackEventLog();
+
+    // Called on the drain thread for every event, in the order they were pushed.
+    // Without a sink, events are drained and discarded.
+    eCaptureError SetSink(void (*pSinkFunc)(const std::string& Line, const sLoopbackEvent& Event, void*), void *pUserData = nullptr);
+
+    // Default: 100
+    eCaptureError SetDrainInterval(DWORD dwInterval);
+
+    eCaptureError Start();
+
+    // Drains the remaining events before returning.
+    void Stop();
+
+    bool IsRunning();
+
+    // Formats an event, e.g. "12.345678s [1] GetBuffer failed: 0x88890004 (AUDCLNT_E_DEVICE_INVALIDATED)".
+    // The time is relative to iTimeOrigin (microseconds, steady_clock), the time of Start for events drained by the log.
+    static std::string Format(const sLoopbackEvent& Event, UINT64 iTimeOrigin = 0);
+
+private:
+
+    void DrainThread();
+    void Drain();
+
+    void                            (*m_pSinkFunc)(const std::string&, const sLoopbackEvent&, void*);
+    void                            *m_pSinkFuncUserData;
+    DWORD                           m_dwDrainInterval;
+
+    UINT64                          m_iTimeOrigin;
+    UINT64                          m_iReportedDropCount;
+
+    std::thread                     *m_pDrainThread;
+    std::mutex                      m_Lock;
+    std::condition_variable         m_Wake;
+    bool                            m_bStop;
+};
+
+// ------------------------------------------------------------ EOF
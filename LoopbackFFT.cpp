@@ -0,0 +1,306 @@
+#include <LoopbackFFT.h>
+#include <LoopbackSampleMath.h>
+
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define LOOPBACK_FFT_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+namespace
+{
+    using LoopbackSampleMath::PI;
+
+#if defined LOOPBACK_FFT_SSE
+    // Two complex products (b0 w0, b1 w1)
+    inline __m128 ComplexMultiply(__m128 B, __m128 W)
+    {
+        const __m128 Sign = _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f);
+
+        __m128 Wr = _mm_shuffle_ps(W, W, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 Wi = _mm_shuffle_ps(W, W, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128 Bs = _mm_shuffle_ps(B, B, _MM_SHUFFLE(2, 3, 0, 1));
+
+        // (br wr - bi wi, bi wr + br wi)
+        return _mm_add_ps(_mm_mul_ps(B, Wr), _mm_xor_ps(_mm_mul_ps(Bs, Wi), Sign));
+    }
+#endif
+}
+
+// ------------------------------------------------------------ LoopbackFFT
+
+// public
+
+LoopbackFFT::LoopbackFFT() :
+    m_iSize(0)
+{
+
+}
+
+eCaptureError LoopbackFFT::SetSize(size_t iSize)
+{
+    if (iSize < 4 || iSize > ((size_t)1 << 24) || (iSize & (iSize - 1)) != 0)
+        return eCaptureError::PARAM;
+
+    if (iSize == m_iSize)
+        return eCaptureError::NONE;
+
+    m_iSize = iSize;
+
+    BuildTables(iSize, m_Reverse, m_Twiddles);
+    BuildTables(iSize / 2, m_HalfReverse, m_HalfTwiddles);
+
+    m_RealTwiddles.resize((iSize / 4 + 1) * 2);
+
+    for (size_t k = 0; k <= iSize / 4; ++k)
+    {
+        double fAngle = -2.0 * PI * (double)k / (double)iSize;
+
+        m_RealTwiddles[k * 2] = (float)cos(fAngle);
+        m_RealTwiddles[k * 2 + 1] = (float)sin(fAngle);
+    }
+
+    m_Work.assign(iSize, 0.0f);
+
+    return eCaptureError::NONE;
+}
+
+size_t LoopbackFFT::GetSize()
+{
+    return m_iSize;
+}
+
+void LoopbackFFT::Forward(float *pData)
+{
+    Transform(pData, m_iSize, m_Reverse, m_Twiddles);
+}
+
+void LoopbackFFT::Inverse(float *pData)
+{
+    // conj(FFT(conj(x))) / N
+
+    for (size_t i = 0; i < m_iSize; ++i)
+        pData[i * 2 + 1] = -pData[i * 2 + 1];
+
+    Transform(pData, m_iSize, m_Reverse, m_Twiddles);
+
+    float fScale = 1.0f / (float)m_iSize;
+
+    for (size_t i = 0; i < m_iSize; ++i)
+    {
+        pData[i * 2] *= fScale;
+        pData[i * 2 + 1] *= -fScale;
+    }
+}
+
+void LoopbackFFT::ForwardReal(const float *pInput, float *pOutput)
+{
+    // The even samples are the real and the odd samples the imaginary part of z, so the input is already interleaved
+
+    size_t M = m_iSize / 2;
+    float *pZ = m_Work.data();
+
+    for (size_t i = 0; i < m_iSize; ++i)
+        pZ[i] = pInput[i];
+
+    Transform(pZ, M, m_HalfReverse, m_HalfTwiddles);
+
+    // Even and odd spectra: E = (Z[k] + conj(Z[M - k])) / 2, O = (Z[k] - conj(Z[M - k])) / 2i
+    // X[k] = E + W^k O, X[M - k] = conj(E - W^k O)
+
+    for (size_t k = 0; k <= M / 2; ++k)
+    {
+        size_t m = (M - k) & (M - 1);
+
+        float fZr = pZ[k * 2];
+        float fZi = pZ[k * 2 + 1];
+        float fCr = pZ[m * 2];
+        float fCi = -pZ[m * 2 + 1];
+
+        float fEr = (fZr + fCr) * 0.5f;
+        float fEi = (fZi + fCi) * 0.5f;
+        float fOr = (fZi - fCi) * 0.5f;
+        float fOi = (fCr - fZr) * 0.5f;
+
+        float fWr = m_RealTwiddles[k * 2];
+        float fWi = m_RealTwiddles[k * 2 + 1];
+
+        float fTr = fOr * fWr - fOi * fWi;
+        float fTi = fOr * fWi + fOi * fWr;
+
+        pOutput[k * 2] = fEr + fTr;
+        pOutput[k * 2 + 1] = fEi + fTi;
+        pOutput[(M - k) * 2] = fEr - fTr;
+        pOutput[(M - k) * 2 + 1] = fTi - fEi;
+    }
+}
+
+void LoopbackFFT::InverseReal(const float *pInput, float *pOutput)
+{
+    size_t M = m_iSize / 2;
+    float *pZ = m_Work.data();
+
+    // E = (X[k] + conj(X[M - k])) / 2, O = (X[k] - conj(X[M - k])) conj(W^k) / 2, Z[k] = E + iO, Z[M - k] = conj(E) + i conj(O).
+    // Z is conjugated on the way for the inverse transform.
+
+    for (size_t k = 0; k <= M / 2; ++k)
+    {
+        float fAr = pInput[k * 2];
+        float fAi = k == 0 ? 0.0f : pInput[k * 2 + 1];
+        float fBr = pInput[(M - k) * 2];
+        float fBi = k == 0 ? 0.0f : -pInput[(M - k) * 2 + 1];
+
+        float fEr = (fAr + fBr) * 0.5f;
+        float fEi = (fAi + fBi) * 0.5f;
+        float fDr = (fAr - fBr) * 0.5f;
+        float fDi = (fAi - fBi) * 0.5f;
+
+        float fWr = m_RealTwiddles[k * 2];
+        float fWi = -m_RealTwiddles[k * 2 + 1];
+
+        float fOr = fDr * fWr - fDi * fWi;
+        float fOi = fDr * fWi + fDi * fWr;
+
+        pZ[k * 2] = fEr - fOi;
+        pZ[k * 2 + 1] = -(fEi + fOr);
+
+        if (k > 0)
+        {
+            pZ[(M - k) * 2] = fEr + fOi;
+            pZ[(M - k) * 2 + 1] = -(fOr - fEi);
+        }
+    }
+
+    Transform(pZ, M, m_HalfReverse, m_HalfTwiddles);
+
+    float fScale = 1.0f / (float)M;
+
+    for (size_t i = 0; i < M; ++i)
+    {
+        pOutput[i * 2] = pZ[i * 2] * fScale;
+        pOutput[i * 2 + 1] = -pZ[i * 2 + 1] * fScale;
+    }
+}
+
+// private
+
+void LoopbackFFT::Transform(float *pData, size_t iSize, const vector<UINT32>& Reverse, const vector<float>& Twiddles)
+{
+    for (size_t i = 0; i < Reverse.size(); i += 2)
+    {
+        float *pA = pData + (size_t)Reverse[i] * 2;
+        float *pB = pData + (size_t)Reverse[i + 1] * 2;
+
+        float fRe = pA[0];
+        float fIm = pA[1];
+
+        pA[0] = pB[0];
+        pA[1] = pB[1];
+        pB[0] = fRe;
+        pB[1] = fIm;
+    }
+
+    // First pass, the twiddle is 1
+
+    for (size_t i = 0; i < iSize; i += 2)
+    {
+        float *p = pData + i * 2;
+
+#if defined LOOPBACK_FFT_SSE
+        __m128 V = _mm_loadu_ps(p);
+        __m128 A = _mm_movelh_ps(V, V);
+        __m128 B = _mm_movehl_ps(V, V);
+
+        _mm_storeu_ps(p, _mm_add_ps(A, _mm_mul_ps(B, _mm_set_ps(-1.0f, -1.0f, 1.0f, 1.0f))));
+#else
+        float fBr = p[2];
+        float fBi = p[3];
+
+        p[2] = p[0] - fBr;
+        p[3] = p[1] - fBi;
+        p[0] += fBr;
+        p[1] += fBi;
+#endif
+    }
+
+    // Pass with half length h uses Twiddles[(h - 1) * 2 ...], exp(-2 pi i j / 2h) for j < h
+
+    for (size_t iHalf = 2; iHalf < iSize; iHalf <<= 1)
+    {
+        const float *pTwiddles = Twiddles.data() + (iHalf - 1) * 2;
+
+        for (size_t i = 0; i < iSize; i += iHalf * 2)
+        {
+            float *pA = pData + i * 2;
+            float *pB = pA + iHalf * 2;
+
+#if defined LOOPBACK_FFT_SSE
+            for (size_t j = 0; j < iHalf * 2; j += 4)
+            {
+                __m128 A = _mm_loadu_ps(pA + j);
+                __m128 T = ComplexMultiply(_mm_loadu_ps(pB + j), _mm_loadu_ps(pTwiddles + j));
+
+                _mm_storeu_ps(pA + j, _mm_add_ps(A, T));
+                _mm_storeu_ps(pB + j, _mm_sub_ps(A, T));
+            }
+#else
+            for (size_t j = 0; j < iHalf * 2; j += 2)
+            {
+                float fWr = pTwiddles[j];
+                float fWi = pTwiddles[j + 1];
+
+                float fTr = pB[j] * fWr - pB[j + 1] * fWi;
+                float fTi = pB[j] * fWi + pB[j + 1] * fWr;
+
+                pB[j] = pA[j] - fTr;
+                pB[j + 1] = pA[j + 1] - fTi;
+                pA[j] += fTr;
+                pA[j + 1] += fTi;
+            }
+#endif
+        }
+    }
+}
+
+void LoopbackFFT::BuildTables(size_t iSize, vector<UINT32>& Reverse, vector<float>& Twiddles)
+{
+    Reverse.clear();
+
+    for (size_t i = 1, j = 0; i < iSize; ++i)
+    {
+        size_t iBit = iSize >> 1;
+
+        for (; j & iBit; iBit >>= 1)
+            j ^= iBit;
+
+        j |= iBit;
+
+        if (i < j)
+        {
+            Reverse.push_back((UINT32)i);
+            Reverse.push_back((UINT32)j);
+        }
+    }
+
+    Twiddles.assign(iSize * 2, 0.0f);
+
+    for (size_t iHalf = 1; iHalf < iSize; iHalf <<= 1)
+    {
+        float *pTwiddles = Twiddles.data() + (iHalf - 1) * 2;
+
+        for (size_t j = 0; j < iHalf; ++j)
+        {
+            double fAngle = -PI * (double)j / (double)iHalf;
+
+            pTwiddles[j * 2] = (float)cos(fAngle);
+            pTwiddles[j * 2 + 1] = (float)sin(fAngle);
+        }
+    }
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+
+Radix-2 FFT shared by the analysis stages (delay estimation, feature extraction, spectral processing).
+
+Sizes are powers of two. The twiddle factors of every pass are stored contiguously, so the butterflies of all passes but the
+first read them in order, two complex butterflies per SSE operation where available. Real transforms use a complex FFT of half
+the size and split the result, so a real frame costs about half of a complex one.
+
+Complex data is interleaved (re, im). A real transform of N samples has N / 2 + 1 bins (DC to Nyquist), i.e. N + 2 floats.
+Forward transforms are not scaled, the inverse transforms are scaled by 1 / N so they restore the input of the forward ones.
+
+LoopbackFFT FFT;
+FFT.SetSize(512);
+FFT.ForwardReal(Frame.data(), Spectrum.data());
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <vector>
+
+// ------------------------------------------------------------
+
+class LoopbackFFT
+{
+public:
+
+    LoopbackFFT();
+
+    // Power of two, 4 to 2^24. Allocates the tables, the transforms themselves do not allocate.
+    eCaptureError SetSize(size_t iSize);
+
+    size_t GetSize();
+
+    // In-place complex transform of GetSize() interleaved values. Inverse is scaled by 1 / GetSize().
+    void Forward(float *pData);
+    void Inverse(float *pData);
+
+    // GetSize() real samples to GetSize() / 2 + 1 interleaved bins. pInput and pOutput may not overlap.
+    void ForwardReal(const float *pInput, float *pOutput);
+
+    // GetSize() / 2 + 1 interleaved bins to GetSize() real samples, scaled by 1 / GetSize(). The imaginary parts of DC and Nyquist
+    // are ignored. pInput and pOutput may not overlap.
+    void InverseReal(const float *pInput, float *pOutput);
+
+private:
+
+    // Complex transform of iSize values with the tables of that size
+    static void Transform(float *pData, size_t iSize, const std::vector<UINT32>& Reverse, const std::vector<float>& Twiddles);
+
+    static void BuildTables(size_t iSize, std::vector<UINT32>& Reverse, std::vector<float>& Twiddles);
+
+    size_t                          m_iSize;
+
+    // Complex transform of m_iSize
+    std::vector<UINT32>             m_Reverse;      // Bit reversal swaps, pairs of indices
+    std::vector<float>              m_Twiddles;     // Per pass, interleaved complex
+
+    // Complex transform of m_iSize / 2 for the real transforms
+    std::vector<UINT32>             m_HalfReverse;
+    std::vector<float>              m_HalfTwiddles;
+    std::vector<float>              m_RealTwiddles; // exp(-2 pi i k / m_iSize), k <= m_iSize / 4
+    std::vector<float>              m_Work;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,900 @@
+#include <LoopbackFingerprint.h>
+#include <LoopbackSampleMath.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+using namespace std;
+
+// ------------------------------------------------------------ Helpers
+
+namespace
+{
+    using LoopbackSampleMath::PI;
+
+    // Level of cells without any power, below every peak threshold
+    const float SILENCE_LEVEL = -120.0f;
+
+    size_t NextPowerOfTwo(size_t iValue)
+    {
+        size_t iResult = 1;
+
+        while (iResult < iValue)
+            iResult <<= 1;
+
+        return iResult;
+    }
+
+    UINT32 MakeHash(UINT32 iAnchorCell, UINT32 iTargetCell, UINT32 iDistance)
+    {
+        return (iAnchorCell << 16) | (iTargetCell << 8) | iDistance;
+    }
+
+    // Match candidate: reference id in the upper half, time offset (reference - query) biased to unsigned in the lower half
+    UINT64 MakeCandidate(UINT32 iId, UINT32 iReferenceTime, UINT32 iQueryTime)
+    {
+        return ((UINT64)iId << 32) | (UINT32)((INT64)iReferenceTime - (INT64)iQueryTime + 0x80000000LL);
+    }
+
+    // Calls Func(candidate, score) for every run of equal candidates in the sorted list. The score includes the run of the
+    // previous offset of the same reference, the candidate is the larger of the two runs.
+    template<typename F> void ScoreOffsets(const vector<UINT64>& Candidates, F Func)
+    {
+        size_t iRun = 0;
+        UINT32 iPreviousCount = 0;
+        UINT64 iPreviousCandidate = 0;
+
+        while (iRun < Candidates.size())
+        {
+            UINT64 iCandidate = Candidates[iRun];
+            size_t iEnd = iRun;
+
+            while (iEnd < Candidates.size() && Candidates[iEnd] == iCandidate)
+                ++iEnd;
+
+            UINT32 iRunCount = (UINT32)(iEnd - iRun);
+            bool bAdjacent = iRun > 0 && iPreviousCandidate + 1 == iCandidate;
+
+            if (bAdjacent)
+                Func(iRunCount >= iPreviousCount ? iCandidate : iPreviousCandidate, iRunCount + iPreviousCount);
+            else
+                Func(iCandidate, iRunCount);
+
+            iPreviousCount = iRunCount;
+            iPreviousCandidate = iCandidate;
+            iRun = iEnd;
+        }
+    }
+
+    void CollectLandmarks(const sLoopbackLandmark *pLandmarks, size_t iCount, void *pUserData)
+    {
+        vector<sLoopbackLandmark> *pTarget = static_cast<vector<sLoopbackLandmark>*>(pUserData);
+        pTarget->insert(pTarget->end(), pLandmarks, pLandmarks + iCount);
+    }
+}
+
+// ------------------------------------------------------------ LoopbackFingerprintIndex
+
+// public
+
+LoopbackFingerprintIndex::LoopbackFingerprintIndex()
+{
+}
+
+eCaptureError LoopbackFingerprintIndex::AddReference(UINT32 iId, const vector<sLoopbackLandmark>& Landmarks)
+{
+    if (Landmarks.empty())
+        return eCaptureError::PARAM;
+
+    vector<sEntry> NewEntries;
+    NewEntries.reserve(Landmarks.size());
+
+    for (const sLoopbackLandmark& Landmark : Landmarks)
+        NewEntries.push_back({ Landmark.iHash, iId, Landmark.iTime });
+
+    auto Less = [](const sEntry& a, const sEntry& b) { return a.iHash < b.iHash; };
+
+    stable_sort(NewEntries.begin(), NewEntries.end(), Less);
+
+    // Only writers change the index and they hold m_WriteLock, so it can be read without m_Lock while the new one is built
+
+    lock_guard<mutex> WriteLock(m_WriteLock);
+
+    vector<sEntry> Entries;
+    vector<UINT32> References = m_References;
+
+    auto Reference = lower_bound(References.begin(), References.end(), iId);
+
+    if (Reference == References.end() || *Reference != iId)
+        References.insert(Reference, iId);
+
+    vector<sEntry> OldEntries;
+    OldEntries.reserve(m_Entries.size());
+    remove_copy_if(m_Entries.begin(), m_Entries.end(), back_inserter(OldEntries), [iId](const sEntry& Entry) { return Entry.iId == iId; });
+
+    Entries.reserve(OldEntries.size() + NewEntries.size());
+    merge(OldEntries.begin(), OldEntries.end(), NewEntries.begin(), NewEntries.end(), back_inserter(Entries), Less);
+
+    // The old index is freed after the lock is released
+
+    {
+        unique_lock<shared_mutex> Lock(m_Lock);
+
+        m_Entries.swap(Entries);
+        m_References.swap(References);
+    }
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFingerprintIndex::RemoveReference(UINT32 iId)
+{
+    lock_guard<mutex> WriteLock(m_WriteLock);
+
+    vector<UINT32> References = m_References;
+
+    auto Reference = lower_bound(References.begin(), References.end(), iId);
+
+    if (Reference == References.end() || *Reference != iId)
+        return eCaptureError::PARAM;
+
+    References.erase(Reference);
+
+    vector<sEntry> Entries;
+    Entries.reserve(m_Entries.size());
+    remove_copy_if(m_Entries.begin(), m_Entries.end(), back_inserter(Entries), [iId](const sEntry& Entry) { return Entry.iId == iId; });
+
+    {
+        unique_lock<shared_mutex> Lock(m_Lock);
+
+        m_Entries.swap(Entries);
+        m_References.swap(References);
+    }
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackFingerprintIndex::Clear()
+{
+    lock_guard<mutex> WriteLock(m_WriteLock);
+
+    vector<sEntry> Entries;
+    vector<UINT32> References;
+
+    {
+        unique_lock<shared_mutex> Lock(m_Lock);
+
+        m_Entries.swap(Entries);
+        m_References.swap(References);
+    }
+}
+
+size_t LoopbackFingerprintIndex::GetReferenceCount()
+{
+    shared_lock<shared_mutex> Lock(m_Lock);
+
+    return m_References.size();
+}
+
+size_t LoopbackFingerprintIndex::GetLandmarkCount()
+{
+    shared_lock<shared_mutex> Lock(m_Lock);
+
+    return m_Entries.size();
+}
+
+bool LoopbackFingerprintIndex::Match(const sLoopbackLandmark *pLandmarks, size_t iCount, sLoopbackFingerprintMatch& Result, UINT32 iMinScore)
+{
+    vector<UINT64> Candidates;
+
+    return Match(pLandmarks, iCount, Result, iMinScore, Candidates);
+}
+
+bool LoopbackFingerprintIndex::Match(const sLoopbackLandmark *pLandmarks, size_t iCount, sLoopbackFingerprintMatch& Result, UINT32 iMinScore, vector<UINT64>& Candidates)
+{
+    using namespace LoopbackFingerprintConst;
+
+    Candidates.clear();
+
+    if (pLandmarks == nullptr || iCount == 0)
+        return false;
+
+    UINT32 iLastTime = 0;
+
+    {
+        shared_lock<shared_mutex> Lock(m_Lock);
+
+        auto Less = [](const sEntry& Entry, UINT32 iHash) { return Entry.iHash < iHash; };
+
+        for (size_t i = 0; i < iCount; ++i)
+        {
+            const sLoopbackLandmark& Landmark = pLandmarks[i];
+
+            iLastTime = max(iLastTime, Landmark.iTime);
+
+            auto First = lower_bound(m_Entries.begin(), m_Entries.end(), Landmark.iHash, Less);
+            auto Last = First;
+
+            while (Last != m_Entries.end() && Last->iHash == Landmark.iHash && (size_t)(Last - First) <= MAX_HASH_ENTRIES)
+                ++Last;
+
+            if ((size_t)(Last - First) > MAX_HASH_ENTRIES)
+                continue;
+
+            for (auto Entry = First; Entry != Last; ++Entry)
+                Candidates.push_back(MakeCandidate(Entry->iId, Entry->iTime, Landmark.iTime));
+        }
+    }
+
+    if (Candidates.empty())
+        return false;
+
+    // Histogram of the offsets per reference. Neighbouring offsets are counted together, since the frames of the query and
+    // the reference are not aligned and a landmark may land one frame off.
+
+    sort(Candidates.begin(), Candidates.end());
+
+    UINT64 iBestCandidate = 0;
+    UINT32 iBestScore = 0;
+
+    ScoreOffsets(Candidates, [&iBestCandidate, &iBestScore](UINT64 iCandidate, UINT32 iScore)
+    {
+        if (iScore > iBestScore)
+        {
+            iBestScore = iScore;
+            iBestCandidate = iCandidate;
+        }
+    });
+
+    // Runner-up: the best score of the other references. Other offsets of the best reference do not count, content that repeats
+    // itself (loops, choruses) scores almost as well there.
+
+    UINT32 iRunnerUp = 0;
+
+    ScoreOffsets(Candidates, [iBestCandidate, &iRunnerUp](UINT64 iCandidate, UINT32 iScore)
+    {
+        if ((iCandidate >> 32) != (iBestCandidate >> 32) && iScore > iRunnerUp)
+            iRunnerUp = iScore;
+    });
+
+    INT64 iOffset = (INT64)(UINT32)iBestCandidate - 0x80000000LL;
+
+    Result = {};
+    Result.iId = (UINT32)(iBestCandidate >> 32);
+    Result.iScore = iBestScore;
+    Result.iRunnerUp = iRunnerUp;
+    Result.fConfidence = min((float)iBestScore / (float)iCount, 1.0f);
+    Result.fReferenceTime = max((double)((INT64)iLastTime + iOffset), 0.0) * FRAME_SECONDS;
+
+    return iBestScore >= iMinScore && (float)iBestScore >= MIN_QUERY_FRACTION * (float)iCount && (float)iBestScore >= MIN_MARGIN * (float)iRunnerUp;
+}
+
+// ------------------------------------------------------------ LoopbackFingerprintSink
+
+// public
+
+LoopbackFingerprintSink::LoopbackFingerprintSink() :
+    m_pLandmarkFunc(nullptr),
+    m_pLandmarkFuncUserData(nullptr),
+    m_pIndex(nullptr),
+    m_fMatchWindow(5.0),
+    m_fMatchInterval(1.0),
+    m_iMinScore(8),
+    m_pMatchFunc(nullptr),
+    m_pMatchFuncUserData(nullptr),
+    m_pEventRing(nullptr),
+    m_iEventSource(0),
+    m_bOpen(false),
+    m_iDecimation(0),
+    m_dwAnalysisRate(0),
+    m_iWindowLength(0),
+    m_iHop(0),
+    m_fPowerScale(1.0f),
+    m_iSampleCount(0),
+    m_iFrameCount(0),
+    m_iNextMatch(0),
+    m_iMatchRequest(0),
+    m_iLastReported(0),
+    m_bReported(false),
+    m_pMatchThread(nullptr),
+    m_bStop(false),
+    m_bMatchValid(false),
+    m_iLandmarkCount(0)
+{
+    m_DecimatedInput.pOwner = this;
+}
+
+LoopbackFingerprintSink::~LoopbackFingerprintSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackFingerprintSink::Extract(const WAVEFORMATEX& Format, const unsigned char *pData, size_t iSize, vector<sLoopbackLandmark>& Landmarks)
+{
+    Landmarks.clear();
+
+    LoopbackFingerprintSink Sink;
+    Sink.SetLandmarkCallback(&CollectLandmarks, &Landmarks);
+
+    eCaptureError eError = Sink.Open(Format);
+
+    if (eError != eCaptureError::NONE)
+        return eError;
+
+    if (pData != nullptr && iSize > 0)
+        Sink.OnData(pData, iSize);
+
+    return Sink.Close();
+}
+
+eCaptureError LoopbackFingerprintSink::SetLandmarkCallback(void (*pLandmarkFunc)(const sLoopbackLandmark *pLandmarks, size_t iCount, void*), void *pUserData)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pLandmarkFunc = pLandmarkFunc;
+    m_pLandmarkFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFingerprintSink::SetIndex(LoopbackFingerprintIndex *pIndex, double fWindow, double fInterval, UINT32 iMinScore)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fWindow < 1.0 || fWindow > 60.0 || fInterval < LoopbackFingerprintConst::FRAME_SECONDS || fInterval > fWindow || iMinScore == 0)
+        return eCaptureError::PARAM;
+
+    m_pIndex = pIndex;
+    m_fMatchWindow = fWindow;
+    m_fMatchInterval = fInterval;
+    m_iMinScore = iMinScore;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFingerprintSink::SetMatchCallback(void (*pMatchFunc)(const sLoopbackFingerprintMatch& Match, void*), void *pUserData)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pMatchFunc = pMatchFunc;
+    m_pMatchFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFingerprintSink::SetEventLog(LoopbackEventRing *pRing, UINT16 iSource)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pEventRing = pRing;
+    m_iEventSource = iSource;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFingerprintSink::Open(const WAVEFORMATEX& Format)
+{
+    using namespace LoopbackFingerprintConst;
+
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || Format.nSamplesPerSec == 0)
+        return eCaptureError::FORMAT;
+
+    // Largest factor that divides the rate and keeps at least the analysis rate
+
+    m_iDecimation = 0;
+
+    for (UINT32 iFactor = min(Format.nSamplesPerSec / MIN_ANALYSIS_RATE, LoopbackDecimationConst::MAX_FACTOR); iFactor >= 2; --iFactor)
+    {
+        if (Format.nSamplesPerSec % iFactor == 0)
+        {
+            m_iDecimation = iFactor;
+            break;
+        }
+    }
+
+    if (m_iDecimation == 0)
+        return eCaptureError::FORMAT;
+
+    m_dwAnalysisRate = Format.nSamplesPerSec / m_iDecimation;
+
+    m_iWindowLength = (size_t)(WINDOW_SECONDS * m_dwAnalysisRate + 0.5);
+    m_iHop = (size_t)(FRAME_SECONDS * m_dwAnalysisRate + 0.5);
+
+    size_t iFFTSize = NextPowerOfTwo(m_iWindowLength);
+
+    m_FFT.SetSize(iFFTSize);
+
+    // Periodic Hann window, scaled so a full scale sine has a power of 1 in its bin
+
+    m_Window.resize(m_iWindowLength);
+
+    double fWindowSum = 0.0;
+
+    for (size_t i = 0; i < m_iWindowLength; ++i)
+    {
+        m_Window[i] = (float)(0.5 - 0.5 * cos(2.0 * PI * i / m_iWindowLength));
+        fWindowSum += m_Window[i];
+    }
+
+    m_fPowerScale = (float)(4.0 / (fWindowSum * fWindowSum));
+
+    // Bins to the nearest cell centre, independent of the analysis rate (at 8 kHz every bin is one cell)
+
+    m_BinCells.resize(iFFTSize / 2 + 1);
+
+    for (size_t k = 0; k < m_BinCells.size(); ++k)
+        m_BinCells[k] = (UINT16)min((size_t)((double)k * m_dwAnalysisRate / iFFTSize / CELL_WIDTH + 0.5), CELL_COUNT);
+
+    m_Samples.assign(m_iWindowLength, 0.0f);
+    m_iSampleCount = 0;
+    m_Frame.assign(iFFTSize, 0.0f);
+    m_Spectrum.assign(iFFTSize + 2, 0.0f);
+    m_Rows.assign((2 * PEAK_FRAMES + 1) * CELL_COUNT, SILENCE_LEVEL);
+    m_MaxRows.assign((2 * PEAK_FRAMES + 1) * CELL_COUNT, SILENCE_LEVEL);
+    m_iFrameCount = 0;
+
+    // Sized for the peaks of one target zone, so OnData does not allocate. The ring holds the landmarks of a target zone (what
+    // a gap or Close emits at once) and of a match interval, the match thread reads it every MATCH_POLL_INTERVAL.
+
+    size_t iWindowFrames = (size_t)(m_fMatchWindow / FRAME_SECONDS + 0.5);
+    size_t iIntervalFrames = (size_t)(m_fMatchInterval / FRAME_SECONDS + 0.5);
+
+    m_Peaks.clear();
+    m_Peaks.reserve((TARGET_FRAMES + 2) * PEAKS_PER_FRAME);
+    m_Landmarks.clear();
+    m_Landmarks.reserve((TARGET_FRAMES + 2) * PEAKS_PER_FRAME * FAN_OUT);
+    m_iNextMatch = (UINT32)max(iIntervalFrames, (size_t)1);
+
+    m_pLandmarkRing.reset();
+    m_iMatchRequest = 0;
+    m_Recent.clear();
+    m_Candidates.clear();
+    m_iLastReported = 0;
+    m_bReported = false;
+
+    if (m_pIndex != nullptr)
+    {
+        m_pLandmarkRing = make_unique<LoopbackRing<sLoopbackLandmark>>((TARGET_FRAMES + 2 + iIntervalFrames) * PEAKS_PER_FRAME * FAN_OUT);
+        m_Recent.reserve((iWindowFrames + iIntervalFrames + TARGET_FRAMES + 2) * PEAKS_PER_FRAME * FAN_OUT);
+    }
+
+    {
+        lock_guard<mutex> Lock(m_MatchLock);
+
+        m_Match = {};
+        m_bMatchValid = false;
+    }
+
+    m_iLandmarkCount = 0;
+
+    m_Bank.ClearOutputs();
+    m_Bank.SetMixToMono(true);
+    m_Bank.AddOutput(m_iDecimation, &m_DecimatedInput);
+
+    eCaptureError eError = m_Bank.Open(Format);
+
+    if (eError != eCaptureError::NONE)
+        return eError;
+
+    if (m_pIndex != nullptr)
+    {
+        m_bStop = false;
+        m_pMatchThread = new thread(&LoopbackFingerprintSink::MatchThread, this);
+    }
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFingerprintSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    m_Bank.Close();
+
+    // The last anchors get the targets that are known
+
+    EmitLandmarks(UINT64_MAX);
+
+    if (m_pMatchThread != nullptr)
+    {
+        {
+            lock_guard<mutex> Lock(m_ThreadLock);
+            m_bStop = true;
+        }
+
+        m_Wake.notify_all();
+
+        m_pMatchThread->join();
+        delete m_pMatchThread;
+        m_pMatchThread = nullptr;
+    }
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackFingerprintSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackFingerprintSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    m_Bank.OnData(pData, iSize);
+}
+
+void LoopbackFingerprintSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    // Calls SkipSamples at the analysis rate through m_DecimatedInput
+    m_Bank.OnGap(iFrames);
+}
+
+bool LoopbackFingerprintSink::GetMatch(sLoopbackFingerprintMatch& Match)
+{
+    lock_guard<mutex> Lock(m_MatchLock);
+
+    if (!m_bMatchValid)
+        return false;
+
+    Match = m_Match;
+
+    return true;
+}
+
+UINT64 LoopbackFingerprintSink::GetLandmarkCount()
+{
+    return m_iLandmarkCount.load(memory_order_relaxed);
+}
+
+// private
+
+void LoopbackFingerprintSink::sDecimatedInput::OnData(const unsigned char *pData, size_t iSize)
+{
+    pOwner->AddSamples((const float*)pData, iSize / sizeof(float));
+}
+
+void LoopbackFingerprintSink::sDecimatedInput::OnGap(UINT64 iFrames)
+{
+    pOwner->SkipSamples(iFrames);
+}
+
+void LoopbackFingerprintSink::AddSamples(const float *pSamples, size_t iCount)
+{
+    while (iCount > 0)
+    {
+        size_t iCopy = min(iCount, m_iWindowLength - m_iSampleCount);
+
+        memcpy(m_Samples.data() + m_iSampleCount, pSamples, iCopy * sizeof(float));
+
+        m_iSampleCount += iCopy;
+        pSamples += iCopy;
+        iCount -= iCopy;
+
+        if (m_iSampleCount == m_iWindowLength)
+        {
+            ComputeFrame(m_Samples.data());
+
+            memmove(m_Samples.data(), m_Samples.data() + m_iHop, (m_iWindowLength - m_iHop) * sizeof(float));
+            m_iSampleCount = m_iWindowLength - m_iHop;
+        }
+    }
+}
+
+void LoopbackFingerprintSink::SkipSamples(UINT64 iCount)
+{
+    using namespace LoopbackFingerprintConst;
+
+    // The frames whose peaks were still pending are dropped with the gap. The next frame is the one that contains the end of the
+    // gap, its part of the gap is silence.
+
+    UINT64 iPosition = (UINT64)m_iFrameCount * m_iHop + m_iSampleCount + iCount;
+
+    m_iFrameCount = (UINT32)(iPosition / m_iHop);
+    m_iSampleCount = (size_t)(iPosition % m_iHop);
+
+    fill(m_Samples.begin(), m_Samples.begin() + m_iSampleCount, 0.0f);
+    fill(m_Rows.begin(), m_Rows.end(), SILENCE_LEVEL);
+    fill(m_MaxRows.begin(), m_MaxRows.end(), SILENCE_LEVEL);
+
+    // Anchors before the gap only have the targets that are known, as on Close
+
+    EmitLandmarks(UINT64_MAX);
+
+    // One match after the gap instead of one per frame until the schedule caught up
+
+    if ((UINT64)m_iNextMatch + TARGET_FRAMES + PEAK_FRAMES < m_iFrameCount)
+        m_iNextMatch = m_iFrameCount - (UINT32)(TARGET_FRAMES + PEAK_FRAMES);
+}
+
+void LoopbackFingerprintSink::ComputeFrame(const float *pSamples)
+{
+    using namespace LoopbackFingerprintConst;
+
+    const size_t iRows = 2 * PEAK_FRAMES + 1;
+
+    for (size_t i = 0; i < m_iWindowLength; ++i)
+        m_Frame[i] = pSamples[i] * m_Window[i];
+
+    m_FFT.ForwardReal(m_Frame.data(), m_Spectrum.data());
+
+    // Strongest bin per cell, in dB relative to a full scale sine
+
+    float *pRow = m_Rows.data() + (m_iFrameCount % iRows) * CELL_COUNT;
+    float *pMaxRow = m_MaxRows.data() + (m_iFrameCount % iRows) * CELL_COUNT;
+
+    fill(pRow, pRow + CELL_COUNT, 0.0f);
+
+    for (size_t k = 0; k < m_BinCells.size(); ++k)
+    {
+        size_t iCell = m_BinCells[k];
+
+        if (iCell >= CELL_COUNT)
+            break;
+
+        float fPower = m_Spectrum[k * 2] * m_Spectrum[k * 2] + m_Spectrum[k * 2 + 1] * m_Spectrum[k * 2 + 1];
+        pRow[iCell] = max(pRow[iCell], fPower);
+    }
+
+    for (size_t j = 0; j < CELL_COUNT; ++j)
+        pRow[j] = pRow[j] > 0.0f ? 10.0f * log10f(pRow[j] * m_fPowerScale + 1e-12f) : SILENCE_LEVEL;
+
+    // Maximum over the neighbouring cells, the peak test then only compares against one value per frame
+
+    for (size_t j = 0; j < CELL_COUNT; ++j)
+    {
+        size_t iFirst = j >= PEAK_CELLS ? j - PEAK_CELLS : 0;
+        size_t iLast = min(j + PEAK_CELLS, CELL_COUNT - 1);
+
+        float fMax = pRow[iFirst];
+
+        for (size_t n = iFirst + 1; n <= iLast; ++n)
+            fMax = max(fMax, pRow[n]);
+
+        pMaxRow[j] = fMax;
+    }
+
+    UINT32 iFrame = m_iFrameCount++;
+
+    // Peaks of the frame in the middle of the neighbourhood, then the anchors whose target zone that completed
+
+    if (iFrame < 2 * PEAK_FRAMES)
+        return;
+
+    UINT32 iComplete = iFrame - (UINT32)PEAK_FRAMES;
+
+    FindPeaks(iComplete);
+    EmitLandmarks(iComplete);
+
+    // The landmarks up to the end of the match are in the ring, the match thread picks up the request. A request it has not
+    // picked up yet is replaced.
+
+    if (m_pIndex != nullptr && iComplete >= TARGET_FRAMES && iComplete - (UINT32)TARGET_FRAMES >= m_iNextMatch)
+    {
+        m_iMatchRequest.store((UINT64)(iComplete - (UINT32)TARGET_FRAMES) + 1, memory_order_release);
+        m_iNextMatch += (UINT32)max((size_t)(m_fMatchInterval / FRAME_SECONDS + 0.5), (size_t)1);
+    }
+}
+
+void LoopbackFingerprintSink::FindPeaks(UINT32 iFrame)
+{
+    using namespace LoopbackFingerprintConst;
+
+    const size_t iRows = 2 * PEAK_FRAMES + 1;
+    const float *pRow = m_Rows.data() + (iFrame % iRows) * CELL_COUNT;
+
+    float fMean = 0.0f;
+
+    for (size_t j = MIN_PEAK_CELL; j < CELL_COUNT; ++j)
+        fMean += pRow[j];
+
+    fMean /= (float)(CELL_COUNT - MIN_PEAK_CELL);
+
+    float fThreshold = max(fMean + PEAK_CONTRAST, PEAK_MIN_LEVEL);
+
+    // Strongest first
+
+    sPeak Peaks[PEAKS_PER_FRAME];
+    size_t iPeaks = 0;
+
+    for (size_t j = MIN_PEAK_CELL; j < CELL_COUNT; ++j)
+    {
+        float fLevel = pRow[j];
+
+        if (fLevel < fThreshold)
+            continue;
+
+        if (iPeaks == PEAKS_PER_FRAME && fLevel <= Peaks[iPeaks - 1].fLevel)
+            continue;
+
+        bool bPeak = true;
+
+        for (size_t r = 0; r < iRows && bPeak; ++r)
+            bPeak = m_MaxRows[r * CELL_COUNT + j] <= fLevel;
+
+        if (!bPeak)
+            continue;
+
+        size_t iInsert = min(iPeaks, PEAKS_PER_FRAME - 1);
+
+        while (iInsert > 0 && Peaks[iInsert - 1].fLevel < fLevel)
+        {
+            Peaks[iInsert] = Peaks[iInsert - 1];
+            --iInsert;
+        }
+
+        Peaks[iInsert] = { iFrame, (UINT32)j, fLevel };
+        iPeaks = min(iPeaks + 1, PEAKS_PER_FRAME);
+    }
+
+    m_Peaks.insert(m_Peaks.end(), Peaks, Peaks + iPeaks);
+}
+
+void LoopbackFingerprintSink::EmitLandmarks(UINT64 iCompleteFrame)
+{
+    using namespace LoopbackFingerprintConst;
+
+    m_Landmarks.clear();
+
+    // Anchors whose target zone is complete, paired with the first peaks of later frames in the zone
+
+    size_t iAnchors = 0;
+
+    while (iAnchors < m_Peaks.size() && (UINT64)m_Peaks[iAnchors].iFrame + TARGET_FRAMES <= iCompleteFrame)
+    {
+        const sPeak& Anchor = m_Peaks[iAnchors];
+        size_t iTargets = 0;
+
+        for (size_t i = iAnchors + 1; i < m_Peaks.size() && iTargets < FAN_OUT; ++i)
+        {
+            const sPeak& Target = m_Peaks[i];
+
+            if (Target.iFrame == Anchor.iFrame)
+                continue;
+
+            if (Target.iFrame > Anchor.iFrame + TARGET_FRAMES)
+                break;
+
+            if (Target.iCell + TARGET_CELLS < Anchor.iCell || Target.iCell > Anchor.iCell + TARGET_CELLS)
+                continue;
+
+            m_Landmarks.push_back({ MakeHash(Anchor.iCell, Target.iCell, Target.iFrame - Anchor.iFrame), Anchor.iFrame });
+            ++iTargets;
+        }
+
+        ++iAnchors;
+    }
+
+    m_Peaks.erase(m_Peaks.begin(), m_Peaks.begin() + iAnchors);
+
+    if (m_Landmarks.empty())
+        return;
+
+    m_iLandmarkCount.fetch_add(m_Landmarks.size(), memory_order_relaxed);
+
+    if (m_pLandmarkFunc != nullptr)
+        m_pLandmarkFunc(m_Landmarks.data(), m_Landmarks.size(), m_pLandmarkFuncUserData);
+
+    // If the match thread fell behind, the landmarks that do not fit are lost for matching
+
+    if (m_pLandmarkRing)
+    {
+        for (const sLoopbackLandmark& Landmark : m_Landmarks)
+        {
+            if (!m_pLandmarkRing->Push(Landmark))
+                break;
+        }
+    }
+}
+
+void LoopbackFingerprintSink::MatchThread()
+{
+    using namespace LoopbackFingerprintConst;
+
+    unique_lock<mutex> Lock(m_ThreadLock);
+
+    while (true)
+    {
+        bool bStop = m_Wake.wait_for(Lock, chrono::milliseconds(MATCH_POLL_INTERVAL), [this]() { return m_bStop; });
+
+        Lock.unlock();
+
+        // The request first: the landmarks it needs were pushed before it was stored
+
+        UINT64 iRequest = m_iMatchRequest.exchange(0, memory_order_acquire);
+
+        ReadLandmarks();
+
+        if (iRequest != 0)
+            MatchRecent((UINT32)(iRequest - 1));
+
+        Lock.lock();
+
+        if (bStop)
+            break;
+    }
+}
+
+void LoopbackFingerprintSink::ReadLandmarks()
+{
+    sLoopbackLandmark Landmark;
+
+    while (m_pLandmarkRing->Pop(Landmark))
+        m_Recent.push_back(Landmark);
+}
+
+void LoopbackFingerprintSink::MatchRecent(UINT32 iEndFrame)
+{
+    using namespace LoopbackFingerprintConst;
+
+    // Landmarks of the anchors in the match window, up to the last anchor with a complete target zone. Landmarks read ahead of
+    // the request stay for the next match.
+
+    UINT32 iWindowFrames = (UINT32)(m_fMatchWindow / FRAME_SECONDS + 0.5);
+
+    auto First = find_if(m_Recent.begin(), m_Recent.end(),
+        [iEndFrame, iWindowFrames](const sLoopbackLandmark& Landmark) { return (UINT64)Landmark.iTime + iWindowFrames > iEndFrame; });
+
+    m_Recent.erase(m_Recent.begin(), First);
+
+    auto Last = find_if(m_Recent.begin(), m_Recent.end(), [iEndFrame](const sLoopbackLandmark& Landmark) { return Landmark.iTime > iEndFrame; });
+
+    sLoopbackFingerprintMatch Match{};
+    bool bMatch = m_pIndex->Match(m_Recent.data(), (size_t)(Last - m_Recent.begin()), Match, m_iMinScore, m_Candidates);
+
+    if (bMatch)
+        Match.iFrame = ((UINT64)iEndFrame * m_iHop + m_iWindowLength) * m_iDecimation;
+
+    {
+        lock_guard<mutex> Lock(m_MatchLock);
+
+        m_Match = Match;
+        m_bMatchValid = bMatch;
+    }
+
+    if (!bMatch)
+    {
+        m_bReported = false;
+        return;
+    }
+
+    if (m_pMatchFunc != nullptr)
+        m_pMatchFunc(Match, m_pMatchFuncUserData);
+
+    if (m_pEventRing != nullptr && (!m_bReported || Match.iId != m_iLastReported))
+    {
+        sLoopbackEvent Event{};
+
+        Event.iTime = (UINT64)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        Event.iValue = Match.iId;
+        Event.iValue2 = Match.iScore;
+        Event.iSource = m_iEventSource;
+        Event.Type = eLoopbackEvent::FINGERPRINT_MATCH;
+
+        m_pEventRing->Push(Event);
+    }
+
+    m_iLastReported = Match.iId;
+    m_bReported = true;
+}
+
+// ------------------------------------------------------------ EOF
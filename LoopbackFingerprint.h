@@ -0,0 +1,296 @@
+#pragma once
+
+/*
+
+Landmark fingerprints of captured audio, to recognize known content (ads, tracks, jingles) a process is playing without storing
+its audio.
+
+LoopbackFingerprintSink downmixes and decimates the stream to 8-11 kHz and computes a spectrogram with 64 ms windows every 32 ms.
+The spectrum below 4 kHz is mapped to a fixed grid of 256 cells of 15.625 Hz, so fingerprints of 44.1 kHz and 48 kHz sources
+are compatible. Per frame:
+
+- Peaks are the cells that are the maximum of their neighbourhood (+-3 frames, +-6 cells), clearly above the frame's mean level
+  and above silence. At most 5 per frame are kept, the strongest first.
+- Every peak (anchor) is paired with the first peaks in its target zone (up to 31 frames later, within +-500 Hz). Each pair is a
+  landmark: a 32-bit hash of both cells and their distance in frames, and the frame of the anchor (the timestamp).
+
+The hashes only depend on relative positions in time, so they survive gain changes, mixing with other sounds and cutting.
+Landmarks are emitted once the target zone of their anchor is complete, about 1.1 s after the anchor was played.
+
+LoopbackFingerprintIndex keeps the landmarks of reference content in memory, sorted by hash. Match looks up the hashes of a
+query and histograms the time offsets per reference: landmarks of the right reference agree on one offset, random hash hits
+do not. The score is the number of landmarks at the best offset. Random hits grow with the query and the index, so a match
+also needs a score of at least 1/128 of the query's landmarks and three times the runner-up, the best score of any other
+reference (the background of random hits).
+
+With an index set, the sink matches the landmarks of the last seconds against it at a fixed interval of audio time. The audio
+thread only pushes the landmarks into a lock-free ring and requests the match, a match thread of the sink reads the ring and
+runs it, so lookups and AddReference never stall OnData. If the match thread falls behind by more than a match interval, the
+ring drops landmarks rather than block. Results are available as a metric (GetMatch), through a callback and as
+FINGERPRINT_MATCH events whenever the identified content changes.
+
+Reference landmarks are extracted with the same code, e.g. from decoded files:
+
+LoopbackFingerprintIndex Index;
+std::vector<sLoopbackLandmark> Landmarks;
+
+LoopbackFingerprintSink::Extract(FileFormat, FileData.data(), FileData.size(), Landmarks);
+Index.AddReference(1, Landmarks);
+
+LoopbackFingerprintSink FingerprintSink;
+FingerprintSink.SetIndex(&Index);
+FingerprintSink.Open(Format);
+
+LoopbackCapture.SetCallback(&ILoopbackCaptureSink::Callback, &FingerprintSink);
+
+*/
+
+#include <LoopbackCaptureSink.h>
+#include <LoopbackDecimationBank.h>
+#include <LoopbackFFT.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackFingerprintConst
+{
+    // Lowest rate the input is decimated to
+    constexpr DWORD MIN_ANALYSIS_RATE = 8000;
+
+    // Hop and window of the spectrogram
+    constexpr double FRAME_SECONDS = 0.032;
+    constexpr double WINDOW_SECONDS = 0.064;
+
+    // Frequency grid, 0 - 4 kHz
+    constexpr double CELL_WIDTH = 15.625;
+    constexpr size_t CELL_COUNT = 256;
+
+    // Peaks below this cell (about 94 Hz) are ignored
+    constexpr size_t MIN_PEAK_CELL = 6;
+
+    // Peak neighbourhood, each side
+    constexpr size_t PEAK_FRAMES = 3;
+    constexpr size_t PEAK_CELLS = 6;
+
+    constexpr size_t PEAKS_PER_FRAME = 5;
+
+    // dB above the mean level of the frame, and the lowest level of a peak relative to a full scale sine
+    constexpr float PEAK_CONTRAST = 10.0f;
+    constexpr float PEAK_MIN_LEVEL = -70.0f;
+
+    // Target zone of an anchor and the number of landmarks per anchor
+    constexpr size_t TARGET_FRAMES = 31;
+    constexpr size_t TARGET_CELLS = 32;
+    constexpr size_t FAN_OUT = 5;
+
+    // Hashes with more entries in the index carry little information and are skipped by Match
+    constexpr size_t MAX_HASH_ENTRIES = 4096;
+
+    // Lowest score of a match as a fraction of the query's landmarks, and the lowest ratio of the score over the runner-up
+    constexpr float MIN_QUERY_FRACTION = 1.0f / 128.0f;
+    constexpr float MIN_MARGIN = 3.0f;
+
+    // Milliseconds between checks of the match thread for a match request
+    constexpr DWORD MATCH_POLL_INTERVAL = 20;
+}
+
+struct sLoopbackLandmark
+{
+    UINT32                          iHash;          // Anchor cell << 16 | target cell << 8 | frame distance
+    UINT32                          iTime;          // Frame of the anchor (FRAME_SECONDS each)
+};
+
+struct sLoopbackFingerprintMatch
+{
+    UINT32                          iId;            // Reference id
+    UINT32                          iScore;         // Landmarks at the best offset
+    UINT32                          iRunnerUp;      // Landmarks at the best offset of the other references
+    float                           fConfidence;    // Score over the landmarks of the query
+    double                          fReferenceTime; // Seconds into the reference at the end of the query
+    UINT64                          iFrame;         // End of the query on the capture's timeline (frames since Open), sink only
+};
+
+// ------------------------------------------------------------
+
+class LoopbackFingerprintIndex
+{
+public:
+
+    LoopbackFingerprintIndex();
+
+    // Adds or replaces the landmarks of reference iId. Fails with PARAM if there are none.
+    eCaptureError AddReference(UINT32 iId, const std::vector<sLoopbackLandmark>& Landmarks);
+
+    eCaptureError RemoveReference(UINT32 iId);
+
+    void Clear();
+
+    size_t GetReferenceCount();
+    size_t GetLandmarkCount();
+
+    // Best reference for the query landmarks. Returns false if the best score is below iMinScore or MIN_QUERY_FRACTION of
+    // iCount, or less than MIN_MARGIN times the runner-up; Result then still holds the rejected candidate if any hash was
+    // found. Match can be called from any number of threads. AddReference, RemoveReference and Clear build the new index
+    // outside the lock and only wait for running matches to swap it in.
+    bool Match(const sLoopbackLandmark *pLandmarks, size_t iCount, sLoopbackFingerprintMatch& Result, UINT32 iMinScore = 8);
+
+    // Same, with the caller's buffer for the hash hits. It keeps its capacity, so repeated matches stop allocating once it has
+    // grown to the largest query.
+    bool Match(const sLoopbackLandmark *pLandmarks, size_t iCount, sLoopbackFingerprintMatch& Result, UINT32 iMinScore, std::vector<UINT64>& Candidates);
+
+private:
+
+    struct sEntry
+    {
+        UINT32                      iHash;
+        UINT32                      iId;
+        UINT32                      iTime;
+    };
+
+    std::mutex                      m_WriteLock;    // One writer at a time, readers only wait for the swap under m_Lock
+    std::shared_mutex               m_Lock;
+    std::vector<sEntry>             m_Entries;      // Sorted by hash
+    std::vector<UINT32>             m_References;   // Sorted ids
+};
+
+// ------------------------------------------------------------
+
+class LoopbackFingerprintSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackFingerprintSink();
+    ~LoopbackFingerprintSink();
+
+    // Landmarks of a complete recording (8-32 bit PCM or float, a sample rate of at least 16 kHz).
+    static eCaptureError Extract(const WAVEFORMATEX& Format, const unsigned char *pData, size_t iSize, std::vector<sLoopbackLandmark>& Landmarks);
+
+    // Called on the thread that calls OnData with the landmarks of each frame, in the order of their timestamps.
+    eCaptureError SetLandmarkCallback(void (*pLandmarkFunc)(const sLoopbackLandmark *pLandmarks, size_t iCount, void*), void *pUserData = nullptr);
+
+    // Matches the landmarks of the last fWindow seconds against pIndex every fInterval seconds of audio, on the match thread of
+    // the sink. The index must outlive the sink, references can be added while open.
+    // Default: nullptr, 5, 1, 8
+    eCaptureError SetIndex(LoopbackFingerprintIndex *pIndex, double fWindow = 5.0, double fInterval = 1.0, UINT32 iMinScore = 8);
+
+    // Called on the match thread with every successful match.
+    eCaptureError SetMatchCallback(void (*pMatchFunc)(const sLoopbackFingerprintMatch& Match, void*), void *pUserData = nullptr);
+
+    // Pushes FINGERPRINT_MATCH events into pRing with iSource. The ring must outlive the sink.
+    // Default: nullptr
+    eCaptureError SetEventLog(LoopbackEventRing *pRing, UINT16 iSource = 0);
+
+    // Fails with FORMAT for sample rates below 16 kHz or without a factor that gives at least 8 kHz. Starts the match thread if
+    // an index is set.
+    eCaptureError Open(const WAVEFORMATEX& Format);
+
+    // Emits the landmarks of the anchors that are still waiting for their target zone, runs a pending match and stops the match
+    // thread. OnData must not be called during Close.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // Drops the frames that overlap the gap, no landmark spans it. Timestamps and match positions still count the gap.
+    void OnGap(UINT64 iFrames) override;
+
+    // Result of the last match, false if the last match found nothing (or there was none yet). Safe to call from any thread.
+    bool GetMatch(sLoopbackFingerprintMatch& Match);
+
+    // Landmarks emitted since Open.
+    UINT64 GetLandmarkCount();
+
+private:
+
+    // Receives the decimated stream
+    struct sDecimatedInput : public ILoopbackCaptureSink
+    {
+        void OnData(const unsigned char *pData, size_t iSize) override;
+        void OnGap(UINT64 iFrames) override;
+
+        LoopbackFingerprintSink     *pOwner = nullptr;
+    };
+
+    struct sPeak
+    {
+        UINT32                      iFrame;
+        UINT32                      iCell;
+        float                       fLevel;
+    };
+
+    void AddSamples(const float *pSamples, size_t iCount);
+    void SkipSamples(UINT64 iCount);
+    void ComputeFrame(const float *pSamples);
+    void FindPeaks(UINT32 iFrame);
+    void EmitLandmarks(UINT64 iCompleteFrame);
+    void MatchThread();
+    void ReadLandmarks();
+    void MatchRecent(UINT32 iEndFrame);
+
+    void                            (*m_pLandmarkFunc)(const sLoopbackLandmark*, size_t, void*);
+    void                            *m_pLandmarkFuncUserData;
+    LoopbackFingerprintIndex        *m_pIndex;
+    double                          m_fMatchWindow;
+    double                          m_fMatchInterval;
+    UINT32                          m_iMinScore;
+    void                            (*m_pMatchFunc)(const sLoopbackFingerprintMatch&, void*);
+    void                            *m_pMatchFuncUserData;
+    LoopbackEventRing               *m_pEventRing;
+    UINT16                          m_iEventSource;
+
+    bool                            m_bOpen;
+    UINT32                          m_iDecimation;
+    DWORD                           m_dwAnalysisRate;
+    LoopbackDecimationBank          m_Bank;
+    sDecimatedInput                 m_DecimatedInput;
+
+    // Processing, OnData only
+    size_t                          m_iWindowLength;
+    size_t                          m_iHop;
+    LoopbackFFT                     m_FFT;
+    std::vector<float>              m_Window;
+    float                           m_fPowerScale;  // Full scale sine to 0 dB
+    std::vector<UINT16>             m_BinCells;     // Grid cell of every bin, CELL_COUNT above 4 kHz
+    std::vector<float>              m_Samples;
+    size_t                          m_iSampleCount;
+    std::vector<float>              m_Frame;
+    std::vector<float>              m_Spectrum;
+    std::vector<float>              m_Rows;         // dB per cell, the last 2 * PEAK_FRAMES + 1 frames
+    std::vector<float>              m_MaxRows;      // Maximum over +-PEAK_CELLS of the same frames
+    UINT32                          m_iFrameCount;
+    std::vector<sPeak>              m_Peaks;        // Anchors waiting for their target zone, and their targets
+    std::vector<sLoopbackLandmark>  m_Landmarks;    // Of the current frame
+    UINT32                          m_iNextMatch;   // Frame
+
+    // Written by OnData, read by the match thread. The request is the end frame of the match + 1, 0 if there is none; it is
+    // stored after the landmarks up to that frame were pushed.
+    std::unique_ptr<LoopbackRing<sLoopbackLandmark>>
+                                    m_pLandmarkRing;
+    std::atomic<UINT64>             m_iMatchRequest;
+
+    // Match thread only
+    std::vector<sLoopbackLandmark>  m_Recent;       // Of the match window, and newer ones read ahead
+    std::vector<UINT64>             m_Candidates;
+    UINT32                          m_iLastReported;
+    bool                            m_bReported;
+
+    std::thread                     *m_pMatchThread;
+    std::mutex                      m_ThreadLock;
+    std::condition_variable         m_Wake;
+    bool                            m_bStop;
+
+    std::mutex                      m_MatchLock;
+    sLoopbackFingerprintMatch       m_Match{};
+    bool                            m_bMatchValid;
+    std::atomic<UINT64>             m_iLandmarkCount;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,73 @@
+#pragma once
+
+/*
+
+FLAC frame checksums shared by LoopbackFlacSink (writing) and LoopbackFlacReader (verification).
+
+Crc8 covers the frame header up to the CRC byte (polynomial x^8 + x^2 + x + 1), Crc16 the whole frame up to the
+footer (polynomial x^16 + x^15 + x^2 + 1). Both start at zero and are table driven.
+
+*/
+
+#include <array>
+
+// ------------------------------------------------------------
+
+namespace LoopbackFlacCrc
+{
+    inline unsigned char Crc8(const unsigned char *pData, size_t iSize)
+    {
+        static const auto Table = []
+        {
+            std::array<unsigned char, 256> t{};
+
+            for (unsigned int i = 0; i < 256; ++i)
+            {
+                unsigned int c = i;
+
+                for (int j = 0; j < 8; ++j)
+                    c = (c & 0x80) ? ((c << 1) ^ 0x07) : (c << 1);
+
+                t[i] = (unsigned char)c;
+            }
+
+            return t;
+        }();
+
+        unsigned char crc = 0;
+
+        for (size_t i = 0; i < iSize; ++i)
+            crc = Table[crc ^ pData[i]];
+
+        return crc;
+    }
+
+    inline unsigned short Crc16(const unsigned char *pData, size_t iSize)
+    {
+        static const auto Table = []
+        {
+            std::array<unsigned short, 256> t{};
+
+            for (unsigned int i = 0; i < 256; ++i)
+            {
+                unsigned int c = i << 8;
+
+                for (int j = 0; j < 8; ++j)
+                    c = (c & 0x8000) ? ((c << 1) ^ 0x8005) : (c << 1);
+
+                t[i] = (unsigned short)c;
+            }
+
+            return t;
+        }();
+
+        unsigned short crc = 0;
+
+        for (size_t i = 0; i < iSize; ++i)
+            crc = (unsigned short)((crc << 8) ^ Table[(crc >> 8) ^ pData[i]]);
+
+        return crc;
+    }
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,752 @@
+#include <LoopbackFlacReader.h>
+#include <LoopbackFlacCrc.h>
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_ARM64)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// ------------------------------------------------------------ FLAC bitstream helpers
+
+namespace
+{
+    constexpr UINT64 PLACEHOLDER_SEEKPOINT = ~0ULL;
+
+    unsigned int CountLeadingZeros(UINT64 iValue)
+    {
+        // iValue must not be zero
+
+#if defined(_M_X64) || defined(_M_ARM64)
+        unsigned long iIndex = 0;
+        _BitScanReverse64(&iIndex, iValue);
+        return 63 - (unsigned int)iIndex;
+#elif defined(__GNUC__)
+        return (unsigned int)__builtin_clzll(iValue);
+#else
+        unsigned int iCount = 0;
+
+        for (; (iValue & (1ULL << 63)) == 0; iValue <<= 1)
+            ++iCount;
+
+        return iCount;
+#endif
+    }
+
+    // MSB-first bit reader. Bits are consumed from a 64 bit cache (left aligned, unused bits zero) that is refilled a byte
+    // at a time. Reading past the end sets the error flag and returns zeros.
+
+    class FlacBitReader
+    {
+    public:
+
+        FlacBitReader(const unsigned char *pData, size_t iSize) :
+            m_pData(pData),
+            m_iSize(iSize),
+            m_iByte(0),
+            m_iCache(0),
+            m_iCacheBits(0),
+            m_bError(false)
+        {
+
+        }
+
+        UINT64 Read(unsigned int iBits)
+        {
+            if (iBits == 0)
+                return 0;
+
+            if (iBits > 56)
+            {
+                UINT64 iHigh = Read(iBits - 32);
+                return (iHigh << 32) | Read(32);
+            }
+
+            if (m_iCacheBits < iBits)
+            {
+                Refill();
+
+                if (m_iCacheBits < iBits)
+                {
+                    m_bError = true;
+                    return 0;
+                }
+            }
+
+            UINT64 iValue = m_iCache >> (64 - iBits);
+
+            m_iCache <<= iBits;
+            m_iCacheBits -= iBits;
+
+            return iValue;
+        }
+
+        INT64 ReadSigned(unsigned int iBits)
+        {
+            if (iBits == 0)
+                return 0;
+
+            UINT64 iValue = Read(iBits);
+
+            return (INT64)(iValue << (64 - iBits)) >> (64 - iBits);
+        }
+
+        UINT64 ReadUnary()
+        {
+            // Zeros up to the next one bit, counted a cache at a time
+
+            UINT64 iCount = 0;
+
+            for (;;)
+            {
+                if (m_iCache == 0)
+                {
+                    iCount += m_iCacheBits;
+                    m_iCacheBits = 0;
+
+                    Refill();
+
+                    if (m_iCacheBits == 0)
+                    {
+                        m_bError = true;
+                        return iCount;
+                    }
+
+                    continue;
+                }
+
+                unsigned int iZeros = CountLeadingZeros(m_iCache);
+
+                m_iCache = (m_iCache << iZeros) << 1;
+                m_iCacheBits -= iZeros + 1;
+
+                return iCount + iZeros;
+            }
+        }
+
+        INT64 ReadRice(unsigned int iParam)
+        {
+            UINT64 iFolded = (ReadUnary() << iParam) | Read(iParam);
+
+            return (INT64)(iFolded >> 1) ^ -(INT64)(iFolded & 1);
+        }
+
+        bool ReadUtf8(UINT64& iValue)
+        {
+            UINT64 iLead = Read(8);
+            unsigned int iContinuation = 0;
+
+            while (iContinuation < 7 && (iLead & (0x80 >> iContinuation)))
+                ++iContinuation;
+
+            if (iContinuation == 1 || iContinuation == 8)
+                return false;
+
+            if (iContinuation == 0)
+            {
+                iValue = iLead;
+                return true;
+            }
+
+            iValue = iLead & (0x7F >> iContinuation);
+
+            for (unsigned int i = 1; i < iContinuation; ++i)
+            {
+                UINT64 iByte = Read(8);
+
+                if ((iByte & 0xC0) != 0x80)
+                    return false;
+
+                iValue = (iValue << 6) | (iByte & 0x3F);
+            }
+
+            return true;
+        }
+
+        void AlignToByte()
+        {
+            unsigned int iPadding = m_iCacheBits & 7;
+
+            m_iCache <<= iPadding;
+            m_iCacheBits -= iPadding;
+        }
+
+        // Bytes consumed so far (rounded down)
+        size_t GetBytePosition() const
+        {
+            return m_iByte - (m_iCacheBits + 7) / 8;
+        }
+
+        bool HasError() const
+        {
+            return m_bError;
+        }
+
+    private:
+
+        void Refill()
+        {
+            while (m_iCacheBits <= 56 && m_iByte < m_iSize)
+            {
+                m_iCache |= (UINT64)m_pData[m_iByte++] << (56 - m_iCacheBits);
+                m_iCacheBits += 8;
+            }
+        }
+
+        const unsigned char *m_pData;
+        size_t m_iSize;
+        size_t m_iByte;         // Next byte to load into the cache
+        UINT64 m_iCache;
+        unsigned int m_iCacheBits;
+        bool m_bError;
+    };
+
+    bool DecodeResidual(FlacBitReader& Reader, INT64 *pResidual, unsigned int iBlockSize, unsigned int iOrder)
+    {
+        unsigned int iMethod = (unsigned int)Reader.Read(2);
+
+        if (iMethod > 1)
+            return false;
+
+        unsigned int iParamBits = iMethod == 0 ? 4 : 5;
+        unsigned int iEscape = (1U << iParamBits) - 1;
+        unsigned int iPartitionOrder = (unsigned int)Reader.Read(4);
+        unsigned int iPartitionSize = iBlockSize >> iPartitionOrder;
+
+        if ((iPartitionSize << iPartitionOrder) != iBlockSize || iPartitionSize < iOrder)
+            return false;
+
+        for (unsigned int p = 0, i = 0; p < (1U << iPartitionOrder); ++p)
+        {
+            unsigned int iParam = (unsigned int)Reader.Read(iParamBits);
+            unsigned int iEnd = (p + 1) * iPartitionSize - iOrder;
+
+            if (iParam == iEscape)
+            {
+                unsigned int iRawBits = (unsigned int)Reader.Read(5);
+
+                for (; i < iEnd; ++i)
+                    pResidual[i] = Reader.ReadSigned(iRawBits);
+            }
+            else
+            {
+                for (; i < iEnd; ++i)
+                    pResidual[i] = Reader.ReadRice(iParam);
+            }
+
+            if (Reader.HasError())
+                return false;
+        }
+
+        return true;
+    }
+
+    bool DecodeSubframe(FlacBitReader& Reader, INT64 *pSamples, unsigned int iBlockSize, unsigned int iBitsPerSample)
+    {
+        if (Reader.Read(1) != 0)
+            return false;
+
+        unsigned int iType = (unsigned int)Reader.Read(6);
+        unsigned int iWastedBits = 0;
+
+        if (Reader.Read(1))
+            iWastedBits = (unsigned int)Reader.ReadUnary() + 1;
+
+        if (iWastedBits >= iBitsPerSample)
+            return false;
+
+        iBitsPerSample -= iWastedBits;
+
+        if (iType == 0) // CONSTANT
+        {
+            fill(pSamples, pSamples + iBlockSize, Reader.ReadSigned(iBitsPerSample));
+        }
+        else if (iType == 1) // VERBATIM
+        {
+            for (unsigned int i = 0; i < iBlockSize; ++i)
+                pSamples[i] = Reader.ReadSigned(iBitsPerSample);
+        }
+        else if (iType >= 8 && iType <= 12) // FIXED
+        {
+            unsigned int iOrder = iType - 8;
+
+            if (iOrder > iBlockSize)
+                return false;
+
+            for (unsigned int i = 0; i < iOrder; ++i)
+                pSamples[i] = Reader.ReadSigned(iBitsPerSample);
+
+            if (!DecodeResidual(Reader, pSamples + iOrder, iBlockSize, iOrder))
+                return false;
+
+            // Residuals were decoded in place, turn them into samples
+            for (unsigned int i = iOrder; i < iBlockSize; ++i)
+            {
+                switch (iOrder)
+                {
+                case 1: pSamples[i] += pSamples[i - 1]; break;
+                case 2: pSamples[i] += 2 * pSamples[i - 1] - pSamples[i - 2]; break;
+                case 3: pSamples[i] += 3 * pSamples[i - 1] - 3 * pSamples[i - 2] + pSamples[i - 3]; break;
+                case 4: pSamples[i] += 4 * pSamples[i - 1] - 6 * pSamples[i - 2] + 4 * pSamples[i - 3] - pSamples[i - 4]; break;
+                }
+            }
+        }
+        else if (iType >= 32) // LPC
+        {
+            unsigned int iOrder = (iType & 31) + 1;
+
+            if (iOrder > iBlockSize)
+                return false;
+
+            for (unsigned int i = 0; i < iOrder; ++i)
+                pSamples[i] = Reader.ReadSigned(iBitsPerSample);
+
+            unsigned int iPrecision = (unsigned int)Reader.Read(4) + 1;
+            INT64 iShift = Reader.ReadSigned(5);
+
+            if (iPrecision == 16 || iShift < 0)
+                return false;
+
+            INT64 Coefs[32]{};
+
+            for (unsigned int i = 0; i < iOrder; ++i)
+                Coefs[i] = Reader.ReadSigned(iPrecision);
+
+            if (!DecodeResidual(Reader, pSamples + iOrder, iBlockSize, iOrder))
+                return false;
+
+            for (unsigned int i = iOrder; i < iBlockSize; ++i)
+            {
+                INT64 iPrediction = 0;
+
+                for (unsigned int j = 0; j < iOrder; ++j)
+                    iPrediction += Coefs[j] * pSamples[i - 1 - j];
+
+                pSamples[i] += iPrediction >> iShift;
+            }
+        }
+        else
+        {
+            return false;
+        }
+
+        if (iWastedBits != 0)
+        {
+            for (unsigned int i = 0; i < iBlockSize; ++i)
+                pSamples[i] <<= iWastedBits;
+        }
+
+        return !Reader.HasError();
+    }
+}
+
+// ------------------------------------------------------------ LoopbackFlacReader
+
+// public
+
+LoopbackFlacReader::LoopbackFlacReader() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_iFileSize(0),
+    m_iFirstFrameOffset(0),
+
+    m_iBitsPerSample(0),
+    m_iBlockSize(0),
+    m_iMaxFrameSize(0),
+    m_iTotalSamples(0),
+
+    m_iWindowOffset(0),
+    m_iLastDecodedBlocks(0)
+{
+
+}
+
+LoopbackFlacReader::~LoopbackFlacReader()
+{
+    Close();
+}
+
+eCaptureError LoopbackFlacReader::Open(const std::wstring& FileName)
+{
+    Close();
+
+    m_hFile = CreateFileW(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::FILE;
+
+    LARGE_INTEGER FileSize{};
+
+    if (!GetFileSizeEx(m_hFile, &FileSize))
+    {
+        Close();
+        return eCaptureError::FILE;
+    }
+
+    m_iFileSize = (UINT64)FileSize.QuadPart;
+
+    // Metadata blocks
+
+    UINT64 iOffset = 4;
+    bool bStreamInfo = false;
+    bool bLast = false;
+
+    if (!LoadWindow(0) || m_Window.size() < 4 || m_Window[0] != 'f' || m_Window[1] != 'L' || m_Window[2] != 'a' || m_Window[3] != 'C')
+    {
+        Close();
+        return eCaptureError::FORMAT;
+    }
+
+    while (!bLast)
+    {
+        if (!LoadWindow(iOffset) || m_iWindowOffset + m_Window.size() < iOffset + 4)
+        {
+            Close();
+            return eCaptureError::FORMAT;
+        }
+
+        size_t iStart = (size_t)(iOffset - m_iWindowOffset);
+        FlacBitReader Reader(m_Window.data() + iStart, m_Window.size() - iStart);
+
+        bLast = Reader.Read(1) != 0;
+        unsigned int iType = (unsigned int)Reader.Read(7);
+        UINT32 iLength = (UINT32)Reader.Read(24);
+
+        if (iOffset + 4 + iLength > m_iFileSize)
+        {
+            Close();
+            return eCaptureError::FORMAT;
+        }
+
+        if (iType == 0) // STREAMINFO
+        {
+            unsigned int iMinBlockSize = (unsigned int)Reader.Read(16);
+            m_iBlockSize = (unsigned int)Reader.Read(16);
+            Reader.Read(24);
+            m_iMaxFrameSize = (UINT32)Reader.Read(24);
+
+            m_Format.nSamplesPerSec = (DWORD)Reader.Read(20);
+            m_Format.nChannels = (WORD)(Reader.Read(3) + 1);
+            m_iBitsPerSample = (unsigned int)Reader.Read(5) + 1;
+            m_iTotalSamples = Reader.Read(36);
+
+            if (iMinBlockSize != m_iBlockSize || m_iBlockSize < 16)
+            {
+                Close();
+                return eCaptureError::FORMAT;
+            }
+
+            bStreamInfo = true;
+        }
+        else if (iType == 3) // SEEKTABLE
+        {
+            // The table can be larger than the window, read it directly
+
+            vector<unsigned char> Table(iLength);
+            DWORD dwBytesRead = 0;
+            LARGE_INTEGER Position{};
+            Position.QuadPart = (LONGLONG)(iOffset + 4);
+
+            if (!SetFilePointerEx(m_hFile, Position, NULL, FILE_BEGIN) || !ReadFile(m_hFile, Table.data(), iLength, &dwBytesRead, NULL) || dwBytesRead != iLength)
+            {
+                Close();
+                return eCaptureError::FILE;
+            }
+
+            FlacBitReader TableReader(Table.data(), Table.size());
+
+            for (UINT32 i = 0; i < iLength / 18; ++i)
+            {
+                sLoopbackFlacSeekPoint Point;
+                Point.iSample = TableReader.Read(64);
+                Point.iOffset = TableReader.Read(64);
+                Point.iFrameSamples = (UINT32)TableReader.Read(16);
+
+                if (Point.iSample != PLACEHOLDER_SEEKPOINT)
+                    m_SeekTable.push_back(Point);
+            }
+        }
+
+        iOffset += 4 + iLength;
+    }
+
+    if (!bStreamInfo)
+    {
+        Close();
+        return eCaptureError::FORMAT;
+    }
+
+    m_iFirstFrameOffset = iOffset;
+
+    m_Format.wFormatTag = WAVE_FORMAT_PCM;
+    m_Format.wBitsPerSample = (WORD)((m_iBitsPerSample + 7) / 8 * 8);
+    m_Format.nBlockAlign = m_Format.wBitsPerSample / 8 * m_Format.nChannels;
+    m_Format.nAvgBytesPerSec = m_Format.nSamplesPerSec * m_Format.nBlockAlign;
+    m_Format.cbSize = 0;
+
+    m_Channels.assign(m_Format.nChannels, vector<INT64>(m_iBlockSize));
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackFlacReader::Close()
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    m_Format = {};
+    m_SeekTable.clear();
+    m_Window.clear();
+    m_Channels.clear();
+
+    m_iFileSize = 0;
+    m_iFirstFrameOffset = 0;
+    m_iTotalSamples = 0;
+    m_iWindowOffset = 0;
+}
+
+bool LoopbackFlacReader::CopyFormat(WAVEFORMATEX& Format)
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    Format = m_Format;
+
+    return true;
+}
+
+UINT64 LoopbackFlacReader::GetFrameCount()
+{
+    return m_iTotalSamples;
+}
+
+const std::vector<sLoopbackFlacSeekPoint>& LoopbackFlacReader::GetSeekTable()
+{
+    return m_SeekTable;
+}
+
+eCaptureError LoopbackFlacReader::ReadFrames(UINT64 iStartFrame, UINT64 iFrameCount, unsigned char *pBuffer, UINT64& iFramesRead)
+{
+    iFramesRead = 0;
+    m_iLastDecodedBlocks = 0;
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::STATE;
+
+    if (pBuffer == nullptr)
+        return eCaptureError::PARAM;
+
+    if (m_iTotalSamples != 0)
+        iFrameCount = iStartFrame < m_iTotalSamples ? min(iFrameCount, m_iTotalSamples - iStartFrame) : 0;
+
+    UINT64 iEndFrame = iStartFrame + iFrameCount;
+
+    // Closest seek point at or before the start
+
+    UINT64 iOffset = m_iFirstFrameOffset;
+
+    auto it = upper_bound(m_SeekTable.begin(), m_SeekTable.end(), iStartFrame, [](UINT64 iFrame, const sLoopbackFlacSeekPoint& Point)
+    {
+        return iFrame < Point.iSample;
+    });
+
+    if (it != m_SeekTable.begin())
+        iOffset += prev(it)->iOffset;
+
+    unsigned int iBytesPerSample = m_Format.wBitsPerSample / 8;
+    unsigned int iShift = m_Format.wBitsPerSample - m_iBitsPerSample;
+
+    while (iFramesRead < iFrameCount && iOffset < m_iFileSize)
+    {
+        UINT64 iBlockFirstSample = 0;
+        UINT32 iBlockSamples = 0;
+
+        if (!DecodeBlock(iOffset, iBlockFirstSample, iBlockSamples))
+            return eCaptureError::FORMAT;
+
+        ++m_iLastDecodedBlocks;
+
+        UINT64 iCopyStart = max(iStartFrame, iBlockFirstSample);
+        UINT64 iCopyEnd = min(iEndFrame, iBlockFirstSample + iBlockSamples);
+
+        for (UINT64 iFrame = iCopyStart; iFrame < iCopyEnd; ++iFrame)
+        {
+            unsigned char *pFrame = pBuffer + (iFrame - iStartFrame) * m_Format.nBlockAlign;
+
+            for (WORD c = 0; c < m_Format.nChannels; ++c)
+            {
+                INT64 iSample = m_Channels[c][iFrame - iBlockFirstSample] << iShift;
+
+                if (iBytesPerSample == 1)
+                    iSample += 128;
+
+                for (unsigned int b = 0; b < iBytesPerSample; ++b)
+                    *pFrame++ = (unsigned char)(iSample >> (8 * b));
+            }
+        }
+
+        if (iCopyEnd > iCopyStart)
+            iFramesRead = iCopyEnd - iStartFrame;
+
+        if (iBlockFirstSample + iBlockSamples >= iEndFrame)
+            break;
+    }
+
+    return eCaptureError::NONE;
+}
+
+UINT64 LoopbackFlacReader::GetLastDecodedBlockCount()
+{
+    return m_iLastDecodedBlocks;
+}
+
+// private
+
+bool LoopbackFlacReader::LoadWindow(UINT64 iOffset)
+{
+    // Large enough for any frame of this stream (verbatim subframes are the worst case)
+
+    size_t iWindowSize = max((size_t)m_iMaxFrameSize, (size_t)m_iBlockSize * m_Format.nChannels * 5 + 1024);
+    iWindowSize = max(iWindowSize, (size_t)1 << 16);
+
+    if (iOffset >= m_iWindowOffset && iOffset - m_iWindowOffset + iWindowSize <= m_Window.size())
+        return true;
+
+    if (iOffset - m_iWindowOffset < m_Window.size() && m_iWindowOffset + m_Window.size() == m_iFileSize)
+        return true; // Tail of the file is already loaded
+
+    // Read twice the required size so consecutive blocks rarely need a new read
+
+    m_Window.resize((size_t)min((UINT64)iWindowSize * 2, m_iFileSize - min(iOffset, m_iFileSize)));
+    m_iWindowOffset = iOffset;
+
+    if (m_Window.empty())
+        return true;
+
+    LARGE_INTEGER Position{};
+    Position.QuadPart = (LONGLONG)iOffset;
+    DWORD dwBytesRead = 0;
+
+    return SetFilePointerEx(m_hFile, Position, NULL, FILE_BEGIN) &&
+        ReadFile(m_hFile, m_Window.data(), (DWORD)m_Window.size(), &dwBytesRead, NULL) &&
+        dwBytesRead == m_Window.size();
+}
+
+bool LoopbackFlacReader::DecodeBlock(UINT64& iOffset, UINT64& iFirstSample, UINT32& iSampleCount)
+{
+    if (!LoadWindow(iOffset))
+        return false;
+
+    size_t iStart = (size_t)(iOffset - m_iWindowOffset);
+    FlacBitReader Reader(m_Window.data() + iStart, m_Window.size() - iStart);
+
+    // Frame header
+
+    if (Reader.Read(14) != 0x3FFE || Reader.Read(1) != 0)
+        return false;
+
+    bool bVariableBlockSize = Reader.Read(1) != 0;
+    unsigned int iBlockSizeCode = (unsigned int)Reader.Read(4);
+    unsigned int iSampleRateCode = (unsigned int)Reader.Read(4);
+    unsigned int iChannelAssignment = (unsigned int)Reader.Read(4);
+    unsigned int iSampleSizeCode = (unsigned int)Reader.Read(3);
+    Reader.Read(1);
+
+    UINT64 iNumber = 0;
+
+    if (!Reader.ReadUtf8(iNumber))
+        return false;
+
+    if (iBlockSizeCode == 0)
+        return false;
+    else if (iBlockSizeCode == 1)
+        iSampleCount = 192;
+    else if (iBlockSizeCode <= 5)
+        iSampleCount = 576U << (iBlockSizeCode - 2);
+    else if (iBlockSizeCode == 6)
+        iSampleCount = (UINT32)Reader.Read(8) + 1;
+    else if (iBlockSizeCode == 7)
+        iSampleCount = (UINT32)Reader.Read(16) + 1;
+    else
+        iSampleCount = 256U << (iBlockSizeCode - 8);
+
+    if (iSampleRateCode == 12)
+        Reader.Read(8);
+    else if (iSampleRateCode == 13 || iSampleRateCode == 14)
+        Reader.Read(16);
+
+    // The header is whole bytes, the CRC-8 covers all of them
+
+    size_t iHeaderSize = Reader.GetBytePosition();
+
+    if (Reader.Read(8) != LoopbackFlacCrc::Crc8(m_Window.data() + iStart, iHeaderSize))
+        return false;
+
+    static const unsigned int SampleSizes[8]{ 0, 8, 12, 0, 16, 20, 24, 32 };
+    unsigned int iBitsPerSample = iSampleSizeCode == 0 ? m_iBitsPerSample : SampleSizes[iSampleSizeCode];
+
+    unsigned int iChannels = iChannelAssignment < 8 ? iChannelAssignment + 1 : 2;
+
+    if (iBitsPerSample == 0 || iChannelAssignment > 10 || iChannels != m_Format.nChannels || iSampleCount > m_iBlockSize)
+        return false;
+
+    iFirstSample = bVariableBlockSize ? iNumber : iNumber * m_iBlockSize;
+
+    // Subframes (the side channel has one extra bit)
+
+    for (unsigned int c = 0; c < iChannels; ++c)
+    {
+        unsigned int iSubframeBits = iBitsPerSample;
+
+        if ((iChannelAssignment == 8 && c == 1) || (iChannelAssignment == 9 && c == 0) || (iChannelAssignment == 10 && c == 1))
+            ++iSubframeBits;
+
+        if (!DecodeSubframe(Reader, m_Channels[c].data(), iSampleCount, iSubframeBits))
+            return false;
+    }
+
+    // Stereo decorrelation
+
+    INT64 *pLeft = m_Channels[0].data();
+    INT64 *pRight = iChannels > 1 ? m_Channels[1].data() : nullptr;
+
+    for (UINT32 i = 0; i < iSampleCount && iChannelAssignment >= 8; ++i)
+    {
+        switch (iChannelAssignment)
+        {
+        case 8: // left/side
+            pRight[i] = pLeft[i] - pRight[i];
+            break;
+        case 9: // side/right
+            pLeft[i] = pLeft[i] + pRight[i];
+            break;
+        case 10: // mid/side
+        {
+            INT64 iMid = (pLeft[i] << 1) | (pRight[i] & 1);
+            INT64 iSide = pRight[i];
+            pLeft[i] = (iMid + iSide) >> 1;
+            pRight[i] = (iMid - iSide) >> 1;
+            break;
+        }
+        }
+    }
+
+    // Footer
+
+    Reader.AlignToByte();
+
+    size_t iFrameSize = Reader.GetBytePosition();
+
+    if (Reader.Read(16) != LoopbackFlacCrc::Crc16(m_Window.data() + iStart, iFrameSize) || Reader.HasError())
+        return false;
+
+    iOffset += Reader.GetBytePosition();
+
+    return true;
+}
+
+// ------------------------------------------------------------ EOF
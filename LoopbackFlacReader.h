@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+
+Random access reader for FLAC recordings (written by LoopbackFlacSink or any other encoder using a fixed block size).
+
+ReadFrames looks up the closest seek point at or before the requested position in the SEEKTABLE and only decodes the
+frames from there to the end of the requested range. With the sink's default 10 second seek interval, extracting a clip
+decodes at most 10 seconds of audio more than the clip itself, independent of the file length.
+Files without a SEEKTABLE are decoded from the first frame.
+
+Decoded audio is returned as interleaved little endian PCM in the smallest whole-byte container for the stream's bit depth
+(8 bit unsigned as in WAV). Every decoded frame is checked against its header CRC-8 and frame CRC-16, the MD5 signature
+is not verified.
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <string>
+#include <vector>
+
+// ------------------------------------------------------------
+
+struct sLoopbackFlacSeekPoint
+{
+    UINT64                          iSample;
+    UINT64                          iOffset;        // Relative to the first frame
+    UINT32                          iFrameSamples;
+};
+
+// ------------------------------------------------------------
+
+class LoopbackFlacReader
+{
+public:
+
+    LoopbackFlacReader();
+    ~LoopbackFlacReader();
+
+    // Parses STREAMINFO and SEEKTABLE. Fails with FORMAT if the stream uses a variable block size.
+    eCaptureError Open(const std::wstring& FileName);
+    void Close();
+
+    // Format of the data returned by ReadFrames.
+    bool CopyFormat(WAVEFORMATEX& Format);
+
+    // Total number of frames (samples per channel), 0 if unknown.
+    UINT64 GetFrameCount();
+
+    const std::vector<sLoopbackFlacSeekPoint>& GetSeekTable();
+
+    // Decodes iFrameCount frames starting at iStartFrame into pBuffer (iFrameCount * nBlockAlign bytes).
+    // iFramesRead is less than iFrameCount if the range extends past the end of the stream.
+    // Fails with FORMAT if a frame can not be decoded or its CRC does not match.
+    eCaptureError ReadFrames(UINT64 iStartFrame, UINT64 iFrameCount, unsigned char *pBuffer, UINT64& iFramesRead);
+
+    // Number of FLAC frames (blocks) the last ReadFrames call had to decode.
+    UINT64 GetLastDecodedBlockCount();
+
+private:
+
+    bool LoadWindow(UINT64 iOffset);
+    bool DecodeBlock(UINT64& iOffset, UINT64& iFirstSample, UINT32& iSampleCount);
+
+    HANDLE                          m_hFile;
+    UINT64                          m_iFileSize;
+    UINT64                          m_iFirstFrameOffset;
+
+    WAVEFORMATEX                    m_Format{};
+    unsigned int                    m_iBitsPerSample;   // Stream bit depth, may be smaller than the container
+    unsigned int                    m_iBlockSize;
+    UINT32                          m_iMaxFrameSize;
+    UINT64                          m_iTotalSamples;
+
+    std::vector<sLoopbackFlacSeekPoint>
+                                    m_SeekTable;
+
+    std::vector<unsigned char>      m_Window;           // File data starting at m_iWindowOffset
+    UINT64                          m_iWindowOffset;
+    std::vector<std::vector<INT64>> m_Channels;         // Decoded samples of the current block
+    UINT64                          m_iLastDecodedBlocks;
+};
+
+// ------------------------------------------------------------ EOF
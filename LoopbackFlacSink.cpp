@@ -0,0 +1,1044 @@
+#include <LoopbackFlacSink.h>
+#include <LoopbackAudioLevel.h>
+#include <LoopbackFlacCrc.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// ------------------------------------------------------------ FLAC bitstream helpers
+
+namespace
+{
+    constexpr unsigned int MAX_PARTITION_ORDER = 8;
+    constexpr unsigned int MAX_FIXED_ORDER = 4;
+    constexpr unsigned int STREAMINFO_SIZE = 34;
+    constexpr unsigned int SEEKPOINT_SIZE = 18;
+    constexpr UINT64 PLACEHOLDER_SEEKPOINT = ~0ULL;
+    constexpr size_t NO_SLOT = ~(size_t)0;
+
+    // MSB-first bit writer as required by the FLAC bitstream.
+
+    class FlacBitWriter
+    {
+    public:
+
+        FlacBitWriter(vector<unsigned char>& Out) :
+            m_Out(Out),
+            m_iAccum(0),
+            m_iBits(0)
+        {
+
+        }
+
+        // iBits must be 32 or less
+        void Write(UINT64 iValue, unsigned int iBits)
+        {
+            if (iBits == 0)
+                return;
+
+            m_iAccum = (m_iAccum << iBits) | (iValue & ((1ULL << iBits) - 1));
+            m_iBits += iBits;
+
+            while (m_iBits >= 8)
+            {
+                m_iBits -= 8;
+                m_Out.push_back((unsigned char)(m_iAccum >> m_iBits));
+            }
+        }
+
+        void WriteSigned(INT64 iValue, unsigned int iBits)
+        {
+            Write((UINT64)iValue, iBits);
+        }
+
+        void WriteUnary(UINT64 iCount)
+        {
+            while (iCount >= 32)
+            {
+                Write(0, 32);
+                iCount -= 32;
+            }
+
+            Write(1, (unsigned int)iCount + 1);
+        }
+
+        void WriteRice(INT64 iValue, unsigned int iParam)
+        {
+            UINT64 iFolded = ((UINT64)iValue << 1) ^ (UINT64)(iValue >> 63);
+
+            WriteUnary(iFolded >> iParam);
+            Write(iFolded, iParam);
+        }
+
+        // FLAC's UTF-8-like coding of the frame number (up to 36 bits)
+        void WriteUtf8(UINT64 iValue)
+        {
+            if (iValue < 0x80)
+            {
+                Write(iValue, 8);
+                return;
+            }
+
+            unsigned int iContinuation =
+                iValue < 0x800 ? 1 :
+                iValue < 0x10000 ? 2 :
+                iValue < 0x200000 ? 3 :
+                iValue < 0x4000000 ? 4 :
+                iValue < 0x80000000 ? 5 : 6;
+
+            // Leading byte: iContinuation + 1 one bits, a zero bit, then the top payload bits
+            unsigned int iLeadPayloadBits = iContinuation == 6 ? 0 : 6 - iContinuation;
+            UINT64 iLead = (0xFF00ULL >> (iContinuation + 1)) & 0xFF;
+
+            Write(iLead | ((iValue >> (iContinuation * 6)) & ((1ULL << iLeadPayloadBits) - 1)), 8);
+
+            for (unsigned int i = iContinuation; i > 0; --i)
+                Write(0x80 | ((iValue >> ((i - 1) * 6)) & 0x3F), 8);
+        }
+
+        void AlignToByte()
+        {
+            if (m_iBits != 0)
+                Write(0, 8 - m_iBits);
+        }
+
+        struct sPosition
+        {
+            size_t iSize;
+            UINT64 iAccum;
+            unsigned int iBits;
+        };
+
+        sPosition GetPosition() const
+        {
+            return { m_Out.size(), m_iAccum, m_iBits };
+        }
+
+        UINT64 GetBitsSince(const sPosition& Position) const
+        {
+            return (UINT64)(m_Out.size() - Position.iSize) * 8 + m_iBits - Position.iBits;
+        }
+
+        void Rewind(const sPosition& Position)
+        {
+            m_Out.resize(Position.iSize);
+            m_iAccum = Position.iAccum;
+            m_iBits = Position.iBits;
+        }
+
+    private:
+
+        vector<unsigned char>& m_Out;
+        UINT64 m_iAccum;
+        unsigned int m_iBits;
+    };
+
+    INT64 ReadSample(const unsigned char *p, unsigned int iBytesPerSample)
+    {
+        switch (iBytesPerSample)
+        {
+        case 1: return (INT64)p[0] - 128; // 8 bit WAV is unsigned
+        case 2: return (INT64)(INT16)(p[0] | (p[1] << 8));
+        case 3: return (INT64)((INT32)((UINT32)p[0] << 8 | (UINT32)p[1] << 16 | (UINT32)p[2] << 24) >> 8);
+        case 4: return (INT64)(INT32)((UINT32)p[0] | (UINT32)p[1] << 8 | (UINT32)p[2] << 16 | (UINT32)p[3] << 24);
+        }
+
+        return 0;
+    }
+
+    // Estimated cost of a Rice coded partition with iCount residuals whose folded values sum up to iSum.
+    unsigned int EstimateRiceParam(UINT64 iSum, UINT64 iCount)
+    {
+        unsigned int iParam = 0;
+
+        while (iParam < 30 && (iCount << (iParam + 1)) <= iSum)
+            ++iParam;
+
+        return iParam;
+    }
+
+    UINT64 EstimateRiceBits(UINT64 iSum, UINT64 iCount, unsigned int iParam)
+    {
+        return iCount * (iParam + 1) + (iSum >> iParam);
+    }
+
+    // Chooses the partition order and Rice parameters for the given residual and writes it.
+    void WriteResidual(FlacBitWriter& Writer, const INT64 *pResidual, unsigned int iBlockSize, unsigned int iOrder)
+    {
+        unsigned int iMaxPartitionOrder = 0;
+
+        while (iMaxPartitionOrder < MAX_PARTITION_ORDER &&
+            (iBlockSize % (1U << (iMaxPartitionOrder + 1))) == 0 &&
+            (iBlockSize >> (iMaxPartitionOrder + 1)) > iOrder)
+        {
+            ++iMaxPartitionOrder;
+        }
+
+        // Folded sums at the highest partition order, merged pairwise for lower orders
+
+        UINT64 Sums[1U << MAX_PARTITION_ORDER]{};
+        unsigned int iPartitions = 1U << iMaxPartitionOrder;
+        unsigned int iPartitionSize = iBlockSize >> iMaxPartitionOrder;
+
+        for (unsigned int p = 0, i = 0; p < iPartitions; ++p)
+        {
+            unsigned int iEnd = (p + 1) * iPartitionSize - iOrder;
+
+            for (; i < iEnd; ++i)
+                Sums[p] += ((UINT64)pResidual[i] << 1) ^ (UINT64)(pResidual[i] >> 63);
+        }
+
+        unsigned int iBestOrder = iMaxPartitionOrder;
+        UINT64 iBestBits = ~0ULL;
+        UINT64 BestSums[1U << MAX_PARTITION_ORDER]{};
+
+        for (int iPartitionOrder = (int)iMaxPartitionOrder; iPartitionOrder >= 0; --iPartitionOrder)
+        {
+            if (iPartitionOrder != (int)iMaxPartitionOrder)
+            {
+                for (unsigned int p = 0; p < (1U << iPartitionOrder); ++p)
+                    Sums[p] = Sums[p * 2] + Sums[p * 2 + 1];
+            }
+
+            UINT64 iBits = 0;
+            unsigned int iSize = iBlockSize >> iPartitionOrder;
+
+            for (unsigned int p = 0; p < (1U << iPartitionOrder); ++p)
+            {
+                UINT64 iCount = p == 0 ? iSize - iOrder : iSize;
+                iBits += 5 + EstimateRiceBits(Sums[p], iCount, EstimateRiceParam(Sums[p], iCount));
+            }
+
+            if (iBits < iBestBits)
+            {
+                iBestBits = iBits;
+                iBestOrder = (unsigned int)iPartitionOrder;
+                copy(Sums, Sums + (1U << iPartitionOrder), BestSums);
+            }
+        }
+
+        unsigned int Params[1U << MAX_PARTITION_ORDER]{};
+        unsigned int iSize = iBlockSize >> iBestOrder;
+        unsigned int iMaxParam = 0;
+
+        for (unsigned int p = 0; p < (1U << iBestOrder); ++p)
+        {
+            Params[p] = EstimateRiceParam(BestSums[p], p == 0 ? iSize - iOrder : iSize);
+            iMaxParam = max(iMaxParam, Params[p]);
+        }
+
+        // RICE (4 bit parameters, 15 is the escape code) or RICE2 (5 bit parameters)
+        bool bRice2 = iMaxParam >= 15;
+
+        Writer.Write(bRice2 ? 1 : 0, 2);
+        Writer.Write(iBestOrder, 4);
+
+        for (unsigned int p = 0, i = 0; p < (1U << iBestOrder); ++p)
+        {
+            Writer.Write(Params[p], bRice2 ? 5 : 4);
+
+            unsigned int iEnd = (p + 1) * iSize - iOrder;
+
+            for (; i < iEnd; ++i)
+                Writer.WriteRice(pResidual[i], Params[p]);
+        }
+    }
+
+    void WriteSubframe(FlacBitWriter& Writer, const INT64 *pSamples, unsigned int iBlockSize, unsigned int iBitsPerSample, vector<INT64>& Residual)
+    {
+        // CONSTANT
+
+        if (all_of(pSamples + 1, pSamples + iBlockSize, [&](INT64 s) { return s == pSamples[0]; }))
+        {
+            Writer.Write(0, 1);
+            Writer.Write(0, 6);
+            Writer.Write(0, 1);
+            Writer.WriteSigned(pSamples[0], iBitsPerSample);
+            return;
+        }
+
+        // FIXED: pick the predictor order with the smallest absolute residual sum
+
+        unsigned int iMaxOrder = min(MAX_FIXED_ORDER, iBlockSize - 1);
+        UINT64 OrderSums[MAX_FIXED_ORDER + 1]{};
+
+        for (unsigned int i = MAX_FIXED_ORDER; i < iBlockSize; ++i)
+        {
+            INT64 e0 = pSamples[i];
+            INT64 e1 = e0 - pSamples[i - 1];
+            INT64 e2 = e1 - (pSamples[i - 1] - pSamples[i - 2]);
+            INT64 e3 = e2 - (pSamples[i - 1] - 2 * pSamples[i - 2] + pSamples[i - 3]);
+            INT64 e4 = e3 - (pSamples[i - 1] - 3 * pSamples[i - 2] + 3 * pSamples[i - 3] - pSamples[i - 4]);
+
+            OrderSums[0] += (UINT64)(e0 < 0 ? -e0 : e0);
+            OrderSums[1] += (UINT64)(e1 < 0 ? -e1 : e1);
+            OrderSums[2] += (UINT64)(e2 < 0 ? -e2 : e2);
+            OrderSums[3] += (UINT64)(e3 < 0 ? -e3 : e3);
+            OrderSums[4] += (UINT64)(e4 < 0 ? -e4 : e4);
+        }
+
+        unsigned int iOrder = 0;
+
+        for (unsigned int o = 1; o <= iMaxOrder; ++o)
+        {
+            if (OrderSums[o] < OrderSums[iOrder])
+                iOrder = o;
+        }
+
+        Residual.resize(iBlockSize);
+
+        bool bFits = true;
+
+        for (unsigned int i = iOrder; i < iBlockSize; ++i)
+        {
+            INT64 r;
+
+            switch (iOrder)
+            {
+            case 0: r = pSamples[i]; break;
+            case 1: r = pSamples[i] - pSamples[i - 1]; break;
+            case 2: r = pSamples[i] - 2 * pSamples[i - 1] + pSamples[i - 2]; break;
+            case 3: r = pSamples[i] - 3 * pSamples[i - 1] + 3 * pSamples[i - 2] - pSamples[i - 3]; break;
+            default: r = pSamples[i] - 4 * pSamples[i - 1] + 6 * pSamples[i - 2] - 4 * pSamples[i - 3] + pSamples[i - 4]; break;
+            }
+
+            // Residuals must fit into 32 bit signed integers (only relevant for 32 bit streams)
+            if (r > INT32_MAX || r < INT32_MIN)
+                bFits = false;
+
+            Residual[i - iOrder] = r;
+        }
+
+        if (bFits)
+        {
+            auto Start = Writer.GetPosition();
+
+            Writer.Write(0, 1);
+            Writer.Write(8 | iOrder, 6);
+            Writer.Write(0, 1);
+
+            for (unsigned int i = 0; i < iOrder; ++i)
+                Writer.WriteSigned(pSamples[i], iBitsPerSample);
+
+            WriteResidual(Writer, Residual.data(), iBlockSize, iOrder);
+
+            // Keep FIXED unless it is larger than VERBATIM (white noise)
+            if (Writer.GetBitsSince(Start) <= (UINT64)iBlockSize * iBitsPerSample + 8)
+                return;
+
+            Writer.Rewind(Start);
+        }
+
+        // VERBATIM
+
+        Writer.Write(0, 1);
+        Writer.Write(1, 6);
+        Writer.Write(0, 1);
+
+        for (unsigned int i = 0; i < iBlockSize; ++i)
+            Writer.WriteSigned(pSamples[i], iBitsPerSample);
+    }
+}
+
+// ------------------------------------------------------------ LoopbackFlacSink
+
+// public
+
+LoopbackFlacSink::LoopbackFlacSink() :
+    m_iThreadCount(0),
+    m_iBlockSize(LoopbackFlacConst::DEFAULT_BLOCK_SIZE),
+    m_iMaxPendingBlocks(0),
+    m_fSeekInterval(LoopbackFlacConst::DEFAULT_SEEK_INTERVAL),
+    m_iMaxSeekPoints(LoopbackFlacConst::DEFAULT_SEEK_POINTS),
+    m_bTrimSilence(false),
+    m_fTrimThreshold(0.0f),
+
+    m_bOpen(false),
+    m_iBytesPerSample(0),
+
+    m_bStopThreads(false),
+    m_bWriting(false),
+
+    m_iFillSlot(0),
+    m_iWriteSlot(0),
+    m_iNextBlockIndex(0),
+
+    m_bActive(false),
+    m_iInputFrames(0),
+    m_iLastActiveFrame(0),
+    m_iActiveSlot(NO_SLOT),
+
+    m_iFrameCount(0),
+    m_iLeadingFrames(0),
+    m_iBytesWritten(0),
+    m_bWriteError(false)
+{
+
+}
+
+LoopbackFlacSink::~LoopbackFlacSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackFlacSink::SetThreadCount(unsigned int iThreadCount)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_iThreadCount = iThreadCount;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFlacSink::SetBlockSize(unsigned int iBlockSize)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (iBlockSize < LoopbackFlacConst::MIN_BLOCK_SIZE || iBlockSize > LoopbackFlacConst::MAX_BLOCK_SIZE)
+        return eCaptureError::PARAM;
+
+    m_iBlockSize = iBlockSize;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFlacSink::SetMaxPendingBlocks(unsigned int iMaxPendingBlocks)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_iMaxPendingBlocks = iMaxPendingBlocks;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFlacSink::SetSeekTable(double fInterval, unsigned int iMaxPoints)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fInterval < 0.0 || (fInterval > 0.0 && iMaxPoints < 2) || iMaxPoints > 0xFFFFFF / SEEKPOINT_SIZE)
+        return eCaptureError::PARAM;
+
+    m_fSeekInterval = fInterval;
+    m_iMaxSeekPoints = fInterval > 0.0 ? iMaxPoints : 0;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFlacSink::SetTrimSilence(bool bTrim, float fThreshold)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fThreshold < 0.0f || fThreshold > 1.0f)
+        return eCaptureError::PARAM;
+
+    m_bTrimSilence = bTrim;
+    m_fTrimThreshold = fThreshold;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFlacSink::Open(const std::wstring& FileName, const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.wFormatTag != WAVE_FORMAT_PCM || Format.wBitsPerSample < 8 || Format.wBitsPerSample > 32 || (Format.wBitsPerSample % 8) != 0)
+        return eCaptureError::FORMAT;
+
+    if (Format.nChannels < 1 || Format.nSamplesPerSec < 1 || Format.nSamplesPerSec >= (1U << 20))
+        return eCaptureError::FORMAT;
+
+    m_Format = Format;
+    m_iBytesPerSample = Format.wBitsPerSample / 8;
+    m_Silence.assign((size_t)m_iBlockSize * Format.nBlockAlign, Format.wBitsPerSample == 8 ? 0x80 : 0x00);
+    m_iFrameCount = 0;
+    m_iLeadingFrames = 0;
+    m_iBytesWritten = 0;
+    m_bWriteError = false;
+
+    m_bActive = false;
+    m_iInputFrames = 0;
+    m_iLastActiveFrame = 0;
+    m_iActiveSlot = NO_SLOT;
+    m_ActiveBlock.clear();
+    m_ActiveBlock.reserve((size_t)m_iBlockSize * Format.nBlockAlign);
+
+    // One stream per group of up to 8 channels
+
+    unsigned int iStreamCount = (Format.nChannels + LoopbackFlacConst::MAX_STREAM_CHANNELS - 1) / LoopbackFlacConst::MAX_STREAM_CHANNELS;
+
+    for (unsigned int s = 0; s < iStreamCount; ++s)
+    {
+        sStream Stream{};
+        Stream.iFirstChannel = s * LoopbackFlacConst::MAX_STREAM_CHANNELS;
+        Stream.iChannelCount = min(LoopbackFlacConst::MAX_STREAM_CHANNELS, (unsigned int)Format.nChannels - Stream.iFirstChannel);
+        Stream.iMinFrameSize = 0;
+        Stream.iMaxFrameSize = 0;
+        Stream.iAudioBytes = 0;
+        Stream.iActiveOffset = 0;
+        Stream.iSeekInterval = max(1ULL, (UINT64)(m_fSeekInterval * Format.nSamplesPerSec));
+        Stream.iNextSeekSample = 0;
+
+        wstring StreamFileName = FileName;
+
+        if (iStreamCount > 1)
+        {
+            auto ChannelText = [](unsigned int iChannel)
+            {
+                wstring Text = to_wstring(iChannel);
+                return Text.size() < 2 ? L"0" + Text : Text;
+            };
+
+            wstring Suffix = L".ch" + ChannelText(Stream.iFirstChannel) + L"-" + ChannelText(Stream.iFirstChannel + Stream.iChannelCount - 1);
+
+            size_t iDot = FileName.find_last_of(L'.');
+            size_t iSeparator = FileName.find_last_of(L"\\/");
+
+            if (iDot == wstring::npos || (iSeparator != wstring::npos && iDot < iSeparator))
+                StreamFileName = FileName + Suffix;
+            else
+                StreamFileName = FileName.substr(0, iDot) + Suffix + FileName.substr(iDot);
+        }
+
+        Stream.hFile = CreateFileW(StreamFileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        if (Stream.hFile == INVALID_HANDLE_VALUE)
+        {
+            Cleanup();
+            return eCaptureError::FILE;
+        }
+
+        m_Streams.push_back(Stream);
+
+        if (!WriteHeader(m_Streams.back()))
+        {
+            Cleanup();
+            return eCaptureError::FILE;
+        }
+    }
+
+    // Slots and encoder threads
+
+    unsigned int iThreadCount = m_iThreadCount != 0 ? m_iThreadCount : max(1U, thread::hardware_concurrency());
+    unsigned int iSlotCount = m_iMaxPendingBlocks != 0 ? max(2U, m_iMaxPendingBlocks) : iThreadCount * 2;
+
+    // Constructed in place, the atomic state can not be moved
+    m_Slots = vector<sSlot>(iSlotCount);
+
+    for (auto& Slot : m_Slots)
+    {
+        Slot.State.store(eSlotState::FREE, memory_order_relaxed);
+        Slot.iBlockIndex = 0;
+        Slot.iFrameCount = 0;
+        Slot.bActive = false;
+        Slot.Input.reserve((size_t)m_iBlockSize * Format.nBlockAlign);
+        Slot.Output.resize(m_Streams.size());
+    }
+
+    m_iFillSlot = 0;
+    m_iWriteSlot = 0;
+    m_iNextBlockIndex = 0;
+    m_bStopThreads = false;
+    m_bWriting = false;
+
+    for (unsigned int i = 0; i < iThreadCount; ++i)
+        m_Threads.emplace_back(&LoopbackFlacSink::EncoderThread, this);
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackFlacSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    // Encode the remaining partial block
+
+    if (m_Slots[m_iFillSlot].State.load(memory_order_acquire) == eSlotState::FILLING && !m_Slots[m_iFillSlot].Input.empty())
+        SubmitCurrentSlot();
+
+    {
+        unique_lock<mutex> Lock(m_Lock);
+
+        if (m_Slots[m_iFillSlot].State.load(memory_order_relaxed) == eSlotState::FILLING)
+            m_Slots[m_iFillSlot].State.store(eSlotState::FREE, memory_order_release);
+
+        m_SlotWritten.wait(Lock, [this]
+        {
+            return all_of(m_Slots.begin(), m_Slots.end(), [](const sSlot& Slot) { return Slot.State.load(memory_order_relaxed) == eSlotState::FREE; });
+        });
+
+        m_bStopThreads = true;
+    }
+
+    m_WorkAvailable.notify_all();
+
+    for (auto& Thread : m_Threads)
+        Thread.join();
+
+    m_Threads.clear();
+
+    if (m_bTrimSilence)
+        TrimTrailingSilence();
+
+    // Finalize headers (total samples, frame sizes and seek points)
+
+    for (auto& Stream : m_Streams)
+    {
+        if (SetFilePointer(Stream.hFile, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER || !WriteHeader(Stream))
+            m_bWriteError = true;
+    }
+
+    bool bWriteError = m_bWriteError;
+
+    Cleanup();
+
+    return bWriteError ? eCaptureError::FILE : eCaptureError::NONE;
+}
+
+bool LoopbackFlacSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackFlacSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    size_t iBlockBytes = (size_t)m_iBlockSize * m_Format.nBlockAlign;
+
+    if (m_bTrimSilence)
+    {
+        UINT64 iFrames = iSize / m_Format.nBlockAlign;
+
+        if (!m_bActive)
+        {
+            // Leading silence is never encoded
+
+            UINT64 iSilentFrames = LoopbackAudioLevel::FindFirstFrameAbove(pData, iSize, m_Format, m_fTrimThreshold);
+
+            m_iLeadingFrames += iSilentFrames;
+
+            if (iSilentFrames == iFrames)
+                return;
+
+            pData += iSilentFrames * m_Format.nBlockAlign;
+            iSize -= (size_t)iSilentFrames * m_Format.nBlockAlign;
+            iFrames -= iSilentFrames;
+            m_bActive = true;
+        }
+
+        UINT64 iLastActive = LoopbackAudioLevel::FindLastFrameAbove(pData, iSize, m_Format, m_fTrimThreshold);
+
+        if (iLastActive < iFrames)
+            m_iLastActiveFrame = m_iInputFrames + iLastActive;
+
+        m_iInputFrames += iFrames;
+    }
+
+    while (iSize > 0)
+    {
+        sSlot& Slot = m_Slots[m_iFillSlot];
+
+        if (Slot.State.load(memory_order_acquire) != eSlotState::FILLING)
+        {
+            // Bounded reordering: wait until the encoders and the writer released this slot
+
+            unique_lock<mutex> Lock(m_Lock);
+            m_SlotWritten.wait(Lock, [&Slot] { return Slot.State.load(memory_order_relaxed) == eSlotState::FREE; });
+
+            Slot.State.store(eSlotState::FILLING, memory_order_release);
+
+            // The last active block is kept for trimming. Both buffers hold a whole block, swapping them does not copy
+            // or allocate.
+            if (m_iFillSlot == m_iActiveSlot)
+            {
+                Slot.Input.swap(m_ActiveBlock);
+                m_iActiveSlot = NO_SLOT;
+            }
+
+            Slot.Input.clear();
+        }
+
+        size_t iCopy = min(iSize, iBlockBytes - Slot.Input.size());
+
+        Slot.Input.insert(Slot.Input.end(), pData, pData + iCopy);
+        pData += iCopy;
+        iSize -= iCopy;
+
+        if (Slot.Input.size() == iBlockBytes)
+            SubmitCurrentSlot();
+    }
+}
+
+void LoopbackFlacSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    // Through OnData, so blocks and trimming treat the gap like captured silence
+
+    while (iFrames > 0)
+    {
+        UINT64 iWriteFrames = min(iFrames, (UINT64)m_iBlockSize);
+
+        OnData(m_Silence.data(), (size_t)iWriteFrames * m_Format.nBlockAlign);
+        iFrames -= iWriteFrames;
+    }
+}
+
+UINT64 LoopbackFlacSink::GetFrameCount()
+{
+    return m_iFrameCount;
+}
+
+UINT64 LoopbackFlacSink::GetLeadingSilenceFrameCount()
+{
+    return m_iLeadingFrames;
+}
+
+UINT64 LoopbackFlacSink::GetBytesWritten()
+{
+    return m_iBytesWritten;
+}
+
+bool LoopbackFlacSink::HasWriteError()
+{
+    return m_bWriteError;
+}
+
+// private
+
+void LoopbackFlacSink::EncoderThread()
+{
+    // Per-thread scratch buffers, reused for every block
+    vector<INT64> Samples;
+    vector<INT64> Residual;
+
+    while (true)
+    {
+        size_t iSlot;
+
+        {
+            unique_lock<mutex> Lock(m_Lock);
+            m_WorkAvailable.wait(Lock, [this] { return m_bStopThreads || !m_WorkQueue.empty(); });
+
+            if (m_WorkQueue.empty())
+                break;
+
+            iSlot = m_WorkQueue.front();
+            m_WorkQueue.pop_front();
+        }
+
+        EncodeSlot(m_Slots[iSlot], Samples, Residual);
+
+        unique_lock<mutex> Lock(m_Lock);
+
+        m_Slots[iSlot].State.store(eSlotState::DONE, memory_order_release);
+        WriteCompletedSlots(Lock);
+    }
+}
+
+void LoopbackFlacSink::EncodeSlot(sSlot& Slot, std::vector<INT64>& Samples, std::vector<INT64>& Residual)
+{
+    Samples.resize(Slot.iFrameCount);
+
+    for (size_t s = 0; s < m_Streams.size(); ++s)
+    {
+        const sStream& Stream = m_Streams[s];
+        vector<unsigned char>& Out = Slot.Output[s];
+
+        Out.clear();
+
+        FlacBitWriter Writer(Out);
+
+        // Frame header
+
+        Writer.Write(0x3FFE, 14);                   // Sync code
+        Writer.Write(0, 1);                         // Reserved
+        Writer.Write(0, 1);                         // Fixed block size stream
+        Writer.Write(7, 4);                         // Block size: 16 bit value at the end of the header
+        Writer.Write(0, 4);                         // Sample rate: from STREAMINFO
+        Writer.Write(Stream.iChannelCount - 1, 4);  // Independent channels
+        Writer.Write(0, 3);                         // Sample size: from STREAMINFO
+        Writer.Write(0, 1);                         // Reserved
+        Writer.WriteUtf8(Slot.iBlockIndex);         // Frame number
+        Writer.Write(Slot.iFrameCount - 1, 16);
+        Writer.Write(LoopbackFlacCrc::Crc8(Out.data(), Out.size()), 8);
+
+        // Subframes
+
+        for (unsigned int c = 0; c < Stream.iChannelCount; ++c)
+        {
+            const unsigned char *pSample = Slot.Input.data() + (size_t)(Stream.iFirstChannel + c) * m_iBytesPerSample;
+
+            for (UINT32 i = 0; i < Slot.iFrameCount; ++i, pSample += m_Format.nBlockAlign)
+                Samples[i] = ReadSample(pSample, m_iBytesPerSample);
+
+            WriteSubframe(Writer, Samples.data(), Slot.iFrameCount, m_Format.wBitsPerSample, Residual);
+        }
+
+        // Footer
+
+        Writer.AlignToByte();
+        Writer.Write(LoopbackFlacCrc::Crc16(Out.data(), Out.size()), 16);
+    }
+}
+
+void LoopbackFlacSink::SubmitCurrentSlot()
+{
+    sSlot& Slot = m_Slots[m_iFillSlot];
+    UINT32 iFrameCount = (UINT32)(Slot.Input.size() / m_Format.nBlockAlign);
+
+    // The chunk was scanned before it was split into blocks, so the last active frame can also be in a later block
+    bool bActive = m_bActive && m_iLastActiveFrame >= m_iNextBlockIndex * m_iBlockSize;
+
+    if (bActive)
+        m_iActiveSlot = m_iFillSlot;
+
+    {
+        lock_guard<mutex> Lock(m_Lock);
+
+        Slot.iBlockIndex = m_iNextBlockIndex++;
+        Slot.iFrameCount = iFrameCount;
+        Slot.bActive = bActive;
+        Slot.State.store(eSlotState::PENDING, memory_order_release);
+
+        m_WorkQueue.push_back(m_iFillSlot);
+    }
+
+    m_WorkAvailable.notify_one();
+
+    m_iFrameCount += iFrameCount;
+    m_iFillSlot = (m_iFillSlot + 1) % m_Slots.size();
+}
+
+void LoopbackFlacSink::WriteCompletedSlots(std::unique_lock<std::mutex>& Lock)
+{
+    // Only one thread writes at a time. Slots completed meanwhile are picked up by the active writer.
+
+    if (m_bWriting)
+        return;
+
+    m_bWriting = true;
+
+    while (m_Slots[m_iWriteSlot].State.load(memory_order_relaxed) == eSlotState::DONE)
+    {
+        sSlot& Slot = m_Slots[m_iWriteSlot];
+
+        Lock.unlock();
+
+        for (size_t s = 0; s < m_Streams.size(); ++s)
+        {
+            sStream& Stream = m_Streams[s];
+            const vector<unsigned char>& Out = Slot.Output[s];
+
+            DWORD dwBytesWritten = 0;
+
+            if (!WriteFile(Stream.hFile, Out.data(), (DWORD)Out.size(), &dwBytesWritten, NULL) || dwBytesWritten != Out.size())
+                m_bWriteError = true;
+
+            Stream.iMinFrameSize = Stream.iMinFrameSize == 0 ? (UINT32)Out.size() : min(Stream.iMinFrameSize, (UINT32)Out.size());
+            Stream.iMaxFrameSize = max(Stream.iMaxFrameSize, (UINT32)Out.size());
+
+            AddSeekPoint(Stream, Slot.iBlockIndex * m_iBlockSize, Slot.iFrameCount);
+
+            if (Slot.bActive)
+                Stream.iActiveOffset = Stream.iAudioBytes;
+
+            Stream.iAudioBytes += Out.size();
+            m_iBytesWritten += Out.size();
+        }
+
+        Lock.lock();
+
+        Slot.State.store(eSlotState::FREE, memory_order_release);
+        m_iWriteSlot = (m_iWriteSlot + 1) % m_Slots.size();
+
+        m_SlotWritten.notify_all();
+    }
+
+    m_bWriting = false;
+}
+
+void LoopbackFlacSink::TrimTrailingSilence()
+{
+    // Only called from Close, after all blocks were written
+
+    if (!m_bActive || m_iLastActiveFrame + 1 == m_iFrameCount)
+        return;
+
+    // Encode the block with the last active frame again, without the silence after it. Its input is still in the slot,
+    // or in m_ActiveBlock if the slot was reused since.
+
+    const vector<unsigned char>& ActiveInput = m_iActiveSlot != NO_SLOT ? m_Slots[m_iActiveSlot].Input : m_ActiveBlock;
+
+    sSlot Tail{};
+    Tail.iBlockIndex = m_iLastActiveFrame / m_iBlockSize;
+    Tail.iFrameCount = (UINT32)(m_iLastActiveFrame + 1 - Tail.iBlockIndex * m_iBlockSize);
+    Tail.Input.assign(ActiveInput.begin(), ActiveInput.begin() + (size_t)Tail.iFrameCount * m_Format.nBlockAlign);
+    Tail.Output.resize(m_Streams.size());
+
+    vector<INT64> Samples;
+    vector<INT64> Residual;
+
+    EncodeSlot(Tail, Samples, Residual);
+
+    UINT64 iTotalFrames = m_iLastActiveFrame + 1;
+
+    for (size_t s = 0; s < m_Streams.size(); ++s)
+    {
+        sStream& Stream = m_Streams[s];
+        const vector<unsigned char>& Out = Tail.Output[s];
+
+        // Overwrite the block and cut the file after it
+
+        LARGE_INTEGER Position{};
+        Position.QuadPart = (LONGLONG)(GetHeaderSize() + Stream.iActiveOffset);
+        DWORD dwBytesWritten = 0;
+
+        if (!SetFilePointerEx(Stream.hFile, Position, NULL, FILE_BEGIN) ||
+            !WriteFile(Stream.hFile, Out.data(), (DWORD)Out.size(), &dwBytesWritten, NULL) || dwBytesWritten != Out.size() ||
+            !SetEndOfFile(Stream.hFile))
+        {
+            m_bWriteError = true;
+        }
+
+        m_iBytesWritten -= Stream.iAudioBytes - Stream.iActiveOffset;
+        m_iBytesWritten += Out.size();
+
+        Stream.iAudioBytes = Stream.iActiveOffset + Out.size();
+        Stream.iMinFrameSize = min(Stream.iMinFrameSize, (UINT32)Out.size());
+        Stream.iMaxFrameSize = max(Stream.iMaxFrameSize, (UINT32)Out.size());
+
+        // Seek points in the removed part are dropped, the one of the rewritten block gets its new length
+
+        while (!Stream.SeekPoints.empty() && Stream.SeekPoints.back().iSample >= iTotalFrames)
+            Stream.SeekPoints.pop_back();
+
+        if (!Stream.SeekPoints.empty() && Stream.SeekPoints.back().iOffset == Stream.iActiveOffset)
+            Stream.SeekPoints.back().iFrameSamples = Tail.iFrameCount;
+    }
+
+    m_iFrameCount = iTotalFrames;
+}
+
+void LoopbackFlacSink::AddSeekPoint(sStream& Stream, UINT64 iSample, UINT32 iFrameSamples)
+{
+    if (m_iMaxSeekPoints == 0 || iSample < Stream.iNextSeekSample)
+        return;
+
+    if (Stream.SeekPoints.size() == m_iMaxSeekPoints)
+    {
+        // Table is full, keep every second point and double the interval
+
+        size_t iKept = 0;
+
+        for (size_t i = 0; i < Stream.SeekPoints.size(); i += 2)
+            Stream.SeekPoints[iKept++] = Stream.SeekPoints[i];
+
+        Stream.SeekPoints.resize(iKept);
+        Stream.iSeekInterval *= 2;
+        Stream.iNextSeekSample = (Stream.SeekPoints.back().iSample / Stream.iSeekInterval + 1) * Stream.iSeekInterval;
+
+        if (iSample < Stream.iNextSeekSample)
+            return;
+    }
+
+    // Stream.iAudioBytes is the offset of the frame that is about to be written
+    Stream.SeekPoints.push_back({ iSample, Stream.iAudioBytes, iFrameSamples });
+    Stream.iNextSeekSample = (iSample / Stream.iSeekInterval + 1) * Stream.iSeekInterval;
+}
+
+bool LoopbackFlacSink::WriteHeader(sStream& Stream)
+{
+    vector<unsigned char> Header;
+    FlacBitWriter Writer(Header);
+
+    UINT64 iTotalSamples = m_iFrameCount;
+
+    Writer.Write(0x664C6143, 32);                   // "fLaC"
+
+    // STREAMINFO
+
+    Writer.Write(m_iMaxSeekPoints == 0 ? 1 : 0, 1); // Last metadata block
+    Writer.Write(0, 7);
+    Writer.Write(STREAMINFO_SIZE, 24);
+
+    Writer.Write(m_iBlockSize, 16);                 // Min block size
+    Writer.Write(m_iBlockSize, 16);                 // Max block size
+    Writer.Write(Stream.iMinFrameSize, 24);
+    Writer.Write(Stream.iMaxFrameSize, 24);
+    Writer.Write(m_Format.nSamplesPerSec, 20);
+    Writer.Write(Stream.iChannelCount - 1, 3);
+    Writer.Write(m_Format.wBitsPerSample - 1, 5);
+    Writer.Write(iTotalSamples >> 32, 4);
+    Writer.Write(iTotalSamples, 32);
+
+    for (int i = 0; i < 4; ++i)
+        Writer.Write(0, 32);                        // MD5 (unknown)
+
+    // SEEKTABLE, unused points are placeholders
+
+    if (m_iMaxSeekPoints != 0)
+    {
+        Writer.Write(1, 1);
+        Writer.Write(3, 7);
+        Writer.Write(m_iMaxSeekPoints * SEEKPOINT_SIZE, 24);
+
+        for (unsigned int i = 0; i < m_iMaxSeekPoints; ++i)
+        {
+            bool bUsed = i < Stream.SeekPoints.size();
+            UINT64 iSample = bUsed ? Stream.SeekPoints[i].iSample : PLACEHOLDER_SEEKPOINT;
+            UINT64 iOffset = bUsed ? Stream.SeekPoints[i].iOffset : 0;
+
+            Writer.Write(iSample >> 32, 32);
+            Writer.Write(iSample, 32);
+            Writer.Write(iOffset >> 32, 32);
+            Writer.Write(iOffset, 32);
+            Writer.Write(bUsed ? Stream.SeekPoints[i].iFrameSamples : 0, 16);
+        }
+    }
+
+    DWORD dwBytesWritten = 0;
+
+    return WriteFile(Stream.hFile, Header.data(), (DWORD)Header.size(), &dwBytesWritten, NULL) && dwBytesWritten == Header.size();
+}
+
+DWORD LoopbackFlacSink::GetHeaderSize()
+{
+    DWORD dwSize = 4 + 4 + STREAMINFO_SIZE;
+
+    if (m_iMaxSeekPoints != 0)
+        dwSize += 4 + m_iMaxSeekPoints * SEEKPOINT_SIZE;
+
+    return dwSize;
+}
+
+void LoopbackFlacSink::Cleanup()
+{
+    for (auto& Stream : m_Streams)
+    {
+        if (Stream.hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(Stream.hFile);
+    }
+
+    m_Streams.clear();
+    m_Slots.clear();
+    m_WorkQueue.clear();
+    m_ActiveBlock.clear();
+    m_iActiveSlot = NO_SLOT;
+
+    m_bOpen = false;
+}
+
+// ------------------------------------------------------------ EOF
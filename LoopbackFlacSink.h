@@ -0,0 +1,204 @@
+#pragma once
+
+/*
+
+Lossless FLAC encoder sink for ProcessLoopbackCapture.
+
+The incoming stream is split into fixed-size blocks. Every block is an independent FLAC frame, so blocks are
+encoded concurrently on a small thread pool and written back to the file in order. The number of blocks in flight
+is bounded (see SetMaxPendingBlocks); if the encoders fall behind, OnData blocks until a slot is written out.
+Use the intermediate thread of ProcessLoopbackCapture so this never stalls the main audio thread.
+
+The output does not depend on the thread count. Encoding with one thread produces the same bytes as with many.
+
+Supports WAVE_FORMAT_PCM with 8, 16, 24 or 32 bits. FLAC streams are limited to 8 channels, captures with more
+channels are split into groups of 8 and written to one file per group ("name.ch00-07.flac", "name.ch08-15.flac", ...).
+
+Frames use the FIXED predictors (order 0-4) with partitioned Rice coding, channels are coded independently.
+The MD5 signature in STREAMINFO is left empty (allowed by the format).
+
+A SEEKTABLE with one point per seek interval is written, so readers (see LoopbackFlacReader.h) can start decoding close to
+any position. Its space is reserved when the file is opened. If a recording needs more points than reserved, every second
+point is dropped and the interval doubles, so the table always covers the whole file.
+
+Optionally trims leading and trailing silence without a second pass over the file. Frames before the first one above
+the threshold are never encoded. Every chunk is scanned for its last frame above the threshold; on Close the file is
+truncated after the block containing it and that block is encoded again with the trailing silence removed.
+
+Gaps (OnGap, e.g. audio shed by LoopbackQosSink) are encoded as silence, so the file keeps the duration of the capture.
+
+*/
+
+#include <LoopbackCaptureSink.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackFlacConst
+{
+    constexpr unsigned int MAX_STREAM_CHANNELS = 8;
+    constexpr unsigned int DEFAULT_BLOCK_SIZE = 4096;
+    constexpr unsigned int MIN_BLOCK_SIZE = 16;
+    constexpr unsigned int MAX_BLOCK_SIZE = 65535;
+
+    constexpr double DEFAULT_SEEK_INTERVAL = 10.0;
+    constexpr unsigned int DEFAULT_SEEK_POINTS = 1024;
+}
+
+// ------------------------------------------------------------
+
+class LoopbackFlacSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackFlacSink();
+    ~LoopbackFlacSink();
+
+    // Number of encoder threads. 0 uses the number of hardware threads.
+    // Default: 0
+    eCaptureError SetThreadCount(unsigned int iThreadCount);
+
+    // Frames per FLAC block (16-65535).
+    // Default: 4096
+    eCaptureError SetBlockSize(unsigned int iBlockSize);
+
+    // Maximum number of blocks buffered for encoding/reordering. 0 uses twice the thread count.
+    // Default: 0
+    eCaptureError SetMaxPendingBlocks(unsigned int iMaxPendingBlocks);
+
+    // Seek point interval in seconds (rounded to blocks) and number of reserved seek points. A zero interval disables the SEEKTABLE.
+    // Default: 10 seconds, 1024 points (18 bytes each)
+    eCaptureError SetSeekTable(double fInterval, unsigned int iMaxPoints);
+
+    // Drops silence before the first and after the last frame with a sample above fThreshold (0-1).
+    // Default: disabled
+    eCaptureError SetTrimSilence(bool bTrim, float fThreshold);
+
+    // Creates the output file(s) and starts the encoder threads. Settings can only be changed while closed.
+    eCaptureError Open(const std::wstring& FileName, const WAVEFORMATEX& Format);
+
+    // Encodes the remaining partial block, waits for all encoders and finalizes the headers.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+    void OnGap(UINT64 iFrames) override;
+
+    // Number of frames (samples per channel) accepted so far.
+    UINT64 GetFrameCount();
+
+    // Frames dropped as leading silence, i.e. the position of the first encoded frame in the captured stream.
+    UINT64 GetLeadingSilenceFrameCount();
+
+    // Number of compressed bytes written to the file(s) so far, excluding headers.
+    UINT64 GetBytesWritten();
+
+    // Returns true if a write to one of the files failed since Open.
+    bool HasWriteError();
+
+private:
+
+    struct sSeekPoint
+    {
+        UINT64                          iSample;
+        UINT64                          iOffset;        // Relative to the first frame
+        UINT32                          iFrameSamples;
+    };
+
+    struct sStream
+    {
+        HANDLE                          hFile;
+        unsigned int                    iFirstChannel;
+        unsigned int                    iChannelCount;
+        UINT32                          iMinFrameSize;
+        UINT32                          iMaxFrameSize;
+
+        UINT64                          iAudioBytes;    // Bytes of frame data written so far
+        UINT64                          iActiveOffset;  // Offset of the last written block flagged as active
+        UINT64                          iSeekInterval;  // In samples, doubles when the table is thinned out
+        UINT64                          iNextSeekSample;
+        std::vector<sSeekPoint>         SeekPoints;
+    };
+
+    enum class eSlotState : int
+    {
+        FREE = 0,
+        FILLING,
+        PENDING,
+        DONE
+    };
+
+    // State is read without m_Lock by OnData and Close to check the fill slot, so it is atomic. Every transition is made under
+    // m_Lock.
+    struct sSlot
+    {
+        std::atomic<eSlotState>         State{ eSlotState::FREE };
+        UINT64                          iBlockIndex;
+        UINT32                          iFrameCount;
+        bool                            bActive;        // May contain the last frame above the trim threshold
+        std::vector<unsigned char>      Input;
+        std::vector<std::vector<unsigned char>>
+                                        Output; // One encoded frame per stream
+    };
+
+    void EncoderThread();
+    void EncodeSlot(sSlot& Slot, std::vector<INT64>& Samples, std::vector<INT64>& Residual);
+    void SubmitCurrentSlot();
+    void WriteCompletedSlots(std::unique_lock<std::mutex>& Lock);
+
+    void TrimTrailingSilence();
+
+    void AddSeekPoint(sStream& Stream, UINT64 iSample, UINT32 iFrameSamples);
+    bool WriteHeader(sStream& Stream);
+    DWORD GetHeaderSize();
+    void Cleanup();
+
+    unsigned int                    m_iThreadCount;
+    unsigned int                    m_iBlockSize;
+    unsigned int                    m_iMaxPendingBlocks;
+    double                          m_fSeekInterval;
+    unsigned int                    m_iMaxSeekPoints;
+    bool                            m_bTrimSilence;
+    float                           m_fTrimThreshold;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format{};
+    unsigned int                    m_iBytesPerSample;
+    std::vector<unsigned char>      m_Silence;      // One block, encoded for gaps
+
+    std::vector<sStream>            m_Streams;
+    std::vector<sSlot>              m_Slots;
+    std::vector<std::thread>        m_Threads;
+
+    std::mutex                      m_Lock;
+    std::condition_variable         m_WorkAvailable;
+    std::condition_variable         m_SlotWritten;
+    std::deque<size_t>              m_WorkQueue;
+    bool                            m_bStopThreads;
+    bool                            m_bWriting;
+
+    size_t                          m_iFillSlot;    // Slot currently filled by OnData (producer only)
+    size_t                          m_iWriteSlot;   // Next slot to be written (m_Lock)
+    UINT64                          m_iNextBlockIndex;
+
+    bool                            m_bActive;          // Producer only: a frame above the trim threshold was seen
+    UINT64                          m_iInputFrames;
+    UINT64                          m_iLastActiveFrame;
+    size_t                          m_iActiveSlot;      // Slot holding the input of the last active block, or none
+    std::vector<unsigned char>      m_ActiveBlock;      // That input once its slot was reused (swapped, not copied)
+
+    std::atomic<UINT64>             m_iFrameCount;
+    std::atomic<UINT64>             m_iLeadingFrames;
+    std::atomic<UINT64>             m_iBytesWritten;
+    std::atomic<bool>               m_bWriteError;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,688 @@
+#include <LoopbackMelSink.h>
+#include <LoopbackSampleMath.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define LOOPBACK_MEL_SSE
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+namespace
+{
+    using LoopbackSampleMath::PI;
+    using LoopbackSampleMath::Dot;
+    using LoopbackSampleMath::ReadSample;
+
+    double HzToMel(double fHz, eLoopbackMelScale Scale)
+    {
+        if (Scale == eLoopbackMelScale::HTK)
+            return 1127.0 * log(1.0 + fHz / 700.0);
+
+        // Slaney: 3 mels per 200 Hz up to 1 kHz, then 27 mels per factor of 6.4
+        if (fHz < 1000.0)
+            return fHz * 3.0 / 200.0;
+
+        return 15.0 + log(fHz / 1000.0) * 27.0 / log(6.4);
+    }
+
+    double MelToHz(double fMel, eLoopbackMelScale Scale)
+    {
+        if (Scale == eLoopbackMelScale::HTK)
+            return 700.0 * (exp(fMel / 1127.0) - 1.0);
+
+        if (fMel < 15.0)
+            return fMel * 200.0 / 3.0;
+
+        return 1000.0 * exp((fMel - 15.0) * log(6.4) / 27.0);
+    }
+
+    double GetMaxFrequency(const sLoopbackMelConfig& Config)
+    {
+        double fNyquist = Config.dwSampleRate / 2.0;
+
+        return Config.fMaxFrequency > 0.0f ? Config.fMaxFrequency : fNyquist + Config.fMaxFrequency;
+    }
+}
+
+// ------------------------------------------------------------ LoopbackMelSink
+
+// public
+
+LoopbackMelSink::LoopbackMelSink() :
+    m_Config(GetPreset(eLoopbackMelPreset::KALDI_FBANK)),
+    m_iCapacity(256),
+    m_pFrameFunc(nullptr),
+    m_pFrameFuncUserData(nullptr),
+
+    m_bOpen(false),
+    m_Format{},
+    m_iDecimation(1),
+
+    m_iFFTSize(0),
+    m_iSampleCount(0),
+    m_iSkip(0),
+    m_iFirstSample(0),
+
+    m_iRingFrameSize(0),
+    m_iRingCapacity(0),
+    m_iWritePosition(0),
+    m_iComputedFrames(0),
+    m_iDroppedFrames(0),
+
+    m_iReadPosition(0)
+{
+    m_DecimatedInput.pOwner = this;
+}
+
+LoopbackMelSink::~LoopbackMelSink()
+{
+    Close();
+}
+
+sLoopbackMelConfig LoopbackMelSink::GetPreset(eLoopbackMelPreset Preset)
+{
+    sLoopbackMelConfig Config;
+
+    switch (Preset)
+    {
+    case eLoopbackMelPreset::KALDI_FBANK:
+    case eLoopbackMelPreset::KALDI_MFCC:
+        Config.fInputScale = 32768.0f;
+
+        if (Preset == eLoopbackMelPreset::KALDI_MFCC)
+        {
+            Config.iBands = 23;
+            Config.iCepstra = 13;
+            Config.fLifter = 22.0f;
+        }
+        break;
+
+    case eLoopbackMelPreset::VGGISH:
+        Config.iBands = 64;
+        Config.fMinFrequency = 125.0f;
+        Config.fMaxFrequency = 7500.0f;
+        Config.Window = eLoopbackMelWindow::HANN;
+        Config.bRemoveDC = false;
+        Config.fPreEmphasis = 0.0f;
+        Config.bPower = false;
+        Config.fLogOffset = 0.01f;
+        Config.fLogFloor = 0.0f;
+        break;
+
+    case eLoopbackMelPreset::PANNS:
+        Config.dwSampleRate = 32000;
+        Config.iWindowLength = 1024;
+        Config.iHopLength = 320;
+        Config.iFFTSize = 1024;
+        Config.iBands = 64;
+        Config.fMinFrequency = 50.0f;
+        Config.fMaxFrequency = 14000.0f;
+        Config.Scale = eLoopbackMelScale::SLANEY;
+        Config.Window = eLoopbackMelWindow::HANN;
+        Config.bRemoveDC = false;
+        Config.fPreEmphasis = 0.0f;
+        Config.Log = eLoopbackMelLog::DECIBEL;
+        Config.fLogFloor = 1e-10f;
+        break;
+    }
+
+    return Config;
+}
+
+eCaptureError LoopbackMelSink::SetConfig(const sLoopbackMelConfig& Config)
+{
+    // Frames left from the last Open keep its frame size, GetFrameSize must still describe them
+    if (m_bOpen || GetFrameCount() > 0)
+        return eCaptureError::STATE;
+
+    sLoopbackMelConfig NewConfig = Config;
+
+    if (NewConfig.iFFTSize == 0)
+    {
+        NewConfig.iFFTSize = 1;
+
+        while (NewConfig.iFFTSize < NewConfig.iWindowLength)
+            NewConfig.iFFTSize <<= 1;
+    }
+
+    double fMaxFrequency = GetMaxFrequency(NewConfig);
+
+    if (NewConfig.dwSampleRate < 1000 || NewConfig.iWindowLength < 2 || NewConfig.iHopLength == 0 ||
+        NewConfig.iFFTSize < 4 || NewConfig.iFFTSize > LoopbackMelConst::MAX_FFT_SIZE || (NewConfig.iFFTSize & (NewConfig.iFFTSize - 1)) != 0 ||
+        NewConfig.iWindowLength > NewConfig.iFFTSize)
+        return eCaptureError::PARAM;
+
+    if (NewConfig.iBands == 0 || NewConfig.iBands > NewConfig.iFFTSize / 2 || NewConfig.fMinFrequency < 0.0f ||
+        NewConfig.fMinFrequency >= fMaxFrequency || fMaxFrequency > NewConfig.dwSampleRate / 2.0)
+        return eCaptureError::PARAM;
+
+    if (!(NewConfig.fInputScale > 0.0f) || NewConfig.fPreEmphasis < 0.0f || NewConfig.fPreEmphasis > 1.0f ||
+        NewConfig.fLogOffset < 0.0f || NewConfig.fLogFloor < 0.0f || (NewConfig.fLogOffset == 0.0f && NewConfig.fLogFloor == 0.0f) ||
+        NewConfig.iCepstra > NewConfig.iBands || NewConfig.fLifter < 0.0f)
+        return eCaptureError::PARAM;
+
+    m_Config = NewConfig;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackMelSink::SetCapacity(size_t iFrames)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (iFrames == 0)
+        return eCaptureError::PARAM;
+
+    m_iCapacity = iFrames;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackMelSink::SetFrameCallback(void (*pFrameFunc)(const float *pValues, size_t iValues, UINT64 iPosition, void*), void *pUserData)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pFrameFunc = pFrameFunc;
+    m_pFrameFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackMelSink::Open(const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || Format.nChannels == 0 || Format.nSamplesPerSec == 0 ||
+        (Format.wFormatTag != WAVE_FORMAT_PCM && Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT) ||
+        Format.nBlockAlign != Format.nChannels * (Format.wBitsPerSample / 8) ||
+        Format.nSamplesPerSec % m_Config.dwSampleRate != 0)
+        return eCaptureError::FORMAT;
+
+    m_Format = Format;
+    m_Format.cbSize = 0;
+    m_iDecimation = Format.nSamplesPerSec / m_Config.dwSampleRate;
+
+    if (m_iDecimation > LoopbackDecimationConst::MAX_FACTOR)
+        return eCaptureError::FORMAT;
+
+    if (m_iDecimation > 1)
+    {
+        m_Bank.ClearOutputs();
+        m_Bank.SetMixToMono(true);
+        m_Bank.AddOutput(m_iDecimation, &m_DecimatedInput);
+
+        eCaptureError eError = m_Bank.Open(Format);
+
+        if (eError != eCaptureError::NONE)
+            return eError;
+    }
+    else
+    {
+        m_Mono.assign(LoopbackMelConst::BLOCK_SAMPLES, 0.0f);
+    }
+
+    // Everything OnData needs is allocated here
+
+    m_iFFTSize = m_Config.iFFTSize;
+    m_FFT.SetSize(m_iFFTSize);
+
+    m_Samples.assign(m_Config.iWindowLength + LoopbackMelConst::BLOCK_SAMPLES, 0.0f);
+    m_iSampleCount = 0;
+    m_iSkip = 0;
+    m_iFirstSample = 0;
+
+    m_Frame.assign(m_iFFTSize, 0.0f);
+    m_Spectrum.assign(m_iFFTSize + 2, 0.0f);
+    m_Power.assign(m_iFFTSize / 2 + 1, 0.0f);
+    m_Energies.assign(m_Config.iBands, 0.0f);
+    m_Values.assign(m_Config.iCepstra, 0.0f);
+
+    BuildWindow();
+    BuildFilters();
+    BuildDCT();
+
+    m_iRingFrameSize = GetFrameSize();
+    m_iRingCapacity = m_iCapacity;
+
+    m_pRing = make_unique<float[]>(m_iRingCapacity * m_iRingFrameSize);
+    m_pRingPositions = make_unique<UINT64[]>(m_iRingCapacity);
+
+    m_iWritePosition = 0;
+    m_iReadPosition = 0;
+    m_iComputedFrames = 0;
+    m_iDroppedFrames = 0;
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackMelSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    if (m_Bank.IsOpen())
+        m_Bank.Close();
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackMelSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackMelSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    if (m_iDecimation > 1)
+    {
+        // Calls AddSamples through m_DecimatedInput
+        m_Bank.OnData(pData, iSize);
+        return;
+    }
+
+    size_t iFrames = iSize / m_Format.nBlockAlign;
+    WORD wBytesPerSample = m_Format.wBitsPerSample / 8;
+    float fScale = 1.0f / (float)m_Format.nChannels;
+
+    while (iFrames > 0)
+    {
+        size_t iBlock = min(iFrames, m_Mono.size());
+
+        for (size_t i = 0; i < iBlock; ++i)
+        {
+            float fSum = 0.0f;
+
+            for (WORD c = 0; c < m_Format.nChannels; ++c)
+                fSum += ReadSample(pData + c * wBytesPerSample, m_Format.wBitsPerSample, m_Format.wFormatTag);
+
+            m_Mono[i] = fSum * fScale;
+            pData += m_Format.nBlockAlign;
+        }
+
+        AddSamples(m_Mono.data(), iBlock);
+        iFrames -= iBlock;
+    }
+}
+
+void LoopbackMelSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    // Calls SkipSamples at the feature rate through m_DecimatedInput
+    if (m_iDecimation > 1)
+        m_Bank.OnGap(iFrames);
+    else
+        SkipSamples(iFrames);
+}
+
+size_t LoopbackMelSink::GetFrameSize()
+{
+    return m_Config.iCepstra > 0 ? m_Config.iCepstra : m_Config.iBands;
+}
+
+bool LoopbackMelSink::PopFrame(float *pValues, UINT64& iPosition)
+{
+    size_t iRead = m_iReadPosition.load(memory_order_relaxed);
+
+    if (iRead == m_iWritePosition.load(memory_order_acquire))
+        return false;
+
+    size_t iSlot = iRead % m_iRingCapacity;
+
+    memcpy(pValues, m_pRing.get() + iSlot * m_iRingFrameSize, m_iRingFrameSize * sizeof(float));
+    iPosition = m_pRingPositions[iSlot];
+
+    m_iReadPosition.store(iRead + 1, memory_order_release);
+
+    return true;
+}
+
+size_t LoopbackMelSink::GetFrameCount()
+{
+    size_t iRead = m_iReadPosition.load(memory_order_acquire);
+
+    return m_iWritePosition.load(memory_order_acquire) - iRead;
+}
+
+UINT64 LoopbackMelSink::GetComputedFrames()
+{
+    return m_iComputedFrames.load(memory_order_relaxed);
+}
+
+UINT64 LoopbackMelSink::GetDroppedFrames()
+{
+    return m_iDroppedFrames.load(memory_order_relaxed);
+}
+
+// private
+
+void LoopbackMelSink::sDecimatedInput::OnData(const unsigned char *pData, size_t iSize)
+{
+    pOwner->AddSamples((const float*)pData, iSize / sizeof(float));
+}
+
+void LoopbackMelSink::sDecimatedInput::OnGap(UINT64 iFrames)
+{
+    pOwner->SkipSamples(iFrames);
+}
+
+void LoopbackMelSink::BuildWindow()
+{
+    size_t L = m_Config.iWindowLength;
+
+    m_Window.resize(L);
+
+    for (size_t i = 0; i < L; ++i)
+    {
+        double fPeriodic = 2.0 * PI * (double)i / (double)L;
+        double fSymmetric = 2.0 * PI * (double)i / (double)(L - 1);
+
+        switch (m_Config.Window)
+        {
+        case eLoopbackMelWindow::HANN:
+            m_Window[i] = (float)(0.5 - 0.5 * cos(fPeriodic));
+            break;
+
+        case eLoopbackMelWindow::HAMMING:
+            m_Window[i] = (float)(0.54 - 0.46 * cos(fSymmetric));
+            break;
+
+        case eLoopbackMelWindow::POVEY:
+            m_Window[i] = (float)pow(0.5 - 0.5 * cos(fSymmetric), 0.85);
+            break;
+
+        default:
+            m_Window[i] = 1.0f;
+            break;
+        }
+    }
+}
+
+void LoopbackMelSink::BuildFilters()
+{
+    size_t iBands = m_Config.iBands;
+    size_t iBins = m_iFFTSize / 2 + 1;
+    double fBinWidth = (double)m_Config.dwSampleRate / (double)m_iFFTSize;
+
+    // iBands + 2 edges evenly spaced in mel
+
+    double fMinMel = HzToMel(m_Config.fMinFrequency, m_Config.Scale);
+    double fMaxMel = HzToMel(GetMaxFrequency(m_Config), m_Config.Scale);
+
+    vector<double> Edges(iBands + 2);
+
+    for (size_t i = 0; i < Edges.size(); ++i)
+        Edges[i] = fMinMel + (fMaxMel - fMinMel) * (double)i / (double)(iBands + 1);
+
+    m_FilterStart.assign(iBands, 0);
+    m_FilterLength.assign(iBands, 0);
+    m_FilterOffset.assign(iBands, 0);
+    m_FilterWeights.clear();
+
+    vector<float> Weights(iBins);
+
+    for (size_t b = 0; b < iBands; ++b)
+    {
+        for (size_t k = 0; k < iBins; ++k)
+        {
+            double fWeight;
+
+            if (m_Config.Scale == eLoopbackMelScale::HTK)
+            {
+                // Triangle in mel
+                double fMel = HzToMel(k * fBinWidth, m_Config.Scale);
+
+                fWeight = min((fMel - Edges[b]) / (Edges[b + 1] - Edges[b]), (Edges[b + 2] - fMel) / (Edges[b + 2] - Edges[b + 1]));
+            }
+            else
+            {
+                // Triangle in Hz, normalized to equal area
+                double fLeft = MelToHz(Edges[b], m_Config.Scale);
+                double fCenter = MelToHz(Edges[b + 1], m_Config.Scale);
+                double fRight = MelToHz(Edges[b + 2], m_Config.Scale);
+                double fHz = k * fBinWidth;
+
+                fWeight = min((fHz - fLeft) / (fCenter - fLeft), (fRight - fHz) / (fRight - fCenter)) * 2.0 / (fRight - fLeft);
+            }
+
+            Weights[k] = (float)max(fWeight, 0.0);
+        }
+
+        // Only the bins under the triangle are kept
+
+        size_t iFirst = 0;
+        size_t iLast = iBins;
+
+        while (iFirst < iBins && Weights[iFirst] == 0.0f)
+            ++iFirst;
+
+        while (iLast > iFirst && Weights[iLast - 1] == 0.0f)
+            --iLast;
+
+        m_FilterStart[b] = (UINT32)iFirst;
+        m_FilterLength[b] = (UINT32)(iLast - iFirst);
+        m_FilterOffset[b] = (UINT32)m_FilterWeights.size();
+        m_FilterWeights.insert(m_FilterWeights.end(), Weights.begin() + iFirst, Weights.begin() + iLast);
+    }
+}
+
+void LoopbackMelSink::BuildDCT()
+{
+    size_t iBands = m_Config.iBands;
+    size_t iCepstra = m_Config.iCepstra;
+
+    m_DCT.assign(iCepstra * iBands, 0.0f);
+
+    for (size_t c = 0; c < iCepstra; ++c)
+    {
+        double fScale = sqrt((c == 0 ? 1.0 : 2.0) / (double)iBands);
+
+        if (m_Config.fLifter > 0.0f)
+            fScale *= 1.0 + 0.5 * m_Config.fLifter * sin(PI * (double)c / m_Config.fLifter);
+
+        for (size_t b = 0; b < iBands; ++b)
+            m_DCT[c * iBands + b] = (float)(fScale * cos(PI * (double)c * ((double)b + 0.5) / (double)iBands));
+    }
+}
+
+void LoopbackMelSink::AddSamples(const float *pSamples, size_t iCount)
+{
+    size_t L = m_Config.iWindowLength;
+    size_t iHop = m_Config.iHopLength;
+
+    while (iCount > 0)
+    {
+        if (m_iSkip > 0)
+        {
+            size_t iSkipped = min(m_iSkip, iCount);
+
+            m_iSkip -= iSkipped;
+            m_iFirstSample += iSkipped;
+            pSamples += iSkipped;
+            iCount -= iSkipped;
+            continue;
+        }
+
+        size_t iCopy = min(iCount, m_Samples.size() - m_iSampleCount);
+
+        memcpy(m_Samples.data() + m_iSampleCount, pSamples, iCopy * sizeof(float));
+        m_iSampleCount += iCopy;
+        pSamples += iCopy;
+        iCount -= iCopy;
+
+        // All complete windows, then the rest is moved to the front
+
+        size_t iOffset = 0;
+
+        for (; iOffset + L <= m_iSampleCount; iOffset += iHop)
+            ComputeFrame(m_Samples.data() + iOffset, m_iFirstSample + iOffset);
+
+        if (iOffset >= m_iSampleCount)
+        {
+            m_iSkip = iOffset - m_iSampleCount;
+            m_iFirstSample += m_iSampleCount;
+            m_iSampleCount = 0;
+        }
+        else if (iOffset > 0)
+        {
+            memmove(m_Samples.data(), m_Samples.data() + iOffset, (m_iSampleCount - iOffset) * sizeof(float));
+            m_iFirstSample += iOffset;
+            m_iSampleCount -= iOffset;
+        }
+    }
+}
+
+void LoopbackMelSink::SkipSamples(UINT64 iCount)
+{
+    // m_iSkip is part of the gap. The next window starts after it, off the previous hop grid.
+
+    m_iFirstSample += m_iSampleCount + iCount;
+    m_iSampleCount = 0;
+    m_iSkip = 0;
+}
+
+void LoopbackMelSink::ComputeFrame(const float *pSamples, UINT64 iPosition)
+{
+    size_t L = m_Config.iWindowLength;
+    size_t iBins = m_iFFTSize / 2 + 1;
+    float *pFrame = m_Frame.data();
+
+    for (size_t i = 0; i < L; ++i)
+        pFrame[i] = pSamples[i] * m_Config.fInputScale;
+
+    if (m_Config.bRemoveDC)
+    {
+        float fMean = 0.0f;
+
+        for (size_t i = 0; i < L; ++i)
+            fMean += pFrame[i];
+
+        fMean /= (float)L;
+
+        for (size_t i = 0; i < L; ++i)
+            pFrame[i] -= fMean;
+    }
+
+    if (m_Config.fPreEmphasis > 0.0f)
+    {
+        for (size_t i = L - 1; i > 0; --i)
+            pFrame[i] -= m_Config.fPreEmphasis * pFrame[i - 1];
+
+        pFrame[0] -= m_Config.fPreEmphasis * pFrame[0];
+    }
+
+    for (size_t i = 0; i < L; ++i)
+        pFrame[i] *= m_Window[i];
+
+    // The tail of m_Frame stays zero
+
+    m_FFT.ForwardReal(pFrame, m_Spectrum.data());
+
+    const float *pSpectrum = m_Spectrum.data();
+    float *pPower = m_Power.data();
+    size_t k = 0;
+
+#if defined LOOPBACK_MEL_SSE
+    // Four bins per step: squares of (re, im) pairs, summed across the pairs
+
+    for (; k + 4 <= iBins; k += 4)
+    {
+        __m128 A = _mm_loadu_ps(pSpectrum + k * 2);
+        __m128 B = _mm_loadu_ps(pSpectrum + k * 2 + 4);
+
+        A = _mm_mul_ps(A, A);
+        B = _mm_mul_ps(B, B);
+
+        __m128 Power = _mm_add_ps(_mm_shuffle_ps(A, B, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(A, B, _MM_SHUFFLE(3, 1, 3, 1)));
+
+        _mm_storeu_ps(pPower + k, m_Config.bPower ? Power : _mm_sqrt_ps(Power));
+    }
+#endif
+
+    for (; k < iBins; ++k)
+    {
+        float fPower = pSpectrum[k * 2] * pSpectrum[k * 2] + pSpectrum[k * 2 + 1] * pSpectrum[k * 2 + 1];
+
+        pPower[k] = m_Config.bPower ? fPower : sqrt(fPower);
+    }
+
+    // Sparse mel matrix and log compression
+
+    size_t iBands = m_Config.iBands;
+
+    for (size_t b = 0; b < iBands; ++b)
+    {
+        float fEnergy = Dot(pPower + m_FilterStart[b], m_FilterWeights.data() + m_FilterOffset[b], m_FilterLength[b]);
+        float fValue = max(fEnergy + m_Config.fLogOffset, m_Config.fLogFloor);
+
+        switch (m_Config.Log)
+        {
+        case eLoopbackMelLog::LOG10:
+            m_Energies[b] = log10(fValue);
+            break;
+
+        case eLoopbackMelLog::DECIBEL:
+            m_Energies[b] = 10.0f * log10(fValue);
+            break;
+
+        default:
+            m_Energies[b] = log(fValue);
+            break;
+        }
+    }
+
+    const float *pValues = m_Energies.data();
+
+    if (m_Config.iCepstra > 0)
+    {
+        for (size_t c = 0; c < m_Config.iCepstra; ++c)
+            m_Values[c] = Dot(m_DCT.data() + c * iBands, m_Energies.data(), iBands);
+
+        pValues = m_Values.data();
+    }
+
+    size_t iFrameSize = m_iRingFrameSize;
+    UINT64 iInputPosition = iPosition * m_iDecimation;
+
+    m_iComputedFrames.fetch_add(1, memory_order_relaxed);
+
+    if (m_pFrameFunc != nullptr)
+        m_pFrameFunc(pValues, iFrameSize, iInputPosition, m_pFrameFuncUserData);
+
+    // The consumer is never waited for, the newest frame is dropped if the ring is full
+
+    size_t iWrite = m_iWritePosition.load(memory_order_relaxed);
+
+    if (iWrite - m_iReadPosition.load(memory_order_acquire) >= m_iRingCapacity)
+    {
+        m_iDroppedFrames.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    size_t iSlot = iWrite % m_iRingCapacity;
+
+    memcpy(m_pRing.get() + iSlot * iFrameSize, pValues, iFrameSize * sizeof(float));
+    m_pRingPositions[iSlot] = iInputPosition;
+
+    m_iWritePosition.store(iWrite + 1, memory_order_release);
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,233 @@
+#pragma once
+
+/*
+
+Streaming log-mel (and MFCC) features for speech and sound event models, computed next to the capture so only the features have
+to leave the host.
+
+LoopbackMelSink is a sink. The input is downmixed to mono and, if the capture runs at an integer multiple of the feature rate
+(e.g. 48 kHz for 16 kHz features), decimated with a LoopbackDecimationBank. Every hop, one frame is computed:
+
+- The window of samples is scaled, optionally freed of its DC offset and pre-emphasized (within the frame, as Kaldi does),
+  multiplied with the window function and transformed with a real FFT (LoopbackFFT, SSE where available).
+- The power (or magnitude) spectrum is multiplied with the mel filter matrix. The matrix is sparse: each band only stores the
+  weights of the bins under its triangle, so 80 bands over a 512 point FFT take about 500 multiplies instead of 20000.
+- The band energies are compressed with log(max(x + offset, floor)), in natural log, log10 or dB.
+- With cepstra enabled, an orthonormal DCT-II of the log energies gives the MFCCs, optionally liftered.
+
+Frames are written into a preallocated ring (single producer, single consumer): PopFrame takes them from any one thread. If the
+consumer falls behind, new frames are dropped and counted rather than blocking or allocating on the audio path. Alternatively
+a frame callback receives every frame on the thread that calls OnData.
+
+Presets match the defaults of common frontends (see eLoopbackMelPreset). Features are computed from samples in [-1, 1) unless
+fInputScale says otherwise (Kaldi works on 16-bit integer values), and the filter delay of the decimation is not compensated.
+
+LoopbackMelSink MelSink;
+MelSink.SetConfig(LoopbackMelSink::GetPreset(eLoopbackMelPreset::KALDI_FBANK));
+MelSink.Open(Format);
+
+LoopbackCapture.SetCallback(&ILoopbackCaptureSink::Callback, &MelSink);
+
+std::vector<float> Frame(MelSink.GetFrameSize());
+UINT64 iPosition;
+
+while (MelSink.PopFrame(Frame.data(), iPosition))
+    Model.Push(Frame);
+
+*/
+
+#include <LoopbackCaptureSink.h>
+#include <LoopbackDecimationBank.h>
+#include <LoopbackFFT.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackMelConst
+{
+    // Largest FFT size
+    constexpr size_t MAX_FFT_SIZE = 16384;
+
+    // Analysis samples buffered beyond one window
+    constexpr size_t BLOCK_SAMPLES = 4096;
+}
+
+enum class eLoopbackMelPreset : int
+{
+    KALDI_FBANK = 0,    // 16 kHz, 25/10 ms, 512 FFT, 80 bands 20 Hz - 8 kHz, HTK, Povey window, pre-emphasis 0.97, log power
+    KALDI_MFCC,         // As KALDI_FBANK with 23 bands, 13 cepstra, lifter 22
+    VGGISH,             // 16 kHz, 25/10 ms, 512 FFT, 64 bands 125 Hz - 7.5 kHz, HTK, Hann window, log(magnitude + 0.01)
+    PANNS               // 32 kHz, 1024/320, 1024 FFT, 64 bands 50 Hz - 14 kHz, Slaney, Hann window, power in dB
+};
+
+enum class eLoopbackMelScale : int
+{
+    HTK = 0,            // 1127 ln(1 + f / 700), triangles in mel (Kaldi, VGGish)
+    SLANEY              // Linear below 1 kHz, logarithmic above, triangles in Hz normalized to equal area (librosa default)
+};
+
+enum class eLoopbackMelWindow : int
+{
+    HANN = 0,           // Periodic
+    HAMMING,            // Symmetric
+    POVEY,              // Symmetric Hann to the power of 0.85 (Kaldi default)
+    RECTANGULAR
+};
+
+enum class eLoopbackMelLog : int
+{
+    NATURAL = 0,
+    LOG10,
+    DECIBEL             // 10 log10
+};
+
+struct sLoopbackMelConfig
+{
+    DWORD                           dwSampleRate = 16000;       // Feature rate, the input rate must be a multiple of it
+    UINT32                          iWindowLength = 400;        // Samples per frame at dwSampleRate
+    UINT32                          iHopLength = 160;
+    UINT32                          iFFTSize = 512;             // Power of two >= iWindowLength, 0 for the next one
+
+    UINT32                          iBands = 80;
+    float                           fMinFrequency = 20.0f;
+    float                           fMaxFrequency = 0.0f;       // 0 for Nyquist, negative for an offset from Nyquist
+    eLoopbackMelScale               Scale = eLoopbackMelScale::HTK;
+
+    eLoopbackMelWindow              Window = eLoopbackMelWindow::POVEY;
+    float                           fInputScale = 1.0f;         // Applied to the samples before anything else
+    bool                            bRemoveDC = true;
+    float                           fPreEmphasis = 0.97f;       // 0 to disable
+    bool                            bPower = true;              // Power spectrum, false for magnitude
+
+    eLoopbackMelLog                 Log = eLoopbackMelLog::NATURAL;
+    float                           fLogOffset = 0.0f;          // Added to the band energies before the log
+    float                           fLogFloor = 1.1920929e-07f; // Lower bound before the log
+
+    UINT32                          iCepstra = 0;               // MFCCs per frame, 0 for log-mel frames
+    float                           fLifter = 0.0f;             // Cepstral lifter, 0 to disable
+};
+
+// ------------------------------------------------------------
+
+class LoopbackMelSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackMelSink();
+    ~LoopbackMelSink();
+
+    static sLoopbackMelConfig GetPreset(eLoopbackMelPreset Preset);
+
+    // Fails with PARAM for inconsistent values (window longer than the FFT, more cepstra than bands, bands above Nyquist ...).
+    // Fails with STATE while open or while frames of the last Open are left in the ring.
+    // Default: GetPreset(eLoopbackMelPreset::KALDI_FBANK)
+    eCaptureError SetConfig(const sLoopbackMelConfig& Config);
+
+    // Frames kept in the ring, takes effect at the next Open.
+    // Default: 256
+    eCaptureError SetCapacity(size_t iFrames);
+
+    // Called with every frame on the thread that calls OnData, in addition to the ring. iPosition is the first input frame of the
+    // window on the capture's timeline (frames passed to OnData or skipped with OnGap since Open).
+    eCaptureError SetFrameCallback(void (*pFrameFunc)(const float *pValues, size_t iValues, UINT64 iPosition, void*), void *pUserData = nullptr);
+
+    // Designs the filters and allocates the ring. Fails with FORMAT if the sample rate is not the feature rate or a multiple of it
+    // (up to 64).
+    eCaptureError Open(const WAVEFORMATEX& Format);
+
+    // OnData must not be called during Close. Frames left in the ring can still be taken until the next Open.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // Drops the partial window and continues after the gap, no frame overlaps it.
+    void OnGap(UINT64 iFrames) override;
+
+    // Values per frame: iCepstra if set, otherwise iBands.
+    size_t GetFrameSize();
+
+    // Copies the oldest frame to pValues (GetFrameSize() floats). Returns false if there is none. One consumer thread at a time.
+    bool PopFrame(float *pValues, UINT64& iPosition);
+
+    // Frames in the ring.
+    size_t GetFrameCount();
+
+    // Frames computed since Open, and frames that were dropped because the ring was full.
+    UINT64 GetComputedFrames();
+    UINT64 GetDroppedFrames();
+
+private:
+
+    // Receives the decimated stream
+    struct sDecimatedInput : public ILoopbackCaptureSink
+    {
+        void OnData(const unsigned char *pData, size_t iSize) override;
+        void OnGap(UINT64 iFrames) override;
+
+        LoopbackMelSink             *pOwner = nullptr;
+    };
+
+    void BuildWindow();
+    void BuildFilters();
+    void BuildDCT();
+
+    void AddSamples(const float *pSamples, size_t iCount);
+    void SkipSamples(UINT64 iCount);
+    void ComputeFrame(const float *pSamples, UINT64 iPosition);
+
+    sLoopbackMelConfig              m_Config;
+    size_t                          m_iCapacity;
+    void                            (*m_pFrameFunc)(const float*, size_t, UINT64, void*);
+    void                            *m_pFrameFuncUserData;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format;
+    UINT32                          m_iDecimation;
+    LoopbackDecimationBank          m_Bank;
+    sDecimatedInput                 m_DecimatedInput;
+
+    // Processing, OnData only
+    size_t                          m_iFFTSize;
+    LoopbackFFT                     m_FFT;
+    std::vector<float>              m_Window;
+    std::vector<float>              m_Samples;      // Mono input, one window and a block
+    size_t                          m_iSampleCount;
+    size_t                          m_iSkip;        // Samples to discard before the next window (hop longer than the window)
+    UINT64                          m_iFirstSample; // Feature rate timeline position of m_Samples[0]
+    std::vector<float>              m_Mono;         // Converted input block without decimation
+    std::vector<float>              m_Frame;
+    std::vector<float>              m_Spectrum;     // Interleaved complex
+    std::vector<float>              m_Power;        // Power or magnitude per bin
+    std::vector<float>              m_Energies;
+    std::vector<float>              m_Values;
+
+    // Sparse mel matrix: band b weights bins m_FilterStart[b] ... with m_FilterLength[b] weights from m_FilterOffset[b]
+    std::vector<UINT32>             m_FilterStart;
+    std::vector<UINT32>             m_FilterLength;
+    std::vector<UINT32>             m_FilterOffset;
+    std::vector<float>              m_FilterWeights;
+
+    std::vector<float>              m_DCT;          // iCepstra x iBands, lifter included
+
+    // Ring of m_iRingCapacity frames of m_iRingFrameSize values, single producer single consumer. The geometry is taken at Open
+    // and kept after Close, the settings may change before the remaining frames are taken.
+    size_t                          m_iRingFrameSize;
+    size_t                          m_iRingCapacity;
+    std::unique_ptr<float[]>        m_pRing;
+    std::unique_ptr<UINT64[]>       m_pRingPositions;
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<size_t>             m_iWritePosition;
+    std::atomic<UINT64>             m_iComputedFrames;
+    std::atomic<UINT64>             m_iDroppedFrames;
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<size_t>             m_iReadPosition;
+};
+
+// ------------------------------------------------------------ EOF
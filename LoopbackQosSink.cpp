@@ -0,0 +1,330 @@
+#include <LoopbackQosSink.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// ------------------------------------------------------------ LoopbackQosSink
+
+// public
+
+LoopbackQosSink::LoopbackQosSink() :
+    m_fShedLoad(0.75f),
+    m_fRestoreLoad(0.4f),
+    m_pCapture(nullptr),
+    m_iQueueThreshold(0),
+    m_fRestoreDelay(2.0),
+    m_pEventRing(nullptr),
+    m_iEventSource(0),
+
+    m_bOpen(false),
+
+    m_iFrameCount(0),
+    m_iWindowFrames(0),
+    m_iWindowLength(0),
+    m_WindowBusy(0),
+    m_iRestoreFrames(0),
+    m_iRestoreLength(0),
+
+    m_iShedLevel(0),
+    m_fLoad(0.0f),
+
+    m_iRecordCount(0)
+{
+
+}
+
+LoopbackQosSink::~LoopbackQosSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackQosSink::AddStage(ILoopbackCaptureSink *pSink, eLoopbackQosPriority Priority, eLoopbackQosShed Shed, UINT32 iThinFactor)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (pSink == nullptr || Priority < eLoopbackQosPriority::CRITICAL || Priority > eLoopbackQosPriority::LOW ||
+        (Shed != eLoopbackQosShed::SKIP && Shed != eLoopbackQosShed::THIN) || (Shed == eLoopbackQosShed::THIN && iThinFactor < 2))
+        return eCaptureError::PARAM;
+
+    m_Stages.push_back({ pSink, Priority, Shed, iThinFactor, 0 });
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::ClearStages()
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_Stages.clear();
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::SetLoadThresholds(float fShed, float fRestore)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fRestore < 0.0f || fShed <= fRestore)
+        return eCaptureError::PARAM;
+
+    m_fShedLoad = fShed;
+    m_fRestoreLoad = fRestore;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::SetQueueThreshold(ProcessLoopbackCapture *pCapture, size_t iBytes)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pCapture = pCapture;
+    m_iQueueThreshold = iBytes;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::SetRestoreDelay(double fSeconds)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fSeconds < 0.0)
+        return eCaptureError::PARAM;
+
+    m_fRestoreDelay = fSeconds;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::SetEventLog(LoopbackEventRing *pRing, UINT16 iSource)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pEventRing = pRing;
+    m_iEventSource = iSource;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::Open(const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || Format.nSamplesPerSec == 0)
+        return eCaptureError::FORMAT;
+
+    m_Format = Format;
+    m_Format.cbSize = 0;
+
+    m_iFrameCount = 0;
+    m_iWindowFrames = 0;
+    m_iWindowLength = max((UINT64)m_Format.nSamplesPerSec * LoopbackQosConst::WINDOW_MILLISECONDS / 1000, (UINT64)1);
+    m_WindowBusy = chrono::steady_clock::duration::zero();
+    m_iRestoreFrames = 0;
+    m_iRestoreLength = (UINT64)(m_fRestoreDelay * m_Format.nSamplesPerSec);
+
+    for (auto& Stage : m_Stages)
+        Stage.iThinCount = 0;
+
+    m_iShedLevel = 0;
+    m_fLoad = 0.0f;
+
+    // The audio thread takes m_RecordLock, nothing is allocated or freed under it
+
+    vector<sLoopbackQosRecord> Records(LoopbackQosConst::MAX_RECORDS);
+
+    {
+        lock_guard<mutex> Lock(m_RecordLock);
+
+        m_Records.swap(Records);
+        m_iRecordCount = 0;
+    }
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackQosSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackQosSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackQosSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    // Level 1 sheds LOW (3), level 2 NORMAL (2) and up, level 3 HIGH (1) and up
+    int iFirstShed = LoopbackQosConst::MAX_SHED_LEVEL + 1 - m_iShedLevel.load(memory_order_relaxed);
+
+    UINT64 iFrames = iSize / m_Format.nBlockAlign;
+
+    auto Start = chrono::steady_clock::now();
+
+    for (auto& Stage : m_Stages)
+    {
+        if (Stage.Priority != eLoopbackQosPriority::CRITICAL && (int)Stage.Priority >= iFirstShed)
+        {
+            // Shed chunks are announced as gaps, so the stage does not join the audio around them
+            if (Stage.Shed == eLoopbackQosShed::SKIP || ++Stage.iThinCount < Stage.iThinFactor)
+            {
+                Stage.pSink->OnGap(iFrames);
+                continue;
+            }
+
+            Stage.iThinCount = 0;
+        }
+
+        Stage.pSink->OnData(pData, iSize);
+    }
+
+    m_WindowBusy += chrono::steady_clock::now() - Start;
+
+    m_iFrameCount += iFrames;
+    m_iWindowFrames += iFrames;
+
+    if (m_iWindowFrames >= m_iWindowLength)
+        EndWindow();
+}
+
+void LoopbackQosSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    // Not part of the load measurement, no audio was processed
+
+    for (auto& Stage : m_Stages)
+        Stage.pSink->OnGap(iFrames);
+
+    m_iFrameCount += iFrames;
+}
+
+int LoopbackQosSink::GetShedLevel()
+{
+    return m_iShedLevel.load(memory_order_relaxed);
+}
+
+float LoopbackQosSink::GetLoad()
+{
+    return m_fLoad.load(memory_order_relaxed);
+}
+
+void LoopbackQosSink::GetRecords(std::vector<sLoopbackQosRecord>& Records)
+{
+    // Sized before the lock is taken, the audio thread never waits for an allocation
+    Records.clear();
+    Records.reserve(LoopbackQosConst::MAX_RECORDS);
+
+    lock_guard<mutex> Lock(m_RecordLock);
+
+    if (m_Records.empty())
+        return;
+
+    size_t iCount = min(m_iRecordCount, m_Records.size());
+    size_t iFirst = (m_iRecordCount - iCount) % m_Records.size();
+
+    for (size_t i = 0; i < iCount; ++i)
+        Records.push_back(m_Records[(iFirst + i) % m_Records.size()]);
+}
+
+// private
+
+void LoopbackQosSink::EndWindow()
+{
+    double fAudio = (double)m_iWindowFrames / m_Format.nSamplesPerSec;
+    float fLoad = (float)(chrono::duration<double>(m_WindowBusy).count() / fAudio);
+
+    size_t iQueueSize = 0;
+
+    if (m_pCapture != nullptr && m_iQueueThreshold != 0 && m_pCapture->GetQueueSize(iQueueSize) != eCaptureError::NONE)
+        iQueueSize = 0;
+
+    m_fLoad.store(fLoad, memory_order_relaxed);
+
+    bool bQueueLong = m_iQueueThreshold != 0 && iQueueSize > m_iQueueThreshold;
+    bool bQueueShort = m_iQueueThreshold == 0 || iQueueSize <= m_iQueueThreshold / 2;
+    int iLevel = m_iShedLevel.load(memory_order_relaxed);
+
+    // One level per window, so the next window already measures the effect of the change
+
+    if (fLoad > m_fShedLoad || bQueueLong)
+    {
+        m_iRestoreFrames = 0;
+
+        if (iLevel < LoopbackQosConst::MAX_SHED_LEVEL)
+            SetShedLevel(iLevel + 1, fLoad, iQueueSize);
+    }
+    else if (fLoad < m_fRestoreLoad && bQueueShort)
+    {
+        m_iRestoreFrames += m_iWindowFrames;
+
+        if (iLevel > 0 && m_iRestoreFrames >= m_iRestoreLength)
+        {
+            m_iRestoreFrames = 0;
+            SetShedLevel(iLevel - 1, fLoad, iQueueSize);
+        }
+    }
+    else
+    {
+        m_iRestoreFrames = 0;
+    }
+
+    m_iWindowFrames = 0;
+    m_WindowBusy = chrono::steady_clock::duration::zero();
+}
+
+void LoopbackQosSink::SetShedLevel(int iLevel, float fLoad, size_t iQueueSize)
+{
+    bool bShed = iLevel > m_iShedLevel.load(memory_order_relaxed);
+
+    m_iShedLevel.store(iLevel, memory_order_relaxed);
+
+    sLoopbackQosRecord Record;
+
+    Record.iTime = (UINT64)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    Record.iFrame = m_iFrameCount;
+    Record.iShedLevel = iLevel;
+    Record.fLoad = fLoad;
+    Record.iQueueSize = iQueueSize;
+
+    {
+        lock_guard<mutex> Lock(m_RecordLock);
+
+        m_Records[m_iRecordCount % m_Records.size()] = Record;
+        ++m_iRecordCount;
+    }
+
+    if (m_pEventRing != nullptr)
+    {
+        sLoopbackEvent Event{};
+
+        Event.iTime = Record.iTime;
+        Event.iValue = iQueueSize;
+        Event.iValue2 = (UINT32)iLevel << 16 | (UINT32)min(fLoad * 1000.0f, 65535.0f);
+        Event.iSource = m_iEventSource;
+        Event.Type = bShed ? eLoopbackEvent::QOS_SHED : eLoopbackEvent::QOS_RESTORE;
+
+        m_pEventRing->Push(Event);
+    }
+}
+
+// ------------------------------------------------------------ EOF
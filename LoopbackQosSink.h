@@ -0,0 +1,159 @@
+#pragma once
+
+/*
+
+Deadline-aware fan-out for ProcessLoopbackCapture: passes the audio to several stages (sinks) with priorities and sheds the optional
+ones when the host cannot keep up, before the capture itself glitches.
+
+The processing time of all stages is measured against the duration of the audio they processed, in windows of 100 ms of audio.
+A window whose load (processing time / audio duration) exceeds the shed threshold, or in which the intermediate queue of the capture
+grew past the queue threshold, raises the shed level by one:
+
+- Level 1 sheds LOW stages, level 2 also NORMAL stages, level 3 also HIGH stages. CRITICAL stages (e.g. the archive writer) always
+  receive all data.
+- A shed stage either receives nothing (SKIP) or only every n-th chunk (THIN, e.g. to lower the rate of a meter or an FFT display).
+  Each chunk it does not receive is passed to its OnGap instead, so stages with filter state or a timeline (decimation, mel and
+  fingerprint sinks, the delay estimator ...) restart cleanly after it and keep their positions in line with the capture.
+- The level drops by one once the load stayed below the restore threshold, with a short queue, for the restore delay.
+
+Level changes are recorded with their time and timeline position (GetRecords) and optionally pushed into an event ring as
+QOS_SHED/QOS_RESTORE events (see LoopbackEventLog.h). OnData does not allocate or lock, except for the record on a level change.
+
+*/
+
+#include <LoopbackCaptureSink.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackQosConst
+{
+    // Duration of audio per load measurement
+    constexpr DWORD WINDOW_MILLISECONDS = 100;
+
+    // Most recent level changes kept by GetRecords
+    constexpr size_t MAX_RECORDS = 256;
+
+    // All but CRITICAL stages shed
+    constexpr int MAX_SHED_LEVEL = 3;
+}
+
+enum class eLoopbackQosPriority : int
+{
+    CRITICAL = 0,   // Never shed
+    HIGH,
+    NORMAL,
+    LOW
+};
+
+enum class eLoopbackQosShed : int
+{
+    SKIP = 0,       // No data while shed
+    THIN            // Every n-th chunk while shed
+};
+
+struct sLoopbackQosRecord
+{
+    UINT64                          iTime;          // Microseconds, steady_clock
+    UINT64                          iFrame;         // Timeline position of the end of the measured window
+    int                             iShedLevel;     // New level
+    float                           fLoad;          // Load of the window that caused the change
+    size_t                          iQueueSize;     // Bytes, 0 without a capture to watch
+};
+
+// ------------------------------------------------------------
+
+class LoopbackQosSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackQosSink();
+    ~LoopbackQosSink();
+
+    // Stages receive the data in the order they were added. pSink must stay valid while open.
+    // iThinFactor is only used with eLoopbackQosShed::THIN.
+    eCaptureError AddStage(ILoopbackCaptureSink *pSink, eLoopbackQosPriority Priority, eLoopbackQosShed Shed = eLoopbackQosShed::SKIP, UINT32 iThinFactor = 4);
+    eCaptureError ClearStages();
+
+    // Loads (processing time / audio duration) that raise and lower the shed level. fRestore must be below fShed.
+    // Default: 0.75, 0.4
+    eCaptureError SetLoadThresholds(float fShed, float fRestore);
+
+    // Raises the shed level when the intermediate queue of pCapture holds more than iBytes (see GetQueueSize). nullptr or 0 disables it.
+    // Default: disabled
+    eCaptureError SetQueueThreshold(ProcessLoopbackCapture *pCapture, size_t iBytes);
+
+    // Seconds of audio the load must stay low before a level is restored.
+    // Default: 2
+    eCaptureError SetRestoreDelay(double fSeconds);
+
+    // Pushes QOS_SHED/QOS_RESTORE events into pRing with iSource. The ring must outlive the sink.
+    // Default: nullptr
+    eCaptureError SetEventLog(LoopbackEventRing *pRing, UINT16 iSource = 0);
+
+    eCaptureError Open(const WAVEFORMATEX& Format);
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // Forwarded to all stages, e.g. when the QoS sink is itself behind another stage that drops audio.
+    void OnGap(UINT64 iFrames) override;
+
+    // 0 (nothing shed) to 3 (all but CRITICAL shed). Safe to call from any thread.
+    int GetShedLevel();
+
+    // Load of the last complete window. Safe to call from any thread.
+    float GetLoad();
+
+    // Level changes, oldest first. Safe to call from any thread.
+    void GetRecords(std::vector<sLoopbackQosRecord>& Records);
+
+private:
+
+    struct sStage
+    {
+        ILoopbackCaptureSink        *pSink;
+        eLoopbackQosPriority        Priority;
+        eLoopbackQosShed            Shed;
+        UINT32                      iThinFactor;
+        UINT32                      iThinCount;
+    };
+
+    void EndWindow();
+    void SetShedLevel(int iLevel, float fLoad, size_t iQueueSize);
+
+    std::vector<sStage>             m_Stages;
+    float                           m_fShedLoad;
+    float                           m_fRestoreLoad;
+    ProcessLoopbackCapture          *m_pCapture;
+    size_t                          m_iQueueThreshold;
+    double                          m_fRestoreDelay;
+    LoopbackEventRing               *m_pEventRing;
+    UINT16                          m_iEventSource;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format{};
+
+    // Written by the thread that calls OnData
+    UINT64                          m_iFrameCount;
+    UINT64                          m_iWindowFrames;
+    UINT64                          m_iWindowLength;
+    std::chrono::steady_clock::duration m_WindowBusy;
+    UINT64                          m_iRestoreFrames;   // Calm audio since the last change
+    UINT64                          m_iRestoreLength;
+
+    std::atomic<int>                m_iShedLevel;
+    std::atomic<float>              m_fLoad;
+
+    std::mutex                      m_RecordLock;
+    std::vector<sLoopbackQosRecord> m_Records;
+    size_t                          m_iRecordCount;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,88 @@
+#pragma once
+
+/*
+
+Sample helpers shared by the float processing sinks (LoopbackDecimationBank, LoopbackMelSink, LoopbackDenoiseSink, ...).
+
+ReadSample converts one sample of block aligned capture data (WAVE_FORMAT_PCM 8-32 bit and WAVE_FORMAT_IEEE_FLOAT) to float
+in [-1, 1), Dot is a float dot product with SSE where available.
+
+*/
+
+#include <windows.h>
+
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define LOOPBACK_SAMPLE_MATH_SSE
+#include <xmmintrin.h>
+#endif
+
+// ------------------------------------------------------------
+
+namespace LoopbackSampleMath
+{
+    constexpr double PI = 3.14159265358979323846;
+
+    inline float ReadSample(const unsigned char *pSample, WORD wBitsPerSample, WORD wFormatTag)
+    {
+        if (wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+        {
+            float fSample;
+            memcpy(&fSample, pSample, sizeof(float));
+            return fSample;
+        }
+
+        switch (wBitsPerSample)
+        {
+        case 8:
+            return (pSample[0] - 128) / 128.0f;
+
+        case 16:
+            return (INT16)(pSample[0] | (pSample[1] << 8)) / 32768.0f;
+
+        case 24:
+            return (INT32)((UINT32)pSample[0] << 8 | (UINT32)pSample[1] << 16 | (UINT32)pSample[2] << 24) / 2147483648.0f;
+
+        case 32:
+            return (INT32)((UINT32)pSample[0] | (UINT32)pSample[1] << 8 | (UINT32)pSample[2] << 16 | (UINT32)pSample[3] << 24) / 2147483648.0f;
+        }
+
+        return 0.0f;
+    }
+
+    inline float Dot(const float *pA, const float *pB, size_t iCount)
+    {
+        size_t i = 0;
+        float fSum = 0.0f;
+
+#if defined LOOPBACK_SAMPLE_MATH_SSE
+        // Two accumulators hide the latency of the adds
+
+        __m128 Sum1 = _mm_setzero_ps();
+        __m128 Sum2 = _mm_setzero_ps();
+
+        for (; i + 8 <= iCount; i += 8)
+        {
+            Sum1 = _mm_add_ps(Sum1, _mm_mul_ps(_mm_loadu_ps(pA + i), _mm_loadu_ps(pB + i)));
+            Sum2 = _mm_add_ps(Sum2, _mm_mul_ps(_mm_loadu_ps(pA + i + 4), _mm_loadu_ps(pB + i + 4)));
+        }
+
+        for (; i + 4 <= iCount; i += 4)
+            Sum1 = _mm_add_ps(Sum1, _mm_mul_ps(_mm_loadu_ps(pA + i), _mm_loadu_ps(pB + i)));
+
+        Sum1 = _mm_add_ps(Sum1, Sum2);
+        Sum1 = _mm_add_ps(Sum1, _mm_movehl_ps(Sum1, Sum1));
+        Sum1 = _mm_add_ss(Sum1, _mm_shuffle_ps(Sum1, Sum1, 1));
+
+        fSum = _mm_cvtss_f32(Sum1);
+#endif
+
+        for (; i < iCount; ++i)
+            fSum += pA[i] * pB[i];
+
+        return fSum;
+    }
+}
+
+// ------------------------------------------------------------ EOF
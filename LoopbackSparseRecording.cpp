@@ -0,0 +1,556 @@
+#include <LoopbackSparseRecording.h>
+#include <LoopbackAudioLevel.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+namespace
+{
+    // Largest single ReadFile/WriteFile call
+    constexpr UINT64 MAX_IO_SIZE = 0x40000000;
+}
+
+// ------------------------------------------------------------ LoopbackSparseSink
+
+// public
+
+LoopbackSparseSink::LoopbackSparseSink() :
+    m_fThreshold(0.0f),
+    m_fHoldTime(0.2),
+
+    m_bOpen(false),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_iFileOffset(0),
+
+    m_iBlockBytes(0),
+
+    m_iHoldFrames(0),
+    m_iHoldRemaining(0),
+    m_iMaxSegmentFrames(0),
+
+    m_bSegmentOpen(false),
+    m_iSegmentHeaderOffset(0),
+
+    m_iFrameCount(0),
+    m_iStoredFrameCount(0),
+    m_iSegmentCount(0),
+    m_bWriteError(false)
+{
+
+}
+
+LoopbackSparseSink::~LoopbackSparseSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackSparseSink::SetThreshold(float fThreshold)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fThreshold < 0.0f || fThreshold > 1.0f)
+        return eCaptureError::PARAM;
+
+    m_fThreshold = fThreshold;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackSparseSink::SetHoldTime(double fHoldTime)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fHoldTime < 0.0)
+        return eCaptureError::PARAM;
+
+    m_fHoldTime = fHoldTime;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackSparseSink::Open(const std::wstring& FileName, const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || (Format.wFormatTag != WAVE_FORMAT_PCM && Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT))
+        return eCaptureError::FORMAT;
+
+    m_hFile = CreateFileW(FileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::FILE;
+
+    m_Format = Format;
+    m_Format.cbSize = 0;
+
+    DWORD dwBlockFrames = m_Format.nSamplesPerSec * LoopbackSparseConst::BLOCK_MILLISECONDS / 1000;
+
+    m_iBlockBytes = (size_t)(dwBlockFrames != 0 ? dwBlockFrames : 1) * m_Format.nBlockAlign;
+    m_PartialBlock.clear();
+    m_PartialBlock.reserve(m_iBlockBytes);
+
+    m_iHoldFrames = (UINT64)(m_fHoldTime * m_Format.nSamplesPerSec);
+    m_iHoldRemaining = 0;
+    m_iMaxSegmentFrames = (UINT64)m_Format.nSamplesPerSec * LoopbackSparseConst::MAX_SEGMENT_SECONDS;
+
+    m_bSegmentOpen = false;
+    m_Index.clear();
+
+    m_iFileOffset = 0;
+    m_iFrameCount = 0;
+    m_iStoredFrameCount = 0;
+    m_iSegmentCount = 0;
+    m_bWriteError = false;
+
+    // Placeholder header (index offset 0 marks an unfinished file)
+
+    sLoopbackSparseHeader Header{};
+    Header.dwMagic = LoopbackSparseConst::MAGIC;
+    Header.dwVersion = LoopbackSparseConst::VERSION;
+    Header.Format = m_Format;
+
+    if (!Write(&Header, sizeof(Header)))
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+        return eCaptureError::FILE;
+    }
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackSparseSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    if (!m_PartialBlock.empty())
+    {
+        ProcessBlock(m_PartialBlock.data(), m_PartialBlock.size());
+        m_PartialBlock.clear();
+    }
+
+    if (m_bSegmentOpen)
+        EndSegment();
+
+    // Index, then the final header
+
+    sLoopbackSparseHeader Header{};
+    Header.dwMagic = LoopbackSparseConst::MAGIC;
+    Header.dwVersion = LoopbackSparseConst::VERSION;
+    Header.Format = m_Format;
+    Header.iTotalFrames = m_iFrameCount;
+    Header.iIndexOffset = m_iFileOffset;
+    Header.dwSegmentCount = (DWORD)m_Index.size();
+
+    if (!m_Index.empty())
+        Write(m_Index.data(), (DWORD)(m_Index.size() * sizeof(sLoopbackSparseIndexEntry)));
+
+    LARGE_INTEGER Position{};
+
+    if (!SetFilePointerEx(m_hFile, Position, NULL, FILE_BEGIN))
+        m_bWriteError = true;
+    else
+        Write(&Header, sizeof(Header));
+
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+
+    m_bOpen = false;
+
+    return m_bWriteError ? eCaptureError::FILE : eCaptureError::NONE;
+}
+
+bool LoopbackSparseSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackSparseSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    while (iSize > 0)
+    {
+        // Full blocks are analyzed in place, only partial blocks are buffered
+
+        if (m_PartialBlock.empty() && iSize >= m_iBlockBytes)
+        {
+            ProcessBlock(pData, m_iBlockBytes);
+            pData += m_iBlockBytes;
+            iSize -= m_iBlockBytes;
+            continue;
+        }
+
+        size_t iCopy = min(iSize, m_iBlockBytes - m_PartialBlock.size());
+
+        m_PartialBlock.insert(m_PartialBlock.end(), pData, pData + iCopy);
+        pData += iCopy;
+        iSize -= iCopy;
+
+        if (m_PartialBlock.size() == m_iBlockBytes)
+        {
+            ProcessBlock(m_PartialBlock.data(), m_PartialBlock.size());
+            m_PartialBlock.clear();
+        }
+    }
+}
+
+void LoopbackSparseSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    if (!m_PartialBlock.empty())
+    {
+        ProcessBlock(m_PartialBlock.data(), m_PartialBlock.size());
+        m_PartialBlock.clear();
+    }
+
+    if (m_bSegmentOpen)
+        EndSegment();
+
+    m_iHoldRemaining = 0;
+    m_iFrameCount += iFrames;
+}
+
+UINT64 LoopbackSparseSink::GetFrameCount()
+{
+    return m_iFrameCount;
+}
+
+UINT64 LoopbackSparseSink::GetStoredFrameCount()
+{
+    return m_iStoredFrameCount;
+}
+
+size_t LoopbackSparseSink::GetSegmentCount()
+{
+    return m_iSegmentCount;
+}
+
+bool LoopbackSparseSink::HasWriteError()
+{
+    return m_bWriteError;
+}
+
+// private
+
+void LoopbackSparseSink::ProcessBlock(const unsigned char *pData, size_t iSize)
+{
+    UINT64 iFrames = iSize / m_Format.nBlockAlign;
+    bool bActive = LoopbackAudioLevel::GetPeak(pData, iSize, m_Format) > m_fThreshold;
+
+    if (bActive)
+    {
+        m_iHoldRemaining = m_iHoldFrames;
+    }
+    else if (m_iHoldRemaining > 0)
+    {
+        // Inside the hold time, keep the segment open
+        m_iHoldRemaining -= min(m_iHoldRemaining, iFrames);
+        bActive = m_bSegmentOpen;
+    }
+
+    if (!bActive)
+    {
+        if (m_bSegmentOpen)
+            EndSegment();
+
+        m_iFrameCount += iFrames;
+        return;
+    }
+
+    if (m_bSegmentOpen && m_Index.back().dwFrameCount + iFrames > m_iMaxSegmentFrames)
+        EndSegment();
+
+    if (!m_bSegmentOpen)
+        BeginSegment();
+
+    Write(pData, (DWORD)iSize);
+
+    m_Index.back().dwFrameCount += (DWORD)iFrames;
+    m_iFrameCount += iFrames;
+    m_iStoredFrameCount += iFrames;
+}
+
+void LoopbackSparseSink::BeginSegment()
+{
+    // The frame count is patched in EndSegment
+
+    sLoopbackSparseSegmentHeader SegmentHeader{};
+    SegmentHeader.iStartFrame = m_iFrameCount;
+
+    m_iSegmentHeaderOffset = m_iFileOffset;
+
+    Write(&SegmentHeader, sizeof(SegmentHeader));
+
+    sLoopbackSparseIndexEntry Entry{};
+    Entry.iStartFrame = m_iFrameCount;
+    Entry.dwFrameCount = 0;
+    Entry.iDataOffset = m_iFileOffset;
+
+    m_Index.push_back(Entry);
+    m_iSegmentCount = m_Index.size();
+
+    m_bSegmentOpen = true;
+}
+
+void LoopbackSparseSink::EndSegment()
+{
+    sLoopbackSparseSegmentHeader SegmentHeader{};
+    SegmentHeader.iStartFrame = m_Index.back().iStartFrame;
+    SegmentHeader.dwFrameCount = m_Index.back().dwFrameCount;
+
+    LARGE_INTEGER Position{};
+    Position.QuadPart = (LONGLONG)m_iSegmentHeaderOffset;
+
+    UINT64 iFileOffset = m_iFileOffset;
+
+    if (SetFilePointerEx(m_hFile, Position, NULL, FILE_BEGIN))
+    {
+        Write(&SegmentHeader, sizeof(SegmentHeader));
+
+        Position.QuadPart = 0;
+        SetFilePointerEx(m_hFile, Position, NULL, FILE_END);
+    }
+    else
+    {
+        m_bWriteError = true;
+    }
+
+    m_iFileOffset = iFileOffset;
+    m_bSegmentOpen = false;
+}
+
+bool LoopbackSparseSink::Write(const void *pData, DWORD dwSize)
+{
+    DWORD dwBytesWritten = 0;
+
+    if (!WriteFile(m_hFile, pData, dwSize, &dwBytesWritten, NULL) || dwBytesWritten != dwSize)
+    {
+        m_bWriteError = true;
+        return false;
+    }
+
+    m_iFileOffset += dwBytesWritten;
+
+    return true;
+}
+
+// ------------------------------------------------------------ LoopbackSparseReader
+
+// public
+
+LoopbackSparseReader::LoopbackSparseReader() :
+    m_hFile(INVALID_HANDLE_VALUE)
+{
+
+}
+
+LoopbackSparseReader::~LoopbackSparseReader()
+{
+    Close();
+}
+
+eCaptureError LoopbackSparseReader::Open(const std::wstring& FileName)
+{
+    Close();
+
+    m_hFile = CreateFileW(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::FILE;
+
+    LARGE_INTEGER FileSize{};
+
+    if (!GetFileSizeEx(m_hFile, &FileSize) || !ReadAt(0, &m_Header, sizeof(m_Header)))
+    {
+        Close();
+        return eCaptureError::FILE;
+    }
+
+    if (m_Header.dwMagic != LoopbackSparseConst::MAGIC || m_Header.dwVersion != LoopbackSparseConst::VERSION || m_Header.Format.nBlockAlign == 0)
+    {
+        Close();
+        return eCaptureError::FORMAT;
+    }
+
+    bool bIndexLoaded = false;
+
+    if (m_Header.iIndexOffset != 0)
+    {
+        m_Index.resize(m_Header.dwSegmentCount);
+
+        bIndexLoaded = m_Index.empty() || ReadAt(m_Header.iIndexOffset, m_Index.data(), (DWORD)(m_Index.size() * sizeof(sLoopbackSparseIndexEntry)));
+    }
+
+    // The segments end where the index starts, when a (damaged) index was written
+
+    UINT64 iSegmentEnd = (UINT64)FileSize.QuadPart;
+
+    if (m_Header.iIndexOffset != 0 && m_Header.iIndexOffset < iSegmentEnd)
+        iSegmentEnd = m_Header.iIndexOffset;
+
+    if (!bIndexLoaded && !RebuildIndex(iSegmentEnd))
+    {
+        Close();
+        return eCaptureError::FILE;
+    }
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackSparseReader::Close()
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    m_Header = {};
+    m_Index.clear();
+}
+
+bool LoopbackSparseReader::CopyFormat(WAVEFORMATEX& Format)
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    Format = m_Header.Format;
+
+    return true;
+}
+
+UINT64 LoopbackSparseReader::GetFrameCount()
+{
+    return m_Header.iTotalFrames;
+}
+
+const std::vector<sLoopbackSparseIndexEntry>& LoopbackSparseReader::GetIndex()
+{
+    return m_Index;
+}
+
+eCaptureError LoopbackSparseReader::ReadFrames(UINT64 iStartFrame, UINT64 iFrameCount, unsigned char *pBuffer)
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::STATE;
+
+    if (pBuffer == nullptr)
+        return eCaptureError::PARAM;
+
+    const WAVEFORMATEX& Format = m_Header.Format;
+    unsigned char Silence = (Format.wFormatTag == WAVE_FORMAT_PCM && Format.wBitsPerSample == 8) ? 0x80 : 0x00;
+
+    fill(pBuffer, pBuffer + iFrameCount * Format.nBlockAlign, Silence);
+
+    UINT64 iEndFrame = iStartFrame + iFrameCount;
+
+    // Last segment starting at or before iStartFrame, it may still overlap the range
+
+    auto it = upper_bound(m_Index.begin(), m_Index.end(), iStartFrame, [](UINT64 iFrame, const sLoopbackSparseIndexEntry& Entry)
+    {
+        return iFrame < Entry.iStartFrame;
+    });
+
+    if (it != m_Index.begin())
+        --it;
+
+    for (; it != m_Index.end() && it->iStartFrame < iEndFrame; ++it)
+    {
+        UINT64 iOverlapStart = max(iStartFrame, it->iStartFrame);
+        UINT64 iOverlapEnd = min(iEndFrame, it->iStartFrame + it->dwFrameCount);
+
+        if (iOverlapStart >= iOverlapEnd)
+            continue;
+
+        UINT64 iOffset = it->iDataOffset + (iOverlapStart - it->iStartFrame) * Format.nBlockAlign;
+        UINT64 iBytes = (iOverlapEnd - iOverlapStart) * Format.nBlockAlign;
+        unsigned char *pDest = pBuffer + (iOverlapStart - iStartFrame) * Format.nBlockAlign;
+
+        while (iBytes > 0)
+        {
+            DWORD dwChunk = (DWORD)min(iBytes, MAX_IO_SIZE);
+
+            if (!ReadAt(iOffset, pDest, dwChunk))
+                return eCaptureError::FILE;
+
+            iOffset += dwChunk;
+            pDest += dwChunk;
+            iBytes -= dwChunk;
+        }
+    }
+
+    return eCaptureError::NONE;
+}
+
+// private
+
+bool LoopbackSparseReader::RebuildIndex(UINT64 iEndOffset)
+{
+    // Walk the segment headers up to iEndOffset. The last segment of an unfinished file has no frame count yet,
+    // it extends to the end of the file.
+
+    m_Index.clear();
+
+    UINT64 iOffset = sizeof(sLoopbackSparseHeader);
+    UINT64 iTotalFrames = 0;
+
+    while (iOffset + sizeof(sLoopbackSparseSegmentHeader) <= iEndOffset)
+    {
+        sLoopbackSparseSegmentHeader SegmentHeader{};
+
+        if (!ReadAt(iOffset, &SegmentHeader, sizeof(SegmentHeader)))
+            return false;
+
+        sLoopbackSparseIndexEntry Entry{};
+        Entry.iStartFrame = SegmentHeader.iStartFrame;
+        Entry.iDataOffset = iOffset + sizeof(SegmentHeader);
+
+        UINT64 iAvailableFrames = (iEndOffset - Entry.iDataOffset) / m_Header.Format.nBlockAlign;
+
+        if (SegmentHeader.dwFrameCount == 0 || SegmentHeader.dwFrameCount > iAvailableFrames)
+            Entry.dwFrameCount = (DWORD)min(iAvailableFrames, (UINT64)0xFFFFFFFF);
+        else
+            Entry.dwFrameCount = SegmentHeader.dwFrameCount;
+
+        if (Entry.dwFrameCount == 0 || (!m_Index.empty() && Entry.iStartFrame < m_Index.back().iStartFrame + m_Index.back().dwFrameCount))
+            break;
+
+        m_Index.push_back(Entry);
+
+        iTotalFrames = Entry.iStartFrame + Entry.dwFrameCount;
+        iOffset = Entry.iDataOffset + (UINT64)Entry.dwFrameCount * m_Header.Format.nBlockAlign;
+    }
+
+    m_Header.iTotalFrames = max(m_Header.iTotalFrames, iTotalFrames);
+    m_Header.dwSegmentCount = (DWORD)m_Index.size();
+
+    return true;
+}
+
+bool LoopbackSparseReader::ReadAt(UINT64 iOffset, void *pData, DWORD dwSize)
+{
+    LARGE_INTEGER Position{};
+    Position.QuadPart = (LONGLONG)iOffset;
+
+    if (!SetFilePointerEx(m_hFile, Position, NULL, FILE_BEGIN))
+        return false;
+
+    DWORD dwBytesRead = 0;
+
+    return ReadFile(m_hFile, pData, dwSize, &dwBytesRead, NULL) && dwBytesRead == dwSize;
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,178 @@
+#pragma once
+
+/*
+
+Sparse recording format for ProcessLoopbackCapture.
+
+LoopbackSparseSink only stores active segments of the stream. The stream is analyzed in blocks of 10 ms; a block is active
+if its peak level is above the threshold. Segments are kept open for the hold time after the last active block, so short
+pauses do not split them. With the default threshold of 0, only digitally silent blocks are dropped and the recording is lossless.
+
+File layout (little endian):
+
+    sLoopbackSparseHeader
+    Segment 0: sLoopbackSparseSegmentHeader, PCM data
+    Segment 1: sLoopbackSparseSegmentHeader, PCM data
+    ...
+    Index: sLoopbackSparseIndexEntry[SegmentCount]
+
+The header and the index are finalized on Close. Every segment carries its own timeline position, so the index of a file that
+was not closed properly can be rebuilt by LoopbackSparseReader.
+
+LoopbackSparseReader reconstructs the complete timeline, filling elided parts with silence, and seeks to any frame with a
+binary search over the index (O(log n) in the number of segments).
+
+*/
+
+#include <LoopbackCaptureSink.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackSparseConst
+{
+    constexpr DWORD MAGIC = 0x5250534C; // 'LSPR'
+    constexpr DWORD VERSION = 1;
+
+    // Segments are split after this duration so that index entries stay reasonably fine grained
+    constexpr DWORD MAX_SEGMENT_SECONDS = 60;
+
+    // Duration of the analysis blocks
+    constexpr DWORD BLOCK_MILLISECONDS = 10;
+}
+
+#pragma pack(push, 1)
+
+struct sLoopbackSparseHeader
+{
+    DWORD                           dwMagic;
+    DWORD                           dwVersion;
+    WAVEFORMATEX                    Format;
+    UINT64                          iTotalFrames;   // Length of the timeline, including silence
+    UINT64                          iIndexOffset;   // 0 if the file was not finalized
+    DWORD                           dwSegmentCount;
+};
+
+struct sLoopbackSparseSegmentHeader
+{
+    UINT64                          iStartFrame;    // Position on the timeline
+    DWORD                           dwFrameCount;
+};
+
+struct sLoopbackSparseIndexEntry
+{
+    UINT64                          iStartFrame;
+    DWORD                           dwFrameCount;
+    UINT64                          iDataOffset;    // File offset of the segment's PCM data
+};
+
+#pragma pack(pop)
+
+// ------------------------------------------------------------
+
+class LoopbackSparseSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackSparseSink();
+    ~LoopbackSparseSink();
+
+    // Peak level (0-1) a block must exceed to be stored.
+    // Default: 0 (drop digital silence only)
+    eCaptureError SetThreshold(float fThreshold);
+
+    // Time (in seconds) a segment is kept open after the last active block.
+    // Default: 0.2
+    eCaptureError SetHoldTime(double fHoldTime);
+
+    eCaptureError Open(const std::wstring& FileName, const WAVEFORMATEX& Format);
+
+    // Closes the open segment, writes the index and finalizes the header.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // Ends the open segment and elides the gap like silence, the next segment starts after it.
+    void OnGap(UINT64 iFrames) override;
+
+    // Length of the timeline in frames (stored and elided).
+    UINT64 GetFrameCount();
+
+    // Frames actually written to the file.
+    UINT64 GetStoredFrameCount();
+
+    size_t GetSegmentCount();
+
+    bool HasWriteError();
+
+private:
+
+    void ProcessBlock(const unsigned char *pData, size_t iSize);
+    void BeginSegment();
+    void EndSegment();
+    bool Write(const void *pData, DWORD dwSize);
+
+    float                           m_fThreshold;
+    double                          m_fHoldTime;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format{};
+    HANDLE                          m_hFile;
+    UINT64                          m_iFileOffset;
+
+    size_t                          m_iBlockBytes;
+    std::vector<unsigned char>      m_PartialBlock;
+
+    UINT64                          m_iHoldFrames;
+    UINT64                          m_iHoldRemaining;
+    UINT64                          m_iMaxSegmentFrames;
+
+    bool                            m_bSegmentOpen;
+    UINT64                          m_iSegmentHeaderOffset;
+    std::vector<sLoopbackSparseIndexEntry>
+                                    m_Index;
+
+    std::atomic<UINT64>             m_iFrameCount;
+    std::atomic<UINT64>             m_iStoredFrameCount;
+    std::atomic<size_t>             m_iSegmentCount;
+    std::atomic<bool>               m_bWriteError;
+};
+
+// ------------------------------------------------------------
+
+class LoopbackSparseReader
+{
+public:
+
+    LoopbackSparseReader();
+    ~LoopbackSparseReader();
+
+    // Loads the header and index. The index is rebuilt from the segment headers if the file was not finalized.
+    eCaptureError Open(const std::wstring& FileName);
+    void Close();
+
+    bool CopyFormat(WAVEFORMATEX& Format);
+    UINT64 GetFrameCount();
+    const std::vector<sLoopbackSparseIndexEntry>& GetIndex();
+
+    // Reads iFrameCount frames of the timeline starting at iStartFrame into pBuffer (iFrameCount * nBlockAlign bytes).
+    // Elided parts are filled with silence. Frames past the end of the timeline are silent as well.
+    eCaptureError ReadFrames(UINT64 iStartFrame, UINT64 iFrameCount, unsigned char *pBuffer);
+
+private:
+
+    bool RebuildIndex(UINT64 iEndOffset);
+    bool ReadAt(UINT64 iOffset, void *pData, DWORD dwSize);
+
+    HANDLE                          m_hFile;
+    sLoopbackSparseHeader           m_Header{};
+    std::vector<sLoopbackSparseIndexEntry>
+                                    m_Index;
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,453 @@
+#include <LoopbackTrace.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// ------------------------------------------------------------ LoopbackTrace
+
+eCaptureError LoopbackTrace::Save(const std::wstring& FileName, const WAVEFORMATEX& Format, const std::vector<sLoopbackTraceRecord>& Records)
+{
+    HANDLE hFile = CreateFileW(FileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::FILE;
+
+    sLoopbackTraceFileHeader Header{};
+    Header.dwMagic = LoopbackTraceConst::MAGIC;
+    Header.dwVersion = LoopbackTraceConst::VERSION;
+    Header.Format = Format;
+    Header.iRecordCount = Records.size();
+
+    DWORD dwBytesWritten = 0;
+    bool bSuccess = WriteFile(hFile, &Header, sizeof(Header), &dwBytesWritten, NULL) && dwBytesWritten == sizeof(Header);
+
+    // Written in pieces, WriteFile takes 32 bit sizes
+
+    size_t iWritten = 0;
+
+    while (bSuccess && iWritten < Records.size())
+    {
+        size_t iCount = min(Records.size() - iWritten, (size_t)(1 << 20));
+        DWORD dwSize = (DWORD)(iCount * sizeof(sLoopbackTraceRecord));
+
+        bSuccess = WriteFile(hFile, Records.data() + iWritten, dwSize, &dwBytesWritten, NULL) && dwBytesWritten == dwSize;
+        iWritten += iCount;
+    }
+
+    CloseHandle(hFile);
+
+    return bSuccess ? eCaptureError::NONE : eCaptureError::FILE;
+}
+
+eCaptureError LoopbackTrace::Load(const std::wstring& FileName, WAVEFORMATEX& Format, std::vector<sLoopbackTraceRecord>& Records)
+{
+    HANDLE hFile = CreateFileW(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return eCaptureError::FILE;
+
+    sLoopbackTraceFileHeader Header{};
+    DWORD dwBytesRead = 0;
+
+    if (!ReadFile(hFile, &Header, sizeof(Header), &dwBytesRead, NULL) || dwBytesRead != sizeof(Header) ||
+        Header.dwMagic != LoopbackTraceConst::MAGIC || Header.dwVersion != LoopbackTraceConst::VERSION)
+    {
+        CloseHandle(hFile);
+        return eCaptureError::FORMAT;
+    }
+
+    LARGE_INTEGER FileSize{};
+
+    if (!GetFileSizeEx(hFile, &FileSize) || (UINT64)FileSize.QuadPart < sizeof(Header) + Header.iRecordCount * sizeof(sLoopbackTraceRecord))
+    {
+        CloseHandle(hFile);
+        return eCaptureError::FORMAT;
+    }
+
+    Records.resize((size_t)Header.iRecordCount);
+
+    size_t iRead = 0;
+    bool bSuccess = true;
+
+    while (bSuccess && iRead < Records.size())
+    {
+        size_t iCount = min(Records.size() - iRead, (size_t)(1 << 20));
+        DWORD dwSize = (DWORD)(iCount * sizeof(sLoopbackTraceRecord));
+
+        bSuccess = ReadFile(hFile, Records.data() + iRead, dwSize, &dwBytesRead, NULL) && dwBytesRead == dwSize;
+        iRead += iCount;
+    }
+
+    CloseHandle(hFile);
+
+    if (!bSuccess)
+    {
+        Records.clear();
+        return eCaptureError::FILE;
+    }
+
+    Format = Header.Format;
+
+    return eCaptureError::NONE;
+}
+
+// ------------------------------------------------------------ LoopbackTraceReplay
+
+// public
+
+LoopbackTraceReplay::LoopbackTraceReplay() :
+    m_fSpeed(1.0),
+
+    m_iTonePosition(0),
+
+    m_hEndEvent(CreateEventW(NULL, true, false, NULL)),
+    m_bRunning(false),
+
+    m_iRecord(0),
+    m_iTraceStart(0),
+    m_iQPCStart(0),
+    m_iDevicePosition(0),
+    m_bDraining(false),
+    m_bEnded(false)
+{
+
+}
+
+LoopbackTraceReplay::~LoopbackTraceReplay()
+{
+    if (m_hEndEvent != NULL)
+        CloseHandle(m_hEndEvent);
+}
+
+eCaptureError LoopbackTraceReplay::Load(const std::wstring& FileName)
+{
+    WAVEFORMATEX Format{};
+    vector<sLoopbackTraceRecord> Records;
+
+    eCaptureError eError = LoopbackTrace::Load(FileName, Format, Records);
+
+    if (eError != eCaptureError::NONE)
+        return eError;
+
+    return SetTrace(Format, Records);
+}
+
+eCaptureError LoopbackTraceReplay::SetTrace(const WAVEFORMATEX& Format, const std::vector<sLoopbackTraceRecord>& Records)
+{
+    if (Format.nBlockAlign == 0 || Format.nChannels == 0 || Format.nSamplesPerSec == 0 || Format.wBitsPerSample < 8 || Format.wBitsPerSample > 32 ||
+        Format.nBlockAlign != Format.wBitsPerSample / 8 * Format.nChannels)
+        return eCaptureError::FORMAT;
+
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    m_Format = Format;
+    m_Records = Records;
+
+    // One second of a 440 Hz tone at -12 dBFS on all channels
+
+    unsigned int iBytesPerSample = m_Format.wBitsPerSample / 8;
+
+    m_Tone.resize((size_t)m_Format.nSamplesPerSec * m_Format.nBlockAlign);
+    m_iTonePosition = 0;
+
+    for (DWORD i = 0; i < m_Format.nSamplesPerSec; ++i)
+    {
+        double fValue = 0.25 * sin(2.0 * 3.14159265358979323846 * 440.0 * i / m_Format.nSamplesPerSec);
+
+        for (WORD c = 0; c < m_Format.nChannels; ++c)
+        {
+            unsigned char *pSample = m_Tone.data() + (size_t)i * m_Format.nBlockAlign + (size_t)c * iBytesPerSample;
+
+            if (m_Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT)
+            {
+                float fSample = (float)fValue;
+                memcpy(pSample, &fSample, sizeof(float));
+                continue;
+            }
+
+            INT64 iSample = (INT64)(fValue * ((1LL << (m_Format.wBitsPerSample - 1)) - 1));
+
+            if (m_Format.wBitsPerSample == 8)
+                iSample += 128;
+
+            for (unsigned int b = 0; b < iBytesPerSample; ++b)
+                pSample[b] = (unsigned char)(iSample >> (8 * b));
+        }
+    }
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackTraceReplay::CopyFormat(WAVEFORMATEX& Format)
+{
+    if (m_Format.nBlockAlign == 0)
+        return false;
+
+    Format = m_Format;
+
+    return true;
+}
+
+eCaptureError LoopbackTraceReplay::SetSpeed(double fSpeed)
+{
+    if (fSpeed < 0.0)
+        return eCaptureError::PARAM;
+
+    m_fSpeed = fSpeed;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTraceReplay::Replay(ProcessLoopbackCapture& Capture, sLoopbackReplayStats& Stats)
+{
+    Stats = {};
+
+    if (m_Format.nBlockAlign == 0)
+        return eCaptureError::FORMAT;
+
+    if (m_hEndEvent == NULL)
+        return eCaptureError::EVENT;
+
+    eCaptureError eError = Capture.SetCaptureFormat(m_Format.nSamplesPerSec, m_Format.wBitsPerSample, m_Format.nChannels, m_Format.wFormatTag);
+
+    if (eError != eCaptureError::NONE)
+        return eError;
+
+    eError = Capture.SetPacketSource(this);
+
+    if (eError != eCaptureError::NONE)
+        return eError;
+
+    eError = Capture.StartCapture();
+
+    if (eError != eCaptureError::NONE)
+    {
+        Capture.SetPacketSource(nullptr);
+        return eError;
+    }
+
+    WaitForEnd(INFINITE);
+
+    // Stopping joins the audio threads, the stats are not touched anymore
+    Capture.StopCapture();
+    Capture.SetPacketSource(nullptr);
+
+    Stats = m_Stats;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackTraceReplay::WaitForEnd(DWORD dwTimeout)
+{
+    if (m_hEndEvent == NULL)
+        return false;
+
+    return WaitForSingleObject(m_hEndEvent, dwTimeout) == WAIT_OBJECT_0;
+}
+
+eCaptureError LoopbackTraceReplay::Start(const WAVEFORMATEX& Format)
+{
+    if (m_bRunning)
+        return eCaptureError::STATE;
+
+    if (m_Format.nBlockAlign == 0 || Format.nSamplesPerSec != m_Format.nSamplesPerSec || Format.nChannels != m_Format.nChannels ||
+        Format.wBitsPerSample != m_Format.wBitsPerSample || Format.wFormatTag != m_Format.wFormatTag)
+        return eCaptureError::FORMAT;
+
+    if (m_hEndEvent == NULL)
+        return eCaptureError::EVENT;
+
+    // The packet buffer is sized up front, the audio thread only fills it
+
+    UINT32 iMaxFrames = 0;
+
+    for (const sLoopbackTraceRecord& Record : m_Records)
+    {
+        if (Record.Type == eLoopbackTraceRecord::PACKET)
+            iMaxFrames = max(iMaxFrames, Record.iValue);
+    }
+
+    m_Packet.assign((size_t)iMaxFrames * m_Format.nBlockAlign, 0);
+
+    // QPC positions continue from now in 100ns units, like the ones of an audio client
+
+    LARGE_INTEGER Counter{};
+    LARGE_INTEGER Frequency{};
+    QueryPerformanceCounter(&Counter);
+    QueryPerformanceFrequency(&Frequency);
+
+    UINT64 iCounter = (UINT64)Counter.QuadPart;
+    UINT64 iFrequency = (UINT64)Frequency.QuadPart;
+
+    m_iQPCStart = iFrequency != 0 ? iCounter / iFrequency * 10000000 + iCounter % iFrequency * 10000000 / iFrequency : 0;
+
+    // The schedule is relative to the first record, traces from a wrapped ring do not start at 0
+
+    m_iRecord = 0;
+    m_iTraceStart = m_Records.empty() ? 0 : m_Records.front().iTime;
+    m_iDevicePosition = 0;
+    m_iTonePosition = 0;
+    m_ReplayStart = chrono::steady_clock::now();
+    m_bDraining = false;
+    m_bEnded = false;
+    m_Stats = {};
+
+    ResetEvent(m_hEndEvent);
+    m_bRunning = true;
+
+    return eCaptureError::NONE;
+}
+
+void LoopbackTraceReplay::Stop()
+{
+    m_bRunning = false;
+
+    // Releases a WaitForEnd of a capture stopped before the end of the trace
+    SetEvent(m_hEndEvent);
+}
+
+bool LoopbackTraceReplay::WaitForPackets(DWORD dwBatchInterval)
+{
+    auto now = chrono::steady_clock::now();
+
+    // Skips to the next wake, the records in front of it belong to the one drained before (or to a wake cut off by the ring)
+
+    while (m_iRecord < m_Records.size() && m_Records[m_iRecord].Type != eLoopbackTraceRecord::WAKE)
+        ++m_iRecord;
+
+    if (m_bDraining)
+    {
+        m_bDraining = false;
+
+        m_Stats.fMaxProcessingTime = max(m_Stats.fMaxProcessingTime, chrono::duration<double, milli>(now - m_DrainStart).count());
+
+        if (m_fSpeed != 0.0 && m_iRecord < m_Records.size() && now > GetScheduledTime(m_Records[m_iRecord].iTime))
+            ++m_Stats.iOverruns;
+    }
+
+    if (m_iRecord >= m_Records.size())
+    {
+        if (!m_bEnded)
+        {
+            m_bEnded = true;
+            SetEvent(m_hEndEvent);
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(10));
+        return false;
+    }
+
+    const sLoopbackTraceRecord& Wake = m_Records[m_iRecord];
+
+    if (m_fSpeed != 0.0)
+    {
+        auto wake_time = GetScheduledTime(Wake.iTime);
+
+        // Long gaps are slept in pieces, the capture checks for a stop between waits
+        if (wake_time - now > chrono::milliseconds(50))
+        {
+            this_thread::sleep_for(chrono::milliseconds(50));
+            return false;
+        }
+
+        this_thread::sleep_until(wake_time);
+
+        now = chrono::steady_clock::now();
+        m_Stats.fMaxLateness = max(m_Stats.fMaxLateness, chrono::duration<double, milli>(now - wake_time).count());
+    }
+
+    ++m_iRecord;
+    ++m_Stats.iWakes;
+
+    // Recorded timeout
+    if (Wake.iValue == 0)
+        return false;
+
+    m_bDraining = true;
+    m_DrainStart = now;
+
+    return true;
+}
+
+HRESULT LoopbackTraceReplay::GetBuffer(BYTE **ppData, UINT32 *pFrames, DWORD *pFlags, UINT64 *pDevicePosition, UINT64 *pQPCPosition)
+{
+    // Serves the packets up to the next wake, the callback durations of the trace are only counted
+
+    while (m_iRecord < m_Records.size() && m_Records[m_iRecord].Type != eLoopbackTraceRecord::WAKE)
+    {
+        const sLoopbackTraceRecord& Record = m_Records[m_iRecord++];
+
+        if (Record.Type == eLoopbackTraceRecord::USER_CALLBACK)
+        {
+            m_Stats.fMaxRecordedCallbackTime = max(m_Stats.fMaxRecordedCallbackTime, Record.iValue / 1000.0);
+            continue;
+        }
+
+        if (Record.Type != eLoopbackTraceRecord::PACKET)
+            continue;
+
+        FillPacket(Record.iValue, (Record.iFlags & AUDCLNT_BUFFERFLAGS_SILENT) != 0);
+
+        double fOffset = (double)(Record.iTime - m_iTraceStart) * 10.0;
+
+        *ppData = m_Packet.data();
+        *pFrames = Record.iValue;
+        *pFlags = Record.iFlags;
+        *pDevicePosition = m_iDevicePosition;
+        *pQPCPosition = m_iQPCStart + (UINT64)(m_fSpeed != 0.0 ? fOffset / m_fSpeed : fOffset);
+
+        m_iDevicePosition += Record.iValue;
+
+        ++m_Stats.iPackets;
+        m_Stats.iFrames += Record.iValue;
+
+        return S_OK;
+    }
+
+    return AUDCLNT_S_BUFFER_EMPTY;
+}
+
+HRESULT LoopbackTraceReplay::ReleaseBuffer(UINT32 iFrames)
+{
+    return S_OK;
+}
+
+// private
+
+std::chrono::steady_clock::time_point LoopbackTraceReplay::GetScheduledTime(UINT64 iTime)
+{
+    if (m_fSpeed == 0.0)
+        return m_ReplayStart;
+
+    return m_ReplayStart + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, micro>((iTime - m_iTraceStart) / m_fSpeed));
+}
+
+void LoopbackTraceReplay::FillPacket(UINT32 iFrames, bool bSilent)
+{
+    size_t iBytes = (size_t)iFrames * m_Format.nBlockAlign;
+
+    if (bSilent)
+    {
+        bool bUnsigned = m_Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT && m_Format.wBitsPerSample == 8;
+        memset(m_Packet.data(), bUnsigned ? 0x80 : 0x00, iBytes);
+        return;
+    }
+
+    size_t iFilled = 0;
+
+    while (iFilled < iBytes)
+    {
+        size_t iCopy = min(iBytes - iFilled, m_Tone.size() - m_iTonePosition);
+
+        memcpy(m_Packet.data() + iFilled, m_Tone.data() + m_iTonePosition, iCopy);
+
+        m_iTonePosition = (m_iTonePosition + iCopy) % m_Tone.size();
+        iFilled += iCopy;
+    }
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,135 @@
+#pragma once
+
+/*
+
+Saving, loading and replaying wake-timing traces recorded by ProcessLoopbackCapture (see SetTraceRecording).
+
+A trace holds the schedule of the main audio thread: when it woke, which packets (frames and flags) it drained and how long
+the user callback and the whole wake took. LoopbackTraceReplay is a packet source (see ProcessLoopbackCapture::SetPacketSource)
+that feeds exactly that schedule into a capture, so the real main loop, intermediate thread, callbacks and sinks run against
+field timing (late wakes, bursts of packets, slow callbacks) and performance fixes can be compared against the same trace.
+
+Replay does not need an audio device or a target process, but still runs on the Windows API like the rest of the capture.
+Packets flagged as silent are filled with silence, all others with a test tone.
+
+    ProcessLoopbackCapture Capture;
+    Capture.SetCallback(&OnData);
+
+    LoopbackTraceReplay Replay;
+    Replay.Load(L"capture.trace");
+
+    sLoopbackReplayStats Stats;
+    Replay.Replay(Capture, Stats);
+
+File layout (little endian): sLoopbackTraceFileHeader, sLoopbackTraceRecord[iRecordCount]
+
+*/
+
+#include <ProcessLoopbackCapture.h>
+
+#include <string>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackTraceConst
+{
+    constexpr DWORD MAGIC = 0x4352544C; // 'LTRC'
+    constexpr DWORD VERSION = 1;
+}
+
+#pragma pack(push, 1)
+
+struct sLoopbackTraceFileHeader
+{
+    DWORD                           dwMagic;
+    DWORD                           dwVersion;
+    WAVEFORMATEX                    Format;
+    UINT64                          iRecordCount;
+};
+
+#pragma pack(pop)
+
+namespace LoopbackTrace
+{
+    eCaptureError Save(const std::wstring& FileName, const WAVEFORMATEX& Format, const std::vector<sLoopbackTraceRecord>& Records);
+    eCaptureError Load(const std::wstring& FileName, WAVEFORMATEX& Format, std::vector<sLoopbackTraceRecord>& Records);
+}
+
+// ------------------------------------------------------------
+
+struct sLoopbackReplayStats
+{
+    UINT64                          iWakes;                     // Recorded wakes, including timeouts
+    UINT64                          iPackets;
+    UINT64                          iFrames;
+
+    double                          fMaxLateness;               // Milliseconds the replay woke after the recorded time
+    double                          fMaxProcessingTime;         // Milliseconds from a replayed drain until the main loop waited again
+    double                          fMaxRecordedCallbackTime;   // Milliseconds, callback in the trace
+
+    UINT64                          iOverruns;                  // Drains that were not processed before the next recorded wake
+};
+
+class LoopbackTraceReplay : public ILoopbackPacketSource
+{
+public:
+
+    LoopbackTraceReplay();
+    ~LoopbackTraceReplay();
+
+    eCaptureError Load(const std::wstring& FileName);
+    eCaptureError SetTrace(const WAVEFORMATEX& Format, const std::vector<sLoopbackTraceRecord>& Records);
+    bool CopyFormat(WAVEFORMATEX& Format);
+
+    // Replay speed relative to the recording. 0 replays as fast as possible, only keeping the order of wakes and packets.
+    // Default: 1
+    eCaptureError SetSpeed(double fSpeed);
+
+    // Sets the trace's format on Capture, which must be ready (configured, not started), drives it through the whole trace and
+    // stops it again. Callbacks, sinks and the intermediate thread are whatever Capture was configured with.
+    eCaptureError Replay(ProcessLoopbackCapture& Capture, sLoopbackReplayStats& Stats);
+
+    // For captures started manually with SetPacketSource(this): true once all wakes were replayed.
+    bool WaitForEnd(DWORD dwTimeout);
+
+    // ILoopbackPacketSource, called by the capture. The batch interval is ignored, the trace already reflects it.
+    eCaptureError Start(const WAVEFORMATEX& Format) override;
+    void Stop() override;
+    bool WaitForPackets(DWORD dwBatchInterval) override;
+    HRESULT GetBuffer(BYTE **ppData, UINT32 *pFrames, DWORD *pFlags, UINT64 *pDevicePosition, UINT64 *pQPCPosition) override;
+    HRESULT ReleaseBuffer(UINT32 iFrames) override;
+
+private:
+
+    std::chrono::steady_clock::time_point GetScheduledTime(UINT64 iTime);
+    void FillPacket(UINT32 iFrames, bool bSilent);
+
+    WAVEFORMATEX                    m_Format{};
+    std::vector<sLoopbackTraceRecord>
+                                    m_Records;
+    double                          m_fSpeed;
+
+    std::vector<unsigned char>      m_Tone;     // One second of test tone
+    size_t                          m_iTonePosition;
+
+    HANDLE                          m_hEndEvent;
+    bool                            m_bRunning;
+
+    // Replay state, main audio thread while running
+    std::vector<unsigned char>      m_Packet;   // Sized for the largest packet of the trace in Start
+    size_t                          m_iRecord;
+    UINT64                          m_iTraceStart;
+    UINT64                          m_iQPCStart;
+    UINT64                          m_iDevicePosition;
+    std::chrono::steady_clock::time_point
+                                    m_ReplayStart;
+    std::chrono::steady_clock::time_point
+                                    m_DrainStart;
+    bool                            m_bDraining;
+    bool                            m_bEnded;
+
+    sLoopbackReplayStats            m_Stats{};
+};
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,382 @@
+#include <LoopbackTriggerSink.h>
+#include <LoopbackAudioLevel.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// ------------------------------------------------------------ LoopbackTriggerSink
+
+// public
+
+LoopbackTriggerSink::LoopbackTriggerSink() :
+    m_pTarget(nullptr),
+    m_LevelMode(eLoopbackTriggerLevel::PEAK),
+    m_fStartThreshold(0.1f),
+    m_fStopThreshold(0.05f),
+    m_fPreRoll(3.0),
+    m_fHoldTime(2.0),
+
+    m_pEventFunc(nullptr),
+    m_pEventFuncUserData(nullptr),
+
+    m_bOpen(false),
+
+    m_iBlockBytes(0),
+
+    m_iPreRollStart(0),
+    m_iPreRollSize(0),
+
+    m_iHoldFrames(0),
+    m_iHoldRemaining(0),
+
+    m_bTriggered(false),
+    m_iFrameCount(0),
+    m_iForwardedFrameCount(0),
+    m_iSpanCount(0)
+{
+
+}
+
+LoopbackTriggerSink::~LoopbackTriggerSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackTriggerSink::SetTarget(ILoopbackCaptureSink *pTarget)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pTarget = pTarget;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::SetLevelMode(eLoopbackTriggerLevel LevelMode)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (LevelMode != eLoopbackTriggerLevel::PEAK && LevelMode != eLoopbackTriggerLevel::RMS)
+        return eCaptureError::PARAM;
+
+    m_LevelMode = LevelMode;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::SetThresholds(float fStart, float fStop)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fStart < 0.0f || fStart > 1.0f || fStop < 0.0f || fStop > fStart)
+        return eCaptureError::PARAM;
+
+    m_fStartThreshold = fStart;
+    m_fStopThreshold = fStop;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::SetPreRoll(double fSeconds)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fSeconds < 0.0 || fSeconds > 600.0)
+        return eCaptureError::PARAM;
+
+    m_fPreRoll = fSeconds;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::SetHoldTime(double fSeconds)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fSeconds < 0.0)
+        return eCaptureError::PARAM;
+
+    m_fHoldTime = fSeconds;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::SetEventCallback(void (*pEventFunc)(eLoopbackTriggerEvent Event, UINT64 iFrame, void*), void *pUserData)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_pEventFunc = pEventFunc;
+    m_pEventFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::Open(const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || Format.nSamplesPerSec == 0 || (Format.wFormatTag != WAVE_FORMAT_PCM && Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT))
+        return eCaptureError::FORMAT;
+
+    m_Format = Format;
+    m_Format.cbSize = 0;
+
+    DWORD dwBlockFrames = m_Format.nSamplesPerSec * LoopbackTriggerConst::BLOCK_MILLISECONDS / 1000;
+
+    m_iBlockBytes = (size_t)(dwBlockFrames != 0 ? dwBlockFrames : 1) * m_Format.nBlockAlign;
+    m_PartialBlock.clear();
+    m_PartialBlock.reserve(m_iBlockBytes);
+
+    // The ring is only ever written whole frames at a time, so it never splits a frame
+
+    m_PreRoll.assign((size_t)(m_fPreRoll * m_Format.nSamplesPerSec) * m_Format.nBlockAlign, 0);
+    m_iPreRollStart = 0;
+    m_iPreRollSize = 0;
+
+    m_iHoldFrames = (UINT64)(m_fHoldTime * m_Format.nSamplesPerSec);
+    m_iHoldRemaining = 0;
+
+    m_bTriggered = false;
+    m_iFrameCount = 0;
+    m_iForwardedFrameCount = 0;
+    m_iSpanCount = 0;
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackTriggerSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    if (!m_PartialBlock.empty())
+    {
+        ProcessBlock(m_PartialBlock.data(), m_PartialBlock.size());
+        m_PartialBlock.clear();
+    }
+
+    if (m_bTriggered)
+        StopSpan();
+
+    m_PreRoll.clear();
+    m_PreRoll.shrink_to_fit();
+
+    m_bOpen = false;
+
+    return eCaptureError::NONE;
+}
+
+bool LoopbackTriggerSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackTriggerSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen)
+        return;
+
+    while (iSize > 0)
+    {
+        // Full blocks are analyzed in place, only partial blocks are buffered
+
+        if (m_PartialBlock.empty() && iSize >= m_iBlockBytes)
+        {
+            ProcessBlock(pData, m_iBlockBytes);
+            pData += m_iBlockBytes;
+            iSize -= m_iBlockBytes;
+            continue;
+        }
+
+        size_t iCopy = min(iSize, m_iBlockBytes - m_PartialBlock.size());
+
+        m_PartialBlock.insert(m_PartialBlock.end(), pData, pData + iCopy);
+        pData += iCopy;
+        iSize -= iCopy;
+
+        if (m_PartialBlock.size() == m_iBlockBytes)
+        {
+            ProcessBlock(m_PartialBlock.data(), m_PartialBlock.size());
+            m_PartialBlock.clear();
+        }
+    }
+}
+
+void LoopbackTriggerSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    // The frames before the gap are analyzed as a short block
+
+    if (!m_PartialBlock.empty())
+    {
+        ProcessBlock(m_PartialBlock.data(), m_PartialBlock.size());
+        m_PartialBlock.clear();
+    }
+
+    m_iPreRollStart = 0;
+    m_iPreRollSize = 0;
+
+    if (m_bTriggered)
+    {
+        UINT64 iSpanFrames = min(iFrames, m_iHoldRemaining);
+
+        if (m_pTarget != nullptr && iSpanFrames > 0)
+            m_pTarget->OnGap(iSpanFrames);
+
+        m_iForwardedFrameCount += iSpanFrames;
+        m_iFrameCount += iSpanFrames;
+        m_iHoldRemaining -= iSpanFrames;
+        iFrames -= iSpanFrames;
+
+        if (m_iHoldRemaining == 0)
+            StopSpan();
+    }
+
+    m_iFrameCount += iFrames;
+}
+
+bool LoopbackTriggerSink::IsTriggered()
+{
+    return m_bTriggered;
+}
+
+UINT64 LoopbackTriggerSink::GetFrameCount()
+{
+    return m_iFrameCount;
+}
+
+UINT64 LoopbackTriggerSink::GetForwardedFrameCount()
+{
+    return m_iForwardedFrameCount;
+}
+
+size_t LoopbackTriggerSink::GetSpanCount()
+{
+    return m_iSpanCount;
+}
+
+// private
+
+void LoopbackTriggerSink::ProcessBlock(const unsigned char *pData, size_t iSize)
+{
+    UINT64 iFrames = iSize / m_Format.nBlockAlign;
+
+    float fPeak = 0.0f;
+    float fRms = 0.0f;
+
+    LoopbackAudioLevel::GetLevels(pData, iSize, m_Format, fPeak, fRms);
+
+    float fLevel = m_LevelMode == eLoopbackTriggerLevel::RMS ? fRms : fPeak;
+
+    if (!m_bTriggered)
+    {
+        if (fLevel > m_fStartThreshold)
+        {
+            StartSpan();
+            Forward(pData, iSize);
+        }
+        else
+        {
+            PushPreRoll(pData, iSize);
+        }
+
+        m_iFrameCount += iFrames;
+        return;
+    }
+
+    Forward(pData, iSize);
+    m_iFrameCount += iFrames;
+
+    if (fLevel >= m_fStopThreshold)
+    {
+        m_iHoldRemaining = m_iHoldFrames;
+        return;
+    }
+
+    m_iHoldRemaining -= min(m_iHoldRemaining, iFrames);
+
+    if (m_iHoldRemaining == 0)
+        StopSpan();
+}
+
+void LoopbackTriggerSink::PushPreRoll(const unsigned char *pData, size_t iSize)
+{
+    size_t iCapacity = m_PreRoll.size();
+
+    if (iCapacity == 0)
+        return;
+
+    // Only the newest iCapacity bytes can survive
+    if (iSize > iCapacity)
+    {
+        pData += iSize - iCapacity;
+        iSize = iCapacity;
+    }
+
+    size_t iWrite = (m_iPreRollStart + m_iPreRollSize) % iCapacity;
+    size_t iFirst = min(iSize, iCapacity - iWrite);
+
+    memcpy(m_PreRoll.data() + iWrite, pData, iFirst);
+    memcpy(m_PreRoll.data(), pData + iFirst, iSize - iFirst);
+
+    // Overwritten bytes are dropped from the front
+    size_t iOverflow = m_iPreRollSize + iSize > iCapacity ? m_iPreRollSize + iSize - iCapacity : 0;
+
+    m_iPreRollStart = (m_iPreRollStart + iOverflow) % iCapacity;
+    m_iPreRollSize += iSize - iOverflow;
+}
+
+void LoopbackTriggerSink::Forward(const unsigned char *pData, size_t iSize)
+{
+    if (m_pTarget != nullptr && iSize > 0)
+        m_pTarget->OnData(pData, iSize);
+
+    m_iForwardedFrameCount += iSize / m_Format.nBlockAlign;
+}
+
+void LoopbackTriggerSink::StartSpan()
+{
+    m_bTriggered = true;
+    m_iHoldRemaining = m_iHoldFrames;
+    ++m_iSpanCount;
+
+    if (m_pEventFunc != nullptr)
+        m_pEventFunc(eLoopbackTriggerEvent::START, m_iFrameCount - m_iPreRollSize / m_Format.nBlockAlign, m_pEventFuncUserData);
+
+    // The ring holds at most two contiguous pieces
+
+    size_t iCapacity = m_PreRoll.size();
+
+    if (m_iPreRollSize > 0)
+    {
+        size_t iFirst = min(m_iPreRollSize, iCapacity - m_iPreRollStart);
+
+        Forward(m_PreRoll.data() + m_iPreRollStart, iFirst);
+        Forward(m_PreRoll.data(), m_iPreRollSize - iFirst);
+    }
+
+    m_iPreRollStart = 0;
+    m_iPreRollSize = 0;
+}
+
+void LoopbackTriggerSink::StopSpan()
+{
+    m_bTriggered = false;
+
+    if (m_pEventFunc != nullptr)
+        m_pEventFunc(eLoopbackTriggerEvent::STOP, m_iFrameCount, m_pEventFuncUserData);
+}
+
+// ------------------------------------------------------------ EOF
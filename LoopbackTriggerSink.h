@@ -0,0 +1,135 @@
+#pragma once
+
+/*
+
+Level-triggered recording for ProcessLoopbackCapture.
+
+LoopbackTriggerSink sits in front of another sink (e.g. LoopbackWavSink) and only forwards triggered spans to it. The stream is
+analyzed in blocks of 10 ms with LoopbackAudioLevel::GetLevels, on the thread that delivers the audio:
+
+- While idle, blocks go into a preallocated pre-roll ring. A block whose level (peak or RMS) exceeds the start threshold
+  triggers a span: the pre-roll is forwarded first, so the span includes the preceding seconds.
+- While triggered, all blocks are forwarded. The span ends once the level stayed below the stop threshold for the hold time.
+  A stop threshold below the start threshold (hysteresis) keeps fading audio from re-triggering.
+
+The event callback is called on the same thread right before the first frame of a span is forwarded (START) and right after the
+last one (STOP), so it can open and close a file of the target sink per span. OnData does not allocate.
+
+*/
+
+#include <LoopbackCaptureSink.h>
+
+#include <atomic>
+#include <vector>
+
+// ------------------------------------------------------------
+
+namespace LoopbackTriggerConst
+{
+    // Duration of the analysis blocks
+    constexpr DWORD BLOCK_MILLISECONDS = 10;
+}
+
+enum class eLoopbackTriggerLevel : int
+{
+    PEAK = 0,
+    RMS
+};
+
+enum class eLoopbackTriggerEvent : int
+{
+    START = 0,  // iFrame: timeline position of the first forwarded frame (start of the pre-roll)
+    STOP        // iFrame: timeline position after the last forwarded frame
+};
+
+// ------------------------------------------------------------
+
+class LoopbackTriggerSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackTriggerSink();
+    ~LoopbackTriggerSink();
+
+    // Sink that receives the triggered spans. Must stay valid while open.
+    eCaptureError SetTarget(ILoopbackCaptureSink *pTarget);
+
+    // Default: PEAK
+    eCaptureError SetLevelMode(eLoopbackTriggerLevel LevelMode);
+
+    // Levels (0-1) a block must exceed to start a span and stay below (for the hold time) to end it. fStop must not exceed fStart.
+    // Default: 0.1 (-20 dBFS), 0.05 (-26 dBFS)
+    eCaptureError SetThresholds(float fStart, float fStop);
+
+    // Seconds of audio before the trigger that are forwarded with the span.
+    // Default: 3
+    eCaptureError SetPreRoll(double fSeconds);
+
+    // Seconds the level must stay below the stop threshold before the span ends.
+    // Default: 2
+    eCaptureError SetHoldTime(double fSeconds);
+
+    eCaptureError SetEventCallback(void (*pEventFunc)(eLoopbackTriggerEvent Event, UINT64 iFrame, void*), void *pUserData = nullptr);
+
+    // Allocates the pre-roll ring. The target sink must be ready to receive data in Format.
+    eCaptureError Open(const WAVEFORMATEX& Format);
+
+    // Ends an open span (STOP event) and releases the ring.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+
+    // Counts as silence: an open span passes the gap to the target until the hold time runs out, the pre-roll is dropped so no
+    // span starts with audio from before the gap.
+    void OnGap(UINT64 iFrames) override;
+
+    bool IsTriggered();
+
+    // Length of the analyzed timeline in frames.
+    UINT64 GetFrameCount();
+
+    // Frames forwarded to the target (spans including pre-roll and gaps).
+    UINT64 GetForwardedFrameCount();
+
+    size_t GetSpanCount();
+
+private:
+
+    void ProcessBlock(const unsigned char *pData, size_t iSize);
+    void PushPreRoll(const unsigned char *pData, size_t iSize);
+    void Forward(const unsigned char *pData, size_t iSize);
+    void StartSpan();
+    void StopSpan();
+
+    ILoopbackCaptureSink            *m_pTarget;
+    eLoopbackTriggerLevel           m_LevelMode;
+    float                           m_fStartThreshold;
+    float                           m_fStopThreshold;
+    double                          m_fPreRoll;
+    double                          m_fHoldTime;
+
+    void                            (*m_pEventFunc)(eLoopbackTriggerEvent, UINT64, void*);
+    void                            *m_pEventFuncUserData;
+
+    bool                            m_bOpen;
+    WAVEFORMATEX                    m_Format{};
+
+    size_t                          m_iBlockBytes;
+    std::vector<unsigned char>      m_PartialBlock;
+
+    std::vector<unsigned char>      m_PreRoll;          // Ring of whole frames
+    size_t                          m_iPreRollStart;
+    size_t                          m_iPreRollSize;
+
+    UINT64                          m_iHoldFrames;
+    UINT64                          m_iHoldRemaining;
+
+    std::atomic<bool>               m_bTriggered;
+    std::atomic<UINT64>             m_iFrameCount;
+    std::atomic<UINT64>             m_iForwardedFrameCount;
+    std::atomic<size_t>             m_iSpanCount;
+};
+
+// ------------------------------------------------------------ EOF
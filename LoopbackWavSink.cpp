@@ -0,0 +1,377 @@
+#include <LoopbackWavSink.h>
+#include <LoopbackAudioLevel.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// ------------------------------------------------------------
+
+namespace
+{
+    // Largest data chunk that keeps the RIFF size below 4 GB (leaves room for the header)
+    constexpr UINT64 MAX_DATA_BYTES = 0xFFFFFFFFULL - 1024;
+}
+
+// ------------------------------------------------------------ LoopbackWavSink
+
+// public
+
+LoopbackWavSink::LoopbackWavSink() :
+    m_iFramesPerFile(0),
+    m_bTrimSilence(false),
+    m_fTrimThreshold(0.0f),
+
+    m_bOpen(false),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_dwHeaderSize(0),
+    m_iFileFrameLimit(0),
+    m_iFileFrames(0),
+
+    m_bActive(false),
+    m_iActiveFrameCount(0),
+    m_iActiveFileIndex(0),
+    m_iActiveFileFrames(0),
+
+    m_iFileIndex(0),
+    m_iFrameCount(0),
+    m_iLeadingFrames(0),
+    m_bWriteError(false)
+{
+
+}
+
+LoopbackWavSink::~LoopbackWavSink()
+{
+    Close();
+}
+
+eCaptureError LoopbackWavSink::SetRotation(UINT64 iFramesPerFile)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    m_iFramesPerFile = iFramesPerFile;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackWavSink::SetTrimSilence(bool bTrim, float fThreshold)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (fThreshold < 0.0f || fThreshold > 1.0f)
+        return eCaptureError::PARAM;
+
+    m_bTrimSilence = bTrim;
+    m_fTrimThreshold = fThreshold;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackWavSink::Open(const std::wstring& FileName, const WAVEFORMATEX& Format)
+{
+    if (m_bOpen)
+        return eCaptureError::STATE;
+
+    if (Format.nBlockAlign == 0 || (Format.wFormatTag != WAVE_FORMAT_PCM && Format.wFormatTag != WAVE_FORMAT_IEEE_FLOAT))
+        return eCaptureError::FORMAT;
+
+    m_FileName = FileName;
+    m_Format = Format;
+    m_Format.cbSize = 0;
+
+    m_iFileFrameLimit = MAX_DATA_BYTES / m_Format.nBlockAlign;
+
+    if (m_iFramesPerFile != 0)
+        m_iFileFrameLimit = min(m_iFileFrameLimit, m_iFramesPerFile);
+
+    m_iFileIndex = 0;
+    m_iFrameCount = 0;
+    m_iLeadingFrames = 0;
+    m_bWriteError = false;
+    m_bActive = false;
+    m_iActiveFrameCount = 0;
+    m_iActiveFileIndex = 0;
+    m_iActiveFileFrames = 0;
+
+    // Unsigned 8-bit PCM is centered at 128
+    m_Silence.assign((size_t)max(m_Format.nSamplesPerSec / 10, (DWORD)1) * m_Format.nBlockAlign,
+        m_Format.wFormatTag == WAVE_FORMAT_PCM && m_Format.wBitsPerSample == 8 ? 0x80 : 0x00);
+
+    if (!OpenFile())
+        return eCaptureError::FILE;
+
+    m_bOpen = true;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError LoopbackWavSink::Close()
+{
+    if (!m_bOpen)
+        return eCaptureError::STATE;
+
+    m_bOpen = false;
+
+    if (m_bTrimSilence && !TrimFiles())
+        m_bWriteError = true;
+
+    if (m_hFile != INVALID_HANDLE_VALUE && !CloseFile())
+        m_bWriteError = true;
+
+    return m_bWriteError ? eCaptureError::FILE : eCaptureError::NONE;
+}
+
+bool LoopbackWavSink::IsOpen()
+{
+    return m_bOpen;
+}
+
+void LoopbackWavSink::OnData(const unsigned char *pData, size_t iSize)
+{
+    if (!m_bOpen || m_hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    UINT64 iFrames = iSize / m_Format.nBlockAlign;
+
+    if (m_bTrimSilence && !m_bActive)
+    {
+        // Leading silence is never written
+
+        UINT64 iSilentFrames = LoopbackAudioLevel::FindFirstFrameAbove(pData, iSize, m_Format, m_fTrimThreshold);
+
+        m_iLeadingFrames += iSilentFrames;
+
+        if (iSilentFrames == iFrames)
+            return;
+
+        pData += iSilentFrames * m_Format.nBlockAlign;
+        iFrames -= iSilentFrames;
+        m_bActive = true;
+    }
+
+    while (iFrames > 0)
+    {
+        if (m_iFileFrames == m_iFileFrameLimit)
+        {
+            // Rotate
+
+            if (!CloseFile())
+                m_bWriteError = true;
+
+            ++m_iFileIndex;
+
+            if (!OpenFile())
+            {
+                m_bWriteError = true;
+                return;
+            }
+        }
+
+        UINT64 iWriteFrames = min(iFrames, m_iFileFrameLimit - m_iFileFrames);
+        DWORD dwSize = (DWORD)(iWriteFrames * m_Format.nBlockAlign);
+        DWORD dwBytesWritten = 0;
+
+        if (!WriteFile(m_hFile, pData, dwSize, &dwBytesWritten, NULL) || dwBytesWritten != dwSize)
+            m_bWriteError = true;
+
+        if (m_bTrimSilence)
+        {
+            UINT64 iLastActive = LoopbackAudioLevel::FindLastFrameAbove(pData, dwSize, m_Format, m_fTrimThreshold);
+
+            if (iLastActive < iWriteFrames)
+            {
+                m_iActiveFrameCount = m_iFrameCount + iLastActive + 1;
+                m_iActiveFileIndex = m_iFileIndex;
+                m_iActiveFileFrames = m_iFileFrames + iLastActive + 1;
+            }
+        }
+
+        m_iFileFrames += iWriteFrames;
+        m_iFrameCount += iWriteFrames;
+
+        pData += dwSize;
+        iFrames -= iWriteFrames;
+    }
+}
+
+void LoopbackWavSink::OnGap(UINT64 iFrames)
+{
+    if (!m_bOpen)
+        return;
+
+    // Through OnData, so rotation and trimming treat the gap like captured silence
+
+    UINT64 iSilenceFrames = m_Silence.size() / m_Format.nBlockAlign;
+
+    while (iFrames > 0)
+    {
+        UINT64 iWriteFrames = min(iFrames, iSilenceFrames);
+
+        OnData(m_Silence.data(), (size_t)iWriteFrames * m_Format.nBlockAlign);
+        iFrames -= iWriteFrames;
+    }
+}
+
+UINT64 LoopbackWavSink::GetFrameCount()
+{
+    return m_iFrameCount;
+}
+
+UINT64 LoopbackWavSink::GetLeadingSilenceFrameCount()
+{
+    return m_iLeadingFrames;
+}
+
+UINT64 LoopbackWavSink::GetBytesWritten()
+{
+    return m_iFrameCount * m_Format.nBlockAlign;
+}
+
+unsigned int LoopbackWavSink::GetFileIndex()
+{
+    return m_iFileIndex;
+}
+
+bool LoopbackWavSink::HasWriteError()
+{
+    return m_bWriteError;
+}
+
+// private
+
+bool LoopbackWavSink::OpenFile()
+{
+    m_hFile = CreateFileW(GetFileName(m_iFileIndex).c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    m_iFileFrames = 0;
+
+    // Sizes are patched in CloseFile
+
+    DWORD header[]{
+        1179011410, // 'RIFF'
+        0,
+        1163280727, // 'WAVE'
+        544501094, // 'fmt '
+        sizeof(WAVEFORMATEX)
+    };
+
+    DWORD data[]{
+        1635017060, // 'data'
+        0
+    };
+
+    DWORD dwBytesWritten = 0;
+    bool bSuccess = true;
+
+    m_dwHeaderSize = 0;
+
+    bSuccess &= WriteFile(m_hFile, header, sizeof(header), &dwBytesWritten, NULL) != FALSE;
+    m_dwHeaderSize += dwBytesWritten;
+
+    bSuccess &= WriteFile(m_hFile, &m_Format, sizeof(WAVEFORMATEX), &dwBytesWritten, NULL) != FALSE;
+    m_dwHeaderSize += dwBytesWritten;
+
+    bSuccess &= WriteFile(m_hFile, data, sizeof(data), &dwBytesWritten, NULL) != FALSE;
+    m_dwHeaderSize += dwBytesWritten;
+
+    if (!bSuccess)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    return true;
+}
+
+bool LoopbackWavSink::CloseFile()
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD dwDataSize = (DWORD)(m_iFileFrames * m_Format.nBlockAlign);
+    DWORD dwRiffSize = dwDataSize + m_dwHeaderSize - 8;
+    DWORD dwBytesWritten = 0;
+    bool bSuccess = true;
+
+    bSuccess &= SetFilePointer(m_hFile, m_dwHeaderSize - sizeof(DWORD), NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER;
+    bSuccess &= WriteFile(m_hFile, &dwDataSize, sizeof(DWORD), &dwBytesWritten, NULL) != FALSE;
+
+    bSuccess &= SetFilePointer(m_hFile, sizeof(DWORD), NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER;
+    bSuccess &= WriteFile(m_hFile, &dwRiffSize, sizeof(DWORD), &dwBytesWritten, NULL) != FALSE;
+
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+
+    return bSuccess;
+}
+
+bool LoopbackWavSink::TrimFiles()
+{
+    if (!m_bActive || m_iActiveFrameCount == m_iFrameCount)
+        return true;
+
+    bool bSuccess = true;
+
+    // Rotated files after the last frame above the threshold only hold silence
+
+    while (m_iFileIndex > m_iActiveFileIndex)
+    {
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+
+        bSuccess &= DeleteFileW(GetFileName(m_iFileIndex).c_str()) != FALSE;
+
+        --m_iFileIndex;
+    }
+
+    // Reopen the file with the last active frame if it was already finished, CloseFile patches its sizes again
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        m_hFile = CreateFileW(GetFileName(m_iFileIndex).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return false;
+    }
+
+    // Cut the file after the last active frame
+
+    LARGE_INTEGER Position{};
+    Position.QuadPart = (LONGLONG)(m_dwHeaderSize + m_iActiveFileFrames * m_Format.nBlockAlign);
+
+    m_iFileFrames = m_iActiveFileFrames;
+    m_iFrameCount = m_iActiveFrameCount;
+
+    return bSuccess && SetFilePointerEx(m_hFile, Position, NULL, FILE_BEGIN) && SetEndOfFile(m_hFile);
+}
+
+std::wstring LoopbackWavSink::GetFileName(unsigned int iIndex)
+{
+    if (iIndex == 0)
+        return m_FileName;
+
+    wstring Number = to_wstring(iIndex);
+
+    if (Number.size() < 4)
+        Number.insert(0, 4 - Number.size(), L'0');
+
+    size_t iDot = m_FileName.find_last_of(L'.');
+    size_t iSeparator = m_FileName.find_last_of(L"\\/");
+
+    if (iDot == wstring::npos || (iSeparator != wstring::npos && iDot < iSeparator))
+        return m_FileName + L"-" + Number;
+
+    return m_FileName.substr(0, iDot) + L"-" + Number + m_FileName.substr(iDot);
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,101 @@
+#pragma once
+
+/*
+
+Streaming WAV file sink for ProcessLoopbackCapture.
+
+Audio is written to disk as it arrives instead of being collected in memory. The RIFF/data sizes are patched
+when a file is finished (Close or rotation).
+
+Optionally rotates to a new file after a given number of frames. The first file has the given name, the following
+ones are numbered by inserting "-0001", "-0002", ... before the file extension, with or without rotation enabled.
+Since RIFF sizes are 32 bit, a file is always rotated before it would grow beyond 4 GB, even if rotation is disabled.
+
+Optionally trims leading and trailing silence while recording, so finished files need no post-processing. Frames before
+the first one above the threshold are never written. The position of the last frame above the threshold is tracked per
+chunk and the file containing it is truncated after it on Close. Rotated files that only hold trailing silence are deleted.
+
+Gaps (OnGap, e.g. audio shed by LoopbackQosSink) are written as silence, so the file keeps the duration of the capture.
+
+*/
+
+#include <LoopbackCaptureSink.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// ------------------------------------------------------------
+
+class LoopbackWavSink : public ILoopbackCaptureSink
+{
+public:
+
+    LoopbackWavSink();
+    ~LoopbackWavSink();
+
+    // Starts a new file every iFramesPerFile frames. 0 disables rotation (except for the 4 GB limit).
+    // Default: 0
+    eCaptureError SetRotation(UINT64 iFramesPerFile);
+
+    // Drops silence before the first and after the last frame with a sample above fThreshold (0-1).
+    // Default: disabled
+    eCaptureError SetTrimSilence(bool bTrim, float fThreshold);
+
+    eCaptureError Open(const std::wstring& FileName, const WAVEFORMATEX& Format);
+
+    // Patches the header of the current file and closes it.
+    eCaptureError Close();
+
+    bool IsOpen();
+
+    void OnData(const unsigned char *pData, size_t iSize) override;
+    void OnGap(UINT64 iFrames) override;
+
+    // Frames written in total (across all rotated files).
+    UINT64 GetFrameCount();
+
+    // Bytes of audio data written in total (across all rotated files).
+    UINT64 GetBytesWritten();
+
+    // Frames dropped as leading silence, i.e. the position of the first written frame in the captured stream.
+    UINT64 GetLeadingSilenceFrameCount();
+
+    // Index of the current file, increases with every rotation.
+    unsigned int GetFileIndex();
+
+    // Returns true if a write failed since Open.
+    bool HasWriteError();
+
+private:
+
+    bool OpenFile();
+    bool CloseFile();
+    bool TrimFiles();
+    std::wstring GetFileName(unsigned int iIndex);
+
+    UINT64                          m_iFramesPerFile;
+    bool                            m_bTrimSilence;
+    float                           m_fTrimThreshold;
+
+    bool                            m_bOpen;
+    std::wstring                    m_FileName;
+    WAVEFORMATEX                    m_Format{};
+    HANDLE                          m_hFile;
+    std::vector<unsigned char>      m_Silence;              // 100 ms, written for gaps
+    DWORD                           m_dwHeaderSize;
+    UINT64                          m_iFileFrameLimit;
+    UINT64                          m_iFileFrames;
+
+    bool                            m_bActive;              // A frame above the trim threshold was written
+    UINT64                          m_iActiveFrameCount;    // Frames up to and including the last one above the threshold
+    unsigned int                    m_iActiveFileIndex;     // File containing that frame
+    UINT64                          m_iActiveFileFrames;    // Frames of that file up to and including it
+
+    std::atomic<unsigned int>       m_iFileIndex;
+    std::atomic<UINT64>             m_iFrameCount;
+    std::atomic<UINT64>             m_iLeadingFrames;
+    std::atomic<bool>               m_bWriteError;
+};
+
+// ------------------------------------------------------------ EOF
@@ -1,6 +1,8 @@
 ﻿#include <ProcessLoopbackCapture.h>
 
 #include <chrono>
+#include <cmath>
+#include <cstring>
 
 #include <mmdeviceapi.h>
 #include <mfapi.h>
@@ -68,6 +70,306 @@ protected:
     }
 };
 
+// ------------------------------------------------------------ LoopbackEventRing
+
+LoopbackEventRing::LoopbackEventRing(size_t iCapacity) :
+    m_Ring(iCapacity),
+
+    m_iDroppedCount(0)
+{
+
+}
+
+bool LoopbackEventRing::Push(const sLoopbackEvent& Event)
+{
+    if (m_Ring.Push(Event))
+        return true;
+
+    m_iDroppedCount.fetch_add(1, memory_order_relaxed);
+
+    return false;
+}
+
+bool LoopbackEventRing::Pop(sLoopbackEvent& Event)
+{
+    return m_Ring.Pop(Event);
+}
+
+UINT64 LoopbackEventRing::GetDroppedCount()
+{
+    return m_iDroppedCount.load(memory_order_relaxed);
+}
+
+// ------------------------------------------------------------ LoopbackChunk
+
+// public
+
+const unsigned char* LoopbackChunk::GetData() const
+{
+    return m_Data.data();
+}
+
+size_t LoopbackChunk::GetSize() const
+{
+    return m_Data.size();
+}
+
+void LoopbackChunk::AddRef()
+{
+    m_iRefCount.fetch_add(1, memory_order_relaxed);
+}
+
+void LoopbackChunk::Release()
+{
+    if (m_iRefCount.fetch_sub(1, memory_order_acq_rel) != 1)
+        return;
+
+    // The chunk may be handed out or freed as soon as it is recycled, the pool reference is moved out first.
+    // If it was the last one, the pool is destroyed with all free chunks when it goes out of scope.
+
+    shared_ptr<LoopbackChunkPool> pPool = std::move(m_pPool);
+    pPool->Recycle(this);
+}
+
+// private
+
+LoopbackChunk::LoopbackChunk() :
+    m_iRefCount(0)
+{
+
+}
+
+// ------------------------------------------------------------ LoopbackChunkPool
+
+// public
+
+LoopbackChunkPool::LoopbackChunkPool(size_t iCapacity) :
+    m_FreeChunks(iCapacity),
+
+    m_iAllocationCount(0)
+{
+
+}
+
+LoopbackChunkPool::~LoopbackChunkPool()
+{
+    // Chunks that are out hold a reference, so only free chunks are left
+
+    LoopbackChunk *pChunk = nullptr;
+
+    while (m_FreeChunks.Pop(pChunk))
+        delete pChunk;
+}
+
+LoopbackChunk* LoopbackChunkPool::Acquire()
+{
+    LoopbackChunk *pChunk = nullptr;
+
+    if (!m_FreeChunks.Pop(pChunk))
+    {
+        pChunk = new LoopbackChunk;
+        m_iAllocationCount.fetch_add(1, memory_order_relaxed);
+    }
+
+    pChunk->m_iRefCount.store(1, memory_order_relaxed);
+    pChunk->m_pPool = shared_from_this();
+
+    return pChunk;
+}
+
+void LoopbackChunkPool::Reserve(size_t iBytes)
+{
+    // The free chunks are taken out and grown first, then new ones are added until the ring is full
+
+    vector<LoopbackChunk*> Chunks;
+    LoopbackChunk *pChunk = nullptr;
+
+    while (m_FreeChunks.Pop(pChunk))
+        Chunks.push_back(pChunk);
+
+    for (LoopbackChunk *pFree : Chunks)
+    {
+        pFree->m_Data.reserve(iBytes);
+
+        // Chunks released meanwhile may have taken the cell
+        if (!m_FreeChunks.Push(pFree))
+            delete pFree;
+    }
+
+    while (true)
+    {
+        pChunk = new LoopbackChunk;
+        pChunk->m_Data.reserve(iBytes);
+
+        if (!m_FreeChunks.Push(pChunk))
+        {
+            delete pChunk;
+            break;
+        }
+
+        m_iAllocationCount.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+UINT64 LoopbackChunkPool::GetAllocationCount()
+{
+    return m_iAllocationCount.load(memory_order_relaxed);
+}
+
+// private
+
+void LoopbackChunkPool::Recycle(LoopbackChunk *pChunk)
+{
+    // Keeps the capacity of the buffer
+    pChunk->m_Data.clear();
+
+    // Enough free chunks
+    if (!m_FreeChunks.Push(pChunk))
+        delete pChunk;
+}
+
+// ------------------------------------------------------------ LoopbackHistogram
+
+// Values below 16 have their own bucket. Above, the exponent selects a group of 8 buckets and the three bits below the
+// leading one select the bucket within it.
+
+LoopbackHistogram::LoopbackHistogram() :
+    m_iCount(0),
+    m_iSum(0),
+    m_iMin(UINT64_MAX),
+    m_iMax(0)
+{
+    for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        m_Buckets[i].store(0, memory_order_relaxed);
+}
+
+LoopbackHistogram::LoopbackHistogram(const LoopbackHistogram& Other) :
+    LoopbackHistogram()
+{
+    *this = Other;
+}
+
+LoopbackHistogram& LoopbackHistogram::operator=(const LoopbackHistogram& Other)
+{
+    if (this == &Other)
+        return *this;
+
+    for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        m_Buckets[i].store(Other.m_Buckets[i].load(memory_order_relaxed), memory_order_relaxed);
+
+    m_iCount.store(Other.m_iCount.load(memory_order_relaxed), memory_order_relaxed);
+    m_iSum.store(Other.m_iSum.load(memory_order_relaxed), memory_order_relaxed);
+    m_iMin.store(Other.m_iMin.load(memory_order_relaxed), memory_order_relaxed);
+    m_iMax.store(Other.m_iMax.load(memory_order_relaxed), memory_order_relaxed);
+
+    return *this;
+}
+
+void LoopbackHistogram::Record(UINT64 iValue)
+{
+    // Single writer, plain stores are enough and keep the audio threads free of locked instructions
+
+    atomic<UINT64>& Bucket = m_Buckets[GetBucketIndex(iValue)];
+    Bucket.store(Bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+
+    m_iCount.store(m_iCount.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    m_iSum.store(m_iSum.load(memory_order_relaxed) + iValue, memory_order_relaxed);
+
+    if (iValue < m_iMin.load(memory_order_relaxed))
+        m_iMin.store(iValue, memory_order_relaxed);
+
+    if (iValue > m_iMax.load(memory_order_relaxed))
+        m_iMax.store(iValue, memory_order_relaxed);
+}
+
+void LoopbackHistogram::Reset()
+{
+    for (size_t i = 0; i < BUCKET_COUNT; ++i)
+        m_Buckets[i].store(0, memory_order_relaxed);
+
+    m_iCount.store(0, memory_order_relaxed);
+    m_iSum.store(0, memory_order_relaxed);
+    m_iMin.store(UINT64_MAX, memory_order_relaxed);
+    m_iMax.store(0, memory_order_relaxed);
+}
+
+UINT64 LoopbackHistogram::GetCount() const
+{
+    return m_iCount.load(memory_order_relaxed);
+}
+
+UINT64 LoopbackHistogram::GetMin() const
+{
+    return GetCount() != 0 ? m_iMin.load(memory_order_relaxed) : 0;
+}
+
+UINT64 LoopbackHistogram::GetMax() const
+{
+    return m_iMax.load(memory_order_relaxed);
+}
+
+double LoopbackHistogram::GetMean() const
+{
+    UINT64 iCount = GetCount();
+
+    return iCount != 0 ? (double)m_iSum.load(memory_order_relaxed) / (double)iCount : 0.0;
+}
+
+UINT64 LoopbackHistogram::GetPercentile(double fPercentile) const
+{
+    UINT64 iCount = GetCount();
+
+    if (iCount == 0)
+        return 0;
+
+    fPercentile = min(max(fPercentile, 0.0), 100.0);
+
+    UINT64 iRank = max((UINT64)ceil(fPercentile / 100.0 * (double)iCount), (UINT64)1);
+    UINT64 iSeen = 0;
+    UINT64 iMax = GetMax();
+
+    for (size_t i = 0; i < BUCKET_COUNT; ++i)
+    {
+        iSeen += m_Buckets[i].load(memory_order_relaxed);
+
+        if (iSeen >= iRank)
+            return i + 1 < BUCKET_COUNT ? min(GetBucketLowerBound(i + 1) - 1, iMax) : iMax;
+    }
+
+    return iMax;
+}
+
+UINT64 LoopbackHistogram::GetBucketCount(size_t iBucket) const
+{
+    return iBucket < BUCKET_COUNT ? m_Buckets[iBucket].load(memory_order_relaxed) : 0;
+}
+
+size_t LoopbackHistogram::GetBucketIndex(UINT64 iValue)
+{
+    if (iValue < 16)
+        return (size_t)iValue;
+
+    size_t iExponent = 4;
+
+    while (iExponent < 39 && (iValue >> (iExponent + 1)) != 0)
+        ++iExponent;
+
+    if ((iValue >> (iExponent + 1)) != 0)
+        return BUCKET_COUNT - 1;
+
+    return 16 + (iExponent - 4) * 8 + (size_t)((iValue >> (iExponent - 3)) & 7);
+}
+
+UINT64 LoopbackHistogram::GetBucketLowerBound(size_t iBucket)
+{
+    if (iBucket < 16)
+        return iBucket;
+
+    size_t iExponent = (iBucket - 16) / 8 + 4;
+
+    return (UINT64)(8 + (iBucket - 16) % 8) << (iExponent - 3);
+}
+
 // ------------------------------------------------------------ ProcessLoopbackCapture
 
 // public
@@ -75,31 +377,68 @@ protected:
 ProcessLoopbackCapture::ProcessLoopbackCapture() :
     m_hrLastError(S_OK),
 
-    m_CaptureState(eCaptureState::READY),
     m_pAudioClient(nullptr),
     m_pAudioCaptureClient(nullptr),
     m_hSampleReadyEvent(NULL),
+    m_hStopEvent(NULL),
     m_bCaptureFormatInitialized(false),
     m_dwProcessId(0),
     m_bProcessInclusive(false),
     m_bUseIntermediateThread(false),
+    m_pPacketSource(nullptr),
 
     m_pCallbackFunc(nullptr),
     m_pCallbackFuncUserData(nullptr),
+    m_pChunkFunc(nullptr),
+    m_pChunkFuncUserData(nullptr),
     m_dwCallbackInterval(100),
+    m_dwBatchInterval(0),
+    m_dwActiveBatchInterval(0),
+    m_iTraceCapacity(0),
+    m_CaptureWindowStart(eCaptureWindowStart::IMMEDIATE),
+    m_iCaptureWindowStart(0),
+    m_iCaptureWindowFrames(0),
+    m_hCaptureWindowEvent(NULL),
+    m_bTimingStatistics(false),
+    m_iBufferFrames(0),
+    m_pEventRing(nullptr),
+    m_iEventSource(0),
+    m_pRetargetAudioClient(nullptr),
+    m_pRetargetAudioCaptureClient(nullptr),
+    m_hRetargetSampleReadyEvent(NULL),
+    m_hRetargetEvent(NULL),
+    m_bExternalDrain(false),
+    m_hDataEvent(NULL),
+    m_pPhaseHistograms(make_unique<LoopbackHistogram[]>(LoopbackCaptureConst::OperationCount * LoopbackCaptureConst::PhaseCount)),
+    m_LastPhaseTimings{},
+    m_bPhaseTimingValid{},
+
+    m_pMainAudioThread(nullptr),
+    m_pQueueAudioThread(nullptr),
 
     m_bRunAudioThreads(false),
+    m_CaptureState(eCaptureState::READY),
 
-    m_pMainAudioThread(nullptr),
     m_dwMainThreadBytesToSkip(0),
-    m_fMaxExecutionTime(0.0),
-
-    m_pQueueAudioThread(nullptr)
+    m_iWakeupCount(0),
+    m_CaptureWindow{},
+    m_iTraceCount(0),
+    m_bResetTimingStatistics(false),
+    m_bRetargetPending(false),
+    m_bRetargetAligned(false),
+    m_iRetargetGap(0),
+    m_fMaxExecutionTime(0.0)
 
 #if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
     ,
-    m_Queue(8192)
+    m_Queue(8192),
+    m_TimestampAnchors(LoopbackCaptureConst::TimestampAnchorCapacity)
 #endif
+    ,
+    m_iDrainWritePosition(0),
+    m_iCallbackDevicePosition(0),
+    m_iCallbackQPCPosition(0),
+    m_iDrainReadPosition(0)
 {
     
 }
@@ -107,6 +446,9 @@ ProcessLoopbackCapture::ProcessLoopbackCapture() :
 ProcessLoopbackCapture::~ProcessLoopbackCapture()
 {
     StopCapture();
+
+    if (m_hDataEvent != NULL)
+        CloseHandle(m_hDataEvent);
 }
 
 eCaptureError ProcessLoopbackCapture::SetCaptureFormat(unsigned int iSampleRate, unsigned int iBitDepth, unsigned int iChannelCount, unsigned int iFormatTag)
@@ -164,6 +506,16 @@ eCaptureError ProcessLoopbackCapture::SetTargetProcess(DWORD dwProcessId, bool b
     return eCaptureError::NONE;
 }
 
+eCaptureError ProcessLoopbackCapture::SetPacketSource(ILoopbackPacketSource *pSource)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    m_pPacketSource = pSource;
+
+    return eCaptureError::NONE;
+}
+
 eCaptureError ProcessLoopbackCapture::SetCallback(void (*pCallbackFunc)(const std::vector<unsigned char>::iterator&, const std::vector<unsigned char>::iterator&, void*), void *pUserData)
 {
     if (m_CaptureState != eCaptureState::READY)
@@ -175,6 +527,23 @@ eCaptureError ProcessLoopbackCapture::SetCallback(void (*pCallbackFunc)(const st
     return eCaptureError::NONE;
 }
 
+eCaptureError ProcessLoopbackCapture::SetChunkCallback(void (*pChunkFunc)(LoopbackChunk *pChunk, void*), void *pUserData, size_t iPoolCapacity)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    if (pChunkFunc != nullptr && iPoolCapacity == 0)
+        return eCaptureError::PARAM;
+
+    // Chunks of a previous pool keep it alive until they are released
+    m_pChunkPool = pChunkFunc != nullptr ? make_shared<LoopbackChunkPool>(iPoolCapacity) : nullptr;
+
+    m_pChunkFunc = pChunkFunc;
+    m_pChunkFuncUserData = pUserData;
+
+    return eCaptureError::NONE;
+}
+
 eCaptureError ProcessLoopbackCapture::SetCallbackInterval(DWORD dwInterval)
 {
     if (m_CaptureState != eCaptureState::READY)
@@ -202,424 +571,1649 @@ eCaptureError ProcessLoopbackCapture::SetIntermediateThreadEnabled(bool bEnable)
     return eCaptureError::NONE;
 }
 
-eCaptureState ProcessLoopbackCapture::GetState()
-{
-    return m_CaptureState.load();
-}
-
-eCaptureError ProcessLoopbackCapture::StartCapture()
+eCaptureError ProcessLoopbackCapture::SetExternalDrain(bool bEnable, size_t iBufferSize)
 {
     if (m_CaptureState != eCaptureState::READY)
         return eCaptureError::STATE;
 
-    if (!m_bCaptureFormatInitialized)
-        return eCaptureError::FORMAT;
+    if (!bEnable)
+    {
+        if (m_hDataEvent != NULL)
+        {
+            CloseHandle(m_hDataEvent);
+            m_hDataEvent = NULL;
+        }
 
-    if (!m_dwProcessId)
-        return eCaptureError::PROCESSID;
+        m_DrainRing.clear();
+        m_DrainRing.shrink_to_fit();
+        m_DrainData.clear();
+        m_DrainData.shrink_to_fit();
 
-    // Set up Params
+        m_iDrainWritePosition.store(0, memory_order_relaxed);
+        m_iDrainReadPosition.store(0, memory_order_relaxed);
 
-    AUDIOCLIENT_ACTIVATION_PARAMS blob{};
-    blob.ActivationType = AUDIOCLIENT_ACTIVATION_TYPE_PROCESS_LOOPBACK;
-    blob.ProcessLoopbackParams.ProcessLoopbackMode = m_bProcessInclusive ? PROCESS_LOOPBACK_MODE_INCLUDE_TARGET_PROCESS_TREE : PROCESS_LOOPBACK_MODE_EXCLUDE_TARGET_PROCESS_TREE;
-    blob.ProcessLoopbackParams.TargetProcessId = m_dwProcessId;
+        m_bExternalDrain = false;
 
-    PROPVARIANT activation_params{};
-    activation_params.vt = VT_BLOB;
-    activation_params.blob.cbSize = sizeof(AUDIOCLIENT_ACTIVATION_PARAMS);
-    activation_params.blob.pBlobData = (BYTE*)&blob;
+        return eCaptureError::NONE;
+    }
 
-    // Activate ("Async")
+    if (iBufferSize == 0 || iBufferSize > ((size_t)1 << 30))
+        return eCaptureError::PARAM;
 
-    IActivateAudioInterfaceAsyncOperation* activation_operation = nullptr;
-    ActivateAudioInterfaceAsyncCallback async_callback;
+    // Auto-reset, a wake consumes the signal and data written after it signals again
 
-    m_hrLastError = ActivateAudioInterfaceAsync(VIRTUAL_AUDIO_DEVICE_PROCESS_LOOPBACK, __uuidof(IAudioClient), &activation_params, &async_callback, &activation_operation);
+    if (m_hDataEvent == NULL)
+    {
+        m_hDataEvent = CreateEventW(NULL, false, false, NULL);
 
-    if (m_hrLastError != S_OK)
+        if (m_hDataEvent == NULL)
+        {
+            m_hrLastError = HRESULT_FROM_WIN32(GetLastError());
+            return eCaptureError::EVENT;
+        }
+    }
+
+    size_t iRingSize = 1;
+
+    while (iRingSize < iBufferSize)
+        iRingSize <<= 1;
+
+    // Data that was not drained yet is kept unless the ring changes size
+
+    if (iRingSize != m_DrainRing.size())
     {
-        Reset();
-        return eCaptureError::DEVICE;
+        m_DrainRing.assign(iRingSize, 0);
+        m_DrainData.reserve(iRingSize);
+
+        m_iDrainWritePosition.store(0, memory_order_relaxed);
+        m_iDrainReadPosition.store(0, memory_order_relaxed);
     }
 
-    async_callback.Wait();
+    m_bExternalDrain = true;
 
-    m_hrLastError = activation_operation->GetActivateResult(&m_hrLastError, reinterpret_cast<IUnknown**>(&m_pAudioClient));
-    activation_operation->Release();
+    return eCaptureError::NONE;
+}
 
-    if (m_hrLastError != S_OK)
+HANDLE ProcessLoopbackCapture::GetDataEvent()
+{
+    return m_hDataEvent;
+}
+
+eCaptureError ProcessLoopbackCapture::Drain(size_t& iBytes)
+{
+    iBytes = 0;
+
+    const unsigned char *pData1 = nullptr;
+    const unsigned char *pData2 = nullptr;
+    size_t iSize1 = 0;
+    size_t iSize2 = 0;
+
+    eCaptureError eError = PeekDrain(pData1, iSize1, pData2, iSize2);
+
+    if (eError != eCaptureError::NONE)
+        return eError;
+
+    size_t iSize = iSize1 + iSize2;
+
+    if (iSize == 0)
+        return eCaptureError::NONE;
+
+    if (m_pChunkFunc != nullptr)
     {
-        Reset();
-        return eCaptureError::ACTIVATION;
+        // The chunk outlives the ring space, the spans are copied into its pooled buffer and released right away
+
+        LoopbackChunk *pChunk = m_pChunkPool->Acquire();
+
+        pChunk->m_Data.assign(pData1, pData1 + iSize1);
+        pChunk->m_Data.insert(pChunk->m_Data.end(), pData2, pData2 + iSize2);
+
+        ReleaseDrain(iSize);
+
+        m_pChunkFunc(pChunk, m_pChunkFuncUserData);
     }
-    
-    // Initialize (AudioClient is valid)
+    else if (iSize2 == 0)
+    {
+        // In place, the main audio thread gets the space back once the callback returned
 
-    m_hrLastError = m_pAudioClient->Initialize(
-        AUDCLNT_SHAREMODE_SHARED,
-        AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
-        0, // buffer duration (100ns units), 10 = 1 micro, 10000 = 1 milli. Does not seem to do anything for this mode (Win10).
-        0, // device periodicty, do not use for Capture Clients.
-        &m_CaptureFormat,
-        nullptr);
+        if (m_pCallbackFunc != nullptr)
+        {
+            auto i1 = m_DrainRing.begin() + (pData1 - m_DrainRing.data());
+            auto i2 = i1 + iSize1;
+
+            m_pCallbackFunc(i1, i2, m_pCallbackFuncUserData);
+        }
+
+        ReleaseDrain(iSize);
+    }
+    else
+    {
+        // Wrapped, the callback takes one contiguous block. The space is released before the callback runs, so the main audio
+        // thread can refill it meanwhile.
+
+        m_DrainData.assign(pData1, pData1 + iSize1);
+        m_DrainData.insert(m_DrainData.end(), pData2, pData2 + iSize2);
+
+        ReleaseDrain(iSize);
+
+        if (m_pCallbackFunc != nullptr)
+        {
+            auto i1 = m_DrainData.begin();
+            auto i2 = m_DrainData.end();
+
+            m_pCallbackFunc(i1, i2, m_pCallbackFuncUserData);
+        }
+    }
+
+    iBytes = iSize;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::PeekDrain(const unsigned char*& pData1, size_t& iSize1, const unsigned char*& pData2, size_t& iSize2)
+{
+    pData1 = nullptr;
+    pData2 = nullptr;
+    iSize1 = 0;
+    iSize2 = 0;
+
+    if (!m_bExternalDrain)
+        return eCaptureError::NOT_AVAILABLE;
+
+    size_t iReadPosition = m_iDrainReadPosition.load(memory_order_relaxed);
+    size_t iWritePosition = m_iDrainWritePosition.load(memory_order_acquire);
+
+    if (iWritePosition == iReadPosition)
+        return eCaptureError::NONE;
+
+    size_t iSize = iWritePosition - iReadPosition;
+    size_t iOffset = iReadPosition & (m_DrainRing.size() - 1);
+
+    pData1 = m_DrainRing.data() + iOffset;
+    iSize1 = min(iSize, m_DrainRing.size() - iOffset);
+
+    if (iSize1 < iSize)
+    {
+        pData2 = m_DrainRing.data();
+        iSize2 = iSize - iSize1;
+    }
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::ReleaseDrain(size_t iBytes)
+{
+    if (!m_bExternalDrain)
+        return eCaptureError::NOT_AVAILABLE;
+
+    size_t iReadPosition = m_iDrainReadPosition.load(memory_order_relaxed);
+    size_t iWritePosition = m_iDrainWritePosition.load(memory_order_acquire);
+
+    if (iBytes > iWritePosition - iReadPosition)
+        return eCaptureError::PARAM;
+
+    // The main audio thread may overwrite the space from now on
+    m_iDrainReadPosition.store(iReadPosition + iBytes, memory_order_release);
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::SetBatchInterval(DWORD dwInterval)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    m_dwBatchInterval = dwInterval;
+
+    return eCaptureError::NONE;
+}
+
+DWORD ProcessLoopbackCapture::GetBatchInterval()
+{
+    return m_dwActiveBatchInterval;
+}
+
+double ProcessLoopbackCapture::GetWakeupsPerSecond()
+{
+    if (m_CaptureState == eCaptureState::READY)
+        return 0.0;
+
+    double fSeconds = chrono::duration<double>(chrono::steady_clock::now() - m_WakeupCountStart).count();
+
+    return fSeconds > 0.0 ? m_iWakeupCount.load(memory_order_relaxed) / fSeconds : 0.0;
+}
+
+eCaptureError ProcessLoopbackCapture::SetTraceRecording(size_t iMaxRecords)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    m_iTraceCapacity = iMaxRecords;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::GetTrace(std::vector<sLoopbackTraceRecord>& Records)
+{
+    if (m_CaptureState == eCaptureState::CAPTURING)
+        return eCaptureError::STATE;
+
+    Records.clear();
+
+    if (m_Trace.empty())
+        return eCaptureError::NONE;
+
+    // Unwrap the ring, oldest record first
+
+    size_t iCount = (size_t)min(m_iTraceCount, (UINT64)m_Trace.size());
+    size_t iFirst = (size_t)((m_iTraceCount - iCount) % m_Trace.size());
+
+    Records.reserve(iCount);
+
+    for (size_t i = 0; i < iCount; ++i)
+        Records.push_back(m_Trace[(iFirst + i) % m_Trace.size()]);
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::SetEventLog(LoopbackEventRing *pRing, UINT16 iSource)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    m_pEventRing = pRing;
+    m_iEventSource = iSource;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::SetCaptureWindow(eCaptureWindowStart Start, UINT64 iStart, UINT64 iFrameCount)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    if (Start != eCaptureWindowStart::IMMEDIATE && Start != eCaptureWindowStart::QPC && Start != eCaptureWindowStart::DEVICE_POSITION)
+        return eCaptureError::PARAM;
+
+    m_CaptureWindowStart = Start;
+    m_iCaptureWindowStart = iStart;
+    m_iCaptureWindowFrames = iFrameCount;
+
+    return eCaptureError::NONE;
+}
+
+bool ProcessLoopbackCapture::WaitForCaptureWindow(DWORD dwTimeout)
+{
+    if (m_hCaptureWindowEvent == NULL)
+        return false;
+
+    return WaitForSingleObject(m_hCaptureWindowEvent, dwTimeout) == WAIT_OBJECT_0;
+}
+
+eCaptureError ProcessLoopbackCapture::SetTimingStatistics(bool bEnable)
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    m_bTimingStatistics = bEnable;
+
+    return eCaptureError::NONE;
+}
+
+void ProcessLoopbackCapture::ResetTimingStatistics()
+{
+    // Without a running writer the histograms can be cleared here, otherwise the main audio thread does it
+
+    if (m_CaptureState == eCaptureState::READY || !m_bTimingStatistics)
+    {
+        m_WakeIntervals.Reset();
+        m_PacketSizes.Reset();
+        m_bResetTimingStatistics = false;
+        return;
+    }
+
+    m_bResetTimingStatistics = true;
+}
+
+LoopbackHistogram ProcessLoopbackCapture::GetWakeIntervalHistogram()
+{
+    return m_WakeIntervals;
+}
+
+LoopbackHistogram ProcessLoopbackCapture::GetPacketSizeHistogram()
+{
+    return m_PacketSizes;
+}
+
+eCaptureError ProcessLoopbackCapture::GetTimingReport(sLoopbackTimingReport& Report)
+{
+    Report = {};
+
+    LoopbackHistogram WakeIntervals = m_WakeIntervals;
+    LoopbackHistogram PacketSizes = m_PacketSizes;
+
+    if (WakeIntervals.GetCount() == 0 || PacketSizes.GetCount() == 0 || m_CaptureFormat.nSamplesPerSec == 0)
+        return eCaptureError::NOT_AVAILABLE;
+
+    double fSampleRate = (double)m_CaptureFormat.nSamplesPerSec;
+
+    Report.iWakeCount = WakeIntervals.GetCount();
+
+    Report.iPacketFramesMedian = PacketSizes.GetPercentile(50.0);
+    Report.iPacketFramesP99 = PacketSizes.GetPercentile(99.0);
+    Report.iPacketFramesMax = PacketSizes.GetMax();
+    Report.fPacketDuration = Report.iPacketFramesMedian * 1000.0 / fSampleRate;
+
+    UINT64 iMedian = WakeIntervals.GetPercentile(50.0);
+    UINT64 iP999 = WakeIntervals.GetPercentile(99.9);
+
+    Report.fWakeIntervalMedian = iMedian / 1000.0;
+    Report.fWakeIntervalP99 = WakeIntervals.GetPercentile(99.0) / 1000.0;
+    Report.fWakeIntervalP999 = iP999 / 1000.0;
+    Report.fWakeIntervalMax = WakeIntervals.GetMax() / 1000.0;
+
+    // Buckets entirely above twice the median
+    UINT64 iLate = 0;
+
+    for (size_t i = LoopbackHistogram::GetBucketIndex(iMedian * 2) + 1; i < LoopbackHistogram::BUCKET_COUNT; ++i)
+        iLate += WakeIntervals.GetBucketCount(i);
+
+    Report.fLateWakeRatio = (double)iLate / (double)Report.iWakeCount;
+
+    // Packets wait in the buffer until the next wake, a wake later than half the buffer leaves no room for the next one
+
+    Report.fBufferDuration = m_iBufferFrames * 1000.0 / fSampleRate;
+    Report.fRecommendedBufferDuration = max(Report.fWakeIntervalP999 * 2.0, Report.fPacketDuration * 2.0);
+    Report.bRaiseBufferSize = Report.fBufferDuration > 0.0 && Report.fWakeIntervalP999 * 2.0 > Report.fBufferDuration;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::GetPhaseTiming(eLoopbackOperation Operation, sLoopbackPhaseTiming& Timing)
+{
+    size_t iOperation = (size_t)Operation;
+
+    if (iOperation >= LoopbackCaptureConst::OperationCount)
+        return eCaptureError::PARAM;
+
+    lock_guard<mutex> Lock(m_PhaseLock);
+
+    if (!m_bPhaseTimingValid[iOperation])
+        return eCaptureError::NOT_AVAILABLE;
+
+    Timing = m_LastPhaseTimings[iOperation];
+
+    return eCaptureError::NONE;
+}
+
+LoopbackHistogram ProcessLoopbackCapture::GetPhaseHistogram(eLoopbackOperation Operation, eLoopbackPhase Phase)
+{
+    if ((size_t)Operation >= LoopbackCaptureConst::OperationCount || (size_t)Phase >= LoopbackCaptureConst::PhaseCount)
+        return LoopbackHistogram();
+
+    return m_pPhaseHistograms[(size_t)Operation * LoopbackCaptureConst::PhaseCount + (size_t)Phase];
+}
+
+void ProcessLoopbackCapture::ResetPhaseStatistics()
+{
+    for (size_t i = 0; i < LoopbackCaptureConst::OperationCount * LoopbackCaptureConst::PhaseCount; ++i)
+        m_pPhaseHistograms[i].Reset();
+
+    lock_guard<mutex> Lock(m_PhaseLock);
+
+    for (size_t i = 0; i < LoopbackCaptureConst::OperationCount; ++i)
+        m_bPhaseTimingValid[i] = false;
+}
+
+eCaptureState ProcessLoopbackCapture::GetState()
+{
+    return m_CaptureState.load();
+}
+
+eCaptureError ProcessLoopbackCapture::StartCapture()
+{
+    if (m_CaptureState != eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    if (!m_bCaptureFormatInitialized)
+        return eCaptureError::FORMAT;
+
+    if (!m_dwProcessId && m_pPacketSource == nullptr)
+        return eCaptureError::PROCESSID;
+
+    auto Start = chrono::steady_clock::now();
+
+    sLoopbackPhaseTiming Timing{};
+    Timing.Operation = eLoopbackOperation::START_CAPTURE;
+
+    eCaptureError eError = OpenCapture(Timing);
+
+    RecordPhaseTiming(Timing, Start, eError);
+
+    return eError;
+}
+
+eCaptureError ProcessLoopbackCapture::StopCapture()
+{
+    if (m_CaptureState == eCaptureState::READY)
+        return eCaptureError::STATE;
+
+    Reset();
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::PauseCapture()
+{
+    if (m_CaptureState != eCaptureState::CAPTURING)
+        return eCaptureError::STATE;
+
+    if (m_pPacketSource != nullptr)
+        return eCaptureError::NOT_AVAILABLE;
+
+    auto Start = chrono::steady_clock::now();
+    auto PhaseStart = Start;
+
+    sLoopbackPhaseTiming Timing{};
+    Timing.Operation = eLoopbackOperation::PAUSE;
+
+    m_CaptureState = eCaptureState::PAUSED;
+
+    m_hrLastError = m_pAudioClient->Stop();
+
+    EndPhase(Timing, eLoopbackPhase::STOP, PhaseStart);
+
+    if (m_hrLastError != S_OK)
+    {
+        RecordPhaseTiming(Timing, Start, eCaptureError::STOP);
+        return eCaptureError::STOP;
+    }
+
+    StopThreads();
+
+    EndPhase(Timing, eLoopbackPhase::STOP_THREADS, PhaseStart);
+    RecordPhaseTiming(Timing, Start, eCaptureError::NONE);
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::ResumeCapture(double fInitialDurationToSkip)
+{
+    if (m_CaptureState != eCaptureState::PAUSED)
+        return eCaptureError::STATE;
+
+    if (m_pPacketSource != nullptr)
+        return eCaptureError::NOT_AVAILABLE;
+
+    auto Start = chrono::steady_clock::now();
+    auto PhaseStart = Start;
+
+    sLoopbackPhaseTiming Timing{};
+    Timing.Operation = eLoopbackOperation::RESUME;
+
+    m_CaptureState = eCaptureState::CAPTURING;
+
+    ResetEvent(m_hSampleReadyEvent);
+    m_hrLastError = m_pAudioClient->Start();
+
+    EndPhase(Timing, eLoopbackPhase::START, PhaseStart);
+
+    if (m_hrLastError != S_OK)
+    {
+        RecordPhaseTiming(Timing, Start, eCaptureError::START);
+        return eCaptureError::START;
+    }
+
+    StartThreads(fInitialDurationToSkip);
+
+    EndPhase(Timing, eLoopbackPhase::START_THREADS, PhaseStart);
+    RecordPhaseTiming(Timing, Start, eCaptureError::NONE);
+
+    return eCaptureError::NONE;
+}
+eCaptureError ProcessLoopbackCapture::Retarget(DWORD dwProcessId, bool bInclusive)
+{
+    if (m_CaptureState != eCaptureState::CAPTURING)
+        return eCaptureError::STATE;
+
+    if (!dwProcessId)
+        return eCaptureError::PROCESSID;
+
+    if (m_pPacketSource != nullptr)
+        return eCaptureError::NOT_AVAILABLE;
+
+    auto Start = chrono::steady_clock::now();
+
+    sLoopbackPhaseTiming Timing{};
+    Timing.Operation = eLoopbackOperation::RETARGET;
+
+    if (m_hRetargetEvent == NULL)
+    {
+        m_hRetargetEvent = CreateEventW(NULL, false, false, NULL);
+
+        if (m_hRetargetEvent == NULL)
+        {
+            m_hrLastError = HRESULT_FROM_WIN32(GetLastError());
+            RecordPhaseTiming(Timing, Start, eCaptureError::EVENT);
+            return eCaptureError::EVENT;
+        }
+    }
+
+    // The old client keeps running meanwhile, activation is what takes hundreds of milliseconds
+
+    eCaptureError eError = CreateAudioClient(dwProcessId, bInclusive, m_pRetargetAudioClient, m_pRetargetAudioCaptureClient, m_hRetargetSampleReadyEvent, Timing);
+
+    if (eError != eCaptureError::NONE)
+    {
+        RecordPhaseTiming(Timing, Start, eError);
+        return eError;
+    }
+
+    auto PhaseStart = chrono::steady_clock::now();
+
+    m_hrLastError = m_pRetargetAudioClient->Start();
+
+    EndPhase(Timing, eLoopbackPhase::START, PhaseStart);
+
+    if (m_hrLastError != S_OK)
+    {
+        ReleaseAudioClient(m_pRetargetAudioClient, m_pRetargetAudioCaptureClient, m_hRetargetSampleReadyEvent);
+        RecordPhaseTiming(Timing, Start, eCaptureError::START);
+        return eCaptureError::START;
+    }
+
+    // Hand the client to the main audio thread. Waking it early is only possible when it waits on the sample ready event,
+    // a batching thread switches after its current interval.
+
+    HANDLE hSampleReadyEvent = m_hSampleReadyEvent; // Swapped by the main audio thread
+
+    m_bRetargetAligned = false;
+    m_bRetargetPending.store(true, memory_order_release);
+
+    if (m_dwActiveBatchInterval == 0)
+        SetEvent(hSampleReadyEvent);
+
+    // Bounded, the main audio thread may have stopped or hang in a callback. Giving up clears m_bRetargetPending, unless the
+    // thread claimed the client meanwhile: then the switch is already under way and the event follows right away.
+
+    auto WaitStart = chrono::steady_clock::now();
+    auto Timeout = chrono::milliseconds(LoopbackCaptureConst::RetargetSwitchTimeout + 2 * m_dwActiveBatchInterval);
+
+    while (WaitForSingleObject(m_hRetargetEvent, LoopbackCaptureConst::RetargetPollInterval) != WAIT_OBJECT_0)
+    {
+        if (m_bRunAudioThreads && chrono::steady_clock::now() - WaitStart < Timeout)
+            continue;
+
+        bool bPending = true;
+
+        if (m_bRetargetPending.compare_exchange_strong(bPending, false, memory_order_acq_rel))
+        {
+            EndPhase(Timing, eLoopbackPhase::SWITCH, PhaseStart);
+
+            m_pRetargetAudioClient->Stop();
+            ReleaseAudioClient(m_pRetargetAudioClient, m_pRetargetAudioCaptureClient, m_hRetargetSampleReadyEvent);
+
+            m_hrLastError = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+            RecordPhaseTiming(Timing, Start, eCaptureError::START);
+            return eCaptureError::START;
+        }
+    }
+
+    EndPhase(Timing, eLoopbackPhase::SWITCH, PhaseStart);
+
+    // The old client was swapped in
+    m_pRetargetAudioClient->Stop();
+
+    EndPhase(Timing, eLoopbackPhase::STOP, PhaseStart);
+
+    ReleaseAudioClient(m_pRetargetAudioClient, m_pRetargetAudioCaptureClient, m_hRetargetSampleReadyEvent);
+
+    EndPhase(Timing, eLoopbackPhase::RELEASE, PhaseStart);
+
+    if (m_pAudioClient->GetBufferSize(&m_iBufferFrames) != S_OK)
+        m_iBufferFrames = 0;
+
+    m_dwProcessId = dwProcessId;
+    m_bProcessInclusive = bInclusive;
+
+    RecordPhaseTiming(Timing, Start, eCaptureError::NONE);
+
+    return eCaptureError::NONE;
+}
+
+bool ProcessLoopbackCapture::GetRetargetGap(INT64& iFrames)
+{
+    if (!m_bRetargetAligned.load(memory_order_acquire))
+        return false;
+
+    iFrames = m_iRetargetGap.load(memory_order_relaxed);
+
+    return true;
+}
+
+HRESULT ProcessLoopbackCapture::GetLastErrorResult()
+{
+    return m_hrLastError.load(memory_order_relaxed);
+}
+
+void ProcessLoopbackCapture::GetCallbackTimestamp(UINT64& iDevicePosition, UINT64& iQPCPosition)
+{
+    iDevicePosition = m_iCallbackDevicePosition;
+    iQPCPosition = m_iCallbackQPCPosition;
+}
+
+double ProcessLoopbackCapture::GetMaxExecutionTime()
+{
+    return m_fMaxExecutionTime.load(memory_order_relaxed);
+}
+
+void ProcessLoopbackCapture::ResetMaxExecutionTime()
+{
+    m_fMaxExecutionTime.store(0.0, memory_order_relaxed);
+}
+
+eCaptureError ProcessLoopbackCapture::GetQueueSize(size_t& iSize)
+{
+    if (m_bExternalDrain)
+    {
+        size_t iReadPosition = m_iDrainReadPosition.load(memory_order_relaxed);
+        iSize = m_iDrainWritePosition.load(memory_order_relaxed) - iReadPosition;
+
+        return eCaptureError::NONE;
+    }
+
+#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
+
+    if (!m_bUseIntermediateThread)
+    {
+        iSize = 0U;
+        return eCaptureError::NOT_AVAILABLE;
+    }
+
+    iSize = m_Queue.size_approx();
+    return eCaptureError::NONE;
+
+#else
+
+    iSize = 0U;
+    return eCaptureError::NOT_AVAILABLE;
+
+#endif
+}
+
+// private
+
+void ProcessLoopbackCapture::Reset()
+{
+    auto Start = chrono::steady_clock::now();
+    auto PhaseStart = Start;
+
+    sLoopbackPhaseTiming Timing{};
+    Timing.Operation = eLoopbackOperation::RESET;
+
+    StopThreads();
+
+    EndPhase(Timing, eLoopbackPhase::STOP_THREADS, PhaseStart);
+
+    if (m_CaptureState == eCaptureState::CAPTURING)
+    {
+        if (m_pPacketSource != nullptr)
+            m_pPacketSource->Stop();
+        else
+            m_pAudioClient->Stop();
+
+        EndPhase(Timing, eLoopbackPhase::STOP, PhaseStart);
+    }
+
+    ReleaseAudioClient(m_pAudioClient, m_pAudioCaptureClient, m_hSampleReadyEvent);
+
+    EndPhase(Timing, eLoopbackPhase::RELEASE, PhaseStart);
+
+    if (m_hStopEvent != NULL)
+    {
+        CloseHandle(m_hStopEvent);
+        m_hStopEvent = NULL;
+    }
+
+    if (m_hCaptureWindowEvent != NULL)
+    {
+        CloseHandle(m_hCaptureWindowEvent);
+        m_hCaptureWindowEvent = NULL;
+    }
+
+    if (m_hRetargetEvent != NULL)
+    {
+        CloseHandle(m_hRetargetEvent);
+        m_hRetargetEvent = NULL;
+    }
+
+    m_dwActiveBatchInterval = 0;
+
+    m_CaptureState = eCaptureState::READY;
+
+    RecordPhaseTiming(Timing, Start, eCaptureError::NONE);
+}
+
+eCaptureError ProcessLoopbackCapture::OpenCapture(sLoopbackPhaseTiming& Timing)
+{
+    // A packet source replaces the audio client
+    eCaptureError eError = eCaptureError::NONE;
+
+    if (m_pPacketSource == nullptr)
+        eError = CreateAudioClient(m_dwProcessId, m_bProcessInclusive, m_pAudioClient, m_pAudioCaptureClient, m_hSampleReadyEvent, Timing);
+
+    if (eError != eCaptureError::NONE)
+    {
+        Reset();
+        return eError;
+    }
+
+    // Batching: the buffer must hold at least two intervals, older Windows versions may ignore the requested duration
+
+    m_dwActiveBatchInterval = m_dwBatchInterval;
+
+    if (m_pAudioClient == nullptr || m_pAudioClient->GetBufferSize(&m_iBufferFrames) != S_OK)
+        m_iBufferFrames = 0;
+
+    if (m_dwBatchInterval != 0)
+    {
+        UINT32 iBufferFrames = m_iBufferFrames;
+
+        if (iBufferFrames != 0)
+        {
+            DWORD dwMaxInterval = (DWORD)((UINT64)iBufferFrames * 1000 / m_CaptureFormat.nSamplesPerSec / 2);
+
+            if (m_dwActiveBatchInterval > dwMaxInterval)
+                m_dwActiveBatchInterval = dwMaxInterval;
+        }
+
+        // Below 10ms, batching would not save any wakeups
+        if (m_dwActiveBatchInterval < 10)
+            m_dwActiveBatchInterval = 0;
+    }
+
+    // The sample ready event stays registered while batching, it is just not waited on
+
+    if (m_dwActiveBatchInterval != 0)
+    {
+        m_hStopEvent = CreateEventW(NULL, true, false, NULL);
+
+        if (m_hStopEvent == NULL)
+        {
+            m_hrLastError = HRESULT_FROM_WIN32(GetLastError());
+            Reset();
+            return eCaptureError::EVENT;
+        }
+    }
+
+    // Capture window, QPC starts are compared with the packet timestamps in 100ns units
+
+    m_CaptureWindow = {};
+
+    if (m_iCaptureWindowFrames != 0)
+    {
+        m_CaptureWindow.Start = m_CaptureWindowStart;
+        m_CaptureWindow.iStart = m_iCaptureWindowStart;
+        m_CaptureWindow.iFramesLeft = m_iCaptureWindowFrames;
+
+        if (m_CaptureWindowStart == eCaptureWindowStart::QPC)
+        {
+            LARGE_INTEGER Frequency{};
+            QueryPerformanceFrequency(&Frequency);
+
+            UINT64 iFrequency = (UINT64)Frequency.QuadPart;
+            m_CaptureWindow.iStart = m_iCaptureWindowStart / iFrequency * 10000000 + m_iCaptureWindowStart % iFrequency * 10000000 / iFrequency;
+        }
+
+        m_hCaptureWindowEvent = CreateEventW(NULL, true, false, NULL);
+
+        if (m_hCaptureWindowEvent == NULL)
+        {
+            m_hrLastError = HRESULT_FROM_WIN32(GetLastError());
+            Reset();
+            return eCaptureError::EVENT;
+        }
+    }
+
+    // Start
+
+    auto PhaseStart = chrono::steady_clock::now();
+
+    if (m_pPacketSource != nullptr)
+    {
+        eError = m_pPacketSource->Start(m_CaptureFormat);
+
+        EndPhase(Timing, eLoopbackPhase::START, PhaseStart);
+
+        if (eError != eCaptureError::NONE)
+        {
+            Reset();
+            return eError;
+        }
+    }
+    else
+    {
+        m_hrLastError = m_pAudioClient->Start();
+
+        EndPhase(Timing, eLoopbackPhase::START, PhaseStart);
+
+        if (m_hrLastError != S_OK)
+        {
+            Reset();
+            return eCaptureError::START;
+        }
+    }
+
+    // The trace of the previous capture is kept until the next one starts
+
+    m_Trace.assign(m_iTraceCapacity, sLoopbackTraceRecord{});
+    m_Trace.shrink_to_fit();
+    m_iTraceCount = 0;
+    m_TraceStart = chrono::steady_clock::now();
+
+    PhaseStart = chrono::steady_clock::now();
+
+    StartThreads(0.0);
+
+    EndPhase(Timing, eLoopbackPhase::START_THREADS, PhaseStart);
+
+    m_CaptureState = eCaptureState::CAPTURING;
+
+    return eCaptureError::NONE;
+}
+
+eCaptureError ProcessLoopbackCapture::CreateAudioClient(DWORD dwProcessId, bool bInclusive, IAudioClient*& pAudioClient, IAudioCaptureClient*& pAudioCaptureClient, HANDLE& hSampleReadyEvent, sLoopbackPhaseTiming& Timing)
+{
+    auto PhaseStart = chrono::steady_clock::now();
+
+    // Set up Params
+
+    AUDIOCLIENT_ACTIVATION_PARAMS blob{};
+    blob.ActivationType = AUDIOCLIENT_ACTIVATION_TYPE_PROCESS_LOOPBACK;
+    blob.ProcessLoopbackParams.ProcessLoopbackMode = bInclusive ? PROCESS_LOOPBACK_MODE_INCLUDE_TARGET_PROCESS_TREE : PROCESS_LOOPBACK_MODE_EXCLUDE_TARGET_PROCESS_TREE;
+    blob.ProcessLoopbackParams.TargetProcessId = dwProcessId;
+
+    PROPVARIANT activation_params{};
+    activation_params.vt = VT_BLOB;
+    activation_params.blob.cbSize = sizeof(AUDIOCLIENT_ACTIVATION_PARAMS);
+    activation_params.blob.pBlobData = (BYTE*)&blob;
+
+    // Activate ("Async")
+
+    IActivateAudioInterfaceAsyncOperation* activation_operation = nullptr;
+    ActivateAudioInterfaceAsyncCallback async_callback;
+
+    m_hrLastError = ActivateAudioInterfaceAsync(VIRTUAL_AUDIO_DEVICE_PROCESS_LOOPBACK, __uuidof(IAudioClient), &activation_params, &async_callback, &activation_operation);
+
+    if (m_hrLastError != S_OK)
+    {
+        EndPhase(Timing, eLoopbackPhase::ACTIVATE, PhaseStart);
+        ReleaseAudioClient(pAudioClient, pAudioCaptureClient, hSampleReadyEvent);
+        return eCaptureError::DEVICE;
+    }
+
+    async_callback.Wait();
+
+    HRESULT hrActivate = E_FAIL;
+    HRESULT hr = activation_operation->GetActivateResult(&hrActivate, reinterpret_cast<IUnknown**>(&pAudioClient));
+
+    m_hrLastError = FAILED(hr) ? hr : hrActivate;
+    activation_operation->Release();
+
+    EndPhase(Timing, eLoopbackPhase::ACTIVATE, PhaseStart);
+
+    if (m_hrLastError != S_OK)
+    {
+        ReleaseAudioClient(pAudioClient, pAudioCaptureClient, hSampleReadyEvent);
+        return eCaptureError::ACTIVATION;
+    }
+    
+    // Initialize (AudioClient is valid)
+
+    m_hrLastError = pAudioClient->Initialize(
+        AUDCLNT_SHAREMODE_SHARED,
+        AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK | AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,
+        (REFERENCE_TIME)m_dwBatchInterval * 2 * 10000, // buffer duration (100ns units), 10 = 1 micro, 10000 = 1 milli. 0 if not batching.
+        0, // device periodicty, do not use for Capture Clients.
+        &m_CaptureFormat,
+        nullptr);
+
+    EndPhase(Timing, eLoopbackPhase::INITIALIZE, PhaseStart);
+
+    if (m_hrLastError != S_OK)
+    {
+        ReleaseAudioClient(pAudioClient, pAudioCaptureClient, hSampleReadyEvent);
+        return eCaptureError::INITIALIZE;
+    }
+
+    // Get CaptureClient pointer (used to get the samples)
+
+    m_hrLastError = pAudioClient->GetService(IID_PPV_ARGS(&pAudioCaptureClient));
+
+    EndPhase(Timing, eLoopbackPhase::GET_SERVICE, PhaseStart);
+
+    if (m_hrLastError != S_OK)
+    {
+        ReleaseAudioClient(pAudioClient, pAudioCaptureClient, hSampleReadyEvent);
+        return eCaptureError::SERVICE;
+    }
+
+    // Create and set event
+
+    hSampleReadyEvent = CreateEventW(NULL, false, false, NULL);
+
+    m_hrLastError = pAudioClient->SetEventHandle(hSampleReadyEvent); // Fails if event fails to create
+
+    EndPhase(Timing, eLoopbackPhase::SET_EVENT_HANDLE, PhaseStart);
+
+    if(m_hrLastError != S_OK || hSampleReadyEvent == NULL) // NULL check so VS doesn't cry
+    {
+        ReleaseAudioClient(pAudioClient, pAudioCaptureClient, hSampleReadyEvent);
+        return eCaptureError::EVENT;
+    }
+
+    return eCaptureError::NONE;
+}
+
+void ProcessLoopbackCapture::ReleaseAudioClient(IAudioClient*& pAudioClient, IAudioCaptureClient*& pAudioCaptureClient, HANDLE& hSampleReadyEvent)
+{
+    if (pAudioCaptureClient != nullptr)
+    {
+        pAudioCaptureClient->Release();
+        pAudioCaptureClient = nullptr;
+    }
+
+    if (pAudioClient != nullptr)
+    {
+        pAudioClient->Reset();
+        pAudioClient->Release();
+        pAudioClient = nullptr;
+    }
+
+    if (hSampleReadyEvent != NULL)
+    {
+        CloseHandle(hSampleReadyEvent);
+        hSampleReadyEvent = NULL;
+    }
+}
+
+void ProcessLoopbackCapture::StartThreads(double fInitialDurationToSkip)
+{
+    if (m_bRunAudioThreads)
+        return;
+
+    if (fInitialDurationToSkip < 0.0)
+        fInitialDurationToSkip = 0.0;
+
+    m_dwMainThreadBytesToSkip = (DWORD)(m_CaptureFormat.nSamplesPerSec * fInitialDurationToSkip) * (DWORD)m_CaptureFormat.nBlockAlign;
+
+    m_iWakeupCount.store(0, memory_order_relaxed);
+    m_WakeupCountStart = chrono::steady_clock::now();
+
+    // The delivery buffers are sized before the threads run, so neither m_AudioData nor the chunk buffers swapped into it grow on
+    // the audio threads. A delivery holds up to a client buffer, a batch or a callback interval of audio, doubled for late wakes.
+
+    DWORD dwDeliveryInterval = m_dwActiveBatchInterval;
+
+#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
+    if (m_bUseIntermediateThread && !m_bExternalDrain)
+        dwDeliveryInterval = max(dwDeliveryInterval, m_dwCallbackInterval);
+#endif
+
+    size_t iDeliveryFrames = max((size_t)m_iBufferFrames, (size_t)m_CaptureFormat.nSamplesPerSec * dwDeliveryInterval / 1000);
+    iDeliveryFrames = max(iDeliveryFrames, (size_t)m_CaptureFormat.nSamplesPerSec / 100);
+
+    size_t iDeliveryBytes = 2 * iDeliveryFrames * m_CaptureFormat.nBlockAlign;
+
+    m_AudioData.reserve(iDeliveryBytes);
+
+    if (m_pChunkPool != nullptr && !m_bExternalDrain)
+        m_pChunkPool->Reserve(iDeliveryBytes);
+
+    if (m_hStopEvent != NULL)
+        ResetEvent(m_hStopEvent);
+
+    m_bRunAudioThreads = true;
+
+#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
+
+    if (m_bUseIntermediateThread && !m_bExternalDrain)
+    {
+        m_pMainAudioThread = new thread(&ProcessLoopbackCapture::ProcessMainToQueue, this);
+        m_pQueueAudioThread = new thread(&ProcessLoopbackCapture::ProcessIntermediate, this);
+    }
+    else
+    {
+        m_pMainAudioThread = new thread(&ProcessLoopbackCapture::ProcessMainToCallback, this);
+        m_pQueueAudioThread = nullptr;
+    }
+
+#else
+
+    m_pMainAudioThread = new thread(&ProcessLoopbackCapture::ProcessMainToCallback, this);
+    m_pQueueAudioThread = nullptr;
+
+#endif
+}
+
+void ProcessLoopbackCapture::StopThreads()
+{
+    if (!m_bRunAudioThreads)
+        return;
+
+    m_bRunAudioThreads = false;
+
+    if (m_hStopEvent != NULL)
+        SetEvent(m_hStopEvent);
+
+#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
+
+    m_pMainAudioThread->join();
+
+    if (m_pQueueAudioThread != nullptr)
+    {
+        m_pQueueAudioThread->join();
+        delete m_pQueueAudioThread;
+        m_pQueueAudioThread = nullptr;
+    }
+
+    delete m_pMainAudioThread;
+    m_pMainAudioThread = nullptr;
+
+    // Flush
+    unsigned char Flush[1024];
+    while (m_Queue.try_dequeue_bulk(Flush, sizeof(Flush)) > 0);
+
+    sTimestampAnchor Anchor;
+    while (m_TimestampAnchors.Pop(Anchor));
+
+#else
+
+    m_pMainAudioThread->join();
+    delete m_pMainAudioThread;
+    m_pMainAudioThread = nullptr;
+
+#endif
+
+    m_AudioData.clear();
+    m_AudioData.shrink_to_fit();
+}
 
-    if (m_hrLastError != S_OK)
-    {
-        Reset();
-        return eCaptureError::INITIALIZE;
-    }
+void ProcessLoopbackCapture::DeliverChunk(std::vector<unsigned char>& Data, size_t iSize)
+{
+    LoopbackChunk *pChunk = m_pChunkPool->Acquire();
 
-    // Get CaptureClient pointer (used to get the samples)
+    if (iSize == Data.size())
+        pChunk->m_Data.swap(Data); // Data gets the empty buffer of the recycled chunk
+    else
+        pChunk->m_Data.assign(Data.begin(), Data.begin() + iSize);
 
-    m_hrLastError = m_pAudioClient->GetService(IID_PPV_ARGS(&m_pAudioCaptureClient));
+    m_pChunkFunc(pChunk, m_pChunkFuncUserData);
+}
 
-    if (m_hrLastError != S_OK)
-    {
-        Reset();
-        return eCaptureError::SERVICE;
-    }
+size_t ProcessLoopbackCapture::WriteDrainRing(const unsigned char *pData, size_t iSize)
+{
+    size_t iWritePosition = m_iDrainWritePosition.load(memory_order_relaxed);
+    size_t iReadPosition = m_iDrainReadPosition.load(memory_order_acquire);
 
-    // Create and set event
+    size_t iFree = m_DrainRing.size() - (iWritePosition - iReadPosition);
+    size_t iCopy = min(iSize, iFree);
 
-    m_hSampleReadyEvent = CreateEventW(NULL, false, false, NULL);
+    iCopy -= iCopy % m_CaptureFormat.nBlockAlign;
 
-    m_hrLastError = m_pAudioClient->SetEventHandle(m_hSampleReadyEvent); // Fails if event fails to create
+    if (iCopy == 0)
+        return 0;
 
-    if(m_hrLastError != S_OK || m_hSampleReadyEvent == NULL) // NULL check so VS doesn't cry
-    {
-        Reset();
-        return eCaptureError::EVENT;
-    }
+    size_t iOffset = iWritePosition & (m_DrainRing.size() - 1);
+    size_t iFirst = min(iCopy, m_DrainRing.size() - iOffset);
 
-    // Start
+    memcpy(m_DrainRing.data() + iOffset, pData, iFirst);
+    memcpy(m_DrainRing.data(), pData + iFirst, iCopy - iFirst);
 
-    m_hrLastError = m_pAudioClient->Start();
+    m_iDrainWritePosition.store(iWritePosition + iCopy, memory_order_release);
 
-    if (m_hrLastError != S_OK)
-    {
-        Reset();
-        return eCaptureError::START;
-    }
+    SetEvent(m_hDataEvent);
 
-    StartThreads(0.0);
+    return iCopy;
+}
 
-    m_CaptureState = eCaptureState::CAPTURING;
+void ProcessLoopbackCapture::AdvanceTimestamp(UINT64& iDevicePosition, UINT64& iQPCPosition, UINT64 iFrames)
+{
+    iDevicePosition += iFrames;
 
-    return eCaptureError::NONE;
+    if (iQPCPosition != 0)
+        iQPCPosition += iFrames * 10000000 / m_CaptureFormat.nSamplesPerSec;
 }
 
-eCaptureError ProcessLoopbackCapture::StopCapture()
+void ProcessLoopbackCapture::EndPhase(sLoopbackPhaseTiming& Timing, eLoopbackPhase Phase, std::chrono::steady_clock::time_point& PhaseStart)
 {
-    if (m_CaptureState == eCaptureState::READY)
-        return eCaptureError::STATE;
+    auto Now = chrono::steady_clock::now();
 
-    Reset();
+    Timing.fDurations[(size_t)Phase] += chrono::duration<double, milli>(Now - PhaseStart).count();
+    Timing.iPhaseMask |= 1U << (UINT32)Phase;
 
-    return eCaptureError::NONE;
+    PhaseStart = Now;
 }
 
-eCaptureError ProcessLoopbackCapture::PauseCapture()
+void ProcessLoopbackCapture::RecordPhaseTiming(sLoopbackPhaseTiming& Timing, std::chrono::steady_clock::time_point Start, eCaptureError Result)
 {
-    if (m_CaptureState != eCaptureState::CAPTURING)
-        return eCaptureError::STATE;
+    Timing.Result = Result;
 
-    m_CaptureState = eCaptureState::PAUSED;
+    EndPhase(Timing, eLoopbackPhase::TOTAL, Start);
 
-    m_hrLastError = m_pAudioClient->Stop();
+    size_t iOperation = (size_t)Timing.Operation;
 
-    if (m_hrLastError != S_OK)
-        return eCaptureError::STOP;
+    for (size_t i = 0; i < LoopbackCaptureConst::PhaseCount; ++i)
+    {
+        if (Timing.iPhaseMask & (1U << i))
+            m_pPhaseHistograms[iOperation * LoopbackCaptureConst::PhaseCount + i].Record((UINT64)(Timing.fDurations[i] * 1000.0 + 0.5));
+    }
 
-    StopThreads();
+    lock_guard<mutex> Lock(m_PhaseLock);
 
-    return eCaptureError::NONE;
+    m_LastPhaseTimings[iOperation] = Timing;
+    m_bPhaseTimingValid[iOperation] = true;
 }
 
-eCaptureError ProcessLoopbackCapture::ResumeCapture(double fInitialDurationToSkip)
+void ProcessLoopbackCapture::UpdateMaxExecutionTime(double fDuration)
 {
-    if (m_CaptureState != eCaptureState::PAUSED)
-        return eCaptureError::STATE;
+    // Single writer (main audio thread). A relaxed load keeps the line shared and it is only written when the maximum grows,
+    // so there is no read-modify-write and no line ownership transfer in the common case.
 
-    m_CaptureState = eCaptureState::CAPTURING;
+    if (fDuration > m_fMaxExecutionTime.load(memory_order_relaxed))
+        m_fMaxExecutionTime.store(fDuration, memory_order_relaxed);
+}
 
-    ResetEvent(m_hSampleReadyEvent);
-    m_hrLastError = m_pAudioClient->Start();
+bool ProcessLoopbackCapture::WaitForPackets(DWORD dwBatchInterval)
+{
+    if (m_pPacketSource != nullptr)
+        return m_pPacketSource->WaitForPackets(dwBatchInterval);
 
-    if (m_hrLastError != S_OK)
-        return eCaptureError::START;
+    // The sample ready event is signaled if either a packet is ready or the capture was stopped.
 
-    StartThreads(fInitialDurationToSkip);
+    if (dwBatchInterval == 0)
+        return WaitForSingleObject(m_hSampleReadyEvent, 50) == WAIT_OBJECT_0;
 
-    return eCaptureError::NONE;
+    // Batching: sleep for the whole interval and drain everything that accumulated meanwhile. Stopping ends the wait early.
+
+    return WaitForSingleObject(m_hStopEvent, dwBatchInterval) == WAIT_TIMEOUT;
 }
 
-HRESULT ProcessLoopbackCapture::GetLastErrorResult()
+HRESULT ProcessLoopbackCapture::GetPacket(BYTE **ppData, UINT32 *pFrames, DWORD *pFlags, UINT64 *pDevicePosition, UINT64 *pQPCPosition)
 {
-    return m_hrLastError;
+    if (m_pPacketSource != nullptr)
+        return m_pPacketSource->GetBuffer(ppData, pFrames, pFlags, pDevicePosition, pQPCPosition);
+
+    return m_pAudioCaptureClient->GetBuffer(ppData, pFrames, pFlags, pDevicePosition, pQPCPosition);
 }
 
-double ProcessLoopbackCapture::GetMaxExecutionTime()
+HRESULT ProcessLoopbackCapture::ReleasePacket(UINT32 iFrames)
 {
-    return m_fMaxExecutionTime;
+    if (m_pPacketSource != nullptr)
+        return m_pPacketSource->ReleaseBuffer(iFrames);
+
+    return m_pAudioCaptureClient->ReleaseBuffer(iFrames);
 }
 
-void ProcessLoopbackCapture::ResetMaxExecutionTime()
+void ProcessLoopbackCapture::AddTraceRecord(eLoopbackTraceRecord Type, std::chrono::steady_clock::time_point Time, UINT32 iValue, UINT16 iFlags)
 {
-    m_fMaxExecutionTime = 0.0;
+    // Preallocated ring, the oldest record is overwritten
+
+    sLoopbackTraceRecord& Record = m_Trace[(size_t)(m_iTraceCount++ % m_Trace.size())];
+
+    Record.iTime = (UINT64)chrono::duration_cast<chrono::microseconds>(Time - m_TraceStart).count();
+    Record.iValue = iValue;
+    Record.iFlags = iFlags;
+    Record.Type = Type;
 }
 
-eCaptureError ProcessLoopbackCapture::GetQueueSize(size_t& iSize)
+void ProcessLoopbackCapture::RecordWakeInterval(std::chrono::steady_clock::time_point& LastDrain, std::chrono::steady_clock::time_point Now)
 {
-#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
-
-    if (!m_bUseIntermediateThread)
+    if (m_bResetTimingStatistics.load(memory_order_relaxed))
     {
-        iSize = 0U;
-        return eCaptureError::NOT_AVAILABLE;
+        m_WakeIntervals.Reset();
+        m_PacketSizes.Reset();
+        m_bResetTimingStatistics = false;
+        LastDrain = {};
     }
 
-    iSize = m_Queue.size_approx();
-    return eCaptureError::NONE;
+    // The first drain after a start or resume has no predecessor
+    if (LastDrain != chrono::steady_clock::time_point{})
+        m_WakeIntervals.Record((UINT64)chrono::duration_cast<chrono::microseconds>(Now - LastDrain).count());
 
-#else
+    LastDrain = Now;
+}
 
-    iSize = 0U;
-    return eCaptureError::NOT_AVAILABLE;
+UINT64 ProcessLoopbackCapture::SwitchToRetargetClient(UINT64 iLastQPCPosition, UINT32 iLastFrames)
+{
+    // The controlling thread waits in Retarget, nothing else touches the clients meanwhile
 
-#endif
-}
+    swap(m_pAudioClient, m_pRetargetAudioClient);
+    swap(m_pAudioCaptureClient, m_pRetargetAudioCaptureClient);
+    swap(m_hSampleReadyEvent, m_hRetargetSampleReadyEvent);
 
-// private
+    SetEvent(m_hRetargetEvent);
 
-void ProcessLoopbackCapture::Reset()
+    if (iLastQPCPosition == 0)
+    {
+        m_iRetargetGap.store(0, memory_order_relaxed);
+        m_bRetargetAligned.store(true, memory_order_release);
+        LogEvent(eLoopbackEvent::RETARGET_COMPLETE, 0);
+        return 0;
+    }
+
+    return iLastQPCPosition + (UINT64)iLastFrames * 10000000 / m_CaptureFormat.nSamplesPerSec;
+}
+
+UINT32 ProcessLoopbackCapture::AlignRetargetPacket(UINT64& iAlignQPC, INT64& iDropped, UINT32 iFrames, UINT64 iQPCPosition, DWORD dwCaptureFlags)
 {
-    StopThreads();
+    INT64 iGap = 0;
+    UINT32 iDrop = 0;
 
-    if (m_CaptureState == eCaptureState::CAPTURING)
+    if (iQPCPosition != 0 && !(dwCaptureFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR))
     {
-        m_pAudioClient->Stop();
+        INT64 iDifference = (INT64)(iQPCPosition - iAlignQPC);
+
+        if (iDifference >= 0)
+        {
+            iGap = iDropped > 0 ? -iDropped : iDifference * m_CaptureFormat.nSamplesPerSec / 10000000;
+        }
+        else
+        {
+            // The new client was started before the switch, its frames up to the end of the old stream are dropped (rounded up)
+
+            UINT64 iOverlap = ((UINT64)-iDifference * m_CaptureFormat.nSamplesPerSec + 9999999) / 10000000;
+
+            if (iOverlap >= iFrames)
+            {
+                iDropped += iFrames;
+                return iFrames;
+            }
+
+            iDrop = (UINT32)iOverlap;
+            iGap = -(iDropped + iDrop);
+        }
     }
 
-    if (m_pAudioCaptureClient != nullptr)
+    // Aligned, or the timestamps cannot be trusted
+    iAlignQPC = 0;
+
+    m_iRetargetGap.store(iGap, memory_order_relaxed);
+    m_bRetargetAligned.store(true, memory_order_release);
+    LogEvent(eLoopbackEvent::RETARGET_COMPLETE, (UINT64)iGap);
+
+    return iDrop;
+}
+
+void ProcessLoopbackCapture::LogEvent(eLoopbackEvent Type, UINT64 iValue, UINT32 iValue2)
+{
+    if (m_pEventRing == nullptr)
+        return;
+
+    sLoopbackEvent Event;
+    Event.iTime = (UINT64)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    Event.iValue = iValue;
+    Event.iValue2 = iValue2;
+    Event.iSource = m_iEventSource;
+    Event.Type = Type;
+
+    m_pEventRing->Push(Event);
+}
+
+void ProcessLoopbackCapture::ClipToCaptureWindow(sCaptureWindow& Window, UINT32 iFrames, UINT64 iDevicePosition, UINT64 iQPCPosition, UINT32& iBegin, UINT32& iEnd)
+{
+    iEnd = iFrames;
+
+    if (Window.iFramesLeft == 0)
     {
-        m_pAudioCaptureClient->Release();
-        m_pAudioCaptureClient = nullptr;
+        iBegin = iFrames;
+        return;
     }
 
-    if (m_pAudioClient != nullptr)
+    if (!Window.bStarted)
     {
-        m_pAudioClient->Reset();
-        m_pAudioClient->Release();
-        m_pAudioClient = nullptr;
+        UINT64 iOffset = 0;
+
+        switch (Window.Start)
+        {
+        case eCaptureWindowStart::QPC:
+            if (Window.iStart > iQPCPosition)
+                iOffset = ((Window.iStart - iQPCPosition) * m_CaptureFormat.nSamplesPerSec + 9999999) / 10000000;
+            break;
+
+        case eCaptureWindowStart::DEVICE_POSITION:
+            if (Window.iStart > iDevicePosition)
+                iOffset = Window.iStart - iDevicePosition;
+            break;
+
+        default:
+            break;
+        }
+
+        iBegin = (UINT32)max((UINT64)iBegin, min(iOffset, (UINT64)iFrames));
+
+        if (iBegin == iFrames)
+            return;
+
+        Window.bStarted = true;
     }
 
-    if (m_hSampleReadyEvent != NULL)
+    iEnd = iBegin + (UINT32)min((UINT64)(iFrames - iBegin), Window.iFramesLeft);
+    Window.iFramesLeft -= iEnd - iBegin;
+}
+
+void ProcessLoopbackCapture::StartMainThread(sMainThread& Thread)
+{
+    DWORD dwTaskIndex = 0;
+    Thread.hTaskHandle = AvSetMmThreadCharacteristicsW(L"Pro Audio", &dwTaskIndex);
+
+    Thread.dwBytesToSkip = m_dwMainThreadBytesToSkip;
+    Thread.dwBatchInterval = m_dwActiveBatchInterval;
+    Thread.iWakeups = 0;
+    Thread.bTrace = !m_Trace.empty();
+    Thread.bTiming = m_bTimingStatistics;
+    Thread.LastDrain = {};
+    Thread.DrainStart = {};
+
+    Thread.Window = m_CaptureWindow;
+    Thread.bWindow = m_hCaptureWindowEvent != NULL;
+    Thread.bWindowComplete = false;
+
+    Thread.iLastQPCPosition = 0;
+    Thread.iLastFrames = 0;
+    Thread.iAlignQPC = 0;
+    Thread.iRetargetDropped = 0;
+
+    Thread.dwBytesSkipped = Thread.dwBytesToSkip;
+    Thread.dwLastCaptureFlags = 0;
+    Thread.hrLastFailure = S_OK;
+
+    LogEvent(eLoopbackEvent::THREAD_START, 0, Thread.hTaskHandle ? 1 : 0);
+}
+
+void ProcessLoopbackCapture::StopMainThread(sMainThread& Thread)
+{
+    m_CaptureWindow = Thread.Window;
+
+    LogEvent(eLoopbackEvent::THREAD_STOP);
+
+    if (Thread.hTaskHandle)
+        AvRevertMmThreadCharacteristics(Thread.hTaskHandle);
+}
+
+bool ProcessLoopbackCapture::BeginMainDrain(sMainThread& Thread)
+{
+    bool bDrain = WaitForPackets(Thread.dwBatchInterval);
+
+    m_iWakeupCount.store(++Thread.iWakeups, memory_order_relaxed);
+
+    if (Thread.bTrace)
+        AddTraceRecord(eLoopbackTraceRecord::WAKE, chrono::steady_clock::now(), bDrain ? 1 : 0, 0);
+
+    // The capture was stopped, the thread exits
+    if (!m_bRunAudioThreads)
+        return false;
+
+    if (!bDrain)
     {
-        CloseHandle(m_hSampleReadyEvent);
-        m_hSampleReadyEvent = NULL;
+        // No packet within the wait: the old client stalled (e.g. its process exited), nothing of it is left to deliver
+        if (Thread.dwBatchInterval == 0)
+            SwitchPendingRetarget(Thread);
+
+        return false;
     }
 
-    m_CaptureState = eCaptureState::READY;
+    Thread.DrainStart = chrono::steady_clock::now();
+    Thread.bWindowComplete = false;
+
+    if (Thread.bTiming)
+        RecordWakeInterval(Thread.LastDrain, Thread.DrainStart);
+
+    return true;
 }
 
-void ProcessLoopbackCapture::StartThreads(double fInitialDurationToSkip)
+bool ProcessLoopbackCapture::GetMainPacket(sMainThread& Thread, sMainPacket& Packet)
 {
-    if (m_bRunAudioThreads)
-        return;
+    HRESULT hr = GetPacket(&Packet.pData, &Packet.iFrames, &Packet.dwFlags, &Packet.iDevicePosition, &Packet.iQPCPosition);
 
-    if (fInitialDurationToSkip < 0.0)
-        fInitialDurationToSkip = 0.0;
+    if (hr != S_OK)
+    {
+        // AUDCLNT_S_BUFFER_EMPTY ends the drain normally, a failure (e.g. device invalidated) usually repeats on every wake
 
-    m_dwMainThreadBytesToSkip = (DWORD)(m_CaptureFormat.nSamplesPerSec * fInitialDurationToSkip) * (DWORD)m_CaptureFormat.nBlockAlign;
+        if (FAILED(hr) && hr != Thread.hrLastFailure)
+            LogEvent(eLoopbackEvent::GETBUFFER_FAILED, (UINT32)hr);
 
-    m_bRunAudioThreads = true;
+        Thread.hrLastFailure = FAILED(hr) ? hr : S_OK;
 
-#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
+        return false;
+    }
+
+    if (Thread.bTrace)
+        AddTraceRecord(eLoopbackTraceRecord::PACKET, chrono::steady_clock::now(), Packet.iFrames, (UINT16)Packet.dwFlags);
 
-    if (m_bUseIntermediateThread)
+    if (Thread.bTiming)
+        m_PacketSizes.Record(Packet.iFrames);
+
+    if (Packet.dwFlags != Thread.dwLastCaptureFlags)
     {
-        m_pMainAudioThread = new thread(&ProcessLoopbackCapture::ProcessMainToQueue, this);
-        m_pQueueAudioThread = new thread(&ProcessLoopbackCapture::ProcessIntermediate, this);
+        LogEvent(eLoopbackEvent::FLAGS_CHANGED, Packet.dwFlags, Thread.dwLastCaptureFlags);
+        Thread.dwLastCaptureFlags = Packet.dwFlags;
     }
-    else
+
+    Packet.iBytesAvailable = (UINT64)Packet.iFrames * (UINT64)m_CaptureFormat.nBlockAlign;
+    Packet.iBytesToSkip = min(Packet.iBytesAvailable, (UINT64)Thread.dwBytesToSkip);
+    Thread.dwBytesToSkip -= (DWORD)Packet.iBytesToSkip;
+
+    if (Packet.iBytesToSkip > 0 && Thread.dwBytesToSkip == 0)
+        LogEvent(eLoopbackEvent::SKIP_COMPLETE, Thread.dwBytesSkipped);
+
+    if (Thread.iAlignQPC != 0)
+        Packet.iBytesToSkip = max(Packet.iBytesToSkip, (UINT64)AlignRetargetPacket(Thread.iAlignQPC, Thread.iRetargetDropped, Packet.iFrames, Packet.iQPCPosition, Packet.dwFlags) * m_CaptureFormat.nBlockAlign);
+
+    Thread.iLastQPCPosition = (Packet.dwFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR) ? 0 : Packet.iQPCPosition;
+    Thread.iLastFrames = Packet.iFrames;
+
+    if (Thread.bWindow)
     {
-        m_pMainAudioThread = new thread(&ProcessLoopbackCapture::ProcessMainToCallback, this);
-        m_pQueueAudioThread = nullptr;
-    }
+        UINT32 iBegin = (UINT32)(Packet.iBytesToSkip / m_CaptureFormat.nBlockAlign);
+        UINT32 iEnd;
+        bool bWindowOpen = Thread.Window.iFramesLeft != 0;
 
-#else
+        ClipToCaptureWindow(Thread.Window, Packet.iFrames, Packet.iDevicePosition, Packet.iQPCPosition, iBegin, iEnd);
 
-    m_pMainAudioThread = new thread(&ProcessLoopbackCapture::ProcessMainToCallback, this);
-    m_pQueueAudioThread = nullptr;
+        Packet.iBytesToSkip = (UINT64)iBegin * m_CaptureFormat.nBlockAlign;
+        Packet.iBytesAvailable = (UINT64)iEnd * m_CaptureFormat.nBlockAlign;
 
-#endif
+        if (bWindowOpen && Thread.Window.iFramesLeft == 0)
+            Thread.bWindowComplete = true;
+    }
+
+    return true;
 }
 
-void ProcessLoopbackCapture::StopThreads()
+void ProcessLoopbackCapture::ReleaseMainPacket(const sMainPacket& Packet)
 {
-    if (!m_bRunAudioThreads)
-        return;
+    HRESULT hr = ReleasePacket(Packet.iFrames);
 
-    m_bRunAudioThreads = false;
+    if (FAILED(hr))
+        LogEvent(eLoopbackEvent::RELEASEBUFFER_FAILED, (UINT32)hr);
+}
 
-#if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
+void ProcessLoopbackCapture::EndMainDrain(sMainThread& Thread)
+{
+    if (Thread.bWindowComplete)
+        SetEvent(m_hCaptureWindowEvent);
 
-    m_pMainAudioThread->join();
+    // Chunk boundary: everything of the old client was delivered
+    SwitchPendingRetarget(Thread);
 
-    if (m_bUseIntermediateThread)
-    {
-        m_pQueueAudioThread->join();
-        delete m_pQueueAudioThread;
-        m_pQueueAudioThread = nullptr;
-    }
+    auto tick_end = chrono::steady_clock::now();
 
-    delete m_pMainAudioThread;
-    m_pMainAudioThread = nullptr;
+    UpdateMaxExecutionTime(chrono::duration_cast<chrono::nanoseconds>(tick_end - Thread.DrainStart).count() / 1e6);
 
-    while (m_Queue.pop()); // Flush
+    if (Thread.bTrace)
+        AddTraceRecord(eLoopbackTraceRecord::DONE, tick_end, (UINT32)chrono::duration_cast<chrono::microseconds>(tick_end - Thread.DrainStart).count(), 0);
+}
 
-#else
+void ProcessLoopbackCapture::SwitchPendingRetarget(sMainThread& Thread)
+{
+    // Claimed with a compare-exchange, Retarget clears the flag itself when it gives up waiting
 
-    m_pMainAudioThread->join();
-    delete m_pMainAudioThread;
-    m_pMainAudioThread = nullptr;
+    bool bPending = true;
 
-#endif
+    if (!m_bRetargetPending.load(memory_order_relaxed) || !m_bRetargetPending.compare_exchange_strong(bPending, false, memory_order_acq_rel))
+        return;
 
-    m_AudioData.clear();
-    m_AudioData.shrink_to_fit();
+    Thread.iAlignQPC = SwitchToRetargetClient(Thread.iLastQPCPosition, Thread.iLastFrames);
+    Thread.iRetargetDropped = 0;
 }
 
 void ProcessLoopbackCapture::ProcessMainToCallback()
 {
-    DWORD dwTaskIndex = 0;
-    HANDLE hTaskHandle = AvSetMmThreadCharacteristicsW(L"Pro Audio", &dwTaskIndex);
+    sMainThread Thread;
+    sMainPacket Packet;
+
+    StartMainThread(Thread);
 
-    BYTE* pData = nullptr;
-    UINT32 iFramesAvailable;
-    UINT64 iBytesAvailable;
-    DWORD dwCaptureFlags;
+    bool bExternalDrain = m_bExternalDrain;
+    bool bDrainOverflow = false; // Event log state, only changes are reported
 
     while (m_bRunAudioThreads)
     {
-        // The event is signaled if either a sample is ready or the capture was stopped.
+        if (!BeginMainDrain(Thread))
+            continue;
 
-        if (WaitForSingleObject(m_hSampleReadyEvent, 50) == WAIT_OBJECT_0)
+        // The packets of a drain are collected and delivered at once
+
+        while (GetMainPacket(Thread, Packet))
         {
-            // The capture was stopped, exit thread.
-            if (!m_bRunAudioThreads)
-                break;
+            if (m_AudioData.empty() && Packet.iBytesAvailable > Packet.iBytesToSkip)
+            {
+                m_iCallbackDevicePosition = Packet.iDevicePosition;
+                m_iCallbackQPCPosition = (Packet.dwFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR) ? 0 : Packet.iQPCPosition;
+
+                AdvanceTimestamp(m_iCallbackDevicePosition, m_iCallbackQPCPosition, Packet.iBytesToSkip / m_CaptureFormat.nBlockAlign);
+            }
 
-            auto tick_start = chrono::steady_clock::now();
+            m_AudioData.insert(m_AudioData.end(), Packet.pData + Packet.iBytesToSkip, Packet.pData + Packet.iBytesAvailable);
 
-            while (m_pAudioCaptureClient->GetBuffer(&pData, &iFramesAvailable, &dwCaptureFlags, nullptr, nullptr) == S_OK)
+            ReleaseMainPacket(Packet);
+        }
+
+        if (m_AudioData.size() > 0)
+        {
+            if (bExternalDrain)
             {
-                iBytesAvailable = (UINT64)iFramesAvailable * (UINT64)m_CaptureFormat.nBlockAlign;
+                size_t iWritten = WriteDrainRing(m_AudioData.data(), m_AudioData.size());
 
-                for (UINT64 i = 0; i < iBytesAvailable; ++i)
-                {
-                    if (m_dwMainThreadBytesToSkip != 0)
-                    {
-                        --m_dwMainThreadBytesToSkip;
-                    }
-                    else
-                    {
-                        m_AudioData.emplace_back(pData[i]);
-                    }
-                }
+                if (iWritten < m_AudioData.size() && !bDrainOverflow)
+                    LogEvent(eLoopbackEvent::DRAIN_OVERFLOW, m_AudioData.size() - iWritten);
 
-                m_pAudioCaptureClient->ReleaseBuffer(iFramesAvailable);
+                bDrainOverflow = iWritten < m_AudioData.size();
             }
-
-            if (m_AudioData.size() > 0)
+            else if (m_pCallbackFunc != nullptr || m_pChunkFunc != nullptr)
             {
-                if (m_pCallbackFunc != nullptr)
+                auto callback_start = chrono::steady_clock::now();
+
+                if (m_pChunkFunc != nullptr)
+                {
+                    DeliverChunk(m_AudioData, m_AudioData.size());
+                }
+                else
                 {
                     auto i1 = m_AudioData.begin();
                     auto i2 = m_AudioData.begin() + m_AudioData.size();
+
                     m_pCallbackFunc(i1, i2, m_pCallbackFuncUserData);
                 }
 
-                m_AudioData.clear();
+                if (Thread.bTrace)
+                {
+                    auto callback_duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - callback_start);
+                    AddTraceRecord(eLoopbackTraceRecord::USER_CALLBACK, callback_start, (UINT32)callback_duration.count(), 0);
+                }
             }
 
-            auto dur = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - tick_start).count() / 1e6;
-
-            if (dur > m_fMaxExecutionTime)
-                m_fMaxExecutionTime = dur;
+            m_AudioData.clear();
         }
+
+        EndMainDrain(Thread);
     }
 
-    if (hTaskHandle)
-        AvRevertMmThreadCharacteristics(hTaskHandle);
+    StopMainThread(Thread);
 }
 
 #if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
 
 void ProcessLoopbackCapture::ProcessMainToQueue()
 {
-    DWORD dwTaskIndex = 0;
-    HANDLE hTaskHandle = AvSetMmThreadCharacteristicsW(L"Pro Audio", &dwTaskIndex);
+    sMainThread Thread;
+    sMainPacket Packet;
+
+    StartMainThread(Thread);
 
-    BYTE* pData = nullptr;
-    UINT32 iFramesAvailable;
-    UINT64 iBytesAvailable;
-    DWORD dwCaptureFlags;
+    // Explicit producer of this thread, created before the loop
+    moodycamel::ProducerToken Producer(m_Queue);
+    UINT64 iEnqueued = 0;
 
     while (m_bRunAudioThreads)
     {
-        // The event is signaled if either a sample is ready or the capture was stopped.
+        if (!BeginMainDrain(Thread))
+            continue;
 
-        if (WaitForSingleObject(m_hSampleReadyEvent, 50) == WAIT_OBJECT_0)
+        while (GetMainPacket(Thread, Packet))
         {
-            // The capture was stopped, exit thread.
-            if (!m_bRunAudioThreads)
-                break;
-
-            auto tick_start = chrono::steady_clock::now();
-
-            while (m_pAudioCaptureClient->GetBuffer(&pData, &iFramesAvailable, &dwCaptureFlags, nullptr, nullptr) == S_OK)
+            // The packet is enqueued in one piece. Growing the queue allocates on this thread, so it is reported.
+            if (Packet.iBytesAvailable > Packet.iBytesToSkip)
             {
-                iBytesAvailable = (UINT64)iFramesAvailable * (UINT64)m_CaptureFormat.nBlockAlign;
+                size_t iBytes = (size_t)(Packet.iBytesAvailable - Packet.iBytesToSkip);
 
-                for (UINT64 i = 0; i < iBytesAvailable; ++i)
+                // If the ring is full, the intermediate thread extrapolates from an older anchor
+                sTimestampAnchor Anchor{ iEnqueued, Packet.iDevicePosition, (Packet.dwFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR) ? 0 : Packet.iQPCPosition };
+                AdvanceTimestamp(Anchor.iDevicePosition, Anchor.iQPCPosition, Packet.iBytesToSkip / m_CaptureFormat.nBlockAlign);
+                m_TimestampAnchors.Push(Anchor);
+
+                if (!m_Queue.try_enqueue_bulk(Producer, Packet.pData + Packet.iBytesToSkip, iBytes))
                 {
-                    if (m_dwMainThreadBytesToSkip != 0)
-                    {
-                        --m_dwMainThreadBytesToSkip;
-                    }
-                    else
-                    {
-                        m_Queue.enqueue(pData[i]);
-                    }
+                    m_Queue.enqueue_bulk(Producer, Packet.pData + Packet.iBytesToSkip, iBytes);
+                    LogEvent(eLoopbackEvent::QUEUE_OVERFLOW, iBytes);
                 }
 
-                m_pAudioCaptureClient->ReleaseBuffer(iFramesAvailable);
+                iEnqueued += iBytes;
             }
 
-            auto dur = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - tick_start).count() / 1e6;
-
-            if (dur > m_fMaxExecutionTime)
-                m_fMaxExecutionTime = dur;
+            ReleaseMainPacket(Packet);
         }
+
+        EndMainDrain(Thread);
     }
 
-    if (hTaskHandle)
-        AvRevertMmThreadCharacteristics(hTaskHandle);
+    StopMainThread(Thread);
 }
 
 void ProcessLoopbackCapture::ProcessIntermediate()
 {
+    moodycamel::ConsumerToken Consumer(m_Queue);
+
+    // Byte offset of m_AudioData[0] in the queued stream, and the last timestamp anchor at or before it
+    UINT64 iOffset = 0;
+    sTimestampAnchor Anchor{};
+    sTimestampAnchor NextAnchor{};
+    bool bNextAnchor = false;
+
+    LogEvent(eLoopbackEvent::THREAD_START);
+
     while (m_bRunAudioThreads)
     {
         // Get all data from the queue into intermediate buffer and pass it to the callback
 
-        unsigned char Data;
+        size_t iQueued = m_Queue.size_approx();
 
-        while (m_Queue.try_dequeue(Data))
+        if (iQueued > 0)
         {
-            m_AudioData.emplace_back(Data);
+            size_t iOldSize = m_AudioData.size();
+
+            m_AudioData.resize(iOldSize + iQueued);
+            m_AudioData.resize(iOldSize + m_Queue.try_dequeue_bulk(Consumer, m_AudioData.begin() + iOldSize, iQueued));
         }
 
         // Get buffer size and send to callback, then delete
@@ -629,18 +2223,56 @@ void ProcessLoopbackCapture::ProcessIntermediate()
 
         if (iAlignedSize > 0)
         {
-            if (m_pCallbackFunc != nullptr)
+            while (true)
+            {
+                if (!bNextAnchor)
+                    bNextAnchor = m_TimestampAnchors.Pop(NextAnchor);
+
+                if (!bNextAnchor || NextAnchor.iOffset > iOffset)
+                    break;
+
+                Anchor = NextAnchor;
+                bNextAnchor = false;
+            }
+
+            m_iCallbackDevicePosition = Anchor.iDevicePosition;
+            m_iCallbackQPCPosition = Anchor.iQPCPosition;
+
+            AdvanceTimestamp(m_iCallbackDevicePosition, m_iCallbackQPCPosition, (iOffset - Anchor.iOffset) / m_CaptureFormat.nBlockAlign);
+
+            if (m_pCallbackFunc != nullptr || m_pChunkFunc != nullptr)
             {
-                auto i1 = m_AudioData.begin();
-                auto i2 = m_AudioData.begin() + iAlignedSize;
-                m_pCallbackFunc(i1, i2, m_pCallbackFuncUserData);
+                auto callback_start = chrono::steady_clock::now();
+
+                if (m_pChunkFunc != nullptr)
+                {
+                    DeliverChunk(m_AudioData, iAlignedSize);
+                }
+                else
+                {
+                    auto i1 = m_AudioData.begin();
+                    auto i2 = m_AudioData.begin() + iAlignedSize;
+
+                    m_pCallbackFunc(i1, i2, m_pCallbackFuncUserData);
+                }
+
+                auto callback_duration = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - callback_start);
+
+                if (callback_duration > chrono::milliseconds(m_dwCallbackInterval))
+                    LogEvent(eLoopbackEvent::CALLBACK_LATE, (UINT64)callback_duration.count());
             }
 
-            m_AudioData.erase(m_AudioData.begin(), m_AudioData.begin() + iAlignedSize);
+            // Empty if the buffer was handed over as a whole chunk
+            if (!m_AudioData.empty())
+                m_AudioData.erase(m_AudioData.begin(), m_AudioData.begin() + iAlignedSize);
+
+            iOffset += iAlignedSize;
         }
 
         std::this_thread::sleep_for(std::chrono::milliseconds(m_dwCallbackInterval));
     }
+
+    LogEvent(eLoopbackEvent::THREAD_STOP);
 }
 
 #endif // #if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
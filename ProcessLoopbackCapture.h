@@ -15,7 +15,7 @@ Settings (ie Capture Format, Process ID, etc) can only be modified if the captur
 When the callback function provided is called, you are expected to retrieve all audio data from it.
 After each call, the internal buffer is cleared.
 
-Optionally uses cameron314's readerwriterqueue to provide a more lenient user callback (https://github.com/cameron314/readerwriterqueue).
+Optionally uses cameron314's concurrentqueue to provide a more lenient user callback (https://github.com/cameron314/concurrentqueue).
 To use it, define PROCESS_LOOPBACK_CAPTURE_USE_QUEUE as a precompiler macro and enable it via the SetIntermediateThreadEnabled member.
 
 Link against mfplat.lib, mmdevapi.lib and avrt.lib.
@@ -28,11 +28,14 @@ Link against mfplat.lib, mmdevapi.lib and avrt.lib.
 #include <AudioClient.h>
 
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 #if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
-#include <readerwriterqueue.h>
+#include <concurrentqueue.h>
 #endif
 
 // ------------------------------------------------------------ 
@@ -62,11 +65,54 @@ enum class eCaptureError : int
     START,
     STOP,
     EVENT,
-    INTERFACE
+    INTERFACE,
+
+    // Errors raised by sinks (see LoopbackCaptureSink.h)
+    FILE
+};
+
+// Control operations and their phases, timed on every call (see GetPhaseTiming)
+
+enum class eLoopbackOperation : int
+{
+    START_CAPTURE = 0,
+    RESET,                  // StopCapture, failed StartCapture and destruction
+    PAUSE,
+    RESUME,
+    RETARGET
+};
+
+enum class eLoopbackPhase : int
+{
+    ACTIVATE = 0,           // ActivateAudioInterfaceAsync until the activation completed
+    INITIALIZE,             // IAudioClient::Initialize
+    GET_SERVICE,            // IAudioClient::GetService
+    SET_EVENT_HANDLE,       // CreateEvent and IAudioClient::SetEventHandle
+    START,                  // IAudioClient::Start
+    START_THREADS,
+    SWITCH,                 // Retarget: until the main audio thread switched to the new client
+    STOP,                   // IAudioClient::Stop
+    STOP_THREADS,           // Until the audio threads were joined
+    RELEASE,                // Reset and release of the audio client
+    TOTAL                   // The whole call
 };
 
 namespace LoopbackCaptureConst
 {
+    // Alignment used to keep state written by different threads on separate cache lines.
+    constexpr size_t CacheLineSize = 64;
+
+    // Packets whose timestamps can wait for the intermediate thread (see GetCallbackTimestamp)
+    constexpr size_t TimestampAnchorCapacity = 1024;
+
+    // Retarget gives up if the main audio thread did not switch within this time (milliseconds) plus two batch intervals,
+    // checking every RetargetPollInterval whether the audio threads still run
+    constexpr DWORD RetargetSwitchTimeout = 1000;
+    constexpr DWORD RetargetPollInterval = 50;
+
+    constexpr size_t OperationCount = 5;
+    constexpr size_t PhaseCount = 11;
+
     constexpr const char* GetErrorText(eCaptureError eID)
     {
         switch (eID)
@@ -86,12 +132,419 @@ namespace LoopbackCaptureConst
         case eCaptureError::STOP: return "Failed to stop capture";
         case eCaptureError::EVENT: return "Failed to create and set event";
         case eCaptureError::INTERFACE: return "Failed to call Windows interface function";
+
+        case eCaptureError::FILE: return "Failed to create or write output file";
+        }
+
+        return "Unknown";
+    }
+
+    constexpr const char* GetOperationName(eLoopbackOperation Operation)
+    {
+        switch (Operation)
+        {
+        case eLoopbackOperation::START_CAPTURE: return "StartCapture";
+        case eLoopbackOperation::RESET: return "Reset";
+        case eLoopbackOperation::PAUSE: return "PauseCapture";
+        case eLoopbackOperation::RESUME: return "ResumeCapture";
+        case eLoopbackOperation::RETARGET: return "Retarget";
         }
 
         return "Unknown";
     }
+
+    constexpr const char* GetPhaseName(eLoopbackPhase Phase)
+    {
+        switch (Phase)
+        {
+        case eLoopbackPhase::ACTIVATE: return "Activate";
+        case eLoopbackPhase::INITIALIZE: return "Initialize";
+        case eLoopbackPhase::GET_SERVICE: return "GetService";
+        case eLoopbackPhase::SET_EVENT_HANDLE: return "SetEventHandle";
+        case eLoopbackPhase::START: return "Start";
+        case eLoopbackPhase::START_THREADS: return "StartThreads";
+        case eLoopbackPhase::SWITCH: return "Switch";
+        case eLoopbackPhase::STOP: return "Stop";
+        case eLoopbackPhase::STOP_THREADS: return "StopThreads";
+        case eLoopbackPhase::RELEASE: return "Release";
+        case eLoopbackPhase::TOTAL: return "Total";
+        }
+
+        return "Unknown";
+    }
+}
+
+// ------------------------------------------------------------ 
+
+// Log-linear histogram of non-negative integers: exact below 16, then 8 buckets per power of two (at most 12.5% wide).
+// Values of 2^40 and above are counted in the last bucket. Record may only be called by one thread at a time,
+// all other functions can be called from any thread at any time (the result is then approximate).
+class LoopbackHistogram
+{
+public:
+
+    static constexpr size_t BUCKET_COUNT = 16 + 36 * 8;
+
+    LoopbackHistogram();
+    LoopbackHistogram(const LoopbackHistogram& Other);
+    LoopbackHistogram& operator=(const LoopbackHistogram& Other);
+
+    void Record(UINT64 iValue);
+    void Reset();
+
+    UINT64 GetCount() const;
+    UINT64 GetMin() const;
+    UINT64 GetMax() const;
+    double GetMean() const;
+
+    // Upper bound of the bucket that contains the given percentile (0-100), limited to the maximum. 0 if empty.
+    UINT64 GetPercentile(double fPercentile) const;
+
+    UINT64 GetBucketCount(size_t iBucket) const;
+    static size_t GetBucketIndex(UINT64 iValue);
+    static UINT64 GetBucketLowerBound(size_t iBucket);
+
+private:
+
+    std::atomic<UINT64>             m_Buckets[BUCKET_COUNT];
+    std::atomic<UINT64>             m_iCount;
+    std::atomic<UINT64>             m_iSum;
+    std::atomic<UINT64>             m_iMin;
+    std::atomic<UINT64>             m_iMax;
+};
+
+// Summary of the wake timing histograms (see SetTimingStatistics)
+
+struct sLoopbackTimingReport
+{
+    UINT64                          iWakeCount;
+
+    double                          fPacketDuration;            // Milliseconds, median packet size. Usually the device period (10ms)
+    double                          fWakeIntervalMedian;        // Milliseconds between wakes that drained packets
+    double                          fWakeIntervalP99;
+    double                          fWakeIntervalP999;
+    double                          fWakeIntervalMax;
+    double                          fLateWakeRatio;             // Share of intervals longer than twice the median
+
+    UINT64                          iPacketFramesMedian;
+    UINT64                          iPacketFramesP99;
+    UINT64                          iPacketFramesMax;
+
+    double                          fBufferDuration;            // Milliseconds, buffer granted by the audio client
+    double                          fRecommendedBufferDuration; // Milliseconds, twice the 99.9th percentile wake interval
+
+    // The 99.9th percentile wake interval does not fit into half of the buffer. On such hosts the audio client's buffer
+    // (SetBatchInterval) or the callback interval has to be raised, otherwise packets are lost under load.
+    bool                            bRaiseBufferSize;
+};
+
+// Durations of the phases of one control operation (see GetPhaseTiming)
+
+struct sLoopbackPhaseTiming
+{
+    eLoopbackOperation              Operation;
+    eCaptureError                   Result;
+    UINT32                          iPhaseMask;     // Bit (1 << phase) for every phase that ran
+    double                          fDurations[LoopbackCaptureConst::PhaseCount]; // Milliseconds, 0 for phases that did not run
+};
+
+// ------------------------------------------------------------ 
+
+// Start of a sample-accurate capture window (see SetCaptureWindow)
+
+enum class eCaptureWindowStart : int
+{
+    IMMEDIATE = 0,      // First frame after StartCapture, iStart is ignored
+    QPC,                // iStart is a QueryPerformanceCounter value
+    DEVICE_POSITION     // iStart is a device position in frames, as reported by IAudioCaptureClient::GetBuffer
+};
+
+// ------------------------------------------------------------ 
+
+// Wake-timing trace of the main audio thread (see SetTraceRecording and LoopbackTrace.h)
+
+enum class eLoopbackTraceRecord : UINT16
+{
+    WAKE = 0,       // The wait returned. iValue: 1 if packets are drained, 0 on timeout
+    PACKET,         // iValue: frames, iFlags: AUDCLNT_BUFFERFLAGS_*
+    USER_CALLBACK,  // Start of the user callback. iValue: duration in microseconds
+    DONE            // All packets drained. iValue: processing time of the wake in microseconds
+};
+
+struct sLoopbackTraceRecord
+{
+    UINT64                          iTime; // Microseconds since StartCapture
+    UINT32                          iValue;
+    UINT16                          iFlags;
+    eLoopbackTraceRecord            Type;
+};
+
+// ------------------------------------------------------------ 
+
+// Diagnostic events of the audio threads (see SetEventLog and LoopbackEventLog.h)
+
+enum class eLoopbackEvent : UINT16
+{
+    THREAD_START = 0,       // iValue2: 1 if MMCSS characteristics were set (main audio thread), 0 otherwise
+    THREAD_STOP,
+    GETBUFFER_FAILED,       // iValue: HRESULT. Only reported when it differs from the last failure
+    RELEASEBUFFER_FAILED,   // iValue: HRESULT
+    FLAGS_CHANGED,          // iValue: AUDCLNT_BUFFERFLAGS_* of the packet, iValue2: flags of the previous packet
+    QUEUE_OVERFLOW,         // The intermediate queue had to allocate. iValue: bytes enqueued by allocating
+    SKIP_COMPLETE,          // The initial duration to skip was dropped. iValue: bytes skipped
+    CALLBACK_LATE,          // The intermediate thread's callback took longer than the callback interval. iValue: microseconds
+    EVENTS_DROPPED,         // Not written by the capture. Reported by the reader, iValue: events lost because the ring was full
+    QOS_SHED,               // Written by LoopbackQosSink. iValue: queue bytes, iValue2: new shed level << 16 | load in per mille
+    QOS_RESTORE,            // Written by LoopbackQosSink, same values as QOS_SHED
+    RETARGET_COMPLETE,      // The main audio thread switched to the client of Retarget. iValue: gap in frames (INT64, see GetRetargetGap)
+    DELAY_CHANGED,          // Written by LoopbackDelayEstimator. iValue: lag in frames (INT64), iValue2: confidence in per mille
+    DRAIN_OVERFLOW,         // The ring of SetExternalDrain was full. iValue: bytes dropped from the first chunk that did not fit
+    FINGERPRINT_MATCH       // Written by LoopbackFingerprintSink when the identified content changes. iValue: reference id, iValue2: score
+};
+
+struct sLoopbackEvent
+{
+    UINT64                          iTime; // Microseconds, steady_clock
+    UINT64                          iValue;
+    UINT32                          iValue2;
+    UINT16                          iSource; // See SetEventLog
+    eLoopbackEvent                  Type;
+};
+
+// Fixed-size lock-free ring of T. Any number of writers, one reader. Push and Pop never block or allocate, so they can be called
+// from the audio threads. Shared by the event ring, the chunk pool and LoopbackCaptureController.
+template<typename T>
+class LoopbackRing
+{
+public:
+
+    // iCapacity is rounded up to a power of two.
+    LoopbackRing(size_t iCapacity);
+
+    LoopbackRing(const LoopbackRing&) = delete;
+    LoopbackRing& operator=(const LoopbackRing&) = delete;
+
+    // Returns false if the ring is full.
+    bool Push(const T& Value);
+
+    // Single reader only. Returns false if the ring is empty.
+    bool Pop(T& Value);
+
+private:
+
+    struct sCell
+    {
+        std::atomic<size_t>         iSequence;
+        T                           Value;
+    };
+
+    std::unique_ptr<sCell[]>        m_pCells;
+    size_t                          m_iMask;
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<size_t>             m_iWritePosition;
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<size_t>             m_iReadPosition;
+};
+
+// Bounded ring with a sequence number per cell. A writer claims a position with a CAS and publishes the cell by storing
+// position + 1 into its sequence, the reader releases it for the next lap by storing position + capacity.
+
+template<typename T>
+LoopbackRing<T>::LoopbackRing(size_t iCapacity) :
+    m_iMask(0),
+
+    m_iWritePosition(0),
+    m_iReadPosition(0)
+{
+    size_t iSize = 2;
+
+    while (iSize < iCapacity)
+        iSize <<= 1;
+
+    m_pCells = std::make_unique<sCell[]>(iSize);
+    m_iMask = iSize - 1;
+
+    for (size_t i = 0; i < iSize; ++i)
+    {
+        m_pCells[i].iSequence.store(i, std::memory_order_relaxed);
+        m_pCells[i].Value = T{};
+    }
+}
+
+template<typename T>
+bool LoopbackRing<T>::Push(const T& Value)
+{
+    size_t iPosition = m_iWritePosition.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        sCell& Cell = m_pCells[iPosition & m_iMask];
+        intptr_t iDiff = (intptr_t)Cell.iSequence.load(std::memory_order_acquire) - (intptr_t)iPosition;
+
+        if (iDiff == 0)
+        {
+            if (m_iWritePosition.compare_exchange_weak(iPosition, iPosition + 1, std::memory_order_relaxed))
+            {
+                Cell.Value = Value;
+                Cell.iSequence.store(iPosition + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (iDiff < 0)
+        {
+            // Full, the reader has not released this cell yet
+            return false;
+        }
+        else
+        {
+            // Claimed by another writer
+            iPosition = m_iWritePosition.load(std::memory_order_relaxed);
+        }
+    }
 }
 
+template<typename T>
+bool LoopbackRing<T>::Pop(T& Value)
+{
+    size_t iPosition = m_iReadPosition.load(std::memory_order_relaxed);
+    sCell& Cell = m_pCells[iPosition & m_iMask];
+
+    // Empty, or the writer of this cell has not published it yet
+    if (Cell.iSequence.load(std::memory_order_acquire) != iPosition + 1)
+        return false;
+
+    Value = Cell.Value;
+
+    Cell.iSequence.store(iPosition + m_iMask + 1, std::memory_order_release);
+    m_iReadPosition.store(iPosition + 1, std::memory_order_relaxed);
+
+    return true;
+}
+
+// Ring for sLoopbackEvent. Push never formats, so it can be called from the audio threads. If the ring is full, the event is
+// dropped and counted.
+class LoopbackEventRing
+{
+public:
+
+    // iCapacity is rounded up to a power of two.
+    LoopbackEventRing(size_t iCapacity = 1024);
+
+    LoopbackEventRing(const LoopbackEventRing&) = delete;
+    LoopbackEventRing& operator=(const LoopbackEventRing&) = delete;
+
+    bool Push(const sLoopbackEvent& Event);
+
+    // Single reader only.
+    bool Pop(sLoopbackEvent& Event);
+
+    // Total number of events dropped because the ring was full.
+    UINT64 GetDroppedCount();
+
+private:
+
+    LoopbackRing<sLoopbackEvent>    m_Ring;
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<UINT64>             m_iDroppedCount;
+};
+
+// ------------------------------------------------------------ 
+
+class LoopbackChunkPool;
+
+// Reference-counted block of audio data passed to the chunk callback (see SetChunkCallback). The callback receives one reference
+// and may keep the chunk as long as it likes, on any thread. The last Release returns it to its pool, which outlives its chunks.
+class LoopbackChunk
+{
+public:
+
+    LoopbackChunk(const LoopbackChunk&) = delete;
+    LoopbackChunk& operator=(const LoopbackChunk&) = delete;
+
+    // Block aligned audio data in the capture format, unchanged until the last reference is released.
+    const unsigned char* GetData() const;
+    size_t GetSize() const;
+
+    // Safe to call from any thread.
+    void AddRef();
+    void Release();
+
+private:
+
+    friend class LoopbackChunkPool;
+    friend class ProcessLoopbackCapture;
+
+    LoopbackChunk();
+
+    std::vector<unsigned char>      m_Data;
+    std::atomic<UINT32>             m_iRefCount;
+    std::shared_ptr<LoopbackChunkPool> m_pPool; // Only set while the chunk is out of the pool
+};
+
+// Free list of chunks. Acquire hands out recycled chunks without allocating once the pool is warm (the buffers keep their capacity).
+// Acquire may only be called by one thread at a time, chunks are released from any thread. Must be owned by a shared_ptr.
+class LoopbackChunkPool :
+    public std::enable_shared_from_this<LoopbackChunkPool>
+{
+public:
+
+    // Keeps up to iCapacity free chunks (rounded up to a power of two), chunks released beyond that are freed.
+    LoopbackChunkPool(size_t iCapacity = 64);
+    ~LoopbackChunkPool();
+
+    LoopbackChunkPool(const LoopbackChunkPool&) = delete;
+    LoopbackChunkPool& operator=(const LoopbackChunkPool&) = delete;
+
+    // Returns an empty chunk with one reference. Allocates a new chunk if none is free.
+    LoopbackChunk* Acquire();
+
+    // Fills the free list up to its capacity with chunks whose buffers hold at least iBytes, so Acquire and the buffers handed out
+    // do not allocate. Must not run concurrently with Acquire.
+    void Reserve(size_t iBytes);
+
+    // Number of chunks allocated so far. Stops growing once enough chunks circulate.
+    UINT64 GetAllocationCount();
+
+private:
+
+    friend class LoopbackChunk;
+
+    void Recycle(LoopbackChunk *pChunk);
+
+    LoopbackRing<LoopbackChunk*>    m_FreeChunks;
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<UINT64>             m_iAllocationCount;
+};
+
+// ------------------------------------------------------------ 
+
+// Replaces the WASAPI capture client as the source of the packets the main audio thread drains (see SetPacketSource), e.g. to
+// replay a recorded trace (LoopbackTrace.h). Everything behind the client (skip, capture window, intermediate queue and thread,
+// callbacks, external drain, statistics and traces) runs unchanged.
+class ILoopbackPacketSource
+{
+public:
+
+    virtual ~ILoopbackPacketSource() = default;
+
+    // Controlling thread, called by StartCapture and by StopCapture (Reset) of a running capture.
+    virtual eCaptureError Start(const WAVEFORMATEX& Format) = 0;
+    virtual void Stop() = 0;
+
+    // Main audio thread. Blocks until packets are due and returns true, or returns false on a timeout. Must return within about
+    // 50 milliseconds, the thread checks for a stop between waits. dwBatchInterval is the active batch interval (0 if not batching).
+    virtual bool WaitForPackets(DWORD dwBatchInterval) = 0;
+
+    // Main audio thread. Same contract as IAudioCaptureClient::GetBuffer/ReleaseBuffer: S_OK and one packet at a time, then
+    // AUDCLNT_S_BUFFER_EMPTY once the packets of the wake are drained.
+    virtual HRESULT GetBuffer(BYTE **ppData, UINT32 *pFrames, DWORD *pFlags, UINT64 *pDevicePosition, UINT64 *pQPCPosition) = 0;
+    virtual HRESULT ReleaseBuffer(UINT32 iFrames) = 0;
+};
+
 // ------------------------------------------------------------ 
 
 class ProcessLoopbackCapture
@@ -112,8 +565,20 @@ public:
     // If it is false, the audio of this process will be excluded from all other sounds on the same device.
     eCaptureError SetTargetProcess(DWORD dwProcessId, bool bInclusive = true);
 
+    // Drains packets from pSource instead of an audio client of the target process, which is then not needed. The source must
+    // outlive the capture. PauseCapture, ResumeCapture and Retarget fail with NOT_AVAILABLE while a source is set.
+    // Default: nullptr (WASAPI)
+    eCaptureError SetPacketSource(ILoopbackPacketSource *pSource);
+
     eCaptureError SetCallback(void (*pCallbackFunc)(const std::vector<unsigned char>::iterator&, const std::vector<unsigned char>::iterator&, void*), void *pUserData = nullptr);
 
+    // Alternative to SetCallback for consumers that keep the audio (recorders, network senders): the data is passed as a pooled chunk
+    // and the callback takes ownership of one reference (see LoopbackChunk). The main audio thread hands its buffer over instead of
+    // copying it. Takes precedence over SetCallback while set, nullptr disables it. iPoolCapacity is the number of free chunks kept,
+    // the pool is filled with buffers sized for one delivery whenever the audio threads start.
+    // Default: nullptr
+    eCaptureError SetChunkCallback(void (*pChunkFunc)(LoopbackChunk *pChunk, void*), void *pUserData = nullptr, size_t iPoolCapacity = 64);
+
     // The interval (in milliseconds) is subject to Windows scheduling. Usually, the wait time is at least 16 and often a multiple of 16.
     // Only used if the intermediate thread is active.
     // Default: 100
@@ -129,6 +594,100 @@ public:
     // Usually, the internal buffer is cleared every 10ms and the callback should take no longer than this period to execute.
     eCaptureError SetIntermediateThreadEnabled(bool bEnable);
 
+    // Hands the audio to an external event loop (IOCP, WaitForMultipleObjects) instead of calling the callback from the library's threads.
+    // If bEnable is true, the main audio thread writes the data into a lock-free ring of iBufferSize bytes (rounded up to a power of two)
+    // and signals the data event (see GetDataEvent). The loop calls Drain on its own thread, which passes everything available to the
+    // callback without blocking. The intermediate thread is not used in this mode. Data that does not fit into the ring is dropped
+    // and reported as DRAIN_OVERFLOW (see SetEventLog).
+    // Default: false
+    eCaptureError SetExternalDrain(bool bEnable, size_t iBufferSize = 1 << 20);
+
+    // Auto-reset event signaled when data was written to the ring. Created by SetExternalDrain and valid until it is disabled or
+    // the capture is destroyed, so it can be registered with the loop once. NULL if external draining is disabled.
+    HANDLE GetDataEvent();
+
+    // Passes all data in the ring to the callback on the calling thread and returns the number of bytes in iBytes (0 if there was none).
+    // Never blocks. Drain from one thread at a time. Data left in the ring when the capture is stopped is delivered by the next Drain.
+    // Data that does not wrap around the end of the ring is passed to the callback in place, wrapped data is copied once.
+    // Fails with NOT_AVAILABLE if external draining is disabled.
+    eCaptureError Drain(size_t& iBytes);
+
+    // Zero-copy alternative to Drain that does not call the callback: returns the readable data as two spans of the ring. The second
+    // one continues the first at the start of the ring (iSize2 is 0 if the data does not wrap around), the split may fall inside a
+    // frame. The spans stay valid and are not overwritten until they are handed back with ReleaseDrain. Same threading as Drain.
+    eCaptureError PeekDrain(const unsigned char*& pData1, size_t& iSize1, const unsigned char*& pData2, size_t& iSize2);
+
+    // Hands the first iBytes of the spans returned by PeekDrain back to the main audio thread. Fails with PARAM if iBytes is larger
+    // than the data in the ring.
+    eCaptureError ReleaseDrain(size_t iBytes);
+
+    // Low-power batching for captures that do not need a low latency (e.g. archiving).
+    // If dwInterval (in milliseconds) is not 0, the main audio thread does not wake for every packet but drains all packets that
+    // accumulated every dwInterval milliseconds. A buffer of twice the interval is requested from the audio client. If it grants a
+    // smaller buffer, the interval is reduced to half of the buffer so no audio is lost (see GetBatchInterval).
+    // Default: 0 (woken by WASAPI for every packet, usually every 10ms)
+    eCaptureError SetBatchInterval(DWORD dwInterval);
+
+    // Returns the batch interval used by the current capture (0 if not batching or not capturing).
+    DWORD GetBatchInterval();
+
+    // Returns the average number of wakeups per second of the main audio thread since the capture was started or resumed.
+    double GetWakeupsPerSecond();
+
+    // Records the wake times, packet sizes and flags and callback durations of the main audio thread into a ring of iMaxRecords
+    // records (16 bytes each, usually 4 per wake). The ring is allocated on StartCapture and keeps the newest records.
+    // Callback durations are only recorded if the intermediate thread is disabled. 0 disables tracing.
+    // Default: 0
+    eCaptureError SetTraceRecording(size_t iMaxRecords);
+
+    // Copies the trace of the last capture in chronological order. Fails while capturing (the audio threads must be stopped).
+    eCaptureError GetTrace(std::vector<sLoopbackTraceRecord>& Records);
+
+    // Reports GetBuffer/ReleaseBuffer failures, buffer flag changes, intermediate queue growth and similar events of the audio threads
+    // into pRing (usually a LoopbackEventLog, which formats them on its own thread). iSource is copied into every event, so several
+    // captures can share one ring. The ring must outlive the capture. nullptr disables the event log.
+    // Default: nullptr
+    eCaptureError SetEventLog(LoopbackEventRing *pRing, UINT16 iSource = 0);
+
+    // Arms a sample-accurate window for the next StartCapture: the callback receives exactly iFrameCount frames, beginning with the first frame
+    // recorded at or after iStart (see eCaptureWindowStart). Frames outside the window are dropped in the copy loop of the main audio thread,
+    // the capture itself keeps running until StopCapture. The window continues across PauseCapture/ResumeCapture.
+    // QPC starts use the packet timestamps of the audio engine (100ns resolution), the first frame is rounded up.
+    // iFrameCount 0 disarms the window.
+    // Default: disarmed
+    eCaptureError SetCaptureWindow(eCaptureWindowStart Start, UINT64 iStart, UINT64 iFrameCount);
+
+    // Waits up to dwTimeout milliseconds until the last frame of the capture window was passed to the callback (or to the intermediate queue).
+    // Returns false on timeout, if no window is armed or if the capture is stopped.
+    bool WaitForCaptureWindow(DWORD dwTimeout);
+
+    // Records the intervals between wakes of the main audio thread that drained packets (microseconds) and the frames of each packet
+    // into histograms. The histograms are kept across captures until ResetTimingStatistics.
+    // Default: false
+    eCaptureError SetTimingStatistics(bool bEnable);
+
+    // Clears the histograms. While capturing, the main audio thread clears them on its next wake.
+    void ResetTimingStatistics();
+
+    // Copies of the histograms. Safe to call from any thread.
+    LoopbackHistogram GetWakeIntervalHistogram();
+    LoopbackHistogram GetPacketSizeHistogram();
+
+    // Summarizes the histograms and flags hosts whose scheduling needs a larger buffer. Fails with NOT_AVAILABLE if nothing was recorded.
+    eCaptureError GetTimingReport(sLoopbackTimingReport& Report);
+
+    // StartCapture, Reset (StopCapture), PauseCapture, ResumeCapture and Retarget time their phases (activation, Initialize, GetService,
+    // SetEventHandle, Start, thread start/stop, ...) on every call, including failed ones. GetPhaseTiming copies the timing of the last
+    // call of an operation, fails with NOT_AVAILABLE if there was none. Safe to call from any thread.
+    eCaptureError GetPhaseTiming(eLoopbackOperation Operation, sLoopbackPhaseTiming& Timing);
+
+    // Durations (microseconds) of one phase of an operation over all calls since construction or ResetPhaseStatistics, e.g. the
+    // activation time of StartCapture across restarts. Safe to call from any thread.
+    LoopbackHistogram GetPhaseHistogram(eLoopbackOperation Operation, eLoopbackPhase Phase);
+
+    // Clears the histograms and last timings. Must be called on the thread that controls the capture.
+    void ResetPhaseStatistics();
+
     // Returns the current state of the capture (ready, paused or started).
     // Safe to call from any thread.
     eCaptureState GetState();
@@ -146,25 +705,69 @@ public:
     // When resuming, you typically want to skip 0.1 seconds of the buffer. WASAPI keeps some of the old buffer when restarting capture.
     eCaptureError ResumeCapture(double fInitialDurationToSkip = 0.1);
 
+    // Switches a running capture to another process without stopping it. The client for the new target is activated and started on the
+    // calling thread while the old one keeps delivering, then the main audio thread switches over after its next drain. Callback, queue,
+    // sinks and statistics are kept. Blocks until the switch happened (usually one device period or batch interval after activation).
+    // Must be called on the thread that called StartCapture. On failure the capture continues with the old target. Fails with START
+    // (GetLastErrorResult: ERROR_TIMEOUT) if the main audio thread does not switch in time.
+    // Device positions (eCaptureWindowStart::DEVICE_POSITION) restart with the new client.
+    eCaptureError Retarget(DWORD dwProcessId, bool bInclusive = true);
+
+    // Gap in frames between the end of the old target's stream and the first frame of the new one at the last Retarget, by the
+    // packet timestamps. Negative values are overlapping frames of the new target that were dropped. Returns false until the first
+    // packet of the new client arrived, and 0 is reported if the timestamps were invalid. Safe to call from any thread.
+    bool GetRetargetGap(INT64& iFrames);
+
     // Gets the last error code returned by Windows interface functions. Does not apply to eCaptureError::PARAM and eCaptureError::STATE.
+    // Safe to call from any thread.
     HRESULT GetLastErrorResult();
 
+    // Only inside the callback or chunk callback, on the thread calling it: device position (frames of the audio engine's stream)
+    // and QPC time (100ns units, see IAudioCaptureClient::GetBuffer) of the first frame passed. With the intermediate thread, the
+    // timestamps of the packets travel alongside the queue. iQPCPosition is 0 if the audio engine reported a timestamp error.
+    void GetCallbackTimestamp(UINT64& iDevicePosition, UINT64& iQPCPosition);
+
     // Returns/Resets the max execution time of the main audio thread (in milliseconds).
     double GetMaxExecutionTime();
     void ResetMaxExecutionTime();
 
-    // Gets the current approx. size of the intermediate queue if the intermediate thread is available and in use.
-    // Fails if PROCESS_LOOPBACK_CAPTURE_USE_QUEUE is not defined or SetIntermediateThreadEnabled was not set to true.
+    // Gets the current approx. size of the intermediate queue if the intermediate thread is available and in use, or of the ring
+    // with external draining. Fails if neither is in use.
     eCaptureError GetQueueSize(size_t& iSize);
 
 private:
 
     void Reset();
 
+    // Activates, initializes and registers the event of a process loopback client for the capture format. Releases everything on failure.
+    eCaptureError CreateAudioClient(DWORD dwProcessId, bool bInclusive, IAudioClient*& pAudioClient, IAudioCaptureClient*& pAudioCaptureClient, HANDLE& hSampleReadyEvent, sLoopbackPhaseTiming& Timing);
+
+    // StartCapture after the settings were validated
+    eCaptureError OpenCapture(sLoopbackPhaseTiming& Timing);
+
+    // Adds the time since PhaseStart to the phase and restarts PhaseStart. RecordPhaseTiming sets the total and stores the timing.
+    void EndPhase(sLoopbackPhaseTiming& Timing, eLoopbackPhase Phase, std::chrono::steady_clock::time_point& PhaseStart);
+    void RecordPhaseTiming(sLoopbackPhaseTiming& Timing, std::chrono::steady_clock::time_point Start, eCaptureError Result);
+    void ReleaseAudioClient(IAudioClient*& pAudioClient, IAudioCaptureClient*& pAudioCaptureClient, HANDLE& hSampleReadyEvent);
+
+    // Main audio thread, at a chunk boundary, after it claimed the pending retarget (m_bRetargetPending true -> false). Swaps in the
+    // client prepared by Retarget and returns the end of the old stream (QPC, 100ns units) the new one is aligned to, 0 if unknown.
+    UINT64 SwitchToRetargetClient(UINT64 iLastQPCPosition, UINT32 iLastFrames);
+
+    // Frames to drop from the start of a packet of the new client that overlap the old stream. Clears iAlignQPC when aligned.
+    UINT32 AlignRetargetPacket(UINT64& iAlignQPC, INT64& iDropped, UINT32 iFrames, UINT64 iQPCPosition, DWORD dwCaptureFlags);
+
     // Duration in seconds of the initial buffer duration to skip. Used in Resume because some digital devices have leftover frames after resuming capture (IAudioClient::Stop, IAudioClient::Start).
     void StartThreads(double fInitialDurationToSkip);
     void StopThreads();
 
+    // Blocks until the next drain of the capture client is due. Returns false if there is nothing to drain (timeout or stop).
+    bool WaitForPackets(DWORD dwBatchInterval);
+
+    // GetBuffer/ReleaseBuffer of the packet source or the active capture client
+    HRESULT GetPacket(BYTE **ppData, UINT32 *pFrames, DWORD *pFlags, UINT64 *pDevicePosition, UINT64 *pQPCPosition);
+    HRESULT ReleasePacket(UINT32 iFrames);
+
     void ProcessMainToCallback();
 
 #if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
@@ -172,38 +775,239 @@ private:
     void ProcessIntermediate();
 #endif
 
-    HRESULT                         m_hrLastError;
+    // Passes the first iSize bytes of Data to the chunk callback. If that is all of Data, its buffer is swapped with the buffer of a
+    // recycled chunk (Data is left empty), otherwise the bytes are copied.
+    void DeliverChunk(std::vector<unsigned char>& Data, size_t iSize);
 
-    std::atomic<eCaptureState>      m_CaptureState;
+    // Main audio thread. Writes whole frames of the collected data into the ring of SetExternalDrain and signals the data event.
+    // Returns the bytes written, the rest did not fit.
+    size_t WriteDrainRing(const unsigned char *pData, size_t iSize);
+
+    void UpdateMaxExecutionTime(double fDuration);
+    void AddTraceRecord(eLoopbackTraceRecord Type, std::chrono::steady_clock::time_point Time, UINT32 iValue, UINT16 iFlags);
+    void RecordWakeInterval(std::chrono::steady_clock::time_point& LastDrain, std::chrono::steady_clock::time_point Now);
+    void LogEvent(eLoopbackEvent Type, UINT64 iValue = 0, UINT32 iValue2 = 0);
+
+    // Progress of the capture window, iStart is converted to 100ns units for QPC starts
+    struct sCaptureWindow
+    {
+        eCaptureWindowStart         Start;
+        UINT64                      iStart;
+        UINT64                      iFramesLeft;
+        bool                        bStarted;
+    };
+
+    // Moves the timestamps of a packet's first frame iFrames later. A QPC position of 0 (timestamp error) stays 0.
+    void AdvanceTimestamp(UINT64& iDevicePosition, UINT64& iQPCPosition, UINT64 iFrames);
+
+    // Narrows the frames [iBegin, iFrames) of a packet to [iBegin, iEnd) inside the window.
+    void ClipToCaptureWindow(sCaptureWindow& Window, UINT32 iFrames, UINT64 iDevicePosition, UINT64 iQPCPosition, UINT32& iBegin, UINT32& iEnd);
+
+    // State of a main audio thread, local to the thread so the hot loop never writes to a member
+    struct sMainThread
+    {
+        HANDLE                      hTaskHandle;
+        DWORD                       dwBytesToSkip;
+        DWORD                       dwBatchInterval;
+        UINT64                      iWakeups;
+        bool                        bTrace;
+        bool                        bTiming;
+        std::chrono::steady_clock::time_point
+                                    LastDrain;
+        std::chrono::steady_clock::time_point
+                                    DrainStart;
+
+        sCaptureWindow              Window;
+        bool                        bWindow;            // Stays set after the window is complete, later frames are dropped
+        bool                        bWindowComplete;    // During the current drain
+
+        // Retarget state, the end of the old stream is derived from its last packet
+        UINT64                      iLastQPCPosition;
+        UINT32                      iLastFrames;
+        UINT64                      iAlignQPC;
+        INT64                       iRetargetDropped;
+
+        // Event log state, only changes are reported
+        DWORD                       dwBytesSkipped;
+        DWORD                       dwLastCaptureFlags;
+        HRESULT                     hrLastFailure;
+    };
+
+    // Packet of the capture client. [iBytesToSkip, iBytesAvailable) is the part to deliver, after the initial skip, the retarget
+    // alignment and the capture window.
+    struct sMainPacket
+    {
+        BYTE                        *pData;
+        UINT32                      iFrames;
+        UINT64                      iDevicePosition;
+        UINT64                      iQPCPosition;
+        DWORD                       dwFlags;
+        UINT64                      iBytesToSkip;
+        UINT64                      iBytesAvailable;
+    };
+
+    // The main audio thread variants only differ in how they deliver the packets, everything else is done here.
+    void StartMainThread(sMainThread& Thread);
+    void StopMainThread(sMainThread& Thread);
+
+    // Waits for the next drain. Returns true if the packets should be drained now.
+    bool BeginMainDrain(sMainThread& Thread);
+
+    // Gets the next packet and does all per-packet bookkeeping (trace, statistics, event log, skip, retarget alignment, capture window).
+    // Returns false when no packet is left.
+    bool GetMainPacket(sMainThread& Thread, sMainPacket& Packet);
+    void ReleaseMainPacket(const sMainPacket& Packet);
+
+    // After the packets of a drain were delivered: signals a completed window, switches to a retarget client and records the timing.
+    void EndMainDrain(sMainThread& Thread);
+
+    // Switches to the client of Retarget if one is pending and Retarget did not give up on it meanwhile
+    void SwitchPendingRetarget(sMainThread& Thread);
+
+    // Written by any control operation, read by GetLastErrorResult from any thread
+    std::atomic<HRESULT>            m_hrLastError;
+
+    // Configuration. Written while the capture is stopped (READY), read-only for the audio threads, with these exceptions:
+    // Retarget prepares the m_pRetarget* members while running, and the main audio thread swaps them with the active client
+    // (m_bRetargetPending). The chunk pool synchronizes itself.
 
     IAudioClient                    *m_pAudioClient;
     IAudioCaptureClient             *m_pAudioCaptureClient; // Accessed from main audio thread
     HANDLE                          m_hSampleReadyEvent;
+    HANDLE                          m_hStopEvent; // Ends the wait of a batching main audio thread early
 
     bool                            m_bCaptureFormatInitialized;
     WAVEFORMATEX                    m_CaptureFormat{};
     DWORD                           m_dwProcessId;
     bool                            m_bProcessInclusive;
     bool                            m_bUseIntermediateThread;
+    ILoopbackPacketSource           *m_pPacketSource;
 
     void                            (*m_pCallbackFunc)(const std::vector<unsigned char>::iterator&, const std::vector<unsigned char>::iterator&, void*);
     void                            *m_pCallbackFuncUserData;
+    void                            (*m_pChunkFunc)(LoopbackChunk*, void*);
+    void                            *m_pChunkFuncUserData;
+    std::shared_ptr<LoopbackChunkPool> m_pChunkPool;
     DWORD                           m_dwCallbackInterval;
+    DWORD                           m_dwBatchInterval;
+    DWORD                           m_dwActiveBatchInterval;
 
-    std::atomic<bool>               m_bRunAudioThreads;
+    std::chrono::steady_clock::time_point
+                                    m_WakeupCountStart;
+
+    size_t                          m_iTraceCapacity;
+    std::chrono::steady_clock::time_point
+                                    m_TraceStart;
+
+    eCaptureWindowStart             m_CaptureWindowStart;
+    UINT64                          m_iCaptureWindowStart;
+    UINT64                          m_iCaptureWindowFrames;
+    HANDLE                          m_hCaptureWindowEvent; // Set by the main audio thread when the window is complete
+
+    bool                            m_bTimingStatistics;
+    UINT32                          m_iBufferFrames; // Granted by the audio client
+
+    LoopbackEventRing               *m_pEventRing;
+    UINT16                          m_iEventSource;
+
+    // Client prepared by Retarget, swapped with the active one by the main audio thread (which then sets m_hRetargetEvent)
+    IAudioClient                    *m_pRetargetAudioClient;
+    IAudioCaptureClient             *m_pRetargetAudioCaptureClient;
+    HANDLE                          m_hRetargetSampleReadyEvent;
+    HANDLE                          m_hRetargetEvent;
+
+    // External draining, the ring is only reallocated while stopped
+    bool                            m_bExternalDrain;
+    HANDLE                          m_hDataEvent;
+    std::vector<unsigned char>      m_DrainRing;
+
+    // Phase timing of the control operations, written by the controlling thread. The histograms are indexed by
+    // operation * PhaseCount + phase.
+    std::unique_ptr<LoopbackHistogram[]> m_pPhaseHistograms;
+    std::mutex                      m_PhaseLock;
+    sLoopbackPhaseTiming            m_LastPhaseTimings[LoopbackCaptureConst::OperationCount];
+    bool                            m_bPhaseTimingValid[LoopbackCaptureConst::OperationCount];
 
     std::thread                     *m_pMainAudioThread;
+    std::thread                     *m_pQueueAudioThread;
+
+    // Control block. Written by the controlling thread, polled by the audio threads.
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<bool>               m_bRunAudioThreads;
+    std::atomic<eCaptureState>      m_CaptureState;
+
+    // Producer block. Only touched by the main audio thread while it is running.
+    // m_dwMainThreadBytesToSkip is handed to the thread on start and consumed locally.
+    // m_iWakeupCount is stored (not incremented) by the main audio thread from a local counter.
+    // m_CaptureWindow is copied by the main audio thread on start and written back when it exits.
+    // The trace is only read by the controlling thread after the audio threads were joined.
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
     DWORD                           m_dwMainThreadBytesToSkip;
+    std::atomic<UINT64>             m_iWakeupCount;
+    sCaptureWindow                  m_CaptureWindow;
+    std::vector<sLoopbackTraceRecord>
+                                    m_Trace;
+    UINT64                          m_iTraceCount;
+
+    // Timing histograms and retarget state. Written by the main audio thread only, the reset and switch are requested through
+    // m_bResetTimingStatistics and m_bRetargetPending.
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<bool>               m_bResetTimingStatistics;
+    std::atomic<bool>               m_bRetargetPending;
+    std::atomic<bool>               m_bRetargetAligned;
+    std::atomic<INT64>              m_iRetargetGap;
+    LoopbackHistogram               m_WakeIntervals;
+    LoopbackHistogram               m_PacketSizes;
+
+    // Written by the main audio thread only when a new maximum is reached, so readers do not steal the producer's lines.
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
     std::atomic<double>             m_fMaxExecutionTime;
 
-    std::thread                     *m_pQueueAudioThread;
-
 #if defined PROCESS_LOOPBACK_CAPTURE_USE_QUEUE
-    moodycamel::ReaderWriterQueue<unsigned char, 8192>
+    // Whole packets are enqueued and dequeued in bulk through the tokens of the two threads, so the indices of the queue are
+    // touched once per packet instead of once per byte. The queue pads them internally, it only needs to be kept away from
+    // the other blocks.
+    struct sQueueTraits : public moodycamel::ConcurrentQueueDefaultTraits
+    {
+        static const size_t BLOCK_SIZE = 1024;
+    };
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    moodycamel::ConcurrentQueue<unsigned char, sQueueTraits>
                                     m_Queue;
+
+    // Timestamps of the enqueued packets, pushed by the main audio thread before the packet's bytes. The intermediate thread
+    // matches them to its position in the byte stream.
+    struct sTimestampAnchor
+    {
+        UINT64                      iOffset;            // Bytes enqueued before the packet
+        UINT64                      iDevicePosition;    // Of the first enqueued frame
+        UINT64                      iQPCPosition;
+    };
+
+    LoopbackRing<sTimestampAnchor>  m_TimestampAnchors;
 #endif
 
+    // Write position of the drain ring, monotonic. Stored by the main audio thread after the data was copied.
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<size_t>             m_iDrainWritePosition;
+
+    // Consumer block. Owned by whichever thread calls the user callback.
+
+    alignas(LoopbackCaptureConst::CacheLineSize)
     std::vector<unsigned char>      m_AudioData; // Used to align the audio data in intermediate mode.
+    UINT64                          m_iCallbackDevicePosition;  // First frame of the data passed to the callback
+    UINT64                          m_iCallbackQPCPosition;
+
+    // Owned by the thread that calls Drain
+    alignas(LoopbackCaptureConst::CacheLineSize)
+    std::atomic<size_t>             m_iDrainReadPosition;
+    std::vector<unsigned char>      m_DrainData;
 };
 
 // ------------------------------------------------------------ EOF
\ No newline at end of file
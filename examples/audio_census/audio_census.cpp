@@ -0,0 +1,212 @@
+/*
+
+Audio census for ProcessLoopbackCapture
+
+Samples every application on the host (the top-most process of each executable, see FindApplicationProcesses) for a short
+window per cycle with LoopbackCensus and prints which ones are playing audio and how loud.
+
+Usage: audio_census [window seconds = 2] [max concurrent captures = 4] [cycle interval seconds = 30]
+
+Ctrl+C stops the census.
+
+*/
+
+#include <Windows.h>
+#include <combaseapi.h> // CoInitialize(Ex)
+
+#include <atomic>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <ProcessLoopbackCapture.h>
+#include <LoopbackCensus.h>
+#include <ProcessInfo.h> // For FindApplicationProcesses
+
+// ------------------------------------------------------------
+
+constexpr double DEFAULT_WINDOW_DURATION = 2.0;
+constexpr unsigned int DEFAULT_MAX_CAPTURES = 4U;
+constexpr double DEFAULT_CYCLE_INTERVAL = 30.0;
+
+// Rows printed per report, silent processes are summarized
+constexpr size_t MAX_REPORT_ROWS = 20U;
+
+// ------------------------------------------------------------
+
+std::atomic<bool> g_bRunCensus{ true };
+HANDLE g_hStopEvent{ NULL };
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[]);
+BOOL WINAPI OnConsoleCtrl(DWORD dwCtrlType);
+void UpdateTargets(LoopbackCensus& Census);
+void PrintTable(LoopbackCensus& Census);
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[])
+{
+    double fWindowDuration = DEFAULT_WINDOW_DURATION;
+    unsigned int iMaxCaptures = DEFAULT_MAX_CAPTURES;
+    double fCycleInterval = DEFAULT_CYCLE_INTERVAL;
+
+    try
+    {
+        if (argc >= 2)
+            fWindowDuration = std::stod(argv[1]);
+
+        if (argc >= 3)
+            iMaxCaptures = static_cast<unsigned int>(std::stoul(argv[2]));
+
+        if (argc >= 4)
+            fCycleInterval = std::stod(argv[3]);
+    }
+    catch (...)
+    {
+        // Checked by the setters below
+        fWindowDuration = -1.0;
+    }
+
+    LoopbackCensus Census;
+
+    if (Census.SetWindowDuration(fWindowDuration) != eCaptureError::NONE ||
+        Census.SetMaxConcurrentCaptures(iMaxCaptures) != eCaptureError::NONE ||
+        Census.SetCycleInterval(fCycleInterval) != eCaptureError::NONE)
+    {
+        std::cout << "Invalid arguments" << std::endl;
+        std::cout << "Usage: audio_census [window seconds] [max concurrent captures] [cycle interval seconds]" << std::endl;
+        return 1;
+    }
+
+    if (CoInitializeEx(NULL, COINIT_MULTITHREADED) != S_OK)
+    {
+        std::cout << "Failed to init COM" << std::endl;
+        return 1;
+    }
+
+    g_hStopEvent = CreateEventW(NULL, true, false, NULL);
+    SetConsoleCtrlHandler(&OnConsoleCtrl, true);
+
+    UpdateTargets(Census);
+
+    eCaptureError eError = Census.Start();
+
+    if (eError != eCaptureError::NONE)
+    {
+        std::cout << "Failed to start census: " << LoopbackCaptureConst::GetErrorText(eError) << std::endl;
+    }
+    else
+    {
+        // Processes come and go, the list is refreshed once per cycle
+
+        while (g_bRunCensus)
+        {
+            if (WaitForSingleObject(g_hStopEvent, (DWORD)(fCycleInterval * 1000.0) + 1000) == WAIT_OBJECT_0)
+                break;
+
+            PrintTable(Census);
+            UpdateTargets(Census);
+        }
+
+        std::cout << "Shutting down ..." << std::endl;
+
+        Census.Stop();
+    }
+
+    SetConsoleCtrlHandler(&OnConsoleCtrl, false);
+    CloseHandle(g_hStopEvent);
+
+    CoUninitialize();
+
+    return eError == eCaptureError::NONE ? 0 : 1;
+}
+
+// ------------------------------------------------------------
+
+BOOL WINAPI OnConsoleCtrl(DWORD dwCtrlType)
+{
+    switch (dwCtrlType)
+    {
+    case CTRL_C_EVENT:
+    case CTRL_BREAK_EVENT:
+    case CTRL_CLOSE_EVENT:
+        g_bRunCensus = false;
+        SetEvent(g_hStopEvent);
+        return true;
+    }
+
+    return false;
+}
+
+void UpdateTargets(LoopbackCensus& Census)
+{
+    std::vector<std::pair<DWORD, std::wstring>> Processes;
+
+    if (!FindApplicationProcesses(Processes))
+    {
+        std::cout << "Failed to enumerate processes" << std::endl;
+        return;
+    }
+
+    std::vector<sLoopbackCensusTarget> Targets;
+    Targets.reserve(Processes.size());
+
+    for (auto& Process : Processes)
+        Targets.push_back({ Process.first, Process.second });
+
+    Census.SetTargets(Targets);
+}
+
+void PrintTable(LoopbackCensus& Census)
+{
+    std::vector<sLoopbackCensusEntry> Table;
+    Census.GetTable(Table);
+
+    size_t iSilent = 0;
+    size_t iFailed = 0;
+    size_t iRows = 0;
+
+    std::wcout << L"---- cycle " << Census.GetCycleCount() << L", " << Table.size() << L" processes" << std::endl;
+    std::wcout << std::fixed << std::setprecision(1);
+
+    for (auto& Entry : Table)
+    {
+        if (Entry.LastError != eCaptureError::NONE)
+        {
+            ++iFailed;
+            continue;
+        }
+
+        if (Entry.fActivity == 0.0f)
+        {
+            ++iSilent;
+            continue;
+        }
+
+        if (++iRows > MAX_REPORT_ROWS)
+            continue;
+
+        double fRmsDb = Entry.fRms > 0.0f ? 20.0 * log10(Entry.fRms) : -INFINITY;
+        double fPeakDb = Entry.fPeak > 0.0f ? 20.0 * log10(Entry.fPeak) : -INFINITY;
+
+        std::wcout << L"  " << std::setw(24) << std::left << Entry.Name << std::right
+            << L" PID " << std::setw(6) << Entry.dwProcessId
+            << L"  RMS " << std::setw(6) << fRmsDb << L" dBFS"
+            << L"  peak " << std::setw(6) << fPeakDb << L" dBFS"
+            << L"  active " << std::setw(5) << Entry.fActivity * 100.0f << L"%"
+            << L"  (" << Entry.iWindowCount << L" windows)"
+            << std::endl;
+    }
+
+    if (iRows > MAX_REPORT_ROWS)
+        std::wcout << L"  ... " << iRows - MAX_REPORT_ROWS << L" more active" << std::endl;
+
+    std::wcout << L"  " << iSilent << L" silent, " << iFailed << L" could not be captured" << std::endl;
+    std::wcout << std::defaultfloat;
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,366 @@
+/*
+
+Denoise benchmark for LoopbackDenoiseSink
+
+Runs the denoise stage offline on synthetic noisy fixtures (no capture or audio device needed) and reports the processing load
+per channel for common capture formats, and how much noise is removed and how much of the voice is kept.
+
+Fixtures: a voice-like signal (harmonic syllables with a moving pitch, 4 per second) mixed with fan noise (hum and low-passed
+broadband noise), keyboard noise (short decaying clicks) or both, at the given SNR.
+
+Fails (exit code 1) if the stage does not improve the SNR of every fixture, i.e. if it removes less noise than it damages the voice.
+
+Usage: denoise_benchmark [seconds of audio per run = 20] [SNR dB = 5]
+
+*/
+
+#include <Windows.h>
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <LoopbackCaptureSink.h>
+#include <LoopbackDenoiseSink.h>
+
+// ------------------------------------------------------------
+
+constexpr double DEFAULT_DURATION = 20.0;
+constexpr double DEFAULT_SNR = 5.0;
+
+constexpr double PI = 3.14159265358979323846;
+
+// ------------------------------------------------------------
+
+enum class eNoise : int
+{
+    FAN = 0,
+    KEYBOARD,
+    FAN_AND_KEYBOARD
+};
+
+struct sFixture
+{
+    std::vector<float> Voice;       // Mono, clean
+    std::vector<float> Noisy;       // Mono, voice and noise
+};
+
+// Keeps the output of the stage for the quality measurements
+class CollectSink : public ILoopbackCaptureSink
+{
+public:
+
+    void OnData(const unsigned char *pData, size_t iSize) override
+    {
+        const float *pSamples = reinterpret_cast<const float*>(pData);
+        Samples.insert(Samples.end(), pSamples, pSamples + iSize / sizeof(float));
+    }
+
+    std::vector<float> Samples;
+};
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[]);
+sFixture CreateFixture(DWORD dwSampleRate, double fDuration, eNoise Noise, double fSNR);
+bool RunLoad(DWORD dwSampleRate, WORD nChannels, const sFixture& Fixture);
+bool RunQuality(DWORD dwSampleRate, eNoise Noise, const sFixture& Fixture);
+WAVEFORMATEX MakeFormat(DWORD dwSampleRate, WORD nChannels);
+const char* GetNoiseName(eNoise Noise);
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[])
+{
+    double fDuration = DEFAULT_DURATION;
+    double fSNR = DEFAULT_SNR;
+
+    try
+    {
+        if (argc >= 2)
+            fDuration = std::stod(argv[1]);
+
+        if (argc >= 3)
+            fSNR = std::stod(argv[2]);
+    }
+    catch (...)
+    {
+        fDuration = -1.0;
+    }
+
+    if (fDuration < 1.0 || fDuration > 3600.0)
+    {
+        std::cout << "Invalid arguments" << std::endl;
+        std::cout << "Usage: denoise_benchmark [seconds of audio per run] [SNR dB]" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed;
+
+    // Load: float captures at the usual rates, the channels are processed independently
+
+    std::cout << "Load (processing time / audio duration)" << std::endl;
+    std::cout << std::setw(8) << "Rate" << std::setw(10) << "Channels" << std::setw(8) << "FFT" << std::setw(12) << "Per channel" << std::setw(10) << "Total" << std::endl;
+
+    for (DWORD dwSampleRate : { 16000U, 44100U, 48000U })
+    {
+        sFixture Fixture = CreateFixture(dwSampleRate, fDuration, eNoise::FAN_AND_KEYBOARD, fSNR);
+
+        for (WORD nChannels : { 1, 2, 8 })
+        {
+            if (!RunLoad(dwSampleRate, nChannels, Fixture))
+                return 1;
+        }
+    }
+
+    // Quality: noise removed in the pauses, voice kept in the syllables
+
+    std::cout << std::endl << "Quality at 48 kHz, " << std::setprecision(1) << fSNR << " dB SNR" << std::endl;
+    std::cout << std::setw(20) << "Noise" << std::setw(18) << "Noise removed" << std::setw(16) << "Voice kept" << std::setw(16) << "SNR gain" << std::endl;
+
+    bool bPassed = true;
+
+    for (eNoise Noise : { eNoise::FAN, eNoise::KEYBOARD, eNoise::FAN_AND_KEYBOARD })
+    {
+        if (!RunQuality(48000, Noise, CreateFixture(48000, fDuration, Noise, fSNR)))
+            bPassed = false;
+    }
+
+    if (!bPassed)
+    {
+        std::cout << std::endl << "FAILED: the SNR gain must be positive for every fixture" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+
+sFixture CreateFixture(DWORD dwSampleRate, double fDuration, eNoise Noise, double fSNR)
+{
+    size_t iSamples = (size_t)(fDuration * dwSampleRate);
+
+    sFixture Fixture;
+    Fixture.Voice.assign(iSamples, 0.0f);
+    Fixture.Noisy.assign(iSamples, 0.0f);
+
+    std::mt19937 Random(1234);
+    std::normal_distribution<double> Gaussian(0.0, 1.0);
+    std::uniform_real_distribution<double> Uniform(0.0, 1.0);
+
+    // Syllables of 150 ms with 100 ms pauses, 20 harmonics of a pitch gliding between 110 and 220 Hz
+
+    double fPhase = 0.0;
+
+    for (size_t i = 0; i < iSamples; ++i)
+    {
+        double t = (double)i / dwSampleRate;
+        double fSyllable = fmod(t, 0.25);
+
+        if (fSyllable >= 0.15)
+            continue;
+
+        double fEnvelope = sin(PI * fSyllable / 0.15);
+        double fPitch = 165.0 + 55.0 * sin(2.0 * PI * 0.3 * t);
+
+        fPhase += 2.0 * PI * fPitch / dwSampleRate;
+
+        double fSample = 0.0;
+
+        for (int h = 1; h <= 20 && fPitch * h < dwSampleRate / 2.0; ++h)
+            fSample += sin(fPhase * h) / h;
+
+        Fixture.Voice[i] = (float)(0.2 * fEnvelope * fSample);
+    }
+
+    // Noise, scaled to the SNR against the voice
+
+    std::vector<double> NoiseSamples(iSamples, 0.0);
+
+    if (Noise != eNoise::KEYBOARD)
+    {
+        double fLowpass = 0.0;
+        double fAlpha = 1.0 - exp(-2.0 * PI * 800.0 / dwSampleRate);
+
+        for (size_t i = 0; i < iSamples; ++i)
+        {
+            double fWhite = Gaussian(Random);
+
+            fLowpass += fAlpha * (fWhite - fLowpass);
+            NoiseSamples[i] += fLowpass + 0.1 * fWhite + 0.3 * sin(2.0 * PI * 100.0 * i / dwSampleRate);
+        }
+    }
+
+    if (Noise != eNoise::FAN)
+    {
+        // A key about every 150 ms, 5 ms clicks
+
+        size_t iNext = 0;
+        size_t iClickLength = dwSampleRate / 200;
+
+        while (iNext < iSamples)
+        {
+            double fLevel = 3.0 + 2.0 * Uniform(Random);
+
+            for (size_t i = 0; i < iClickLength && iNext + i < iSamples; ++i)
+                NoiseSamples[iNext + i] += fLevel * Gaussian(Random) * exp(-(double)i / (iClickLength / 4.0));
+
+            iNext += (size_t)((0.1 + 0.1 * Uniform(Random)) * dwSampleRate);
+        }
+    }
+
+    double fVoiceEnergy = 0.0;
+    double fNoiseEnergy = 0.0;
+
+    for (size_t i = 0; i < iSamples; ++i)
+    {
+        fVoiceEnergy += (double)Fixture.Voice[i] * Fixture.Voice[i];
+        fNoiseEnergy += NoiseSamples[i] * NoiseSamples[i];
+    }
+
+    double fNoiseScale = fNoiseEnergy > 0.0 ? sqrt(fVoiceEnergy / fNoiseEnergy / pow(10.0, fSNR / 10.0)) : 0.0;
+
+    for (size_t i = 0; i < iSamples; ++i)
+        Fixture.Noisy[i] = Fixture.Voice[i] + (float)(NoiseSamples[i] * fNoiseScale);
+
+    return Fixture;
+}
+
+bool RunLoad(DWORD dwSampleRate, WORD nChannels, const sFixture& Fixture)
+{
+    WAVEFORMATEX Format = MakeFormat(dwSampleRate, nChannels);
+
+    LoopbackDenoiseSink Denoiser;
+
+    if (Denoiser.Open(Format) != eCaptureError::NONE)
+    {
+        std::cout << "Failed to open the denoise stage" << std::endl;
+        return false;
+    }
+
+    // Interleaved with the same fixture on every channel, fed in 10 ms packets like the capture does
+
+    size_t iPacketFrames = dwSampleRate / 100;
+    std::vector<float> Packet(iPacketFrames * nChannels);
+
+    for (size_t iFrame = 0; iFrame + iPacketFrames <= Fixture.Noisy.size(); iFrame += iPacketFrames)
+    {
+        for (size_t i = 0; i < iPacketFrames; ++i)
+        {
+            for (WORD c = 0; c < nChannels; ++c)
+                Packet[i * nChannels + c] = Fixture.Noisy[iFrame + i];
+        }
+
+        Denoiser.OnData(reinterpret_cast<const unsigned char*>(Packet.data()), Packet.size() * sizeof(float));
+    }
+
+    std::cout << std::setw(8) << dwSampleRate << std::setw(10) << nChannels << std::setw(8) << Denoiser.GetLatency() * 2
+        << std::setw(11) << std::setprecision(3) << Denoiser.GetChannelLoad() * 100.0 << "%"
+        << std::setw(9) << Denoiser.GetLoad() * 100.0 << "%" << std::endl;
+
+    Denoiser.Close();
+
+    return true;
+}
+
+bool RunQuality(DWORD dwSampleRate, eNoise Noise, const sFixture& Fixture)
+{
+    WAVEFORMATEX Format = MakeFormat(dwSampleRate, 1);
+
+    CollectSink Output;
+    LoopbackDenoiseSink Denoiser;
+
+    Denoiser.SetTarget(&Output);
+
+    if (Denoiser.Open(Format) != eCaptureError::NONE)
+    {
+        std::cout << "Failed to open the denoise stage" << std::endl;
+        return false;
+    }
+
+    Denoiser.OnData(reinterpret_cast<const unsigned char*>(Fixture.Noisy.data()), Fixture.Noisy.size() * sizeof(float));
+
+    // Output sample i + latency belongs to input sample i. The first two seconds are skipped while the tracker settles.
+
+    size_t iLatency = Denoiser.GetLatency();
+    size_t iStart = 2 * dwSampleRate;
+
+    double fPauseIn = 0.0;
+    double fPauseOut = 0.0;
+    double fVoiceIn = 0.0;
+    double fVoiceOut = 0.0;
+    double fErrorIn = 0.0;
+    double fErrorOut = 0.0;
+
+    for (size_t i = iStart; i + iLatency < Output.Samples.size(); ++i)
+    {
+        double fClean = Fixture.Voice[i];
+        double fIn = Fixture.Noisy[i];
+        double fOut = Output.Samples[i + iLatency];
+
+        if (fClean == 0.0)
+        {
+            fPauseIn += fIn * fIn;
+            fPauseOut += fOut * fOut;
+        }
+        else
+        {
+            fVoiceIn += fClean * fClean;
+            fVoiceOut += fOut * fClean;
+        }
+
+        fErrorIn += (fIn - fClean) * (fIn - fClean);
+        fErrorOut += (fOut - fClean) * (fOut - fClean);
+    }
+
+    // Voice kept: projection of the output onto the clean voice, 0 dB is all of it. SNR gain: error against the clean voice
+    // before over after, noise and voice damage together.
+
+    double fGain = 10.0 * log10(fErrorIn / (fErrorOut + 1e-20));
+
+    std::cout << std::setw(20) << GetNoiseName(Noise) << std::setprecision(1)
+        << std::setw(15) << 10.0 * log10(fPauseIn / (fPauseOut + 1e-20)) << " dB"
+        << std::setw(13) << 10.0 * log10((fabs(fVoiceOut) + 1e-20) / fVoiceIn) << " dB"
+        << std::setw(13) << fGain << " dB" << (fGain > 0.0 ? "" : "  FAILED") << std::endl;
+
+    Denoiser.Close();
+
+    return fGain > 0.0;
+}
+
+WAVEFORMATEX MakeFormat(DWORD dwSampleRate, WORD nChannels)
+{
+    WAVEFORMATEX Format{};
+
+    Format.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+    Format.nChannels = nChannels;
+    Format.nSamplesPerSec = dwSampleRate;
+    Format.wBitsPerSample = 32;
+    Format.nBlockAlign = nChannels * sizeof(float);
+    Format.nAvgBytesPerSec = dwSampleRate * Format.nBlockAlign;
+
+    return Format;
+}
+
+const char* GetNoiseName(eNoise Noise)
+{
+    switch (Noise)
+    {
+    case eNoise::FAN:
+        return "Fan";
+
+    case eNoise::KEYBOARD:
+        return "Keyboard";
+
+    case eNoise::FAN_AND_KEYBOARD:
+        return "Fan and keyboard";
+    }
+
+    return "";
+}
+
+// ------------------------------------------------------------ EOF
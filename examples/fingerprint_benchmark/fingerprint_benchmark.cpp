@@ -0,0 +1,376 @@
+/*
+
+Fingerprint benchmark for LoopbackFingerprintSink and LoopbackFingerprintIndex
+
+Builds an index of synthetic reference tracks offline (no capture or audio device needed), then streams queries through the sink
+like a capture does and reports the matches and the time OnData takes.
+
+Fixtures: tracks of three-note chords with decaying notes, a new chord every 150-400 ms, each track from its own seed. References
+are extracted at 44.1 kHz mono. Queries are played at 48 kHz stereo, 10 dB quieter and with white noise added:
+
+- Known: an excerpt of a reference, which must be identified (and nothing else).
+- Unrelated: tracks with seeds that are not in the index, which must not match anything.
+- Drone: one chord of the scale held for the whole query, which must not match anything.
+- Noise: noise only, which must not match anything.
+
+Queries are streamed in 10 ms packets at about 10x real time, so the match thread of the sink keeps up as it would with a
+capture. One reference is replaced during every query, to show that AddReference does not stall OnData. Matches counts the
+matches of the sink, score and runner-up are those of the whole query matched directly, accepted or not.
+
+Fails (exit code 1) if a known query is not identified, or if anything else matches.
+
+Usage: fingerprint_benchmark [references = 50] [seconds per query = 20]
+
+*/
+
+#include <Windows.h>
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <LoopbackCaptureSink.h>
+#include <LoopbackFingerprint.h>
+
+// ------------------------------------------------------------
+
+constexpr size_t DEFAULT_REFERENCES = 50;
+constexpr double DEFAULT_DURATION = 20.0;
+
+constexpr double REFERENCE_SECONDS = 60.0;
+constexpr DWORD REFERENCE_RATE = 44100;
+constexpr DWORD QUERY_RATE = 48000;
+
+// Seeds of unrelated tracks start here, far from the reference ids
+constexpr UINT32 UNRELATED_SEED = 100000;
+
+constexpr size_t QUERIES_PER_KIND = 5;
+
+constexpr double PI = 3.14159265358979323846;
+
+// ------------------------------------------------------------
+
+enum class eQuery : int
+{
+    KNOWN = 0,
+    UNRELATED,
+    DRONE,
+    NOISE
+};
+
+// Collects the results of the match callback, called on the match thread of the sink
+struct sMatches
+{
+    std::mutex                      Lock;
+    std::vector<sLoopbackFingerprintMatch>
+                                    Matches;
+};
+
+struct sResult
+{
+    size_t                          iMatches;
+    size_t                          iWrongMatches;
+    UINT32                          iScore;         // Whole query
+    UINT32                          iRunnerUp;      // Whole query
+    double                          fMaxOnData;     // Microseconds
+};
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[]);
+std::vector<float> RenderTrack(UINT32 iSeed, DWORD dwSampleRate, WORD nChannels, double fStart, double fDuration, double fGain, double fNoise, bool bDrone);
+bool BuildIndex(LoopbackFingerprintIndex& Index, size_t iReferences);
+bool RunQuery(LoopbackFingerprintIndex& Index, eQuery Query, UINT32 iSeed, double fDuration, sResult& Result);
+void OnMatch(const sLoopbackFingerprintMatch& Match, void *pUserData);
+WAVEFORMATEX MakeFormat(DWORD dwSampleRate, WORD nChannels);
+const char* GetQueryName(eQuery Query);
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[])
+{
+    size_t iReferences = DEFAULT_REFERENCES;
+    double fDuration = DEFAULT_DURATION;
+
+    try
+    {
+        if (argc >= 2)
+            iReferences = (size_t)std::stoul(argv[1]);
+
+        if (argc >= 3)
+            fDuration = std::stod(argv[2]);
+    }
+    catch (...)
+    {
+        fDuration = -1.0;
+    }
+
+    if (iReferences < QUERIES_PER_KIND || iReferences > 10000 || fDuration < 8.0 || fDuration > REFERENCE_SECONDS - 10.0)
+    {
+        std::cout << "Invalid arguments" << std::endl;
+        std::cout << "Usage: fingerprint_benchmark [references] [seconds per query]" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed;
+
+    LoopbackFingerprintIndex Index;
+
+    if (!BuildIndex(Index, iReferences))
+        return 1;
+
+    std::cout << std::endl << "Queries of " << std::setprecision(0) << fDuration << " s at 48 kHz stereo, -10 dB with noise" << std::endl;
+    std::cout << std::setw(12) << "Query" << std::setw(8) << "Seed" << std::setw(10) << "Matches" << std::setw(8) << "Wrong"
+        << std::setw(8) << "Score" << std::setw(12) << "Runner-up" << std::setw(16) << "OnData max" << std::endl;
+
+    bool bPassed = true;
+
+    for (eQuery Query : { eQuery::KNOWN, eQuery::UNRELATED, eQuery::DRONE, eQuery::NOISE })
+    {
+        for (size_t q = 0; q < QUERIES_PER_KIND; ++q)
+        {
+            // Known queries are spread over the index, the others use seeds that are not in it
+            UINT32 iSeed = Query == eQuery::KNOWN ? (UINT32)(1 + q * iReferences / QUERIES_PER_KIND) : UNRELATED_SEED + (UINT32)q;
+
+            sResult Result{};
+
+            if (!RunQuery(Index, Query, iSeed, fDuration, Result))
+                return 1;
+
+            bool bFailed = Query == eQuery::KNOWN ? Result.iMatches == 0 || Result.iWrongMatches > 0 : Result.iMatches > 0;
+
+            std::cout << std::setw(12) << GetQueryName(Query) << std::setw(8) << iSeed << std::setw(10) << Result.iMatches
+                << std::setw(8) << Result.iWrongMatches << std::setw(8) << Result.iScore << std::setw(12) << Result.iRunnerUp
+                << std::setw(13) << std::setprecision(0) << Result.fMaxOnData << " us" << (bFailed ? "  FAILED" : "") << std::endl;
+
+            if (bFailed)
+                bPassed = false;
+        }
+    }
+
+    if (!bPassed)
+    {
+        std::cout << std::endl << "FAILED: known queries must be identified and nothing else may match" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+
+std::vector<float> RenderTrack(UINT32 iSeed, DWORD dwSampleRate, WORD nChannels, double fStart, double fDuration, double fGain, double fNoise, bool bDrone)
+{
+    // Chord starts and frequencies of the whole track, so an excerpt is the same audio as the reference. Like music, all tracks
+    // use the notes of one scale (4 octaves from 200 Hz) and a grid of 8th notes at 120 bpm, so unrelated tracks share many
+    // hashes and offsets.
+
+    std::mt19937 Random(iSeed);
+    std::uniform_int_distribution<int> Note(0, 47);
+    std::uniform_int_distribution<int> Length(1, 3);
+
+    std::vector<double> Starts;
+    std::vector<double> Frequencies;
+
+    for (double t = 0.0; t < REFERENCE_SECONDS; t += bDrone ? REFERENCE_SECONDS : 0.25 * Length(Random))
+    {
+        Starts.push_back(t);
+
+        for (int n = 0; n < 3; ++n)
+            Frequencies.push_back(200.0 * pow(2.0, Note(Random) / 12.0));
+    }
+
+    Starts.push_back(1e9);
+
+    std::mt19937 NoiseRandom(iSeed ^ 0x5A5A5A5A);
+    std::normal_distribution<double> Gaussian(0.0, 1.0);
+
+    size_t iFrames = (size_t)(fDuration * dwSampleRate);
+    std::vector<float> Samples(iFrames * nChannels);
+
+    size_t iChord = 0;
+
+    for (size_t i = 0; i < iFrames; ++i)
+    {
+        double t = fStart + (double)i / dwSampleRate;
+
+        while (Starts[iChord + 1] <= t)
+            ++iChord;
+
+        double fSample = 0.0;
+
+        if (fGain > 0.0)
+        {
+            double fEnvelope = bDrone ? 1.0 : exp(-6.0 * (t - Starts[iChord]));
+
+            for (int n = 0; n < 3; ++n)
+                fSample += sin(2.0 * PI * Frequencies[iChord * 3 + n] * t) / (n + 1) * fEnvelope;
+        }
+
+        fSample = 0.3 * fGain * fSample + fNoise * Gaussian(NoiseRandom);
+
+        for (WORD c = 0; c < nChannels; ++c)
+            Samples[i * nChannels + c] = (float)fSample;
+    }
+
+    return Samples;
+}
+
+bool BuildIndex(LoopbackFingerprintIndex& Index, size_t iReferences)
+{
+    WAVEFORMATEX Format = MakeFormat(REFERENCE_RATE, 1);
+
+    double fExtractSeconds = 0.0;
+
+    for (UINT32 iId = 1; iId <= (UINT32)iReferences; ++iId)
+    {
+        std::vector<float> Track = RenderTrack(iId, REFERENCE_RATE, 1, 0.0, REFERENCE_SECONDS, 1.0, 0.0, false);
+        std::vector<sLoopbackLandmark> Landmarks;
+
+        auto Start = std::chrono::steady_clock::now();
+
+        if (LoopbackFingerprintSink::Extract(Format, reinterpret_cast<const unsigned char*>(Track.data()), Track.size() * sizeof(float), Landmarks) != eCaptureError::NONE ||
+            Index.AddReference(iId, Landmarks) != eCaptureError::NONE)
+        {
+            std::cout << "Failed to add reference " << iId << std::endl;
+            return false;
+        }
+
+        fExtractSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    }
+
+    std::cout << "Index: " << Index.GetReferenceCount() << " references of " << std::setprecision(0) << REFERENCE_SECONDS << " s, "
+        << Index.GetLandmarkCount() << " landmarks, extracted and added at " << std::setprecision(2)
+        << fExtractSeconds / (iReferences * REFERENCE_SECONDS) * 100.0 << "% of the audio duration" << std::endl;
+
+    return true;
+}
+
+bool RunQuery(LoopbackFingerprintIndex& Index, eQuery Query, UINT32 iSeed, double fDuration, sResult& Result)
+{
+    WAVEFORMATEX Format = MakeFormat(QUERY_RATE, 2);
+
+    // Known queries start 20 s into the reference, off the frame grid of the reference
+
+    std::vector<float> Samples = RenderTrack(iSeed, QUERY_RATE, 2, 20.0137, fDuration, Query == eQuery::NOISE ? 0.0 : 0.3162, 0.02, Query == eQuery::DRONE);
+
+    sMatches Matches;
+    LoopbackFingerprintSink Sink;
+
+    Sink.SetIndex(&Index);
+    Sink.SetMatchCallback(&OnMatch, &Matches);
+
+    if (Sink.Open(Format) != eCaptureError::NONE)
+    {
+        std::cout << "Failed to open the fingerprint sink" << std::endl;
+        return false;
+    }
+
+    // A reference that is not queried is replaced while the query runs
+
+    std::vector<float> Replacement = RenderTrack((UINT32)Index.GetReferenceCount(), REFERENCE_RATE, 1, 0.0, REFERENCE_SECONDS, 1.0, 0.0, false);
+    std::vector<sLoopbackLandmark> ReplacementLandmarks;
+
+    LoopbackFingerprintSink::Extract(MakeFormat(REFERENCE_RATE, 1), reinterpret_cast<const unsigned char*>(Replacement.data()), Replacement.size() * sizeof(float), ReplacementLandmarks);
+
+    std::thread Writer([&Index, &ReplacementLandmarks]()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        Index.AddReference((UINT32)Index.GetReferenceCount(), ReplacementLandmarks);
+    });
+
+    size_t iPacketSize = QUERY_RATE / 100 * Format.nBlockAlign;
+    size_t iSize = Samples.size() * sizeof(float);
+
+    const unsigned char *pData = reinterpret_cast<const unsigned char*>(Samples.data());
+
+    for (size_t iOffset = 0; iOffset + iPacketSize <= iSize; iOffset += iPacketSize)
+    {
+        auto Start = std::chrono::steady_clock::now();
+
+        Sink.OnData(pData + iOffset, iPacketSize);
+
+        double fOnData = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - Start).count();
+
+        if (fOnData > Result.fMaxOnData)
+            Result.fMaxOnData = fOnData;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    Writer.join();
+    Sink.Close();
+
+    std::lock_guard<std::mutex> Lock(Matches.Lock);
+
+    for (const sLoopbackFingerprintMatch& Match : Matches.Matches)
+    {
+        ++Result.iMatches;
+
+        if (Query != eQuery::KNOWN || Match.iId != iSeed)
+            ++Result.iWrongMatches;
+    }
+
+    // The whole query against the index, to show how far the best candidate is from the runner-up even if it is rejected
+
+    std::vector<sLoopbackLandmark> Landmarks;
+    sLoopbackFingerprintMatch Whole{};
+
+    LoopbackFingerprintSink::Extract(Format, reinterpret_cast<const unsigned char*>(Samples.data()), Samples.size() * sizeof(float), Landmarks);
+    Index.Match(Landmarks.data(), Landmarks.size(), Whole);
+
+    Result.iScore = Whole.iScore;
+    Result.iRunnerUp = Whole.iRunnerUp;
+
+    return true;
+}
+
+void OnMatch(const sLoopbackFingerprintMatch& Match, void *pUserData)
+{
+    sMatches *pMatches = static_cast<sMatches*>(pUserData);
+
+    std::lock_guard<std::mutex> Lock(pMatches->Lock);
+    pMatches->Matches.push_back(Match);
+}
+
+WAVEFORMATEX MakeFormat(DWORD dwSampleRate, WORD nChannels)
+{
+    WAVEFORMATEX Format{};
+
+    Format.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
+    Format.nChannels = nChannels;
+    Format.nSamplesPerSec = dwSampleRate;
+    Format.wBitsPerSample = 32;
+    Format.nBlockAlign = nChannels * sizeof(float);
+    Format.nAvgBytesPerSec = dwSampleRate * Format.nBlockAlign;
+
+    return Format;
+}
+
+const char* GetQueryName(eQuery Query)
+{
+    switch (Query)
+    {
+    case eQuery::KNOWN:
+        return "Known";
+
+    case eQuery::UNRELATED:
+        return "Unrelated";
+
+    case eQuery::DRONE:
+        return "Drone";
+
+    case eQuery::NOISE:
+        return "Noise";
+    }
+
+    return "";
+}
+
+// ------------------------------------------------------------ EOF
@@ -0,0 +1,248 @@
+/*
+
+FLAC benchmark for LoopbackFlacSink
+
+Encodes the same synthetic capture with 1, 2, 4 and 8 encoder threads and the number of hardware threads (no capture or audio
+device needed), reports the encoding speed, and checks that every thread count writes exactly the same bytes as one thread.
+
+Fixtures, fed in 10 ms packets like the capture does, with silence trimming enabled:
+
+- 16 bit stereo at 48 kHz: a chord with a slow tremolo and some noise, with 1 s of silence before and after.
+- 24 bit with 10 channels at 48 kHz (two files: channels 0-7 and 8-9), the same signal with a different gain per channel.
+
+Fails (exit code 1) if a file differs from the one encoded with one thread, or if the sink reports an error.
+
+The files are written to the given directory and deleted afterwards.
+
+Usage: flac_benchmark [seconds of audio = 60] [directory = .]
+
+*/
+
+#include <Windows.h>
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <LoopbackFlacSink.h>
+
+// ------------------------------------------------------------
+
+constexpr double DEFAULT_DURATION = 60.0;
+constexpr double SILENCE_SECONDS = 1.0;
+
+constexpr double PI = 3.14159265358979323846;
+
+// ------------------------------------------------------------
+
+struct sFixture
+{
+    const char                      *pName;
+    WAVEFORMATEX                    Format;
+    std::vector<unsigned char>      Data;
+    std::vector<std::wstring>       FileSuffixes;   // Of the files written for one output name
+};
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[]);
+sFixture CreateFixture(const char *pName, WORD nChannels, WORD wBitsPerSample, double fDuration);
+bool Encode(const sFixture& Fixture, unsigned int iThreadCount, const std::wstring& FileName, double& fSeconds);
+bool LoadFile(const std::wstring& FileName, std::vector<char>& Data);
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[])
+{
+    double fDuration = DEFAULT_DURATION;
+    std::wstring Directory = L".";
+
+    try
+    {
+        if (argc >= 2)
+            fDuration = std::stod(argv[1]);
+
+        if (argc >= 3)
+            Directory = argv[2];
+    }
+    catch (...)
+    {
+        fDuration = -1.0;
+    }
+
+    if (fDuration < 1.0 || fDuration > 3600.0)
+    {
+        std::cout << "Invalid arguments" << std::endl;
+        std::cout << "Usage: flac_benchmark [seconds of audio] [directory]" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed;
+
+    std::vector<sFixture> Fixtures;
+
+    Fixtures.push_back(CreateFixture("16 bit stereo", 2, 16, fDuration));
+    Fixtures.push_back(CreateFixture("24 bit 10 ch", 10, 24, fDuration));
+
+    Fixtures[0].FileSuffixes = { L".flac" };
+    Fixtures[1].FileSuffixes = { L".ch00-07.flac", L".ch08-09.flac" };
+
+    std::vector<unsigned int> ThreadCounts = { 1, 2, 4, 8 };
+    unsigned int iHardwareThreads = std::thread::hardware_concurrency();
+
+    if (iHardwareThreads > 8)
+        ThreadCounts.push_back(iHardwareThreads);
+
+    std::cout << std::setw(16) << "Fixture" << std::setw(10) << "Threads" << std::setw(16) << "Speed" << std::setw(14) << "Output" << std::endl;
+
+    bool bPassed = true;
+
+    for (const sFixture& Fixture : Fixtures)
+    {
+        std::vector<std::vector<char>> Reference;
+
+        for (unsigned int iThreadCount : ThreadCounts)
+        {
+            std::wstring Name = Directory + L"/flac_benchmark_" + std::to_wstring(iThreadCount);
+            double fSeconds = 0.0;
+
+            if (!Encode(Fixture, iThreadCount, Name + L".flac", fSeconds))
+            {
+                std::cout << "Failed to encode " << Fixture.pName << " with " << iThreadCount << " threads" << std::endl;
+                return 1;
+            }
+
+            // Every file of the output, compared with the same file of the single thread run
+
+            bool bSame = true;
+            size_t iBytes = 0;
+
+            for (size_t f = 0; f < Fixture.FileSuffixes.size(); ++f)
+            {
+                std::wstring FileName = Name + Fixture.FileSuffixes[f];
+                std::vector<char> Data;
+
+                if (!LoadFile(FileName, Data))
+                    bSame = false;
+
+                std::filesystem::remove(FileName);
+
+                iBytes += Data.size();
+
+                if (iThreadCount == 1)
+                    Reference.push_back(std::move(Data));
+                else if (f >= Reference.size() || Data != Reference[f])
+                    bSame = false;
+            }
+
+            std::cout << std::setw(16) << Fixture.pName << std::setw(10) << iThreadCount
+                << std::setw(10) << std::setprecision(1) << fDuration / fSeconds << "x real"
+                << std::setw(11) << iBytes / 1024 << " kB" << (bSame ? "" : "  DIFFERS") << std::endl;
+
+            if (!bSame)
+                bPassed = false;
+        }
+    }
+
+    if (!bPassed)
+    {
+        std::cout << std::endl << "FAILED: the output must not depend on the thread count" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+
+sFixture CreateFixture(const char *pName, WORD nChannels, WORD wBitsPerSample, double fDuration)
+{
+    sFixture Fixture;
+
+    Fixture.pName = pName;
+
+    Fixture.Format.wFormatTag = WAVE_FORMAT_PCM;
+    Fixture.Format.nChannels = nChannels;
+    Fixture.Format.nSamplesPerSec = 48000;
+    Fixture.Format.wBitsPerSample = wBitsPerSample;
+    Fixture.Format.nBlockAlign = nChannels * wBitsPerSample / 8;
+    Fixture.Format.nAvgBytesPerSec = Fixture.Format.nSamplesPerSec * Fixture.Format.nBlockAlign;
+
+    size_t iSilence = (size_t)(SILENCE_SECONDS * Fixture.Format.nSamplesPerSec);
+    size_t iFrames = (size_t)(fDuration * Fixture.Format.nSamplesPerSec) + 2 * iSilence;
+    size_t iBytesPerSample = wBitsPerSample / 8;
+
+    Fixture.Data.assign(iFrames * Fixture.Format.nBlockAlign, 0);
+
+    std::mt19937 Random(1234);
+    std::normal_distribution<double> Gaussian(0.0, 1.0);
+
+    for (size_t i = iSilence; i < iFrames - iSilence; ++i)
+    {
+        double t = (double)i / Fixture.Format.nSamplesPerSec;
+        double fSample = (0.6 + 0.4 * sin(2.0 * PI * 3.0 * t)) *
+            (0.3 * sin(2.0 * PI * 220.0 * t) + 0.2 * sin(2.0 * PI * 277.2 * t) + 0.15 * sin(2.0 * PI * 329.6 * t)) + 0.01 * Gaussian(Random);
+
+        for (WORD c = 0; c < nChannels; ++c)
+        {
+            double fChannel = fSample * (1.0 - 0.05 * c);
+            INT32 iValue = (INT32)lround(fChannel * ((1 << (wBitsPerSample - 1)) - 1));
+
+            unsigned char *pSample = Fixture.Data.data() + i * Fixture.Format.nBlockAlign + c * iBytesPerSample;
+
+            for (size_t b = 0; b < iBytesPerSample; ++b)
+                pSample[b] = (unsigned char)(iValue >> (8 * b));
+        }
+    }
+
+    return Fixture;
+}
+
+bool Encode(const sFixture& Fixture, unsigned int iThreadCount, const std::wstring& FileName, double& fSeconds)
+{
+    LoopbackFlacSink Sink;
+
+    Sink.SetThreadCount(iThreadCount);
+    Sink.SetTrimSilence(true, 0.001f);
+
+    if (Sink.Open(FileName, Fixture.Format) != eCaptureError::NONE)
+        return false;
+
+    size_t iPacketSize = Fixture.Format.nSamplesPerSec / 100 * Fixture.Format.nBlockAlign;
+
+    auto Start = std::chrono::steady_clock::now();
+
+    for (size_t iOffset = 0; iOffset < Fixture.Data.size(); iOffset += iPacketSize)
+    {
+        size_t iSize = Fixture.Data.size() - iOffset < iPacketSize ? Fixture.Data.size() - iOffset : iPacketSize;
+        Sink.OnData(Fixture.Data.data() + iOffset, iSize);
+    }
+
+    eCaptureError eError = Sink.Close();
+
+    fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+    return eError == eCaptureError::NONE;
+}
+
+bool LoadFile(const std::wstring& FileName, std::vector<char>& Data)
+{
+    std::ifstream File(std::filesystem::path(FileName), std::ios::binary);
+
+    if (!File)
+        return false;
+
+    Data.assign(std::istreambuf_iterator<char>(File), std::istreambuf_iterator<char>());
+
+    return true;
+}
+
+// ------------------------------------------------------------ EOF
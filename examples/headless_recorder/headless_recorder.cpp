@@ -0,0 +1,582 @@
+/*
+
+Headless recorder for ProcessLoopbackCapture
+
+Non-interactive counterpart of simple_recorder, meant to run as a service or scheduled task.
+Records any number of processes concurrently, as configured in a config file (first command line argument, default "recorder.ini").
+Audio is streamed to disk through the library's sinks (LoopbackWavSink with rotation, LoopbackFlacSink for compression).
+
+Targets that are not running are retried periodically, and a capture is restarted if its process exits.
+Per-capture statistics are printed every stats interval. Ctrl+C, Ctrl+Break, console close, logoff and shutdown stop all captures
+and finalize the files before exiting.
+
+Config file format (one key = value pair per line, '#' or ';' start a comment):
+
+    # Global settings
+    output_directory = C:\recordings
+    stats_interval = 10         # Seconds between stats reports and retries
+    sample_rate = 48000
+    bit_depth = 16
+    channels = 2
+    event_log = 1               # print audio thread diagnostics (GetBuffer failures, buffer flag changes, queue growth)
+
+    # One section per target process
+    [capture]
+    process = firefox.exe
+    sink = flac                 # wav (default) or flac
+    rotate_minutes = 60         # wav only, 0 = single file
+    encoder_threads = 2         # flac only, 0 = hardware threads
+    trim_silence = 1            # drop digital silence at the start and end of each file
+    batch_interval = 200        # ms between audio thread wakeups, 0 = wake for every packet
+    trace_seconds = 60          # keep a wake-timing trace of the last n seconds, saved next to the recording (see LoopbackTrace.h)
+    timing_stats = 1            # print wake interval and packet size percentiles, warns if the host needs a larger buffer
+
+    [capture]
+    process = Discord.exe
+
+Requires the library to be built with PROCESS_LOOPBACK_CAPTURE_USE_QUEUE, sinks are driven from the intermediate thread.
+
+*/
+
+#include <Windows.h>
+#include <combaseapi.h> // CoInitialize(Ex)
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ProcessLoopbackCapture.h>
+#include <LoopbackWavSink.h>
+#include <LoopbackFlacSink.h>
+#include <LoopbackTrace.h>
+#include <LoopbackEventLog.h>
+#include <ProcessInfo.h> // For FindParentProcessIDs
+
+// ------------------------------------------------------------
+
+constexpr unsigned int DEFAULT_SAMPLE_RATE = 48000U;
+constexpr unsigned int DEFAULT_BIT_DEPTH = 16U;
+constexpr unsigned int DEFAULT_CHANNEL_COUNT = 2U;
+constexpr unsigned int DEFAULT_STATS_INTERVAL = 10U;
+
+// ------------------------------------------------------------
+
+struct sCaptureConfig
+{
+    std::wstring ProcessName;
+    bool bFlac = false;
+    unsigned int iRotateMinutes = 0;
+    unsigned int iEncoderThreads = 0;
+    bool bTrimSilence = false;
+    unsigned int iBatchInterval = 0;
+    unsigned int iTraceSeconds = 0;
+    bool bTimingStats = false;
+};
+
+struct sRecorderConfig
+{
+    std::wstring OutputDirectory = L".";
+    unsigned int iStatsInterval = DEFAULT_STATS_INTERVAL;
+    unsigned int iSampleRate = DEFAULT_SAMPLE_RATE;
+    unsigned int iBitDepth = DEFAULT_BIT_DEPTH;
+    unsigned int iChannelCount = DEFAULT_CHANNEL_COUNT;
+    bool bEventLog = false;
+
+    std::vector<sCaptureConfig> Captures;
+};
+
+struct sCapture
+{
+    sCaptureConfig Config;
+
+    ProcessLoopbackCapture LoopbackCapture;
+    std::unique_ptr<LoopbackWavSink> pWavSink;
+    std::unique_ptr<LoopbackFlacSink> pFlacSink;
+
+    std::wstring TraceFileName;
+
+    DWORD dwProcessId = 0;
+    HANDLE hProcess = NULL;
+    unsigned int iSession = 0;
+};
+
+// ------------------------------------------------------------
+
+std::atomic<bool> g_bRunService{ true };
+HANDLE g_hStopEvent{ NULL };
+HANDLE g_hShutdownCompleteEvent{ NULL }; // Set by the main thread once all files are finalized
+LoopbackEventLog g_EventLog;
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[]);
+BOOL WINAPI OnConsoleCtrl(DWORD dwCtrlType);
+void OnEventLogLine(const std::string& Line, const sLoopbackEvent& Event, void *pUserData);
+bool LoadConfig(const std::wstring& FileName, sRecorderConfig& Config);
+bool StartRecording(sCapture& Capture, UINT16 iIndex, const sRecorderConfig& Config);
+void StopRecording(sCapture& Capture);
+void PrintStats(std::vector<std::unique_ptr<sCapture>>& Captures, double fElapsedSeconds);
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[])
+{
+    std::wstring ConfigFile = argc >= 2 ? argv[1] : L"recorder.ini";
+
+    sRecorderConfig Config;
+
+    if (!LoadConfig(ConfigFile, Config))
+    {
+        std::wcout << L"Failed to load config \"" << ConfigFile << L"\"" << std::endl;
+        return 1;
+    }
+
+    if (Config.Captures.empty())
+    {
+        std::wcout << L"No [capture] sections in \"" << ConfigFile << L"\"" << std::endl;
+        return 1;
+    }
+
+    if (CoInitializeEx(NULL, COINIT_MULTITHREADED) != S_OK)
+    {
+        std::cout << "Failed to init COM" << std::endl;
+        return 1;
+    }
+
+    // The sinks block on file IO, they must not run on the main audio thread
+
+    if (ProcessLoopbackCapture().SetIntermediateThreadEnabled(true) != eCaptureError::NONE)
+    {
+        std::cout << "The intermediate thread is not available, build the library with PROCESS_LOOPBACK_CAPTURE_USE_QUEUE" << std::endl;
+        CoUninitialize();
+        return 1;
+    }
+
+    g_hStopEvent = CreateEventW(NULL, true, false, NULL);
+    g_hShutdownCompleteEvent = CreateEventW(NULL, true, false, NULL);
+    SetConsoleCtrlHandler(&OnConsoleCtrl, true);
+
+    // All captures are controlled from this thread (StartCapture/StopCapture must be called on the same thread)
+
+    std::vector<std::unique_ptr<sCapture>> Captures;
+
+    for (auto& CaptureConfig : Config.Captures)
+    {
+        auto pCapture = std::make_unique<sCapture>();
+        pCapture->Config = CaptureConfig;
+        Captures.emplace_back(std::move(pCapture));
+    }
+
+    // Events carry the index of their capture as source
+
+    if (Config.bEventLog)
+    {
+        g_EventLog.SetSink(&OnEventLogLine, &Captures);
+        g_EventLog.Start();
+    }
+
+    auto last_stats = std::chrono::steady_clock::now();
+
+    while (g_bRunService)
+    {
+        for (size_t i = 0; i < Captures.size(); ++i)
+        {
+            auto& pCapture = Captures[i];
+
+            // Restart if the target exited, a new instance is picked up below
+
+            if (pCapture->hProcess != NULL && WaitForSingleObject(pCapture->hProcess, 0) == WAIT_OBJECT_0)
+            {
+                std::wcout << pCapture->Config.ProcessName << L": process " << pCapture->dwProcessId << L" exited" << std::endl;
+                StopRecording(*pCapture);
+            }
+
+            if (pCapture->LoopbackCapture.GetState() == eCaptureState::READY)
+                StartRecording(*pCapture, (UINT16)i, Config);
+        }
+
+        if (WaitForSingleObject(g_hStopEvent, Config.iStatsInterval * 1000) == WAIT_OBJECT_0)
+            break;
+
+        auto now = std::chrono::steady_clock::now();
+        PrintStats(Captures, std::chrono::duration<double>(now - last_stats).count());
+        last_stats = now;
+    }
+
+    std::cout << "Shutting down ..." << std::endl;
+
+    for (auto& pCapture : Captures)
+        StopRecording(*pCapture);
+
+    // After all captures stopped, so their last events are printed
+    g_EventLog.Stop();
+
+    Captures.clear();
+
+    // Lets a close/logoff/shutdown handler return, which ends the process. The event is not closed, the handler may still wait on it.
+    SetEvent(g_hShutdownCompleteEvent);
+
+    SetConsoleCtrlHandler(&OnConsoleCtrl, false);
+    CloseHandle(g_hStopEvent);
+
+    CoUninitialize();
+
+    std::cout << "Done" << std::endl;
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+
+BOOL WINAPI OnConsoleCtrl(DWORD dwCtrlType)
+{
+    switch (dwCtrlType)
+    {
+    case CTRL_C_EVENT:
+    case CTRL_BREAK_EVENT:
+    case CTRL_CLOSE_EVENT:
+    case CTRL_LOGOFF_EVENT:
+    case CTRL_SHUTDOWN_EVENT:
+        g_bRunService = false;
+        SetEvent(g_hStopEvent);
+
+        // For close/logoff/shutdown the process is terminated once this handler returns, wait until the main thread finalized the
+        // files (Windows ends the process anyway after its own timeout)
+        if (dwCtrlType != CTRL_C_EVENT && dwCtrlType != CTRL_BREAK_EVENT)
+            WaitForSingleObject(g_hShutdownCompleteEvent, INFINITE);
+
+        return true;
+    }
+
+    return false;
+}
+
+void OnEventLogLine(const std::string& Line, const sLoopbackEvent& Event, void *pUserData)
+{
+    auto& Captures = *(std::vector<std::unique_ptr<sCapture>>*)pUserData;
+
+    if (Event.iSource < Captures.size())
+        std::wcout << Captures[Event.iSource]->Config.ProcessName << L": ";
+
+    std::cout << Line << std::endl;
+}
+
+bool LoadConfig(const std::wstring& FileName, sRecorderConfig& Config)
+{
+    std::wifstream File{ std::filesystem::path(FileName) };
+
+    if (!File.is_open())
+        return false;
+
+    auto Trim = [](const std::wstring& Text)
+    {
+        size_t iBegin = Text.find_first_not_of(L" \t\r");
+        size_t iEnd = Text.find_last_not_of(L" \t\r");
+
+        return iBegin == std::wstring::npos ? std::wstring() : Text.substr(iBegin, iEnd - iBegin + 1);
+    };
+
+    auto ToUInt = [](const std::wstring& Text, unsigned int iDefault)
+    {
+        try
+        {
+            return static_cast<unsigned int>(std::stoul(Text));
+        }
+        catch (...)
+        {
+            return iDefault;
+        }
+    };
+
+    std::wstring Line;
+    sCaptureConfig* pSection = nullptr;
+
+    while (std::getline(File, Line))
+    {
+        Line = Trim(Line.substr(0, Line.find_first_of(L"#;")));
+
+        if (Line.empty())
+            continue;
+
+        if (Line == L"[capture]")
+        {
+            Config.Captures.emplace_back();
+            pSection = &Config.Captures.back();
+            continue;
+        }
+
+        size_t iEquals = Line.find(L'=');
+
+        if (iEquals == std::wstring::npos)
+        {
+            std::wcout << L"Ignoring config line \"" << Line << L"\"" << std::endl;
+            continue;
+        }
+
+        std::wstring Key = Trim(Line.substr(0, iEquals));
+        std::wstring Value = Trim(Line.substr(iEquals + 1));
+
+        if (pSection == nullptr)
+        {
+            if (Key == L"output_directory") Config.OutputDirectory = Value;
+            else if (Key == L"stats_interval") Config.iStatsInterval = ToUInt(Value, DEFAULT_STATS_INTERVAL);
+            else if (Key == L"sample_rate") Config.iSampleRate = ToUInt(Value, DEFAULT_SAMPLE_RATE);
+            else if (Key == L"bit_depth") Config.iBitDepth = ToUInt(Value, DEFAULT_BIT_DEPTH);
+            else if (Key == L"channels") Config.iChannelCount = ToUInt(Value, DEFAULT_CHANNEL_COUNT);
+            else if (Key == L"event_log") Config.bEventLog = ToUInt(Value, 0) != 0;
+            else std::wcout << L"Unknown global key \"" << Key << L"\"" << std::endl;
+        }
+        else
+        {
+            if (Key == L"process") pSection->ProcessName = Value;
+            else if (Key == L"sink") pSection->bFlac = (Value == L"flac");
+            else if (Key == L"rotate_minutes") pSection->iRotateMinutes = ToUInt(Value, 0);
+            else if (Key == L"encoder_threads") pSection->iEncoderThreads = ToUInt(Value, 0);
+            else if (Key == L"trim_silence") pSection->bTrimSilence = ToUInt(Value, 0) != 0;
+            else if (Key == L"batch_interval") pSection->iBatchInterval = ToUInt(Value, 0);
+            else if (Key == L"trace_seconds") pSection->iTraceSeconds = ToUInt(Value, 0);
+            else if (Key == L"timing_stats") pSection->bTimingStats = ToUInt(Value, 0) != 0;
+            else std::wcout << L"Unknown capture key \"" << Key << L"\"" << std::endl;
+        }
+    }
+
+    if (Config.iStatsInterval == 0)
+        Config.iStatsInterval = 1;
+
+    // Drop sections without a process name
+
+    std::erase_if(Config.Captures, [](const sCaptureConfig& Capture) { return Capture.ProcessName.empty(); });
+
+    return true;
+}
+
+bool StartRecording(sCapture& Capture, UINT16 iIndex, const sRecorderConfig& Config)
+{
+    std::vector<DWORD> vecProcessIds;
+    FindParentProcessIDs(Capture.Config.ProcessName, vecProcessIds);
+
+    if (vecProcessIds.empty())
+        return false;
+
+    Capture.dwProcessId = vecProcessIds[0];
+
+    // Checked before any file is created
+    eCaptureError eError = Capture.LoopbackCapture.SetIntermediateThreadEnabled(true);
+
+    if (eError != eCaptureError::NONE)
+    {
+        std::wcout << Capture.Config.ProcessName << L": intermediate thread not available: " << LoopbackCaptureConst::GetErrorText(eError) << std::endl;
+        return false;
+    }
+
+    eError = Capture.LoopbackCapture.SetCaptureFormat(Config.iSampleRate, Config.iBitDepth, Config.iChannelCount, WAVE_FORMAT_PCM);
+
+    if (eError != eCaptureError::NONE)
+    {
+        std::wcout << Capture.Config.ProcessName << L": invalid format: " << LoopbackCaptureConst::GetErrorText(eError) << std::endl;
+        return false;
+    }
+
+    WAVEFORMATEX Format{};
+    Capture.LoopbackCapture.CopyCaptureFormat(Format);
+
+    // Output file: <directory>\<process>-<tick>.<ext>
+
+    std::wstring BaseName = Capture.Config.ProcessName;
+    size_t iDot = BaseName.find_last_of(L'.');
+
+    if (iDot != std::wstring::npos)
+        BaseName.resize(iDot);
+
+    std::wstring FileName = Config.OutputDirectory + L"\\" + BaseName + L"-" + std::to_wstring(GetTickCount64()) + (Capture.Config.bFlac ? L".flac" : L".wav");
+
+    ILoopbackCaptureSink* pSink = nullptr;
+
+    if (Capture.Config.bFlac)
+    {
+        Capture.pFlacSink = std::make_unique<LoopbackFlacSink>();
+        Capture.pFlacSink->SetThreadCount(Capture.Config.iEncoderThreads);
+        Capture.pFlacSink->SetTrimSilence(Capture.Config.bTrimSilence, 0.0f);
+        eError = Capture.pFlacSink->Open(FileName, Format);
+        pSink = Capture.pFlacSink.get();
+    }
+    else
+    {
+        Capture.pWavSink = std::make_unique<LoopbackWavSink>();
+        Capture.pWavSink->SetRotation((UINT64)Capture.Config.iRotateMinutes * 60 * Format.nSamplesPerSec);
+        Capture.pWavSink->SetTrimSilence(Capture.Config.bTrimSilence, 0.0f);
+        eError = Capture.pWavSink->Open(FileName, Format);
+        pSink = Capture.pWavSink.get();
+    }
+
+    if (eError != eCaptureError::NONE)
+    {
+        std::wcout << Capture.Config.ProcessName << L": failed to open \"" << FileName << L"\": " << LoopbackCaptureConst::GetErrorText(eError) << std::endl;
+        StopRecording(Capture);
+        return false;
+    }
+
+    Capture.LoopbackCapture.SetTargetProcess(Capture.dwProcessId, true);
+    Capture.LoopbackCapture.SetCallback(&ILoopbackCaptureSink::Callback, pSink);
+    Capture.LoopbackCapture.SetCallbackInterval(100);
+    Capture.LoopbackCapture.SetBatchInterval(Capture.Config.iBatchInterval);
+    Capture.LoopbackCapture.SetEventLog(Config.bEventLog ? &g_EventLog : nullptr, iIndex);
+    Capture.LoopbackCapture.SetTimingStatistics(Capture.Config.bTimingStats);
+
+    // About 4 records per wake, at most 100 wakes per second
+    Capture.LoopbackCapture.SetTraceRecording((size_t)Capture.Config.iTraceSeconds * 400);
+    Capture.TraceFileName = Capture.Config.iTraceSeconds != 0 ? FileName + L".trace" : L"";
+
+    eError = Capture.LoopbackCapture.StartCapture();
+
+    if (eError != eCaptureError::NONE)
+    {
+        std::wcout << Capture.Config.ProcessName << L": failed to start capture: " << LoopbackCaptureConst::GetErrorText(eError)
+            << L" (HR 0x" << std::hex << Capture.LoopbackCapture.GetLastErrorResult() << std::dec << L")" << std::endl;
+        StopRecording(Capture);
+        return false;
+    }
+
+    Capture.hProcess = OpenProcess(SYNCHRONIZE, false, Capture.dwProcessId);
+    ++Capture.iSession;
+
+    std::wcout << Capture.Config.ProcessName << L": recording PID " << Capture.dwProcessId << L" to \"" << FileName << L"\"" << std::endl;
+
+    // Where the start time went, e.g. a slow activation on a busy host
+
+    sLoopbackPhaseTiming Timing;
+
+    if (Capture.Config.bTimingStats && Capture.LoopbackCapture.GetPhaseTiming(eLoopbackOperation::START_CAPTURE, Timing) == eCaptureError::NONE)
+    {
+        std::wcout << L"    StartCapture";
+
+        for (size_t i = 0; i < LoopbackCaptureConst::PhaseCount; ++i)
+        {
+            if (Timing.iPhaseMask & (1U << i))
+                std::wcout << L" " << LoopbackCaptureConst::GetPhaseName((eLoopbackPhase)i) << L" " << Timing.fDurations[i] << L"ms";
+        }
+
+        std::wcout << std::endl;
+    }
+
+    return true;
+}
+
+void StopRecording(sCapture& Capture)
+{
+    // Stop the capture first, the sinks must not receive data while closing
+
+    Capture.LoopbackCapture.StopCapture();
+
+    if (!Capture.TraceFileName.empty())
+    {
+        WAVEFORMATEX Format{};
+        std::vector<sLoopbackTraceRecord> Trace;
+
+        Capture.LoopbackCapture.CopyCaptureFormat(Format);
+
+        if (Capture.LoopbackCapture.GetTrace(Trace) != eCaptureError::NONE || LoopbackTrace::Save(Capture.TraceFileName, Format, Trace) != eCaptureError::NONE)
+            std::wcout << Capture.Config.ProcessName << L": failed to save trace \"" << Capture.TraceFileName << L"\"" << std::endl;
+
+        Capture.TraceFileName.clear();
+    }
+
+    if (Capture.pWavSink)
+    {
+        Capture.pWavSink->Close();
+        Capture.pWavSink.reset();
+    }
+
+    if (Capture.pFlacSink)
+    {
+        Capture.pFlacSink->Close();
+        Capture.pFlacSink.reset();
+    }
+
+    if (Capture.hProcess != NULL)
+    {
+        CloseHandle(Capture.hProcess);
+        Capture.hProcess = NULL;
+    }
+
+    Capture.dwProcessId = 0;
+}
+
+void PrintStats(std::vector<std::unique_ptr<sCapture>>& Captures, double fElapsedSeconds)
+{
+    std::wcout << L"---- " << Captures.size() << L" captures, interval " << fElapsedSeconds << L"s" << std::endl;
+
+    for (auto& pCapture : Captures)
+    {
+        sCapture& Capture = *pCapture;
+
+        if (Capture.LoopbackCapture.GetState() == eCaptureState::READY)
+        {
+            std::wcout << L"  " << Capture.Config.ProcessName << L": waiting for process" << std::endl;
+            continue;
+        }
+
+        UINT64 iFrames = 0;
+        UINT64 iBytes = 0;
+        bool bWriteError = false;
+
+        if (Capture.pWavSink)
+        {
+            iFrames = Capture.pWavSink->GetFrameCount();
+            iBytes = Capture.pWavSink->GetBytesWritten();
+            bWriteError = Capture.pWavSink->HasWriteError();
+        }
+        else if (Capture.pFlacSink)
+        {
+            iFrames = Capture.pFlacSink->GetFrameCount();
+            iBytes = Capture.pFlacSink->GetBytesWritten();
+            bWriteError = Capture.pFlacSink->HasWriteError();
+        }
+
+        size_t iQueueSize = 0;
+        Capture.LoopbackCapture.GetQueueSize(iQueueSize);
+
+        WAVEFORMATEX Format{};
+        Capture.LoopbackCapture.CopyCaptureFormat(Format);
+
+        std::wcout << L"  " << Capture.Config.ProcessName
+            << L": PID " << Capture.dwProcessId
+            << L", session " << Capture.iSession
+            << L", " << (double)iFrames / Format.nSamplesPerSec << L"s recorded"
+            << L", " << iBytes / 1024 << L" KiB written"
+            << L", queue " << iQueueSize << L" bytes"
+            << L", max audio thread " << Capture.LoopbackCapture.GetMaxExecutionTime() << L"ms"
+            << L", " << Capture.LoopbackCapture.GetWakeupsPerSecond() << L" wakeups/s"
+            << (bWriteError ? L", WRITE ERROR" : L"")
+            << std::endl;
+
+        // Percentiles over the whole run, the histograms survive restarts of the capture
+
+        sLoopbackTimingReport Report;
+
+        if (Capture.Config.bTimingStats && Capture.LoopbackCapture.GetTimingReport(Report) == eCaptureError::NONE)
+        {
+            std::wcout << L"    wake interval median " << Report.fWakeIntervalMedian << L"ms"
+                << L", p99 " << Report.fWakeIntervalP99 << L"ms"
+                << L", p99.9 " << Report.fWakeIntervalP999 << L"ms"
+                << L", max " << Report.fWakeIntervalMax << L"ms"
+                << L", " << Report.fLateWakeRatio * 100.0 << L"% late"
+                << L", packets " << Report.iPacketFramesMedian << L"/" << Report.iPacketFramesP99 << L"/" << Report.iPacketFramesMax << L" frames"
+                << L", buffer " << Report.fBufferDuration << L"ms"
+                << std::endl;
+
+            if (Report.bRaiseBufferSize)
+                std::wcout << L"    host wakes too late for the buffer, raise batch_interval to at least " << Report.fRecommendedBufferDuration / 2.0 << L"ms" << std::endl;
+        }
+
+        Capture.LoopbackCapture.ResetMaxExecutionTime();
+    }
+}
+
+// ------------------------------------------------------------ EOF
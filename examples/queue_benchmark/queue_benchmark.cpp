@@ -0,0 +1,295 @@
+/*
+
+Queue benchmark for the intermediate path of ProcessLoopbackCapture
+
+Runs the producer/consumer patterns of the capture offline (no capture or audio device needed) on two threads and reports the
+CPU cycles the producer (the main audio thread) spends per operation, taken from the thread cycle counter (QueryThreadCycleTime).
+Cycles spent waiting for cache lines owned by the other core are counted there, so cache line bouncing shows up as more cycles
+per operation. For cache miss counts, run the benchmark under a hardware counter profiler (e.g. VTune or WPR with PMC sources).
+
+- State layout: the producer stores the wakeup count and updates the maximum execution time while the consumer polls the run
+  flag, the state and the maximum, as a control thread does. Packed puts them on one cache line like the members were before,
+  isolated uses the control, producer and maximum blocks of ProcessLoopbackCapture.
+- Intermediate queue: the producer enqueues 10 ms packets of 48 kHz stereo float while the consumer drains them, byte by byte
+  (try_enqueue / try_dequeue) and in bulk through the tokens of the two threads (try_enqueue_bulk / try_dequeue_bulk), as the
+  capture does.
+
+Requires concurrentqueue.h (https://github.com/cameron314/concurrentqueue).
+
+Usage: queue_benchmark [seconds of audio per queue run = 600]
+
+*/
+
+#include <Windows.h>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <concurrentqueue.h>
+
+// ------------------------------------------------------------
+
+constexpr double DEFAULT_DURATION = 600.0;
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr size_t STATE_ITERATIONS = 20000000;
+
+// 10 ms of 48 kHz stereo float
+constexpr size_t PACKET_BYTES = 480 * 2 * sizeof(float);
+
+// ------------------------------------------------------------
+
+// Before: everything both threads touch on one line
+struct sPackedState
+{
+    std::atomic<bool>               bRun{ true };
+    std::atomic<int>                State{ 1 };
+    DWORD                           dwBytesToSkip = 0;
+    std::atomic<UINT64>             iWakeupCount{ 0 };
+    std::atomic<double>             fMaxExecutionTime{ 0.0 };
+};
+
+// After: control, producer and the published maximum on their own lines
+struct sIsolatedState
+{
+    alignas(CACHE_LINE_SIZE)
+    std::atomic<bool>               bRun{ true };
+    std::atomic<int>                State{ 1 };
+
+    alignas(CACHE_LINE_SIZE)
+    DWORD                           dwBytesToSkip = 0;
+    std::atomic<UINT64>             iWakeupCount{ 0 };
+
+    alignas(CACHE_LINE_SIZE)
+    std::atomic<double>             fMaxExecutionTime{ 0.0 };
+};
+
+struct sQueueTraits : public moodycamel::ConcurrentQueueDefaultTraits
+{
+    static const size_t BLOCK_SIZE = 1024;
+};
+
+typedef moodycamel::ConcurrentQueue<unsigned char, sQueueTraits> ByteQueue;
+
+struct sResult
+{
+    double                          fCyclesPerOperation;
+    double                          fSeconds;
+};
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[]);
+template<typename T> sResult RunState(bool bIsolated);
+sResult RunQueue(size_t iPackets, bool bBulk);
+UINT64 GetThreadCycles();
+void PrintRow(const char *pName, const sResult& Result, const char *pUnit);
+
+// ------------------------------------------------------------
+
+int wmain(int argc, wchar_t* argv[])
+{
+    double fDuration = DEFAULT_DURATION;
+
+    try
+    {
+        if (argc >= 2)
+            fDuration = std::stod(argv[1]);
+    }
+    catch (...)
+    {
+        fDuration = -1.0;
+    }
+
+    if (fDuration < 1.0 || fDuration > 36000.0)
+    {
+        std::cout << "Invalid arguments" << std::endl;
+        std::cout << "Usage: queue_benchmark [seconds of audio per queue run]" << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+
+    std::cout << "State layout, producer cycles per wakeup (" << STATE_ITERATIONS << " wakeups)" << std::endl;
+
+    PrintRow("Packed", RunState<sPackedState>(false), "cycles");
+    PrintRow("Isolated", RunState<sIsolatedState>(true), "cycles");
+
+    size_t iPackets = (size_t)(fDuration * 100.0);
+
+    std::cout << std::endl << "Intermediate queue, producer cycles per byte (" << iPackets << " packets of " << PACKET_BYTES << " bytes)" << std::endl;
+
+    std::cout << std::setprecision(3);
+
+    PrintRow("Per byte", RunQueue(iPackets, false), "cycles");
+    PrintRow("Bulk", RunQueue(iPackets, true), "cycles");
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+
+template<typename T> sResult RunState(bool bIsolated)
+{
+    T State;
+    std::atomic<bool> bConsumerRun{ true };
+
+    // The consumer polls as fast as it can, the worst case for the producer's lines
+    std::thread Consumer([&State, &bConsumerRun]()
+    {
+        double fSum = 0.0;
+
+        while (bConsumerRun.load(std::memory_order_relaxed))
+        {
+            if (State.bRun.load(std::memory_order_relaxed) && State.State.load(std::memory_order_relaxed) == 1)
+                fSum += State.fMaxExecutionTime.load(std::memory_order_relaxed);
+        }
+
+        volatile double fSink = fSum;
+        (void)fSink;
+    });
+
+    auto Start = std::chrono::steady_clock::now();
+    UINT64 iStartCycles = GetThreadCycles();
+
+    UINT64 iWakeups = 0;
+
+    for (size_t i = 0; i < STATE_ITERATIONS; ++i)
+    {
+        double fDuration = (double)(i % 1000) * 1e-3;
+
+        if (State.dwBytesToSkip > 0)
+            --State.dwBytesToSkip;
+
+        if (bIsolated)
+        {
+            // As the capture does now: the count is stored from a local counter, the maximum only written when it grows
+            State.iWakeupCount.store(++iWakeups, std::memory_order_relaxed);
+
+            if (fDuration > State.fMaxExecutionTime.load(std::memory_order_relaxed))
+                State.fMaxExecutionTime.store(fDuration, std::memory_order_relaxed);
+        }
+        else
+        {
+            // As the capture did before: sequentially consistent updates of the shared members
+            ++State.iWakeupCount;
+
+            if (fDuration > State.fMaxExecutionTime)
+                State.fMaxExecutionTime = fDuration;
+        }
+    }
+
+    UINT64 iCycles = GetThreadCycles() - iStartCycles;
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+    bConsumerRun = false;
+    Consumer.join();
+
+    return { (double)iCycles / STATE_ITERATIONS, fSeconds };
+}
+
+sResult RunQueue(size_t iPackets, bool bBulk)
+{
+    ByteQueue Queue(8192);
+    std::vector<unsigned char> Packet(PACKET_BYTES);
+
+    for (size_t i = 0; i < Packet.size(); ++i)
+        Packet[i] = (unsigned char)i;
+
+    std::atomic<bool> bProducing{ true };
+    size_t iConsumed = 0;
+
+    // Drains every millisecond like the intermediate thread does with a short callback interval
+    std::thread Consumer([&Queue, &bProducing, &iConsumed, bBulk]()
+    {
+        moodycamel::ConsumerToken Token(Queue);
+        std::vector<unsigned char> Data;
+
+        while (true)
+        {
+            bool bDone = !bProducing.load(std::memory_order_acquire);
+
+            if (bBulk)
+            {
+                size_t iQueued = Queue.size_approx();
+
+                if (iQueued > 0)
+                {
+                    Data.resize(iQueued);
+                    iConsumed += Queue.try_dequeue_bulk(Token, Data.begin(), iQueued);
+                }
+            }
+            else
+            {
+                unsigned char Byte;
+
+                while (Queue.try_dequeue(Byte))
+                {
+                    Data.push_back(Byte);
+                    ++iConsumed;
+                }
+
+                Data.clear();
+            }
+
+            if (bDone && Queue.size_approx() == 0)
+                break;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    moodycamel::ProducerToken Token(Queue);
+
+    auto Start = std::chrono::steady_clock::now();
+    UINT64 iStartCycles = GetThreadCycles();
+
+    for (size_t p = 0; p < iPackets; ++p)
+    {
+        if (bBulk)
+        {
+            if (!Queue.try_enqueue_bulk(Token, Packet.data(), Packet.size()))
+                Queue.enqueue_bulk(Token, Packet.data(), Packet.size());
+        }
+        else
+        {
+            for (size_t i = 0; i < Packet.size(); ++i)
+            {
+                if (!Queue.try_enqueue(Packet[i]))
+                    Queue.enqueue(Packet[i]);
+            }
+        }
+    }
+
+    UINT64 iCycles = GetThreadCycles() - iStartCycles;
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+    bProducing.store(false, std::memory_order_release);
+    Consumer.join();
+
+    if (iConsumed != iPackets * PACKET_BYTES)
+        std::cout << "Lost " << iPackets * PACKET_BYTES - iConsumed << " bytes" << std::endl;
+
+    return { (double)iCycles / (double)(iPackets * PACKET_BYTES), fSeconds };
+}
+
+UINT64 GetThreadCycles()
+{
+    ULONG64 iCycles = 0;
+    QueryThreadCycleTime(GetCurrentThread(), &iCycles);
+
+    return iCycles;
+}
+
+void PrintRow(const char *pName, const sResult& Result, const char *pUnit)
+{
+    std::cout << std::setw(12) << pName << std::setw(12) << Result.fCyclesPerOperation << " " << pUnit
+        << std::setw(10) << Result.fSeconds << " s" << std::endl;
+}
+
+// ------------------------------------------------------------ EOF
@@ -129,6 +129,64 @@ inline bool FindParentProcessIDs(std::wstring executable_name, std::vector<DWORD
     return true;
 }
 
+// Finds the top-most process of every application: processes whose parent is not running or has a different executable name
+// System processes (ids 0 and 4) and the calling process are skipped
+inline bool FindApplicationProcesses(std::vector<std::pair<DWORD, std::wstring>>& process_list)
+{
+    process_list.clear();
+
+    HANDLE handle = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    struct s_process_entry
+    {
+        DWORD process_id;
+        DWORD parent_id;
+        std::wstring executable_name;
+    };
+
+    std::vector<s_process_entry> processes;
+
+    PROCESSENTRY32W  process_info = { sizeof(PROCESSENTRY32W) };
+
+    if (Process32FirstW(handle, &process_info))
+    {
+        do
+        {
+            processes.push_back({ process_info.th32ProcessID, process_info.th32ParentProcessID, process_info.szExeFile });
+        }
+        while (Process32NextW(handle, &process_info));
+    }
+
+    CloseHandle(handle);
+
+    DWORD own_process_id = GetCurrentProcessId();
+
+    for (auto &a : processes)
+    {
+        if (a.process_id == 0 || a.process_id == 4 || a.process_id == own_process_id)
+            continue;
+
+        bool is_child = false;
+
+        for (auto &b : processes)
+        {
+            if (a.process_id != b.process_id && a.parent_id == b.process_id && a.executable_name == b.executable_name)
+            {
+                is_child = true;
+                break;
+            }
+        }
+
+        if (!is_child)
+            process_list.emplace_back(a.process_id, a.executable_name);
+    }
+
+    return true;
+}
+
 // Gets the executable file path of the specified process id
 inline bool GetProcessExecutablePath(DWORD process_id, std::filesystem::path& path)
 {